@@ -0,0 +1,480 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Test that compressed output decompresses to the uncompressed output
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+#include "ReaderGKey.h"
+
+/* Local header files */
+#include "misc.h"
+#include "tar.h"
+
+enum {
+  NUM_SONGS = 2,
+  MAX_PATH = 1024,
+  MAX_COMMAND = 4096,
+  READ_CHUNK = 4096
+};
+
+typedef enum {
+  Output_Module,
+  Output_Tar,
+  Output_Pack,
+  Output_Count
+} Output;
+
+static const char *const output_names[Output_Count] = {
+  "module", "tar", "pack"
+};
+
+/* Sizes of history to test, including the smallest, the largest and the
+   size used by the SF3000 music files */
+static const int histories[] = {1, 9, 12, 16};
+
+typedef struct {
+  const char *gen; /* Path of SF3KGen */
+  const char *conv; /* Path of SF3KtoProT */
+  const char *dir; /* Directory in which to write files */
+} Programs;
+
+typedef struct {
+  unsigned char *data;
+  size_t size;
+} Buffer;
+
+static bool make_path(const Programs * const programs,
+                      const char * const leaf, char path[MAX_PATH])
+{
+  assert(programs != NULL);
+  assert(leaf != NULL);
+  assert(path != NULL);
+
+  const int n = snprintf(path, MAX_PATH, "%s%c%s", programs->dir,
+                         PATH_SEPARATOR, leaf);
+  if (n < 0 || n >= MAX_PATH) {
+    fputs("Path of directory is too long\n", stderr);
+    return false;
+  }
+  return true;
+}
+
+static bool run(const char * const format, ...)
+{
+  assert(format != NULL);
+
+  char command[MAX_COMMAND];
+  va_list args;
+  va_start(args, format);
+  const int n = vsnprintf(command, sizeof(command), format, args);
+  va_end(args);
+
+  if (n < 0 || n >= (int)sizeof(command)) {
+    fputs("Command is too long\n", stderr);
+    return false;
+  }
+
+  puts(command);
+  fflush(stdout);
+
+  if (system(command) != 0) {
+    fprintf(stderr, "Command failed: %s\n", command);
+    return false;
+  }
+  return true;
+}
+
+static bool read_all(FILE * const f, Buffer * const buffer)
+{
+  assert(f != NULL);
+  assert(buffer != NULL);
+
+  *buffer = (Buffer){NULL, 0};
+  size_t alloc = 0;
+  for (;;) {
+    if (alloc - buffer->size < READ_CHUNK) {
+      _Optional unsigned char * const data = realloc(buffer->data,
+                                                     alloc + READ_CHUNK);
+      if (data == NULL) {
+        fputs("Failed to allocate memory\n", stderr);
+        return false;
+      }
+      buffer->data = &*data;
+      alloc += READ_CHUNK;
+    }
+
+    const size_t n = fread(buffer->data + buffer->size, 1,
+                           alloc - buffer->size, f);
+    buffer->size += n;
+    if (n == 0)
+      break;
+  }
+
+  if (ferror(f)) {
+    fputs("Failed to read file\n", stderr);
+    return false;
+  }
+  return true;
+}
+
+static bool load_file(const char * const path, Buffer * const buffer)
+{
+  assert(path != NULL);
+  assert(buffer != NULL);
+
+  _Optional FILE * const f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open '%s'\n", path);
+    *buffer = (Buffer){NULL, 0};
+    return false;
+  }
+
+  const bool success = read_all(&*f, buffer);
+  fclose(&*f);
+  return success;
+}
+
+static bool decompress(const int history_log2, const Buffer * const in,
+                       Buffer * const out)
+{
+  assert(in != NULL);
+  assert(out != NULL);
+
+  *out = (Buffer){NULL, 0};
+
+  /* The decompressor reads from a file, as it would in the game. */
+  _Optional FILE * const f = tmpfile();
+  if (f == NULL) {
+    fputs("Failed to create temporary file\n", stderr);
+    return false;
+  }
+
+  bool success = fwrite(in->data, in->size, 1, &*f) == 1 &&
+                 fseek(&*f, 0, SEEK_SET) == 0;
+
+  Reader r;
+  if (success)
+    success = reader_gkey_init(&r, history_log2, &*f);
+
+  if (success) {
+    size_t alloc = 0;
+    for (;;) {
+      if (alloc - out->size < READ_CHUNK) {
+        _Optional unsigned char * const data = realloc(out->data,
+                                                       alloc + READ_CHUNK);
+        if (data == NULL) {
+          success = false;
+          break;
+        }
+        out->data = &*data;
+        alloc += READ_CHUNK;
+      }
+
+      const size_t n = reader_fread(out->data + out->size, 1,
+                                    alloc - out->size, &r);
+      out->size += n;
+      if (n == 0)
+        break;
+    }
+
+    if (reader_ferror(&r))
+      success = false;
+
+    reader_destroy(&r);
+  }
+
+  fclose(&*f);
+
+  if (!success)
+    fputs("Failed to decompress output\n", stderr);
+
+  return success;
+}
+
+static bool compare(const char * const what, const int history_log2,
+                    const Buffer * const plain, const Buffer * const packed)
+{
+  assert(what != NULL);
+  assert(plain != NULL);
+  assert(packed != NULL);
+
+  /* Output that merely ends with a copy of the uncompressed data (e.g.
+     because the encoder was built as a stub) would otherwise pass. A real
+     compressed bitstream interleaves flags with the data. */
+  if (plain->size > 0 && packed->size >= plain->size &&
+      memcmp(packed->data + packed->size - plain->size, plain->data,
+             plain->size) == 0) {
+    fprintf(stderr, "%s (history 2^%d) was not compressed\n", what,
+            history_log2);
+    return false;
+  }
+
+  Buffer unpacked;
+  bool success = decompress(history_log2, packed, &unpacked);
+
+  if (success && (unpacked.size != plain->size ||
+                  (plain->size > 0 &&
+                   memcmp(unpacked.data, plain->data, plain->size) != 0))) {
+    fprintf(stderr, "%s (history 2^%d) decompressed to %zu bytes that "
+            "differ from the uncompressed output (%zu bytes)\n", what,
+            history_log2, unpacked.size, plain->size);
+    success = false;
+  }
+
+  free(unpacked.data);
+  return success;
+}
+
+static bool compare_tar(const int history_log2, const char * const plain_path,
+                        const char * const packed_path)
+{
+  assert(plain_path != NULL);
+  assert(packed_path != NULL);
+
+  _Optional FILE * const plain = fopen(plain_path, "rb");
+  _Optional FILE * const packed = fopen(packed_path, "rb");
+  bool success = plain != NULL && packed != NULL;
+  if (!success)
+    fputs("Failed to open tar archives\n", stderr);
+
+  /* Each entry is compressed separately, under the same name as its
+     uncompressed counterpart. */
+  int count = 0;
+  for (bool end = false; success && !end; ) {
+    TarEntry plain_entry, packed_entry;
+    bool packed_end;
+    success = tar_read_header(&*plain, &plain_entry, &end) &&
+              tar_read_header(&*packed, &packed_entry, &packed_end);
+    if (!success || end || packed_end) {
+      if (success && end != packed_end) {
+        fputs("Tar archives have different numbers of entries\n", stderr);
+        success = false;
+      }
+      break;
+    }
+
+    if (strcmp(plain_entry.name, packed_entry.name) != 0) {
+      fprintf(stderr, "Tar entry '%s' doesn't match '%s'\n",
+              packed_entry.name, plain_entry.name);
+      success = false;
+      break;
+    }
+
+    Buffer plain_data = {malloc(plain_entry.size ? plain_entry.size : 1),
+                         plain_entry.size};
+    Buffer packed_data = {malloc(packed_entry.size ? packed_entry.size : 1),
+                          packed_entry.size};
+    success = plain_data.data != NULL && packed_data.data != NULL &&
+              tar_read_data(&*plain, plain_data.data, plain_data.size) &&
+              tar_read_data(&*packed, packed_data.data, packed_data.size) &&
+              compare(plain_entry.name, history_log2, &plain_data,
+                      &packed_data);
+
+    free(plain_data.data);
+    free(packed_data.data);
+    count++;
+  }
+
+  if (success && count != NUM_SONGS) {
+    fprintf(stderr, "Tar archive has %d entries instead of %d\n", count,
+            NUM_SONGS);
+    success = false;
+  }
+
+  if (plain != NULL)
+    fclose(&*plain);
+  if (packed != NULL)
+    fclose(&*packed);
+
+  return success;
+}
+
+static bool write_input_tar(const char * const tar_path,
+                            char music[NUM_SONGS][MAX_PATH],
+                            const char * const names[NUM_SONGS])
+{
+  assert(tar_path != NULL);
+  assert(music != NULL);
+  assert(names != NULL);
+
+  _Optional FILE * const f = fopen(tar_path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to create '%s'\n", tar_path);
+    return false;
+  }
+
+  bool success = true;
+  for (int s = 0; s < NUM_SONGS && success; s++) {
+    Buffer data;
+    success = load_file(music[s], &data);
+    if (success) {
+      TarEntry entry = {.size = data.size, .mtime = 0, .regular = true};
+      strcpy(entry.name, names[s]);
+      success = tar_write_entry(&*f, &entry, data.data);
+    }
+    free(data.data);
+  }
+
+  if (success)
+    success = tar_write_end(&*f);
+
+  if (fclose(&*f) != 0)
+    success = false;
+
+  if (!success)
+    fprintf(stderr, "Failed to write '%s'\n", tar_path);
+
+  return success;
+}
+
+static bool read_compress_time(const char * const trace_file,
+                               unsigned long * const dur,
+                               unsigned long * const size)
+{
+  assert(trace_file != NULL);
+  assert(dur != NULL);
+  assert(size != NULL);
+
+  _Optional FILE * const f = fopen(trace_file, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open trace file '%s'\n", trace_file);
+    return false;
+  }
+
+  /* Each event is on a separate line. There is one compression span for
+     each output file or tar entry. */
+  char line[256];
+  while (fgets(line, sizeof(line), &*f) != NULL) {
+    if (strstr(line, "\"name\":\"compress\"") == NULL)
+      continue;
+
+    _Optional const char * const dur_value = strstr(line, "\"dur\":");
+    _Optional const char * const size_value = strstr(line, "\"size\":");
+    if (dur_value != NULL && size_value != NULL) {
+      *dur += strtoul(&*dur_value + strlen("\"dur\":"), NULL, 10);
+      *size += strtoul(&*size_value + strlen("\"size\":"), NULL, 10);
+    }
+  }
+
+  fclose(&*f);
+  return true;
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <SF3KGen> <SF3KtoProT> <work-dir>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!system(NULL)) {
+    fputs("No command processor is available\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  const Programs programs = {argv[1], argv[2], argv[3]};
+  static const char *const names[NUM_SONGS] = {"song1", "song2"};
+  char music[NUM_SONGS][MAX_PATH], input_tar[MAX_PATH], trace[MAX_PATH];
+  char plain[Output_Count][MAX_PATH], packed[Output_Count][MAX_PATH];
+
+  bool success = make_path(&programs, "music.tar", input_tar) &&
+                 make_path(&programs, "trace.json", trace) &&
+                 make_path(&programs, "plain.mod", plain[Output_Module]) &&
+                 make_path(&programs, "plain.tar", plain[Output_Tar]) &&
+                 make_path(&programs, "plain_pack.mod", plain[Output_Pack]) &&
+                 make_path(&programs, "packed.mod", packed[Output_Module]) &&
+                 make_path(&programs, "packed.tar", packed[Output_Tar]) &&
+                 make_path(&programs, "packed_pack.mod", packed[Output_Pack]);
+
+  for (int s = 0; s < NUM_SONGS && success; s++)
+    success = make_path(&programs, names[s], music[s]);
+
+  /* Generate compressed music, as in the game, and an archive of it. */
+  if (success) {
+    success = run("\"%s\" \"%s\" \"%s\" \"%s\"", programs.gen, programs.dir,
+                  music[0], music[1]) &&
+              write_input_tar(input_tar, music, names);
+  }
+
+  for (int h = -1;
+       success && h < (int)(sizeof(histories) / sizeof(histories[0]));
+       h++) {
+    /* The first pass writes the uncompressed output for comparison. The song
+       name is fixed because it would otherwise depend on the name of the
+       output file when packing. */
+    char switches[32] = "-name test";
+    if (h >= 0)
+      snprintf(switches, sizeof(switches), "-name test -compress -history %d",
+               histories[h]);
+
+    char (* const out)[MAX_PATH] = h >= 0 ? packed : plain;
+    for (int o = 0; o < Output_Count && success; o++) {
+      switch ((Output)o) {
+        case Output_Module:
+          success = run("\"%s\" %s -trace \"%s\" \"%s\" \"%s\" \"%s\"",
+                        programs.conv, switches, trace, programs.dir, music[0],
+                        out[o]);
+          break;
+        case Output_Tar:
+          success = run("\"%s\" -tar %s -trace \"%s\" \"%s\" \"%s\" \"%s\"",
+                        programs.conv, switches, trace, programs.dir,
+                        input_tar, out[o]);
+          break;
+        default:
+          success = run("\"%s\" -pack %s -trace \"%s\" \"%s\" \"%s\" \"%s\" "
+                        "\"%s\"", programs.conv, switches, trace,
+                        programs.dir, out[o], music[0], music[1]);
+          break;
+      }
+      if (!success || h < 0)
+        continue;
+
+      /* Encoding speed is reported in kilobytes of uncompressed data per
+         second, as recorded by the converter itself. */
+      unsigned long dur = 0, size = 0;
+      success = read_compress_time(trace, &dur, &size);
+      if (success)
+        printf("%s, history 2^%d: %lu bytes compressed in %lu us "
+               "(%lu KB/s)\n", output_names[o], histories[h], size, dur,
+               dur > 0 ? (unsigned long)(size * 1000000ull / 1024 / dur) : 0);
+
+      if (success && o == Output_Tar) {
+        success = compare_tar(histories[h], plain[o], out[o]);
+      } else if (success) {
+        Buffer plain_data, packed_data;
+        success = load_file(plain[o], &plain_data) &&
+                  load_file(out[o], &packed_data) &&
+                  compare(output_names[o], histories[h], &plain_data,
+                          &packed_data);
+        free(plain_data.data);
+        free(packed_data.data);
+      }
+    }
+  }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
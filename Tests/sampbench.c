@@ -0,0 +1,141 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Benchmark of sample data pre-tuning
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+
+/* Local header files */
+#include "misc.h"
+#include "sampdata.h"
+
+enum {
+  DEFAULT_FRAMES = 1 << 20, /* 2 MB of sample data */
+  MIN_TICKS_DIVISOR = 4 /* Time each test for at least 1/4 second */
+};
+
+static bool write_sample(FILE * const f, const unsigned long count)
+{
+  assert(f != NULL);
+
+  /* A sawtooth wave with a period that isn't a power of two, so that
+     pre-tuning doesn't produce trivially repetitive output. */
+  for (unsigned long n = 0; n < count; n++) {
+    const long int value = (long int)((n * 997) % 65536) - 32768;
+    const unsigned int u = (unsigned int)(value & 0xffff);
+    if (fputc((int)(u & UCHAR_MAX), f) == EOF ||
+        fputc((int)(u >> 8), f) == EOF) {
+      fputs("Failed to write sample data\n", stderr);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool pretune_all(FILE * const f, const int octaves,
+                        const bool band_limited, unsigned long * const sum)
+{
+  assert(f != NULL);
+  assert(sum != NULL);
+
+  SampleStream stream;
+  bool success = sample_stream_init(&stream, f, octaves, band_limited);
+
+  /* Add up the output so that it can't be optimised away. */
+  for (unsigned long pos = 0; success && pos < stream.count; ) {
+    unsigned long count = stream.count - pos;
+    _Optional const int16_t * const frames =
+      sample_stream_read(&stream, pos, &count);
+
+    if (frames == NULL) {
+      success = false;
+    } else {
+      for (unsigned long n = 0; n < count; n++)
+        *sum += (unsigned long)(frames[n] & 0xffff);
+      pos += count;
+    }
+  }
+
+  sample_stream_destroy(&stream);
+  return success;
+}
+
+static bool bench(FILE * const f, const unsigned long num_frames,
+                  const int octaves, const bool band_limited)
+{
+  assert(f != NULL);
+
+  /* Repeat until enough processor time has passed to measure accurately. */
+  unsigned long sum = 0;
+  long int runs = 0;
+  const clock_t start = clock();
+  clock_t elapsed;
+  do {
+    if (!pretune_all(f, octaves, band_limited, &sum))
+      return false;
+
+    runs++;
+    elapsed = clock() - start;
+  } while (elapsed < CLOCKS_PER_SEC / MIN_TICKS_DIVISOR);
+
+  /* Throughput is given in bytes of sample data read per second, to one
+     decimal place of a megabyte. */
+  const unsigned long long bytes = (unsigned long long)num_frames * 2 *
+                                   (unsigned long long)runs;
+  const unsigned long long rate = bytes * 10 /
+    ((unsigned long long)elapsed * 1000000u / CLOCKS_PER_SEC);
+  printf("%-9s %+d octaves: %5llu.%llu MB/s (checksum %lx)\n",
+         band_limited ? "resample" : "crude", octaves,
+         rate / 10, rate % 10, sum / (unsigned long)runs);
+  return true;
+}
+
+int main(int argc, const char *argv[])
+{
+  unsigned long num_frames = DEFAULT_FRAMES;
+  if (argc > 1) {
+    char *end;
+    num_frames = strtoul(argv[1], &end, 10);
+    if (end == argv[1] || *end != '\0' || num_frames == 0) {
+      fprintf(stderr, "usage: %s [<frames>]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  _Optional FILE * const f = tmpfile();
+  if (f == NULL) {
+    fputs("Failed to create temporary file\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  bool success = write_sample(&*f, num_frames);
+
+  static const int octaves[] = {2, 1, -1, -2};
+  for (size_t i = 0; success && i < sizeof(octaves) / sizeof(octaves[0]); i++) {
+    success = bench(&*f, num_frames, octaves[i], false) &&
+              bench(&*f, num_frames, octaves[i], true);
+  }
+
+  fclose(&*f);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
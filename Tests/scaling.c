@@ -0,0 +1,243 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Test that conversion time grows linearly with the size of the input
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+
+/* Local header files */
+#include "misc.h"
+
+enum {
+  NUM_SIZES = 3, /* No. of corpora in each series */
+  GROWTH = 4, /* Factor by which each corpus is larger than the one before */
+  MAX_SLOWDOWN = 2, /* Tolerated growth in time per unit between corpora */
+  NUM_RUNS = 5, /* The fastest of this many conversions is timed */
+  NUM_GEN_SAMPLES = 4, /* Default no. of samples written by SF3KGen */
+  BYTES_PER_FRAME = 2, /* Sample data written by SF3KGen is 16 bit */
+  MIN_DURATION = 5000, /* Shortest time (in microseconds) worth comparing */
+  EXIT_SKIPPED = 77, /* Tells ctest that the test was skipped */
+  MAX_COMMAND = 4096
+};
+
+typedef struct {
+  const char *gen; /* Path of SF3KGen */
+  const char *conv; /* Path of SF3KtoProT */
+  const char *dir; /* Directory in which to write files */
+} Programs;
+
+/* Each series varies either the no. of patterns or the length of samples,
+   starting from the given values. */
+static const struct {
+  const char *unit;
+  int num_patterns;
+  long int sample_len;
+  bool vary_patterns;
+} series[] = {
+  {"pattern", 15, 1000, true},
+  {"sample byte", 4, 2000, false},
+};
+
+static bool run(const char * const command)
+{
+  assert(command != NULL);
+
+  puts(command);
+  fflush(stdout);
+
+  if (system(command) != 0) {
+    fprintf(stderr, "Command failed: %s\n", command);
+    return false;
+  }
+  return true;
+}
+
+static bool read_duration(const char * const trace_file,
+                          unsigned long * const dur)
+{
+  assert(trace_file != NULL);
+  assert(dur != NULL);
+
+  _Optional FILE * const f = fopen(trace_file, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open trace file '%s'\n", trace_file);
+    return false;
+  }
+
+  /* Each event is on a separate line. The name and duration of an event
+     precede its arguments, so a long line needn't be read in full. */
+  bool found = false;
+  char line[256];
+  while (!found && fgets(line, sizeof(line), &*f) != NULL) {
+    if (strstr(line, "\"name\":\"process_file\"") == NULL)
+      continue;
+
+    _Optional const char * const value = strstr(line, "\"dur\":");
+    if (value != NULL) {
+      *dur = strtoul(&*value + strlen("\"dur\":"), NULL, 10);
+      found = true;
+    }
+  }
+
+  fclose(&*f);
+
+  if (!found)
+    fprintf(stderr, "No conversion recorded in trace file '%s'\n",
+            trace_file);
+
+  return found;
+}
+
+static bool time_conversion(const Programs * const programs,
+                            const int num_patterns,
+                            const long int sample_len,
+                            unsigned long * const best)
+{
+  assert(programs != NULL);
+  assert(best != NULL);
+
+  char music[MAX_COMMAND / 4], module[MAX_COMMAND / 4], trace[MAX_COMMAND / 4];
+  char command[MAX_COMMAND];
+  const int n1 = snprintf(music, sizeof(music), "%s%cmusic", programs->dir,
+                          PATH_SEPARATOR);
+  const int n2 = snprintf(module, sizeof(module), "%s%cmusic%cmod",
+                          programs->dir, PATH_SEPARATOR, EXT_SEPARATOR);
+  const int n3 = snprintf(trace, sizeof(trace), "%s%ctrace%cjson",
+                          programs->dir, PATH_SEPARATOR, EXT_SEPARATOR);
+  if (n1 < 0 || (size_t)n1 >= sizeof(music) ||
+      n2 < 0 || (size_t)n2 >= sizeof(module) ||
+      n3 < 0 || (size_t)n3 >= sizeof(trace)) {
+    fputs("Path of directory is too long\n", stderr);
+    return false;
+  }
+
+  /* The same music is converted every time, so the fastest conversion is
+     the one least disturbed by other activity. */
+  snprintf(command, sizeof(command),
+           "\"%s\" -raw -patterns %d -samplelen %ld \"%s\" \"%s\"",
+           programs->gen, num_patterns, sample_len, programs->dir, music);
+  if (!run(command))
+    return false;
+
+  snprintf(command, sizeof(command),
+           "\"%s\" -raw -trace \"%s\" \"%s\" \"%s\" \"%s\"",
+           programs->conv, trace, programs->dir, music, module);
+
+  *best = ULONG_MAX;
+  for (int r = 0; r < NUM_RUNS; r++) {
+    unsigned long dur;
+    if (!run(command) || !read_duration(trace, &dur))
+      return false;
+
+    if (dur < *best)
+      *best = dur;
+  }
+
+  return true;
+}
+
+static bool check_series(const Programs * const programs, const size_t s,
+                         int * const num_compared)
+{
+  assert(programs != NULL);
+  assert(s < sizeof(series) / sizeof(series[0]));
+  assert(num_compared != NULL);
+
+  int num_patterns = series[s].num_patterns;
+  long int sample_len = series[s].sample_len;
+  unsigned long last_dur = 0, last_per_unit = 0;
+  bool success = true;
+
+  for (int i = 0; i < NUM_SIZES && success; i++) {
+    unsigned long dur;
+    success = time_conversion(programs, num_patterns, sample_len, &dur);
+    if (!success)
+      break;
+
+    /* Time per unit is in nanoseconds, because the trace gives
+       microseconds and there may be many units. */
+    const unsigned long long units = series[s].vary_patterns ?
+      (unsigned long long)num_patterns :
+      (unsigned long long)sample_len * NUM_GEN_SAMPLES * BYTES_PER_FRAME;
+    const unsigned long per_unit = (unsigned long)(dur * 1000ull / units);
+
+    printf("%llu %s%s: %lu us (%lu ns per %s)\n", units, series[s].unit,
+           units == 1 ? "" : "s", dur, per_unit, series[s].unit);
+
+    /* A fixed overhead makes the time per unit fall as the size grows, so
+       any substantial rise means that the time grows superlinearly. Short
+       times are dominated by the resolution of the clock (which may be as
+       coarse as a millisecond) and by noise, so they aren't compared. */
+    if (i > 0 && last_dur < MIN_DURATION) {
+      printf("Not compared because %lu us is too short to measure\n",
+             last_dur);
+    } else if (i > 0) {
+      ++*num_compared;
+      if (per_unit > last_per_unit * MAX_SLOWDOWN) {
+        fprintf(stderr, "Time per %s grew from %lu to %lu ns (limit is %dx) "
+                "when the input grew %dx\n", series[s].unit, last_per_unit,
+                per_unit, MAX_SLOWDOWN, GROWTH);
+        success = false;
+      }
+    }
+    last_dur = dur;
+    last_per_unit = per_unit;
+
+    if (series[s].vary_patterns)
+      num_patterns *= GROWTH;
+    else
+      sample_len *= GROWTH;
+  }
+
+  return success;
+}
+
+int main(int argc, const char *argv[])
+{
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <SF3KGen> <SF3KtoProT> <work-dir>\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!system(NULL)) {
+    fputs("No command processor is available\n", stderr);
+    return EXIT_FAILURE;
+  }
+
+  const Programs programs = {argv[1], argv[2], argv[3]};
+  bool success = true;
+  int num_compared = 0;
+  for (size_t s = 0; success && s < sizeof(series) / sizeof(series[0]); s++)
+    success = check_series(&programs, s, &num_compared);
+
+  if (!success)
+    return EXIT_FAILURE;
+
+  if (num_compared == 0) {
+    puts("No conversion took long enough to be compared");
+    return EXIT_SKIPPED;
+  }
+
+  return EXIT_SUCCESS;
+}
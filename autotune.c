@@ -0,0 +1,438 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Choice of conversion flags by comparison of rendered audio
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h> /* Required for fork and pipe */
+#define HAVE_FORK
+#endif
+
+/* ISO library header files */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "samp.h"
+#include "sftrack.h"
+#include "protracker.h"
+#include "sfplay.h"
+#include "ptplay.h"
+#include "wav.h"
+#include "autotune.h"
+
+enum {
+  MIX_RATE        = 44100, /* Hz, as rendered by sfplay and ptplay */
+  SF_TICK_FREQ    = 100, /* Hz, as played by 'SFX_Handler' */
+  PT_TICK_FREQ    = 90, /* Hz, as set by the tempo pattern of a module */
+  SF_TICK_FRAMES  = MIX_RATE / SF_TICK_FREQ,
+  PT_TICK_FRAMES  = MIX_RATE / PT_TICK_FREQ,
+  MAX_TICK_FRAMES = PT_TICK_FRAMES,
+  NUM_CANDIDATES  = 4, /* Combinations of the flags to be tuned */
+  TUNED_FLAGS     = FLAGS_GLISSANDO_SINGLE | FLAGS_EXTRA_OCTAVES
+};
+
+/* Each tick of music is reduced to its mean absolute level and the mean
+   absolute difference between consecutive frames. The latter rises with
+   pitch and brightness, so together they are a crude spectral envelope
+   that is cheap to compute and insensitive to the phase of each note. */
+typedef struct {
+  unsigned long num_ticks;
+  _Optional uint32_t *level;
+  _Optional uint32_t *slope;
+} Envelope;
+
+static bool envelope_init(Envelope * const env,
+                          const unsigned long num_ticks)
+{
+  assert(env != NULL);
+
+  const size_t n = num_ticks > 0 ? num_ticks : 1;
+  *env = (Envelope){
+    .num_ticks = num_ticks,
+    .level = malloc(n * sizeof(uint32_t)),
+    .slope = malloc(n * sizeof(uint32_t)),
+  };
+
+  if (env->level == NULL || env->slope == NULL) {
+    fprintf(stderr, "Failed to allocate memory for %lu ticks of envelope\n",
+            num_ticks);
+    free(env->level);
+    free(env->slope);
+    return false;
+  }
+
+  return true;
+}
+
+static void envelope_destroy(Envelope * const env)
+{
+  assert(env != NULL);
+  free(env->level);
+  free(env->slope);
+}
+
+static bool read_envelope(FILE * const f, const unsigned int tick_frames,
+                          const unsigned long skip_ticks,
+                          Envelope * const env)
+{
+  assert(f != NULL);
+  assert(tick_frames > 0);
+  assert(tick_frames <= MAX_TICK_FRAMES);
+  assert(env != NULL);
+  assert(env->level != NULL);
+  assert(env->slope != NULL);
+
+  if (fflush(f) || fseek(f, 0, SEEK_SET)) {
+    fprintf(stderr, "Failed to rewind temporary file: %s\n", strerror(errno));
+    return false;
+  }
+
+  unsigned long rate, num_frames;
+  if (!wav_read_header(f, &rate, &num_frames) || rate != MIX_RATE) {
+    fprintf(stderr, "Bad rendered audio in temporary file\n");
+    return false;
+  }
+
+  /* Any ticks beyond the end of the rendered audio are silent. */
+  uint8_t raw[MAX_TICK_FRAMES * 2];
+  int16_t frames[MAX_TICK_FRAMES];
+  int32_t prev = 0;
+
+  for (unsigned long t = 0; t < skip_ticks + env->num_ticks; t++) {
+    const unsigned int n = num_frames < tick_frames ?
+                           (unsigned int)num_frames : tick_frames;
+    if (n > 0 && fread(raw, (size_t)n * 2, 1, f) != 1) {
+      fprintf(stderr, "Failed to read temporary file: %s\n", strerror(errno));
+      return false;
+    }
+    num_frames -= n;
+    wav_decode_frames(raw, n, frames);
+    memset(frames + n, 0, (tick_frames - n) * sizeof(frames[0]));
+
+    unsigned long level = 0, slope = 0;
+    for (unsigned int i = 0; i < tick_frames; i++) {
+      const int32_t frame = frames[i];
+      level += (unsigned long)(frame < 0 ? -frame : frame);
+      slope += (unsigned long)(frame < prev ? prev - frame : frame - prev);
+      prev = frame;
+    }
+
+    if (t >= skip_ticks) {
+      env->level[t - skip_ticks] = (uint32_t)(level / tick_frames);
+      env->slope[t - skip_ticks] = (uint32_t)(slope / tick_frames);
+    }
+  }
+
+  return true;
+}
+
+static unsigned long long envelope_distance(const Envelope * const a,
+                                            const Envelope * const b)
+{
+  assert(a != NULL);
+  assert(a->level != NULL);
+  assert(a->slope != NULL);
+  assert(b != NULL);
+  assert(b->level != NULL);
+  assert(b->slope != NULL);
+  assert(a->num_ticks == b->num_ticks);
+
+  /* Sum of absolute differences, written as a simple loop over arrays so
+     that compilers can vectorise it. */
+  unsigned long long distance = 0;
+  for (unsigned long t = 0; t < a->num_ticks; t++) {
+    const uint32_t dl = a->level[t] > b->level[t] ?
+                        a->level[t] - b->level[t] : b->level[t] - a->level[t];
+    const uint32_t ds = a->slope[t] > b->slope[t] ?
+                        a->slope[t] - b->slope[t] : b->slope[t] - a->slope[t];
+    distance += dl + ds;
+  }
+
+  return distance;
+}
+
+static unsigned int candidate_flags(const unsigned int flags, const int n)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(n >= 0);
+  assert(n < NUM_CANDIDATES);
+
+  /* Candidates are ordered so that the fewest flags win a tie. Statistics
+     are only wanted for the final conversion. The tempo is never folded, so
+     that the first division of every candidate can be skipped. */
+  return (flags & ~(TUNED_FLAGS | FLAGS_AUTOTUNE | FLAGS_STATS |
+                    FLAGS_FOLD_TEMPO)) |
+         ((n & 1) != 0 ? FLAGS_GLISSANDO_SINGLE : 0) |
+         ((n & 2) != 0 ? FLAGS_EXTRA_OCTAVES : 0);
+}
+
+static bool score_candidate(const unsigned int flags,
+                            const char * const song_name,
+                            const SFTrack * const music_data,
+                            const char * const samples_dir,
+                            const SampleArray * const sf_samples,
+                            const Envelope * const ref,
+                            unsigned long long * const score)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(ref != NULL);
+  assert(score != NULL);
+
+  /* Convert the track to a module in one temporary file and play that
+     module into another. */
+  _Optional FILE * const module = tmpfile();
+  _Optional FILE * const audio = tmpfile();
+  bool success = false;
+
+  if (module == NULL || audio == NULL) {
+    fprintf(stderr, "Failed to create temporary file: %s\n", strerror(errno));
+  } else if (convert_sftrack(flags, song_name, music_data, samples_dir,
+                             sf_samples, &*module)) {
+    if (fflush(&*module) || fseek(&*module, 0, SEEK_SET)) {
+      fprintf(stderr, "Failed to rewind temporary file: %s\n",
+              strerror(errno));
+    } else if (render_protracker(flags, &*module, &*audio)) {
+      /* The first division of a module only sets the tempo, after which
+         each tick corresponds to one tick of the original track. Ticks of
+         the module are longer, which is why means are compared. */
+      Envelope env;
+      if (envelope_init(&env, ref->num_ticks)) {
+        if (read_envelope(&*audio, PT_TICK_FRAMES, music_data->speed,
+                          &env)) {
+          *score = envelope_distance(ref, &env);
+          success = true;
+        }
+        envelope_destroy(&env);
+      }
+    }
+  }
+
+  if (module != NULL)
+    fclose(&*module);
+
+  if (audio != NULL)
+    fclose(&*audio);
+
+  return success;
+}
+
+static bool make_reference(const unsigned int flags,
+                           const SFTrack * const music_data,
+                           const char * const samples_dir,
+                           const SampleArray * const sf_samples,
+                           Envelope * const ref)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(ref != NULL);
+
+  /* Only the music itself is compared, so no blank pattern is needed.
+     'SFX_Handler' plays glissandos on all channels. */
+  const unsigned int ref_flags = flags & ~(FLAGS_GLISSANDO_SINGLE |
+                                           FLAGS_BLANK_PATTERN |
+                                           FLAGS_AUTOTUNE | FLAGS_STATS);
+
+  const unsigned long num_ticks = (unsigned long)sftrack_song_len(music_data) *
+                                  NUM_SF_DIVISIONS * music_data->speed;
+
+  _Optional FILE * const audio = tmpfile();
+  if (audio == NULL) {
+    fprintf(stderr, "Failed to create temporary file: %s\n", strerror(errno));
+    return false;
+  }
+
+  bool success = envelope_init(ref, num_ticks);
+  if (success) {
+    success = play_sftrack(ref_flags, music_data, samples_dir, sf_samples,
+                           &*audio) &&
+              read_envelope(&*audio, SF_TICK_FRAMES, 0, ref);
+
+    if (!success)
+      envelope_destroy(ref);
+  }
+
+  fclose(&*audio);
+  return success;
+}
+
+#ifdef HAVE_FORK
+static void score_all(const unsigned int flags,
+                      const char * const song_name,
+                      const SFTrack * const music_data,
+                      const char * const samples_dir,
+                      const SampleArray * const sf_samples,
+                      const Envelope * const ref,
+                      bool valid[NUM_CANDIDATES],
+                      unsigned long long scores[NUM_CANDIDATES])
+{
+  pid_t pids[NUM_CANDIDATES];
+  int fds[NUM_CANDIDATES];
+
+  /* Score each candidate in a child process. The track, samples list and
+     reference envelope are shared with the parent until written. */
+  fflush(NULL);
+
+  for (int n = 0; n < NUM_CANDIDATES; n++) {
+    int pipe_fds[2];
+    pids[n] = -1;
+    fds[n] = -1;
+    valid[n] = false;
+
+    if (pipe(pipe_fds)) {
+      fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+      continue;
+    }
+
+    pids[n] = fork();
+    if (pids[n] == 0) {
+      close(pipe_fds[0]);
+
+      /* Warnings would otherwise be repeated for every candidate as well as
+         for the final conversion. */
+      if ((flags & FLAGS_VERBOSE) == 0)
+        freopen(NULL_DEVICE, "w", stderr);
+
+      unsigned long long score;
+      const bool success = score_candidate(candidate_flags(flags, n),
+                                           song_name, music_data, samples_dir,
+                                           sf_samples, ref, &score) &&
+                           write(pipe_fds[1], &score, sizeof(score)) ==
+                           (ssize_t)sizeof(score);
+      exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    if (pids[n] < 0) {
+      fprintf(stderr, "Failed to start job: %s\n", strerror(errno));
+      close(pipe_fds[0]);
+    } else {
+      fds[n] = pipe_fds[0];
+    }
+  }
+
+  for (int n = 0; n < NUM_CANDIDATES; n++) {
+    if (pids[n] > 0) {
+      int status;
+      valid[n] = read(fds[n], &scores[n], sizeof(scores[n])) ==
+                 (ssize_t)sizeof(scores[n]);
+      close(fds[n]);
+      if (waitpid(pids[n], &status, 0) < 0 ||
+          !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        valid[n] = false;
+    } else {
+      /* Fall back to scoring this candidate in the parent process. */
+      valid[n] = score_candidate(candidate_flags(flags, n), song_name,
+                                 music_data, samples_dir, sf_samples, ref,
+                                 &scores[n]);
+    }
+  }
+}
+#else
+static void score_all(const unsigned int flags,
+                      const char * const song_name,
+                      const SFTrack * const music_data,
+                      const char * const samples_dir,
+                      const SampleArray * const sf_samples,
+                      const Envelope * const ref,
+                      bool valid[NUM_CANDIDATES],
+                      unsigned long long scores[NUM_CANDIDATES])
+{
+  for (int n = 0; n < NUM_CANDIDATES; n++)
+    valid[n] = score_candidate(candidate_flags(flags, n), song_name,
+                               music_data, samples_dir, sf_samples, ref,
+                               &scores[n]);
+}
+#endif
+
+bool autotune_flags(unsigned int * const flags,
+                    const char * const song_name,
+                    const SFTrack * const music_data,
+                    const char * const samples_dir,
+                    const SampleArray * const sf_samples)
+{
+  assert(flags != NULL);
+  assert(!(*flags & ~FLAGS_ALL));
+  assert(!(*flags & FLAGS_XM));
+  assert(music_data != NULL);
+  assert(samples_dir != NULL);
+  assert(sf_samples != NULL);
+
+  if (sftrack_song_len(music_data) >= MAX_SF_PATTERNS) {
+    fprintf(stderr, "Unterminated pattern play order in input file\n");
+    return false;
+  }
+
+  /* Progress is only logged for the final conversion. */
+  const unsigned int saved_mask = log_set_mask(0);
+  Envelope ref;
+  const bool have_ref = make_reference(*flags, music_data, samples_dir,
+                                       sf_samples, &ref);
+
+  bool valid[NUM_CANDIDATES];
+  unsigned long long scores[NUM_CANDIDATES];
+  if (have_ref) {
+    score_all(*flags, song_name, music_data, samples_dir, sf_samples, &ref,
+              valid, scores);
+    envelope_destroy(&ref);
+  }
+  log_set_mask(saved_mask);
+
+  if (!have_ref)
+    return false;
+
+  int best = -1;
+  for (int n = 0; n < NUM_CANDIDATES; n++) {
+    if (!valid[n])
+      continue;
+
+    const unsigned int cflags = candidate_flags(*flags, n);
+    LOGF(LogLevel_Info, LogCategory_Planning, "Candidate%s%s has distance %llu",
+         (cflags & FLAGS_GLISSANDO_SINGLE) != 0 ? " -channelglissando" : "",
+         (cflags & FLAGS_EXTRA_OCTAVES) != 0 ? " -extraoctaves" : "",
+         scores[n]);
+
+    if (best < 0 || scores[n] < scores[best])
+      best = n;
+  }
+
+  if (best < 0) {
+    fprintf(stderr, "No candidate conversion could be rendered\n");
+    return false;
+  }
+
+  const unsigned int chosen = candidate_flags(*flags, best) & TUNED_FLAGS;
+  if ((*flags & FLAGS_STATS) != 0)
+    fprintf(stderr, "Chose conversion flags:%s%s%s (distance %llu)\n",
+            (chosen & FLAGS_GLISSANDO_SINGLE) != 0 ? " -channelglissando" : "",
+            (chosen & FLAGS_EXTRA_OCTAVES) != 0 ? " -extraoctaves" : "",
+            chosen == 0 ? " none" : "",
+            scores[best]);
+
+  *flags = (*flags & ~TUNED_FLAGS) | chosen;
+  return true;
+}
@@ -0,0 +1,23 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Choice of conversion flags by comparison of rendered audio
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+/* ISO library header files */
+#include <stdbool.h>
+
+/* Local headers */
+#include "samp.h"
+#include "sftrack.h"
+
+extern bool autotune_flags(unsigned int      *flags,
+                           const char        *song_name,
+                           const SFTrack     *music_data,
+                           const char        *samples_dir,
+                           const SampleArray *sf_samples);
+
+#endif /* AUTOTUNE_H */
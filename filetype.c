@@ -32,24 +32,52 @@
 
 enum
 {
-  FTYPE_TEQMUSIC = 0xCC5 /* RISC OS file type equivalent to file
-                            extension *.mod or *.nst */
+  FTYPE_TEQMUSIC = 0xCC5, /* RISC OS file type equivalent to file
+                             extension *.mod or *.nst */
+  FTYPE_DATA     = 0xFFD, /* No file type is allocated for *.xm or
+                             for *.tar */
+  FTYPE_WAVE     = 0xFB1, /* RISC OS file type equivalent to file
+                             extension *.wav */
+  FTYPE_TEXT     = 0xFFF, /* No file type is allocated for *.json */
+  FTYPE_GKEY     = 0x154 /* RISC OS file type of data compressed using
+                            Gordon Key's algorithm */
 };
 
 /* Platform-specific function */
-bool set_file_type(const char *file_path)
+bool set_file_type(const char *file_path, FileType type)
 {
 #ifdef ACORN_C
   _kernel_osfile_block kob;
 
   assert(file_path != NULL);
 
-  /* Apply the RISC OS file type for Amiga ProTracker music
-     to the specified file. */
-  kob.load = FTYPE_TEQMUSIC;
+  /* Apply the RISC OS file type for Amiga ProTracker music (or
+     other output) to the specified file. */
+  switch (type) {
+    case FileType_XM:
+      kob.load = FTYPE_DATA;
+      break;
+    case FileType_WAV:
+      kob.load = FTYPE_WAVE;
+      break;
+    case FileType_JSON:
+      kob.load = FTYPE_TEXT;
+      break;
+    case FileType_Tar:
+      kob.load = FTYPE_DATA;
+      break;
+    case FileType_Compressed:
+      kob.load = FTYPE_GKEY;
+      break;
+    default:
+      assert(type == FileType_ProTracker);
+      kob.load = FTYPE_TEQMUSIC;
+      break;
+  }
   return (_kernel_osfile(18, file_path, &kob) != _kernel_ERROR);
 #else
   (void)file_path;
+  (void)type;
   return true;
 #endif
 }
@@ -9,6 +9,15 @@
 
 #include <stdbool.h>
 
-extern bool set_file_type(const char *file_path);
+typedef enum {
+  FileType_ProTracker,
+  FileType_XM,
+  FileType_WAV,
+  FileType_JSON,
+  FileType_Tar,
+  FileType_Compressed
+} FileType;
+
+extern bool set_file_type(const char *file_path, FileType type);
 
 #endif /* FILETYPE_H */
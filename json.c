@@ -0,0 +1,45 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  JSON output helpers
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdio.h>
+
+/* Local header files */
+#include "misc.h"
+#include "json.h"
+
+void json_put_string(const char * const s, FILE * const out)
+{
+  assert(s != NULL);
+  assert(out != NULL);
+
+  /* Characters outside the ASCII range are assumed to be Latin-1, which
+     is what RISC OS uses by default. */
+  putc('"', out);
+  for (const unsigned char *p = (const unsigned char *)s; *p != '\0'; p++) {
+    if (*p == '"' || *p == '\\')
+      fprintf(out, "\\%c", *p);
+    else if (*p < ' ' || *p > '~')
+      fprintf(out, "\\u%04x", *p);
+    else
+      putc(*p, out);
+  }
+  putc('"', out);
+}
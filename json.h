@@ -0,0 +1,15 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  JSON output helpers
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef JSON_H
+#define JSON_H
+
+/* ISO library header files */
+#include <stdio.h>
+
+extern void json_put_string(const char *s, FILE *out);
+
+#endif /* JSON_H */
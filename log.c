@@ -0,0 +1,190 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Buffered logging of progress by level and category
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+/* Local header files */
+#include "misc.h"
+#include "json.h"
+#include "log.h"
+
+enum {
+  LOG_RING_SIZE = 32, /* Records buffered before writing any */
+  LOG_MAX_TEXT  = 512 /* Including the string terminator */
+};
+
+typedef struct {
+  unsigned long seq;
+  LogLevel      level;
+  LogCategory   category;
+  char          text[LOG_MAX_TEXT];
+} LogRecord;
+
+unsigned int log_mask = 0;
+
+/* The program has only one thread, and each process started by '-jobs'
+   has its own copy of this state. */
+static LogFormat log_format = LogFormat_Text;
+static LogRecord ring[LOG_RING_SIZE];
+static int ring_start = 0, ring_count = 0;
+static unsigned long next_seq = 0;
+
+static const char *const level_names[LogLevel_Count] = {
+  [LogLevel_Info] = "info",
+  [LogLevel_Debug] = "debug",
+};
+
+static const char *const category_names[LogCategory_Count] = {
+  [LogCategory_Index] = "index",
+  [LogCategory_Decode] = "decode",
+  [LogCategory_Planning] = "planning",
+  [LogCategory_Transcode] = "transcode",
+  [LogCategory_Samples] = "samples",
+  [LogCategory_Render] = "render",
+};
+
+unsigned int log_set_mask(const unsigned int mask)
+{
+  assert(!(mask & ~LOG_ALL));
+
+  const unsigned int old_mask = log_mask;
+  log_mask = mask;
+  return old_mask;
+}
+
+static bool parse_level(const char * const name, const size_t len,
+                        unsigned int * const bits)
+{
+  assert(name != NULL);
+  assert(bits != NULL);
+
+  /* Enabling a level also enables the less detailed levels. */
+  for (int level = 0; level < LogLevel_Count; level++) {
+    if (strlen(level_names[level]) == len &&
+        strncmp(name, level_names[level], len) == 0) {
+      *bits = (1u << (level + 1)) - 1;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool log_parse_spec(const char * const spec)
+{
+  assert(spec != NULL);
+
+  /* The specification is a comma-separated list of category names, each
+     optionally followed by a colon and the most detailed level to log. */
+  unsigned int mask = 0;
+  const char *item = spec;
+
+  do {
+    const char *end = strchr(item, ',');
+    if (end == NULL)
+      end = item + strlen(item);
+
+    const char *colon = memchr(item, ':', (size_t)(end - item));
+    const char * const name_end = colon != NULL ? colon : end;
+    const size_t name_len = (size_t)(name_end - item);
+
+    unsigned int level_bits = (1u << LogLevel_Count) - 1;
+    if (colon != NULL &&
+        !parse_level(colon + 1, (size_t)(end - colon - 1), &level_bits)) {
+      fprintf(stderr, "Bad log level '%.*s'\n", (int)(end - colon - 1),
+              colon + 1);
+      return false;
+    }
+
+    bool found = false;
+    for (int category = 0; category < LogCategory_Count; category++) {
+      if ((name_len == 3 && strncmp(item, "all", 3) == 0) ||
+          (strlen(category_names[category]) == name_len &&
+           strncmp(item, category_names[category], name_len) == 0)) {
+        mask |= level_bits << (category * LogLevel_Count);
+        found = true;
+      }
+    }
+
+    if (!found) {
+      fprintf(stderr, "Bad log category '%.*s'\n", (int)name_len, item);
+      return false;
+    }
+
+    item = *end != '\0' ? end + 1 : end;
+  } while (*item != '\0');
+
+  log_mask |= mask;
+  return true;
+}
+
+void log_set_format(const LogFormat format)
+{
+  log_format = format;
+}
+
+void log_printf(const LogLevel level, const LogCategory category,
+                const char * const format, ...)
+{
+  assert(level >= 0);
+  assert(level < LogLevel_Count);
+  assert(category >= 0);
+  assert(category < LogCategory_Count);
+  assert(format != NULL);
+
+  if (ring_count == LOG_RING_SIZE)
+    log_flush();
+
+  /* Formatting is cheap compared to writing each message as it arrives.
+     Overlong messages are truncated. */
+  LogRecord * const record =
+    &ring[(ring_start + ring_count++) % LOG_RING_SIZE];
+
+  record->seq = next_seq++;
+  record->level = level;
+  record->category = category;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record->text, sizeof(record->text), format, args);
+  va_end(args);
+}
+
+void log_flush(void)
+{
+  for (; ring_count > 0; ring_count--) {
+    const LogRecord * const record = &ring[ring_start];
+    ring_start = (ring_start + 1) % LOG_RING_SIZE;
+
+    if (log_format == LogFormat_JSON) {
+      printf("{\"seq\":%lu,\"level\":\"%s\",\"category\":\"%s\","
+             "\"message\":", record->seq, level_names[record->level],
+             category_names[record->category]);
+      json_put_string(record->text, stdout);
+      puts("}");
+    } else {
+      puts(record->text);
+    }
+  }
+}
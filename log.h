@@ -0,0 +1,66 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Buffered logging of progress by level and category
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+/* ISO library header files */
+#include <stdbool.h>
+
+typedef enum {
+  LogLevel_Info,  /* Progress through each stage of processing */
+  LogLevel_Debug, /* Details of each note, pattern or sample */
+  LogLevel_Count
+} LogLevel;
+
+typedef enum {
+  LogCategory_Index,     /* Loading the sound samples index */
+  LogCategory_Decode,    /* Opening files and reading music data */
+  LogCategory_Planning,  /* Choosing ProTracker samples */
+  LogCategory_Transcode, /* Writing song positions and patterns */
+  LogCategory_Samples,   /* Writing sample data */
+  LogCategory_Render,    /* Playing music to record it */
+  LogCategory_Count
+} LogCategory;
+
+typedef enum {
+  LogFormat_Text,
+  LogFormat_JSON
+} LogFormat;
+
+/* One bit per combination of level and category. Only read it via
+   LOG_ENABLED so that a disabled message costs a single test. */
+extern unsigned int log_mask;
+
+#define LOG_BIT(level, category) \
+  (1u << ((unsigned int)(category) * LogLevel_Count + (unsigned int)(level)))
+
+#define LOG_ALL ((1u << (LogCategory_Count * LogLevel_Count)) - 1)
+
+#define LOG_ENABLED(level, category) \
+  ((log_mask & LOG_BIT(level, category)) != 0)
+
+#define LOGF(level, category, ...) \
+  do { \
+    if (LOG_ENABLED(level, category)) \
+      log_printf(level, category, __VA_ARGS__); \
+  } while (0)
+
+extern unsigned int log_set_mask(unsigned int mask);
+
+extern bool log_parse_spec(const char *spec);
+
+extern void log_set_format(LogFormat format);
+
+#ifdef __GNUC__
+__attribute__((format(printf, 3, 4)))
+#endif
+extern void log_printf(LogLevel level, LogCategory category,
+                       const char *format, ...);
+
+extern void log_flush(void);
+
+#endif /* LOG_H */
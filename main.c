@@ -18,22 +18,38 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+/* Declare fmemopen and open_memstream even when compiling for strict ISO C.
+   This must precede the first header file to have any effect. */
+#define _POSIX_C_SOURCE 200809L
+
 #ifdef _WIN32
 #include <io.h>     /* Required for _setmode and _fileno */
 #include <fcntl.h>  /* Required for _O_BINARY */
 #endif
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h> /* Required for fork and sysconf */
+#define HAVE_FORK
+#define HAVE_MEMSTREAM /* fmemopen and open_memstream */
+#endif
+
 /* ISO library header files */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
 
 /* StreamLib headers */
 #include "Reader.h"
 #include "ReaderGKey.h"
 #include "ReaderRaw.h"
+#include "Writer.h"
+#include "WriterGKey.h"
 
 /* CBUtilLib headers */
 #include "ArgUtils.h"
@@ -42,17 +58,289 @@
 
 /* Local header files */
 #include "misc.h"
+#include "log.h"
+#include "trace.h"
 #include "samp.h"
+#include "sampdata.h"
 #include "protracker.h"
+#include "sfplay.h"
+#include "ptplay.h"
+#include "sfinfo.h"
+#include "sftrack.h"
 #include "main.h"
 #include "filetype.h"
+#include "tar.h"
+#include "watch.h"
 #include "version.h"
 
 enum {
-  HistoryLog2 = 9 /* Base 2 logarithm of the history size used by
-                     the compression algorithm */
+  HistoryLog2 = 9, /* Base 2 logarithm of the history size used by
+                      the compression algorithm */
+  MaxHistoryLog2 = 16
 };
 
+/* History size used to compress output, which needn't match that of the
+   input if the output is only read by this program's readers */
+static int history_log2 = HistoryLog2;
+
+static FileType get_content_type(const unsigned int flags)
+{
+  if ((flags & FLAGS_INFO) != 0)
+    return FileType_JSON;
+
+  if ((flags & (FLAGS_WAV | FLAGS_RENDER)) != 0)
+    return FileType_WAV;
+
+  return (flags & FLAGS_XM) != 0 ? FileType_XM : FileType_ProTracker;
+}
+
+static FileType get_file_type(const unsigned int flags)
+{
+  /* Compressed output has a different file type but the same extension. */
+  return (flags & FLAGS_COMPRESS) != 0 ? FileType_Compressed :
+                                         get_content_type(flags);
+}
+
+static const char *get_extension(const unsigned int flags)
+{
+  static const char *const extensions[] = {
+    [FileType_ProTracker] = "mod",
+    [FileType_XM] = "xm",
+    [FileType_WAV] = "wav",
+    [FileType_JSON] = "json"
+  };
+
+  return extensions[get_content_type(flags)];
+}
+
+typedef struct {
+  _Optional FILE *f;
+  char           *data; /* Valid after closing */
+  size_t          size;
+} OutputBuffer;
+
+static bool output_buffer_open(OutputBuffer * const buffer)
+{
+  assert(buffer != NULL);
+
+  buffer->data = NULL;
+  buffer->size = 0;
+#ifdef HAVE_MEMSTREAM
+  buffer->f = open_memstream(&buffer->data, &buffer->size);
+#else
+  buffer->f = tmpfile();
+#endif
+  if (buffer->f == NULL) {
+    fprintf(stderr, "Failed to create output buffer: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool output_buffer_close(OutputBuffer * const buffer)
+{
+  assert(buffer != NULL);
+  assert(buffer->f != NULL);
+
+  bool success = true;
+  FILE * const f = &*buffer->f;
+  buffer->f = NULL;
+
+#ifdef HAVE_MEMSTREAM
+  /* The buffer is allocated (and its size updated) when the stream is
+     flushed or closed. */
+  if (fclose(f))
+    success = false;
+#else
+  const long int size = fflush(f) ? -1 : ftell(f);
+  if (size < 0 || fseek(f, 0, SEEK_SET)) {
+    success = false;
+  } else {
+    buffer->size = (size_t)size;
+    buffer->data = malloc(size > 0 ? buffer->size : 1);
+    if (buffer->data == NULL ||
+        (size > 0 && fread(buffer->data, buffer->size, 1, f) != 1))
+      success = false;
+  }
+  fclose(f);
+#endif
+
+  if (!success)
+    fprintf(stderr, "Failed to read output buffer: %s\n", strerror(errno));
+
+  return success;
+}
+
+static bool write_compressed(const unsigned int flags,
+                             const void * const data, const size_t size,
+                             FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(data != NULL || size == 0);
+  assert(out != NULL);
+
+  /* The size of the data before compression is recorded as a signed 32 bit
+     integer. */
+  if (size > INT32_MAX) {
+    fprintf(stderr, "Output is too big to compress (%zu bytes)\n", size);
+    return false;
+  }
+
+  const long int start = (flags & FLAGS_STATS) != 0 ? ftell(out) : -1;
+  const TraceTime trace_start = trace_now();
+
+  Writer w;
+  if (!writer_gkey_init(&w, history_log2, (long int)size, out)) {
+    fprintf(stderr, "Failed to initialize compressor\n");
+    return false;
+  }
+
+  bool success = (size == 0 || writer_fwrite(data, size, 1, &w) == 1) &&
+                 !writer_ferror(&w);
+
+  if (writer_destroy(&w) < 0)
+    success = false;
+
+  trace_span_number("compress", trace_start, "size", (long int)size);
+
+  if (!success) {
+    fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+    return false;
+  }
+
+  const long int end = start < 0 || fflush(out) ? -1 : ftell(out);
+  if (end >= 0)
+    fprintf(stderr, "Compressed: %ld bytes (from %zu bytes)\n", end - start,
+            size);
+
+  return true;
+}
+
+static _Optional FILE *begin_output(const unsigned int flags,
+                                    OutputBuffer * const buffer,
+                                    FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(buffer != NULL);
+  assert(out != NULL);
+
+  /* Compressed output is held in memory until it is complete, because its
+     size must be written before it. */
+  if ((flags & FLAGS_COMPRESS) == 0)
+    return out;
+
+  return output_buffer_open(buffer) ? buffer->f : NULL;
+}
+
+static bool end_output(const unsigned int flags, bool success,
+                       OutputBuffer * const buffer, FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(buffer != NULL);
+  assert(out != NULL);
+
+  if ((flags & FLAGS_COMPRESS) == 0)
+    return success;
+
+  if (!output_buffer_close(buffer))
+    success = false;
+
+  if (success)
+    success = write_compressed(flags, buffer->data, buffer->size, out);
+
+  free(buffer->data);
+  buffer->data = NULL;
+  return success;
+}
+
+static bool render_module(const unsigned int flags,
+                          const char * const song_name,
+                          Reader * const in,
+                          const char * const samples_dir,
+                          const SampleArray * const sf_samples,
+                          FILE * const out)
+{
+  /* Create the ProTracker module in a temporary file, then play it. */
+  _Optional FILE * const tmp = tmpfile();
+  if (tmp == NULL) {
+    fprintf(stderr, "Failed to create temporary file: %s\n", strerror(errno));
+    return false;
+  }
+
+  bool success = create_protracker(flags, song_name, in, samples_dir,
+                                   sf_samples, &*tmp);
+  if (success) {
+    if (fflush(&*tmp) || fseek(&*tmp, 0, SEEK_SET)) {
+      fprintf(stderr, "Failed to rewind temporary file: %s\n",
+              strerror(errno));
+      success = false;
+    } else {
+      success = render_protracker(flags, &*tmp, out);
+    }
+  }
+
+  fclose(&*tmp);
+  return success;
+}
+
+static bool convert_input(const unsigned int flags,
+                          const char * const song_name,
+                          FILE * const in, const bool raw,
+                          const char * const samples_dir,
+                          const SampleArray * const sf_samples,
+                          FILE * const out)
+{
+  Reader r;
+  if (raw) {
+    reader_raw_init(&r, in);
+  } else if (!reader_gkey_init(&r, HistoryLog2, in)) {
+    return false;
+  }
+
+  OutputBuffer buffer = {NULL, NULL, 0};
+  _Optional FILE * const dest = begin_output(flags, &buffer, out);
+  if (dest == NULL) {
+    reader_destroy(&r);
+    return false;
+  }
+
+  bool success;
+  if ((flags & FLAGS_INFO) != 0) {
+    /* Describe the music without converting it */
+    success = report_sftrack_info(flags,
+                                  song_name,
+                                  &r,
+                                  sf_samples,
+                                  &*dest);
+  } else if ((flags & FLAGS_WAV) != 0) {
+    /* Play the music and record it in the output file */
+    success = render_sftrack(flags,
+                             &r,
+                             samples_dir,
+                             sf_samples,
+                             &*dest);
+  } else if ((flags & FLAGS_RENDER) != 0) {
+    /* Create a ProTracker module and record it playing */
+    success = render_module(flags,
+                            song_name,
+                            &r,
+                            samples_dir,
+                            sf_samples,
+                            &*dest);
+  } else {
+    /* Create the ProTracker output file */
+    success = create_protracker(flags,
+                                song_name,
+                                &r,
+                                samples_dir,
+                                sf_samples,
+                                &*dest);
+  }
+
+  reader_destroy(&r);
+  return end_output(flags, success, &buffer, out);
+}
+
 static bool process_file(_Optional const char * const input_file,
                          _Optional const char * const output_file,
                          _Optional const char *song_name,
@@ -69,6 +357,7 @@ static bool process_file(_Optional const char * const input_file,
 
   _Optional FILE *out = NULL, *in = NULL;
   bool success = true;
+  const TraceTime start = trace_now();
 
   if (input_file != NULL) {
     if (song_name == NULL) {
@@ -77,8 +366,8 @@ static bool process_file(_Optional const char * const input_file,
     }
 
     /* An explicit input file name was specified, so open it */
-    if (flags & FLAGS_VERBOSE)
-      printf("Opening input file '%s'\n", input_file);
+    LOGF(LogLevel_Info, LogCategory_Decode, "Opening input file '%s'",
+         &*input_file);
 
     in = fopen(&*input_file, "rb");
     if (in == NULL) {
@@ -101,10 +390,19 @@ static bool process_file(_Optional const char * const input_file,
 #endif
   }
 
-  if (success) {
+  if (success && (flags & FLAGS_CHECK) != 0) {
+    /* Discard the output when only checking the input */
+    out = fopen(NULL_DEVICE, "wb");
+    if (out == NULL) {
+      fprintf(stderr,
+              "Failed to open null device: %s\n",
+              strerror(errno));
+      success = false;
+    }
+  } else if (success) {
     if (output_file != NULL) {
-      if (flags & FLAGS_VERBOSE)
-        printf("Opening output file '%s'\n", output_file);
+      LOGF(LogLevel_Info, LogCategory_Decode, "Opening output file '%s'",
+           &*output_file);
 
       out = fopen(&*output_file, "wb");
       if (out == NULL) {
@@ -123,44 +421,290 @@ static bool process_file(_Optional const char * const input_file,
     }
   }
 
-  if (success && in) {
-    Reader r;
-    if (raw) {
-      reader_raw_init(&r, &*in);
+  if (success && in && song_name && out) {
+    success = convert_input(flags, &*song_name, &*in, raw, samples_dir,
+                            sf_samples, &*out);
+  }
+
+  if (in != NULL && in != stdin) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Closing input file");
+    fclose(&*in);
+  }
+
+  if (out != NULL && out != stdout) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Closing output file");
+    if (fclose(&*out)) {
+      fprintf(stderr, "Failed to close output file: %s\n", strerror(errno));
+      success = false;
+    }
+  }
+
+  /* Don't mix up the log of one file with the next (or with the result). */
+  log_flush();
+
+  if ((flags & FLAGS_CHECK) != 0) {
+    printf("%s: %s\n", input_file != NULL ? &*input_file : "stdin",
+           success ? "OK" : "failed");
+  }
+
+  if (output_file != NULL && (flags & FLAGS_CHECK) == 0) {
+    /* Use OS-specific functionality to update the output file's metadata */
+    if (success && !set_file_type(&*output_file, get_file_type(flags))) {
+      fprintf(stderr, "Failed to set type of output file '%s'\n", &*output_file);
+      success = false;
+    }
+
+    /* Delete malformed output unless debugging is enabled */
+    if (!success && !(flags & FLAGS_VERBOSE)) {
+      remove(&*output_file);
+    }
+  }
+
+  trace_span_string("process_file", start, "file",
+                    input_file != NULL ? &*input_file : "stdin");
+  return success;
+}
+
+static bool process_batch_file(const char * const input_file,
+                               _Optional const char * const song_name,
+                               const char * const samples_dir,
+                               const SampleArray * const sf_samples,
+                               const unsigned int flags, const bool raw)
+{
+  bool success = true;
+
+  assert(input_file != NULL);
+
+  /* Invent an output file name */
+  StringBuffer default_output;
+  stringbuffer_init(&default_output);
+
+  if (!stringbuffer_append(&default_output, input_file, SIZE_MAX) ||
+      !stringbuffer_append_separated(&default_output, EXT_SEPARATOR,
+                                     get_extension(flags))) {
+    fprintf(stderr, "Failed to allocate memory for output file path\n");
+    success = false;
+  } else {
+    success = process_file(input_file,
+                           stringbuffer_get_pointer(&default_output),
+                           song_name, samples_dir, sf_samples, flags, raw);
+  }
+
+  stringbuffer_destroy(&default_output);
+  return success;
+}
+
+static _Optional FILE *open_buffer(void * const data, const size_t size)
+{
+  assert(data != NULL);
+  assert(size > 0);
+
+#ifdef HAVE_MEMSTREAM
+  return fmemopen(data, size, "rb");
+#else
+  /* Standard C has no streams in memory, so copy the data to a file. */
+  _Optional FILE * const f = tmpfile();
+  if (f != NULL &&
+      (fwrite(data, size, 1, &*f) != 1 || fflush(&*f) ||
+       fseek(&*f, 0, SEEK_SET))) {
+    fclose(&*f);
+    return NULL;
+  }
+  return f;
+#endif
+}
+
+static bool process_tar_entry(const TarEntry * const entry,
+                              void * const data,
+                              _Optional const char *song_name,
+                              const char * const samples_dir,
+                              const SampleArray * const sf_samples,
+                              const unsigned int flags, const bool raw,
+                              FILE * const out, bool * const converted)
+{
+  assert(entry != NULL);
+  assert(data != NULL);
+  assert(converted != NULL);
+
+  const TraceTime start = trace_now();
+  LOGF(LogLevel_Info, LogCategory_Decode, "Converting tar entry '%s'",
+       entry->name);
+
+  /* Use the leaf part of the entry name as the song name. Tar archives
+     always use '/' as a directory separator. */
+  if (song_name == NULL)
+    song_name = strtail(entry->name, '/', 1);
+
+  /* Output must be complete before it can be written to the archive,
+     because each entry's header records its size. */
+  TarEntry out_entry = {
+    .size = 0,
+    .mtime = entry->mtime,
+    .regular = true,
+  };
+
+  bool success = true;
+  const int len = snprintf(out_entry.name, sizeof(out_entry.name), "%s.%s",
+                           entry->name, get_extension(flags));
+  if (len < 0 || (size_t)len >= sizeof(out_entry.name)) {
+    fprintf(stderr, "Name of tar entry '%s' is too long\n", entry->name);
+    success = false;
+  }
+
+  _Optional FILE *in = NULL;
+  if (success) {
+    in = open_buffer(data, entry->size);
+    if (in == NULL) {
+      fprintf(stderr, "Failed to open tar entry: %s\n", strerror(errno));
+      success = false;
+    }
+  }
+
+  OutputBuffer buffer = {NULL, NULL, 0};
+  if (success && in && song_name) {
+    success = output_buffer_open(&buffer);
+    if (success && buffer.f) {
+      success = convert_input(flags, &*song_name, &*in, raw, samples_dir,
+                              sf_samples, &*buffer.f);
+
+      if (!output_buffer_close(&buffer))
+        success = false;
+    }
+  }
+
+  if (in != NULL)
+    fclose(&*in);
+
+  /* Only a failure to write the output archive is returned, because no more
+     entries could be written after it. An entry that cannot be represented
+     in the archive is rejected before anything is written. */
+  bool written = true;
+  if (success) {
+    out_entry.size = buffer.size;
+    if (!tar_write_entry(out, &out_entry, buffer.data)) {
+      success = false;
+      written = !ferror(out);
+    }
+  }
+  *converted = success;
+
+  free(buffer.data);
+
+  /* Don't mix up the log of one entry with the next (or with the result). */
+  log_flush();
+
+  trace_span_string("process_file", start, "file", entry->name);
+  return written;
+}
+
+static bool process_tar(_Optional const char * const input_file,
+                        _Optional const char * const output_file,
+                        _Optional const char * const song_name,
+                        const char * const samples_dir,
+                        const SampleArray * const sf_samples,
+                        const unsigned int flags, const bool raw)
+{
+  assert(samples_dir != NULL);
+  assert(sf_samples != NULL);
+  assert(!(flags & ~FLAGS_ALL));
+
+  _Optional FILE *out = NULL, *in = NULL;
+  bool success = true, all_converted = true;
+
+  if (input_file != NULL) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Opening input archive '%s'",
+         &*input_file);
+
+    in = fopen(&*input_file, "rb");
+    if (in == NULL) {
+      fprintf(stderr, "Failed to open input file: %s\n", strerror(errno));
+      success = false;
+    }
+  } else {
+    /* Default input is from standard input stream */
+    fprintf(stderr, "Reading from stdin...\n");
+    in = stdin;
+#ifdef _WIN32
+    /* Force binary mode on Windows to prevent corruption */
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  }
+
+  if (success) {
+    if (output_file != NULL) {
+      LOGF(LogLevel_Info, LogCategory_Decode, "Opening output archive '%s'",
+           &*output_file);
+
+      out = fopen(&*output_file, "wb");
+      if (out == NULL) {
+        fprintf(stderr, "Failed to open output file: %s\n", strerror(errno));
+        success = false;
+      }
     } else {
-      success = reader_gkey_init(&r, HistoryLog2, &*in);
+      /* Default output is to standard output stream */
+      out = stdout;
+#ifdef _WIN32
+      /* Force binary mode on Windows to prevent corruption */
+      _setmode(_fileno(stdout), _O_BINARY);
+#endif
     }
+  }
 
-    if (success && song_name && out) {
-      /* Create the ProTracker output file */
-      success = create_protracker(flags,
-                                  &*song_name,
-                                  &r,
-                                  samples_dir,
-                                  sf_samples,
-                                  &*out);
-      reader_destroy(&r);
+  /* Convert each file in the archive as soon as it has been read, and
+     ignore anything else (e.g. directories). A file that can't be converted
+     is left out, but only failure to read or write an archive stops the
+     loop. */
+  for (bool end = false; success && in && out && !end; ) {
+    TarEntry entry;
+    success = tar_read_header(&*in, &entry, &end);
+    if (!success || end)
+      continue;
+
+    if (!entry.regular || entry.size == 0) {
+      LOGF(LogLevel_Info, LogCategory_Decode, "Skipping tar entry '%s'",
+           entry.name);
+      success = tar_skip_data(&*in, entry.size);
+      continue;
+    }
+
+    _Optional char * const data = malloc(entry.size);
+    bool converted = false;
+    if (data == NULL) {
+      fprintf(stderr, "Failed to allocate %lu bytes for tar entry '%s'\n",
+              entry.size, entry.name);
+      success = tar_skip_data(&*in, entry.size);
+    } else {
+      success = tar_read_data(&*in, &*data, entry.size) &&
+                process_tar_entry(&entry, &*data, song_name, samples_dir,
+                                  sf_samples, flags, raw, &*out, &converted);
+      free(data);
     }
+
+    if (!converted)
+      all_converted = false;
   }
 
+  if (success && out)
+    success = tar_write_end(&*out);
+
   if (in != NULL && in != stdin) {
-    if (flags & FLAGS_VERBOSE)
-      puts("Closing input file");
+    LOGF(LogLevel_Info, LogCategory_Decode, "Closing input archive");
     fclose(&*in);
   }
 
   if (out != NULL && out != stdout) {
-    if (flags & FLAGS_VERBOSE)
-      puts("Closing output file");
+    LOGF(LogLevel_Info, LogCategory_Decode, "Closing output archive");
     if (fclose(&*out)) {
       fprintf(stderr, "Failed to close output file: %s\n", strerror(errno));
       success = false;
     }
   }
 
+  log_flush();
+
   if (output_file != NULL) {
     /* Use OS-specific functionality to update the output file's metadata */
-    if (success && !set_file_type(&*output_file)) {
+    if (success && !set_file_type(&*output_file, FileType_Tar)) {
       fprintf(stderr, "Failed to set type of output file '%s'\n", &*output_file);
       success = false;
     }
@@ -171,9 +715,387 @@ static bool process_file(_Optional const char * const input_file,
     }
   }
 
+  return success && all_converted;
+}
+
+static bool process_pack(const char * const output_file,
+                         _Optional const char *song_name,
+                         const int num_files,
+                         const char * const input_files[],
+                         const char * const samples_dir,
+                         const SampleArray * const sf_samples,
+                         const unsigned int flags, const bool raw)
+{
+  assert(output_file != NULL);
+  assert(num_files > 0);
+  assert(input_files != NULL);
+  assert(samples_dir != NULL);
+  assert(sf_samples != NULL);
+  assert(!(flags & ~FLAGS_ALL));
+
+  bool success = true;
+  const TraceTime start = trace_now();
+
+  if (song_name == NULL) {
+    /* Use the leaf part of the output file path as the song name */
+    song_name = strtail(output_file, PATH_SEPARATOR, 1);
+  }
+
+  /* Every input file is open at once, because all of the songs must be
+     read before the samples that they share can be chosen. */
+  _Optional FILE ** const in = malloc(sizeof(*in) * (size_t)num_files);
+  _Optional Reader * const readers = malloc(sizeof(*readers) *
+                                            (size_t)num_files);
+  if (in == NULL || readers == NULL) {
+    fprintf(stderr, "Failed to allocate memory for %d input files\n",
+            num_files);
+    success = false;
+  }
+
+  int num_open = 0;
+  while (success && in && readers && num_open < num_files) {
+    const char * const input_file = input_files[num_open];
+
+    LOGF(LogLevel_Info, LogCategory_Decode, "Opening input file '%s'",
+         input_file);
+
+    _Optional FILE * const f = fopen(input_file, "rb");
+    if (f == NULL) {
+      fprintf(stderr, "Failed to open input file '%s': %s\n", input_file,
+              strerror(errno));
+      success = false;
+    } else if (raw) {
+      reader_raw_init(&readers[num_open], &*f);
+      in[num_open++] = f;
+    } else if (reader_gkey_init(&readers[num_open], HistoryLog2, &*f)) {
+      in[num_open++] = f;
+    } else {
+      fclose(&*f);
+      success = false;
+    }
+  }
+
+  _Optional FILE *out = NULL;
+  if (success) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Opening output file '%s'",
+         output_file);
+
+    out = fopen(output_file, "wb");
+    if (out == NULL) {
+      fprintf(stderr, "Failed to open output file: %s\n", strerror(errno));
+      success = false;
+    }
+  }
+
+  if (success && readers && song_name && out) {
+    OutputBuffer buffer = {NULL, NULL, 0};
+    _Optional FILE * const dest = begin_output(flags, &buffer, &*out);
+    if (dest == NULL) {
+      success = false;
+    } else {
+      success = pack_protracker(flags, &*song_name, num_files, &*readers,
+                                input_files, samples_dir, sf_samples, &*dest);
+      success = end_output(flags, success, &buffer, &*out);
+    }
+  }
+
+  for (int i = 0; i < num_open && in && readers; i++) {
+    reader_destroy(&readers[i]);
+    if (in[i] != NULL)
+      fclose(&*in[i]);
+  }
+  free(readers);
+  free(in);
+
+  if (out != NULL) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Closing output file");
+    if (fclose(&*out)) {
+      fprintf(stderr, "Failed to close output file: %s\n", strerror(errno));
+      success = false;
+    }
+  }
+
+  log_flush();
+
+  /* Use OS-specific functionality to update the output file's metadata */
+  if (success && !set_file_type(output_file, get_file_type(flags))) {
+    fprintf(stderr, "Failed to set type of output file '%s'\n", output_file);
+    success = false;
+  }
+
+  /* Delete malformed output unless debugging is enabled */
+  if (!success && out != NULL && !(flags & FLAGS_VERBOSE)) {
+    remove(output_file);
+  }
+
+  trace_span_string("process_file", start, "file", output_file);
+  return success;
+}
+
+typedef struct {
+  const char *path;
+  const char *leaf; /* Name of the file within its directory */
+  int dir; /* Number of the watched directory containing the file */
+  uint8_t voice_table[NUM_SF_VOICES]; /* From when last converted */
+  bool changed;
+  bool failed;
+} WatchedTrack;
+
+typedef struct {
+  int num_tracks;
+  WatchedTrack *tracks;
+  const SampleArray *sf_samples;
+  int samples_dir;
+  int index_dir;
+  const char *index_leaf;
+  bool index_changed;
+  bool sample_changed[UCHAR_MAX + 1];
+} WatchState;
+
+static void note_change(const int dir, const char * const name,
+                        void * const arg)
+{
+  assert(name != NULL);
+  assert(arg != NULL);
+
+  WatchState * const state = arg;
+
+  if (dir < 0) {
+    /* Something may have been missed, so reload and rebuild everything. */
+    state->index_changed = true;
+    return;
+  }
+
+  if (dir == state->index_dir && strcmp(name, state->index_leaf) == 0)
+    state->index_changed = true;
+
+  /* More than one index entry can refer to the same sample data file. */
+  if (dir == state->samples_dir && state->sf_samples->sample_info) {
+    for (int id = 0; id < state->sf_samples->count; id++) {
+      const SampleInfo * const info = &state->sf_samples->sample_info[id];
+      if (info->type != SampleInfo_Type_Unused &&
+          strcmp(name, info->file_name) == 0) {
+        state->sample_changed[id] = true;
+      }
+    }
+  }
+
+  for (int t = 0; t < state->num_tracks; t++) {
+    WatchedTrack * const track = &state->tracks[t];
+    if (dir == track->dir && strcmp(name, track->leaf) == 0)
+      track->changed = true;
+  }
+}
+
+static bool read_voice_table(WatchedTrack * const track, const bool raw)
+{
+  assert(track != NULL);
+
+  _Optional FILE * const f = fopen(track->path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open input file '%s': %s\n", track->path,
+            strerror(errno));
+    return false;
+  }
+
+  Reader r;
+  bool success = false;
+  if (raw) {
+    reader_raw_init(&r, &*f);
+    success = true;
+  } else {
+    success = reader_gkey_init(&r, HistoryLog2, &*f);
+  }
+
+  if (success) {
+    /* Only the header is needed to know which samples are used. */
+    SFTrack music_data;
+    success = sftrack_read_header(&music_data, &r);
+    if (success) {
+      memcpy(track->voice_table, music_data.voice_table,
+             sizeof(track->voice_table));
+      sftrack_destroy(&music_data);
+    }
+    reader_destroy(&r);
+  }
+
+  fclose(&*f);
+  return success;
+}
+
+static bool uses_bad_sample(const WatchedTrack * const track,
+                            const bool sample_bad[UCHAR_MAX + 1])
+{
+  assert(track != NULL);
+  assert(sample_bad != NULL);
+
+  for (int v = 0; v < NUM_SF_VOICES; v++) {
+    if (sample_bad[track->voice_table[v]])
+      return true;
+  }
+  return false;
+}
+
+static bool process_watch(const int num_files,
+                          const char * const input_files[],
+                          _Optional const char * const song_name,
+                          const char * const samples_dir,
+                          const char * const index_file,
+                          const int silence_level,
+                          SampleArray * const sf_samples,
+                          const unsigned int flags, const bool raw)
+{
+  assert(num_files > 0);
+  assert(input_files != NULL);
+  assert(samples_dir != NULL);
+  assert(index_file != NULL);
+  assert(sf_samples != NULL);
+  assert(!(flags & ~FLAGS_ALL));
+
+  _Optional WatchedTrack * const tracks = malloc(sizeof(*tracks) *
+                                                 (size_t)num_files);
+  if (tracks == NULL) {
+    fprintf(stderr, "Failed to allocate memory for %d input files\n",
+            num_files);
+    return false;
+  }
+
+  WatchState state = {
+    .num_tracks = num_files,
+    .tracks = &*tracks,
+    .sf_samples = sf_samples,
+    .samples_dir = -1,
+    .index_dir = -1,
+    .index_leaf = "",
+    .index_changed = false,
+    .sample_changed = {false},
+  };
+
+  /* Samples whose data couldn't be measured since they last changed */
+  bool sample_bad[UCHAR_MAX + 1] = {false};
+
+  bool success = watch_open();
+  if (success) {
+    state.samples_dir = watch_add_dir(samples_dir);
+    state.index_dir = watch_add_parent(index_file, &state.index_leaf);
+    success = state.samples_dir >= 0 && state.index_dir >= 0;
+  }
+
+  for (int t = 0; t < num_files && success; t++) {
+    WatchedTrack * const track = &tracks[t];
+    *track = (WatchedTrack){
+      .path = input_files[t],
+      .leaf = "",
+      .dir = -1,
+      .voice_table = {0},
+      .changed = true, /* Everything is converted to begin with */
+      .failed = false,
+    };
+    track->dir = watch_add_parent(track->path, &track->leaf);
+    success = track->dir >= 0;
+  }
+
+  /* The sample index and the analysis of each sample stay loaded between
+     changes; only sample data that changed is measured again. */
+  while (success) {
+    const TraceTime start = trace_now();
+
+    if (state.index_changed) {
+      SampleArray new_samples;
+      if (load_sample_index((flags & FLAGS_NORMALISE) != 0, silence_level,
+                            index_file, samples_dir, &new_samples)) {
+        free(sf_samples->sample_info);
+        *sf_samples = new_samples;
+        memset(sample_bad, 0, sizeof(sample_bad));
+        for (int t = 0; t < num_files; t++)
+          tracks[t].changed = true;
+      }
+    } else {
+      for (int id = 0; id < sf_samples->count; id++) {
+        if (!state.sample_changed[id])
+          continue;
+
+        LOGF(LogLevel_Info, LogCategory_Index, "Sample %d changed", id);
+        sample_bad[id] = !remeasure_sample((flags & FLAGS_NORMALISE) != 0,
+                                           silence_level, samples_dir,
+                                           sf_samples, id);
+        if (sample_bad[id])
+          fprintf(stderr, "Failed to measure sample %d; tracks that use it "
+                  "won't be rebuilt until it changes again\n", id);
+
+        /* A track that failed to convert is retried in case the sample
+           was the cause. */
+        for (int t = 0; t < num_files; t++) {
+          for (int v = 0; v < NUM_SF_VOICES; v++) {
+            if (tracks[t].failed || tracks[t].voice_table[v] == id)
+              tracks[t].changed = true;
+          }
+        }
+      }
+    }
+
+    state.index_changed = false;
+    memset(state.sample_changed, 0, sizeof(state.sample_changed));
+
+    int count = 0;
+    for (int t = 0; t < num_files; t++) {
+      WatchedTrack * const track = &tracks[t];
+      if (!track->changed)
+        continue;
+
+      track->changed = false;
+      count++;
+
+      /* The stored length of a sample that couldn't be measured is stale,
+         so a track that uses it would be converted wrongly. */
+      if (uses_bad_sample(track, sample_bad)) {
+        track->failed = true;
+        if ((flags & FLAGS_CHECK) == 0)
+          printf("%s: skipped\n", track->path);
+        continue;
+      }
+
+      track->failed = !process_batch_file(track->path, song_name,
+                                          samples_dir, sf_samples, flags,
+                                          raw) ||
+                      !read_voice_table(track, raw);
+
+      if ((flags & FLAGS_CHECK) == 0)
+        printf("%s: %s\n", track->path, track->failed ? "failed" : "OK");
+    }
+
+    if (count > 0) {
+      trace_span_number("rebuild", start, "files", count);
+      fflush(stdout);
+    }
+
+    success = watch_wait(note_change, &state);
+  }
+
+  watch_close();
+  free(tracks);
   return success;
 }
 
+#ifdef HAVE_FORK
+static bool wait_job(int * const running)
+{
+  assert(running != NULL);
+  assert(*running > 0);
+
+  /* Wait for any child process to finish and get its exit status. */
+  int status;
+  if (wait(&status) < 0) {
+    fprintf(stderr, "Failed to wait for job: %s\n", strerror(errno));
+    *running = 0;
+    return false;
+  }
+
+  --*running;
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+#endif
+
 static int syntax_msg(FILE * const f, const char * const path)
 {
   assert(f != NULL);
@@ -183,24 +1105,68 @@ static int syntax_msg(FILE * const f, const char * const path)
   fprintf(f,
           "usage: %s [switches] <samples-dir> [<input-file> [<output-file>]]\n"
           "or     %s -batch [switches] <samples-dir> <file1> [<file2> .. <fileN>]\n"
+          "or     %s -check [switches] <samples-dir> <file1> [<file2> .. <fileN>]\n"
+          "or     %s -tar [switches] <samples-dir> [<input-tar> [<output-tar>]]\n"
+          "or     %s -pack [switches] <samples-dir> <output-file> <file1> [<file2> .. <fileN>]\n"
+          "or     %s -watch [switches] <samples-dir> <file1> [<file2> .. <fileN>]\n"
           "If no input file is specified, it reads from stdin.\n"
           "If no output file is specified, it writes to stdout.\n"
           "In batch processing mode, output file names are generated by appending\n"
-          "extension 'mod' to the input file names.\n",
-          leaf, leaf);
+          "extension 'mod' (or 'xm', 'wav' or 'json') to the input file names.\n"
+          "In tar mode, the same extension is appended to the name of each entry.\n"
+          "In pack mode, all of the input files are converted to one module.\n"
+          "In watch mode, files are converted again whenever they change.\n",
+          leaf, leaf, leaf, leaf, leaf, leaf);
 
   fputs("Switches (names may be abbreviated):\n"
         "  -allowsfx           Allow notes to be played using sound effect samples\n"
+        "  -autotune           Choose -channelglissando and -extraoctaves by comparing\n"
+        "                      renders of the module with the original music\n"
         "  -batch              Process a batch of files (see above)\n"
         "  -blankend           Append a blank pattern to the end of the song\n"
         "  -channelglissando   Restrict glissando effects to the same channel\n"
+        "  -check              Report problems with each input file without writing\n"
+        "                      any output (all arguments are input files)\n"
+        "  -compress           Compress the output using Gordon Key's algorithm\n"
         "  -extraoctaves       Utilise non-standard ProTracker octaves 0 and 4\n"
+        "  -foldtempo          Set the tempo in the first pattern played, if possible\n"
         "  -help               Display this text\n"
+        "  -history <n>        Compress output using a history of 2^n bytes (1-16,\n"
+        "                      default 9)\n"
         "  -indexfile <file>   Index file to use instead of looking in <samples-dir>\n"
+        "  -info               Describe the music in JSON instead of converting it\n"
+        "  -jobs <n>           Process up to n files at once in batch mode (0 for\n"
+        "                      one per processor)\n"
+        "  -log <categories>   Log progress in the given categories (comma-separated\n"
+        "                      list of index, decode, planning, transcode, samples,\n"
+        "                      render or all, each optionally suffixed by :info)\n"
+        "  -logformat <fmt>    Write the log as 'text' (default) or 'json' lines\n"
+        "  -looprepeats        Loop samples and cut notes instead of repeating data\n"
         "  -name <song-name>   Name to give the song (default is the input file name)\n"
+        "  -nonormalise        Don't normalise samples (default in single file mode)\n"
+        "  -normalise          Scale samples to use the full 8 bit range (default\n"
+        "                      in batch processing mode)\n"
         "  -outfile <file>     Specify a name for the output file\n"
+        "  -pack               Convert several files to one module with shared\n"
+        "                      samples (see above)\n"
+        "  -planoctaves        Choose variants of samples to minimise their size\n"
+        "  -prunepatterns      Omit patterns that are never played\n"
         "  -raw                Input is uncompressed raw data\n"
-        "  -verbose or -debug  Emit debug output (and keep bad output)\n", f);
+        "  -render             Play the ProTracker module and record it in a WAV file\n"
+        "  -resample           Use a band-limited resampler to pre-tune samples\n"
+        "  -samplebuffer <n>   Pre-tune samples using up to n KB of memory (default 64)\n"
+        "  -scan               Like -info, but also scan the patterns\n"
+        "  -stats              Report the size of sample data written\n"
+        "  -tar                Convert each file in a tar archive and write a tar\n"
+        "                      archive of the output (see above)\n"
+        "  -trace <file>       Record a timeline of processing in Chrome trace format\n"
+        "  -trimsilence <n>    Omit trailing sample data no louder than n (0-32767)\n"
+        "  -truncate           Omit sample data that is never played\n"
+        "  -verbose or -debug  Emit debug output (and keep bad output)\n"
+        "  -watch              Convert files again whenever they, their samples or\n"
+        "                      the index change (see above)\n"
+        "  -wav                Play the music and record it in a 16 bit WAV file\n"
+        "  -xm                 Write a FastTracker 2 module with 16 bit samples\n", f);
 
   return EXIT_FAILURE;
 }
@@ -232,8 +1198,11 @@ int main(int argc, const char *argv[])
 {
   unsigned int flags = 0;
   _Optional const char *output_file = NULL, *input_file = NULL, *index_file = NULL;
-  _Optional const char *song_name = NULL;
-  bool batch = false, raw = false;
+  _Optional const char *song_name = NULL, *trace_file = NULL;
+  bool batch = false, raw = false, normalise = false, no_normalise = false;
+  bool tar = false, pack = false, watch = false;
+  int silence_level = -1; /* don't trim by default */
+  int jobs = 1;
 
   assert(argc > 0);
   assert(argv != NULL);
@@ -251,17 +1220,76 @@ int main(int argc, const char *argv[])
     } else if (is_switch(opt, "allowsfx", 1)) {
       /* Allow sound effects during music */
       flags |= FLAGS_ALLOW_SFX;
+    } else if (is_switch(opt, "autotune", 2)) {
+      /* Choose conversion flags by comparing renders of the module and
+         the original music */
+      flags |= FLAGS_AUTOTUNE;
     } else if (is_switch(opt, "blankend", 2)) {
       /* Generate an extra blank pattern to prevent late notes being cut off */
       flags |= FLAGS_BLANK_PATTERN;
+    } else if (is_switch(opt, "check", 3)) {
+      /* Report problems with each input file without writing any output */
+      flags |= FLAGS_CHECK;
+    } else if (is_switch(opt, "compress", 3)) {
+      /* Compress the output file */
+      flags |= FLAGS_COMPRESS;
     } else if (is_switch(opt, "extraoctaves", 1)) {
       /* Utilise non-standard ProTracker octaves 0 and 4 in preference to
          pre-tuning samples. */
       flags |= FLAGS_EXTRA_OCTAVES;
+    } else if (is_switch(opt, "foldtempo", 1)) {
+      /* Set the tempo in the first pattern to be played instead of in an
+         extra pattern, where possible */
+      flags |= FLAGS_FOLD_TEMPO;
+    } else if (is_switch(opt, "history", 2)) {
+      /* Base 2 logarithm of the history size used to compress output */
+      char *end;
+      if (++n >= argc) {
+        fprintf(stderr, "Missing history size\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      const long int size_log2 = strtol(argv[n], &end, 10);
+      if (end == argv[n] || *end != '\0' || size_log2 < 1 ||
+          size_log2 > MaxHistoryLog2) {
+        fprintf(stderr, "Bad history size '%s'\n", argv[n]);
+        return syntax_msg(stderr, argv[0]);
+      }
+      history_log2 = (int)size_log2;
     } else if (is_switch(opt, "help", 1)) {
       /* Output version number and usage information */
       (void)syntax_msg(stdout, argv[0]);
       return EXIT_SUCCESS;
+    } else if (is_switch(opt, "normalise", 3)) {
+      /* Scale sample data to use the full range of 8 bit values */
+      normalise = true;
+    } else if (is_switch(opt, "nonormalise", 3)) {
+      /* Keep the original scale of sample data, even in batch mode */
+      no_normalise = true;
+    } else if (is_switch(opt, "looprepeats", 1)) {
+      /* Loop samples and cut notes instead of repeating sample data */
+      flags |= FLAGS_LOOP_REPEATS;
+    } else if (is_switch(opt, "log", 3)) {
+      /* Categories of progress to be logged */
+      if (++n >= argc || argv[n][0] == '-') {
+        fprintf(stderr, "Missing log categories\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      if (!log_parse_spec(argv[n]))
+        return syntax_msg(stderr, argv[0]);
+    } else if (is_switch(opt, "logformat", 4)) {
+      /* Format of logged progress */
+      if (++n >= argc || argv[n][0] == '-') {
+        fprintf(stderr, "Missing log format\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      if (strcmp(argv[n], "json") == 0) {
+        log_set_format(LogFormat_JSON);
+      } else if (strcmp(argv[n], "text") == 0) {
+        log_set_format(LogFormat_Text);
+      } else {
+        fprintf(stderr, "Bad log format '%s'\n", argv[n]);
+        return syntax_msg(stderr, argv[0]);
+      }
     } else if (is_switch(opt, "name", 1)) {
       /* ProTracker song name was specified */
       if (++n >= argc || argv[n][0] == '-') {
@@ -283,12 +1311,100 @@ int main(int argc, const char *argv[])
         return syntax_msg(stderr, argv[0]);
       }
       index_file = argv[n];
+    } else if (is_switch(opt, "info", 3)) {
+      /* Report metadata about the music instead of converting it */
+      flags |= FLAGS_INFO;
+    } else if (is_switch(opt, "jobs", 1)) {
+      /* Maximum no. of files to process in parallel */
+      char *end;
+      if (++n >= argc) {
+        fprintf(stderr, "Missing no. of jobs\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      const long int num = strtol(argv[n], &end, 10);
+      if (end == argv[n] || *end != '\0' || num < 0 || num > INT_MAX) {
+        fprintf(stderr, "Bad no. of jobs '%s'\n", argv[n]);
+        return syntax_msg(stderr, argv[0]);
+      }
+      jobs = (int)num;
+    } else if (is_switch(opt, "pack", 2)) {
+      /* Convert several files to one module with shared samples */
+      pack = true;
+    } else if (is_switch(opt, "planoctaves", 1)) {
+      /* Plan the pre-tuning of samples to minimise their total size */
+      flags |= FLAGS_PLAN_OCTAVES;
+    } else if (is_switch(opt, "prunepatterns", 2)) {
+      /* Omit patterns that aren't in the play order */
+      flags |= FLAGS_PRUNE_PATTERNS;
     } else if (is_switch(opt, "raw", 1)) {
       /* Enable raw input */
       raw = true;
+    } else if (is_switch(opt, "render", 3)) {
+      /* Record the ProTracker module playing instead of writing it */
+      flags |= FLAGS_RENDER;
+    } else if (is_switch(opt, "resample", 2)) {
+      /* Pre-tune samples using a band-limited resampler instead of
+         duplicating or skipping sample frames */
+      flags |= FLAGS_RESAMPLE;
+    } else if (is_switch(opt, "samplebuffer", 2)) {
+      /* Maximum size of the buffer used to pre-tune each sample */
+      char *end;
+      if (++n >= argc) {
+        fprintf(stderr, "Missing sample buffer size\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      const long int size = strtol(argv[n], &end, 10);
+      if (end == argv[n] || *end != '\0' || size < 1 ||
+          (unsigned long)size > SIZE_MAX / 1024) {
+        fprintf(stderr, "Bad sample buffer size '%s'\n", argv[n]);
+        return syntax_msg(stderr, argv[0]);
+      }
+      sample_stream_set_limit((size_t)size * 1024);
+    } else if (is_switch(opt, "scan", 2)) {
+      /* Report metadata based on the patterns as well as the header */
+      flags |= FLAGS_INFO | FLAGS_SCAN;
+    } else if (is_switch(opt, "stats", 1)) {
+      /* Report the size of sample data and the savings made */
+      flags |= FLAGS_STATS;
+    } else if (is_switch(opt, "tar", 2)) {
+      /* Convert each file in a tar archive */
+      tar = true;
+    } else if (is_switch(opt, "trace", 3)) {
+      /* Record a timeline of processing in a file */
+      if (++n >= argc || argv[n][0] == '-') {
+        fprintf(stderr, "Missing trace file name\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      trace_file = argv[n];
+    } else if (is_switch(opt, "trimsilence", 3)) {
+      /* Threshold below which trailing sample data is considered silent */
+      char *end;
+      if (++n >= argc) {
+        fprintf(stderr, "Missing silence level\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      const long int level = strtol(argv[n], &end, 10);
+      if (end == argv[n] || *end != '\0' || level < 0 || level > INT16_MAX) {
+        fprintf(stderr, "Bad silence level '%s'\n", argv[n]);
+        return syntax_msg(stderr, argv[0]);
+      }
+      silence_level = (int)level;
+    } else if (is_switch(opt, "truncate", 3)) {
+      /* Truncate samples to the longest time for which they are played */
+      flags |= FLAGS_TRUNCATE;
     } else if (is_switch(opt, "verbose", 1) || is_switch(opt, "debug", 1)) {
       /* Enable debugging output */
       flags |= FLAGS_VERBOSE;
+      log_set_mask(LOG_ALL);
+    } else if (is_switch(opt, "watch", 3)) {
+      /* Convert files again whenever they (or the samples) change */
+      watch = true;
+    } else if (is_switch(opt, "wav", 1)) {
+      /* Render the music to a WAV file instead of converting it */
+      flags |= FLAGS_WAV;
+    } else if (is_switch(opt, "xm", 1)) {
+      /* Enable FastTracker 2 output */
+      flags |= FLAGS_XM;
     } else if (is_switch(opt, "channelglissando", 1)) {
       /* Restrict effect of glissando command to a single channel */
       flags |= FLAGS_GLISSANDO_SINGLE;
@@ -305,7 +1421,95 @@ int main(int argc, const char *argv[])
   }
   const char *const samples_dir = argv[n++];
 
-  if (batch) {
+  if ((flags & FLAGS_WAV) != 0 && (flags & (FLAGS_XM | FLAGS_RENDER)) != 0) {
+    fprintf(stderr, "Cannot specify both -wav and -%s\n",
+            (flags & FLAGS_XM) != 0 ? "xm" : "render");
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if ((flags & FLAGS_RENDER) != 0 && (flags & FLAGS_XM) != 0) {
+    fputs("Cannot specify both -render and -xm\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if ((flags & FLAGS_INFO) != 0 &&
+      (flags & (FLAGS_XM | FLAGS_WAV | FLAGS_RENDER | FLAGS_AUTOTUNE)) != 0) {
+    fputs("Cannot combine -info or -scan with -xm, -wav, -render or "
+          "-autotune\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if ((flags & FLAGS_CHECK) != 0 &&
+      (flags & (FLAGS_WAV | FLAGS_RENDER | FLAGS_INFO | FLAGS_AUTOTUNE)) != 0) {
+    fputs("Cannot combine -check with -wav, -render, -info, -scan or "
+          "-autotune\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if ((flags & FLAGS_AUTOTUNE) != 0 && (flags & (FLAGS_XM | FLAGS_WAV)) != 0) {
+    fprintf(stderr, "Cannot specify both -autotune and -%s\n",
+            (flags & FLAGS_XM) != 0 ? "xm" : "wav");
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if ((flags & (FLAGS_COMPRESS | FLAGS_CHECK)) ==
+      (FLAGS_COMPRESS | FLAGS_CHECK)) {
+    fputs("Cannot specify both -compress and -check\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if (tar && (batch || (flags & FLAGS_CHECK) != 0)) {
+    fputs("Cannot combine -tar with -batch or -check\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if (pack && (batch || tar ||
+               (flags & (FLAGS_CHECK | FLAGS_XM | FLAGS_WAV | FLAGS_RENDER |
+                         FLAGS_INFO | FLAGS_AUTOTUNE)) != 0)) {
+    fputs("Cannot combine -pack with -batch, -tar, -check, -xm, -wav, "
+          "-render, -info, -scan or -autotune\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if (watch && (tar || pack)) {
+    fputs("Cannot combine -watch with -tar or -pack\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if (jobs == 0) {
+    /* Use one job per processor, if the number of processors is known. */
+#ifdef HAVE_FORK
+    const long int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = num_cpus > 0 && num_cpus <= INT_MAX ? (int)num_cpus : 1;
+#else
+    jobs = 1;
+#endif
+  }
+
+  /* Normalisation is cheap enough to be enabled by default when processing
+     a batch of files (or an archive), because sample data is only analysed
+     once. It is pointless when no sample data will be written. */
+  if (!no_normalise && (normalise || batch || tar || watch) &&
+      (flags & (FLAGS_INFO | FLAGS_CHECK)) == 0) {
+    flags |= FLAGS_NORMALISE;
+  }
+
+  /* Every argument after the samples directory is an input file to be
+     checked (or watched), as in batch processing mode. */
+  if ((flags & FLAGS_CHECK) != 0 || watch)
+    batch = true;
+
+  if (pack) {
+    /* The output file name precedes the input file names, unless already
+       specified */
+    if (output_file == NULL && n < argc)
+      output_file = argv[n++];
+
+    if (n >= argc) {
+      fputs("Must specify file(s) in pack mode\n", stderr);
+      return syntax_msg(stderr, argv[0]);
+    }
+  } else if (batch) {
     if (output_file != NULL) {
       fputs("Cannot specify an output file in batch processing mode\n", stderr);
       return syntax_msg(stderr, argv[0]);
@@ -331,8 +1535,9 @@ int main(int argc, const char *argv[])
     }
 
     /* Ensure that MOD output isn't mixed up with other text on stdout */
-    if ((output_file == NULL) && (flags & FLAGS_VERBOSE)) {
-      fputs("Must specify an output file in verbose mode\n", stderr);
+    if ((output_file == NULL) && (log_mask != 0)) {
+      fputs("Must specify an output file in verbose mode or with -log\n",
+            stderr);
       return syntax_msg(stderr, argv[0]);
     }
 
@@ -347,6 +1552,9 @@ int main(int argc, const char *argv[])
            "Copyright (C) 2009, Christopher Bazley\n");
   }
 
+  if (trace_file != NULL && !trace_open(&*trace_file))
+    return EXIT_FAILURE;
+
   int rtn = EXIT_SUCCESS;
 
   /* If no samples index filename was specified then invent one */
@@ -367,36 +1575,80 @@ int main(int argc, const char *argv[])
 
   if (rtn == EXIT_SUCCESS) {
     /* Load the sound samples index file */
-    if (!load_sample_index((flags & FLAGS_VERBOSE) != 0, &*index_file, samples_dir,
-                           &sf_samples)) {
+    const TraceTime start = trace_now();
+    if (!load_sample_index((flags & FLAGS_NORMALISE) != 0,
+                           silence_level,
+                           &*index_file, samples_dir, &sf_samples)) {
       rtn = EXIT_FAILURE;
     }
+    trace_span("load_sample_index", start);
   }
 
-  stringbuffer_destroy(&default_index);
+  if (rtn == EXIT_SUCCESS && watch) {
+    /* Only returns if watching fails */
+    if (!process_watch(argc - n, argv + n, song_name, samples_dir,
+                       &*index_file, silence_level, &sf_samples, flags, raw)) {
+      rtn = EXIT_FAILURE;
+    }
+  } else if (rtn == EXIT_SUCCESS && batch) {
+    int running = 0;
 
-  if (batch) {
     /* In batch processing mode, the remaining arguments are treated as a
-       list of file names (output to default file names) */
-    for (; n < argc && rtn == EXIT_SUCCESS; n++) {
-      /* Invent an output file name */
+       list of file names (output to default file names). A file that
+       can't be processed doesn't stop the others from being processed. */
+    for (; n < argc; n++) {
       assert(argv[n] != NULL);
 
-      StringBuffer default_output;
-      stringbuffer_init(&default_output);
-
-      if (!stringbuffer_append(&default_output, argv[n], SIZE_MAX) ||
-          !stringbuffer_append_separated(&default_output, EXT_SEPARATOR, "mod")) {
-        fprintf(stderr, "Failed to allocate memory for output file path\n");
-        rtn = EXIT_FAILURE;
-      } else {
-        if (!process_file(argv[n], stringbuffer_get_pointer(&default_output),
-                          song_name, samples_dir, &sf_samples, flags, raw)) {
+#ifdef HAVE_FORK
+      if (jobs > 1) {
+        /* Process each file in a child process, but no more than the
+           specified number at once. */
+        if (running >= jobs && !wait_job(&running))
           rtn = EXIT_FAILURE;
+
+        /* Don't duplicate any buffered output in the child process. */
+        log_flush();
+        fflush(NULL);
+
+        const pid_t pid = fork();
+        if (pid == 0) {
+          exit(process_batch_file(argv[n], song_name, samples_dir,
+                                  &sf_samples, flags, raw) ?
+               EXIT_SUCCESS : EXIT_FAILURE);
+        }
+
+        if (pid > 0) {
+          running++;
+          continue;
         }
+
+        fprintf(stderr, "Failed to start job: %s\n", strerror(errno));
+      }
+#endif
+
+      if (!process_batch_file(argv[n], song_name, samples_dir, &sf_samples,
+                              flags, raw)) {
+        rtn = EXIT_FAILURE;
       }
+    }
 
-      stringbuffer_destroy(&default_output);
+#ifdef HAVE_FORK
+    while (running > 0) {
+      if (!wait_job(&running))
+        rtn = EXIT_FAILURE;
+    }
+#else
+    (void)running;
+#endif
+  } else if (rtn == EXIT_SUCCESS && pack && output_file) {
+    if (!process_pack(&*output_file, song_name, argc - n, argv + n,
+                      samples_dir, &sf_samples, flags, raw)) {
+      rtn = EXIT_FAILURE;
+    }
+  } else if (rtn == EXIT_SUCCESS && tar) {
+    if (!process_tar(input_file, output_file, song_name, samples_dir,
+                     &sf_samples, flags, raw)) {
+      rtn = EXIT_FAILURE;
     }
   } else if (rtn == EXIT_SUCCESS) {
     if (!process_file(input_file, output_file, song_name, samples_dir,
@@ -406,10 +1658,14 @@ int main(int argc, const char *argv[])
   }
 
   free(sf_samples.sample_info);
+  stringbuffer_destroy(&default_index);
+
+  LOGF(LogLevel_Info, LogCategory_Decode, "%s", rtn == EXIT_SUCCESS ?
+       "Conversion completed successfully" : "Conversion failed");
+  log_flush();
+
+  if (!trace_close())
+    rtn = EXIT_FAILURE;
 
-  if (flags & FLAGS_VERBOSE) {
-    puts(rtn == EXIT_SUCCESS ?
-         "Conversion completed successfully" : "Conversion failed");
-  }
   return rtn;
 }
@@ -26,6 +26,17 @@
 #endif
 #endif
 
+/* Name of a file that discards anything written to it. */
+#ifndef NULL_DEVICE
+#ifdef _WIN32
+#define NULL_DEVICE "NUL"
+#elif defined(ACORN_C)
+#define NULL_DEVICE "Null:"
+#else
+#define NULL_DEVICE "/dev/null"
+#endif
+#endif
+
 #ifdef FORTIFY
 #include "Fortify.h"
 #else
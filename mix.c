@@ -0,0 +1,85 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Mixing of resampled sample data
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdint.h>
+
+/* Local header files */
+#include "misc.h"
+#include "mix.h"
+
+enum {
+  MIX_BLOCK = 64 /* No. of output frames resampled at once */
+};
+
+int mix_frames(const int16_t * const in, const unsigned long end,
+               MixCursor * const cursor, const int32_t volume,
+               const int count, int32_t * const out)
+{
+  assert(in != NULL);
+  assert(cursor != NULL);
+  assert(cursor->frac < (1ul << MIX_FRAC_BITS));
+  assert(count >= 0);
+  assert(out != NULL);
+
+  /* Mixes frames from the cursor position until the given number have been
+     output or the end of the sample data (or its loop) is reached. */
+  unsigned long pos = cursor->pos, frac = cursor->frac;
+  const unsigned long step = cursor->step;
+  if (pos >= end)
+    return 0;
+
+  int run = count;
+  if (step > 0) {
+    const unsigned long long left =
+      ((unsigned long long)(end - pos) << MIX_FRAC_BITS) - frac;
+    const unsigned long long avail = (left + step - 1) / step;
+    if (avail < (unsigned long long)run)
+      run = (int)avail;
+  }
+
+  /* The position of each frame in a block is computed from the start of the
+     block instead of from the previous frame, so that the iterations are
+     independent. Fetching the frames is a gather, which compilers usually
+     leave as scalar code, but scaling and accumulating them is a separate
+     loop with a constant step that can be vectorised. */
+  for (int done = 0; done < run; ) {
+    int32_t frames[MIX_BLOCK];
+    const int n = run - done > MIX_BLOCK ? MIX_BLOCK : run - done;
+
+    for (int i = 0; i < n; i++) {
+      const unsigned long long offset = frac + (unsigned long long)i * step;
+      frames[i] = in[pos + (unsigned long)(offset >> MIX_FRAC_BITS)];
+    }
+
+    int32_t * const block_out = out + done;
+    for (int i = 0; i < n; i++)
+      block_out[i] += frames[i] * volume;
+
+    const unsigned long long advance = frac + (unsigned long long)n * step;
+    pos += (unsigned long)(advance >> MIX_FRAC_BITS);
+    frac = (unsigned long)advance & ((1ul << MIX_FRAC_BITS) - 1);
+    done += n;
+  }
+
+  cursor->pos = pos;
+  cursor->frac = frac;
+  return run;
+}
@@ -0,0 +1,28 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Mixing of resampled sample data
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef MIX_H
+#define MIX_H
+
+/* ISO library header files */
+#include <stdint.h>
+
+enum {
+  MIX_FRAC_BITS = 16 /* Fractional bits of sample positions and steps */
+};
+
+/* Position in a sample, advanced by a fixed point step per output frame */
+typedef struct {
+  unsigned long pos; /* Integral part */
+  unsigned long frac; /* Fractional part */
+  unsigned long step; /* Increment per output frame */
+} MixCursor;
+
+extern int mix_frames(const int16_t *in, unsigned long end,
+                      MixCursor *cursor, int32_t volume, int count,
+                      int32_t *out);
+
+#endif /* MIX_H */
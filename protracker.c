@@ -36,46 +36,67 @@
 
 /* Local header files */
 #include "misc.h"
+#include "log.h"
+#include "trace.h"
 #include "main.h"
 #include "samp.h"
+#include "sampdata.h"
+#include "sftrack.h"
 #include "protracker.h"
+#include "xm.h"
+#include "autotune.h"
 
 enum {
   INIT_SIZE              = 4, /* No. of ProTracker samples */
+  MAX_PLAN_OCTAVES       = 24, /* Max. no. of distinct octaves in which
+                                  notes are played using the same sample
+                                  with the same no. of repeats */
   SEMITONES_PER_OCTAVE   = 12,
   SECONDS_PER_MINUTE     = 60,
 
 /* The following values are dictated by the SF3000 music file format */
-  MAX_SF_PATTERNS        = 64,
   SF_CLOCK_FREQ          = 90, /* Hz (actually 100, but for latency) */
-  SF_MAX_VOLUME          = 15,
-  SF_MAX_REPEATS         = 15,
-  SF_GLISSANDO_THRESHOLD = 2, /* Values below this mean 'play note' */
-  SF_TUNING_OCTAVE       = 4096, /* Tuning units per octave */
-  NUM_SF_CHANNELS        = 4,
   BYTES_PER_SF_SAMPLE    = 2,
-  NUM_SF_VOICES          = 16,
 
 /* The following values are dictated by the ProTracker file format */
   MAX_PT_SAMPLES         = 31,
   BYTES_PER_PT_SAMPLE    = 30,
   BYTES_PER_PT_COMMAND   = 4,
   MAX_PT_SONG_LEN        = 128,
+  MAX_PT_PATTERNS        = 64, /* More require a different identifier */
   MAX_PT_POSITIONS       = 64,
-  NUM_SF_DIVISIONS       = 64,
   NUM_PT_CHANNELS        = 4,
   PT_BPM_DIVISOR         = 24, /* ProTracker tempo is based upon 1/24th of the
                                   no. of ticks per minute of a 50Hz timer. */
   PT_SPEED_THRESHOLD     = 32,
+  PT_DEFAULT_SPEED       = 6,
   PT_MAX_VOLUME          = 64,
   PT_COM_NORMAL          = 0x0,
   PT_COM_TONE_PORTAMENTO = 0x3,
+  PT_COM_POSITION_JUMP   = 0xb,
   PT_COM_SET_VOLUME      = 0xc,
   PT_COM_PATTERN_BREAK   = 0xd,
+  PT_COM_EXTENDED        = 0xe,
   PT_COM_SET_SPEED       = 0xf,
   PT_TUNING_SEMITONE     = 8, /* Tuning units per semitone */
   PT_OCTAVE_RANGE        = 5,
-  PT_GLISSANDO_SPEED     = 2
+  PT_GLISSANDO_SPEED     = 2,
+  PT_EXT_NOTE_CUT        = 0xc0, /* Extended command to cut a note at the
+                                    tick given by the low 4 bits */
+  PT_MAX_CUT_TICK        = 0xf,
+  PT_CLOCK_FREQ          = 3546895, /* Hz (PAL Amiga) divided by period to get
+                                       the playback rate in bytes/second */
+  PT_FINETUNE_MARGIN     = 17, /* Playback rate is multiplied by this/16 to
+                                  allow for a finetune up to +7/8 semitone
+                                  (and for the XM base rate being ~1% higher) */
+
+/* The following values are dictated by the XM file format */
+  XM_OCTAVE_OFFSET       = 2, /* XM octave equivalent to ProTracker octave 0 */
+  XM_OCTAVE_RANGE        = 8,
+  XM_FINETUNE_SCALE      = 16, /* XM finetune units per ProTracker unit */
+  XM_BASE_RATE           = 8363, /* Hz at ProTracker octave 2 note 0 */
+  MAX_VARIANTS           = XM_MAX_INSTRUMENTS /* Max. no. of variants of
+                                                 samples in either format */
 };
 
 typedef struct {
@@ -84,8 +105,11 @@ typedef struct {
   unsigned short half_len;
   unsigned short half_repeat_offset;
   unsigned short half_repeat_len;
+  unsigned long  half_trimmed; /* Length of trailing silence omitted */
+  unsigned long  half_truncated; /* Length omitted because never played */
   signed long    pt_tuning;
   signed int     octaves_cheat;
+  unsigned char  volume;
 } PTSampleInfo;
 
 typedef struct {
@@ -95,27 +119,66 @@ typedef struct {
 } PTSampleArray;
 
 typedef struct {
-  uint8_t note;
-  uint8_t oct_vol;
-  uint8_t voice_act;
-  uint8_t num_repeats;
-} SFChannelData;
+  int           len;
+  unsigned char positions[MAX_PT_SONG_LEN];
+  size_t        desc_len;
+  char          desc[MAX_PT_SONG_LEN * 4 + 32]; /* Only if logging */
+} PTPlayOrder;
 
 typedef struct {
-  SFChannelData channels[NUM_SF_CHANNELS];
-} SFDivision;
+  unsigned char sample_num;
+  unsigned char num_repeats;
+  int           num_octaves;
+  signed int    octaves[MAX_PLAN_OCTAVES]; /* Ascending order */
+  unsigned long cost[MAX_PT_SAMPLES + 1]; /* Least total length (in units of
+                                             2 bytes) of any set of variants
+                                             of the given size */
+} PlanGroup;
 
 typedef struct {
-  SFDivision divisions[NUM_SF_DIVISIONS];
-} SFPattern;
+  int count;
+  int alloc;
+  _Optional PlanGroup *groups;
+} PlanArray;
+
+typedef struct {
+  signed int min, max; /* Octaves playable without pre-tuning */
+  signed int std_min, std_max; /* Standard octaves */
+} OctaveRange;
+
+/* Choices about how notes are played that depend only on the flags, made
+   once per song instead of for every note */
+typedef struct {
+  bool allow_sfx; /* Notes may be played using sound effect samples */
+  bool loop_repeats; /* Repeated notes may use looping samples */
+  bool glissando_single; /* Glissandos affect one channel only */
+  bool plan_octaves; /* Variants of samples were planned in advance */
+  bool xm; /* Notes are played by an XM player */
+} NoteRules;
+
+typedef struct {
+  PTSampleArray pt_samples;
+  PlanArray     plan; /* Notes seen so far, if planning octaves */
+  OctaveRange   octaves;
+  NoteRules     rules;
+  bool          success;
+  bool          bad_sample; /* A sample couldn't be added while checking */
+} SampleListBuilder;
 
 typedef struct {
-  uint8_t speed;
-  uint8_t voice_table[NUM_SF_VOICES];
-  int32_t last_pattern_no;
-  uint8_t play_order[MAX_SF_PATTERNS];
-  _Optional SFPattern *patterns;
-} SFTrack;
+  SFTrack music_data;
+  int     song_len;
+  int     first_pos; /* Song position of the tempo pattern */
+  int     first_pattern; /* Pattern number of the tempo pattern */
+  int     loop_pattern; /* Pattern number of the pattern that loops it */
+} PackedSong;
+
+typedef struct {
+  unsigned int       flags;
+  const SampleArray *sf_samples;
+  bool               started; /* builder is valid */
+  SampleListBuilder  builder;
+} PatternStream;
 
 typedef enum {
   GlissandoState_None, /* No glissando on this channel since last note */
@@ -126,10 +189,35 @@ typedef enum {
 typedef struct {
   unsigned char  pt_sample_no;
   unsigned char  sample_num;
-  unsigned short target_pitch;
+  signed char    target_octave;
+  signed char    target_note;
   GlissandoState glissando_state;
+  signed char    cut_division; /* -1 if the note needn't be cut */
+  signed char    cut_tick;
 } ChannelState;
 
+typedef struct {
+  unsigned char pt_sample_no; /* 0 if none */
+  signed char   octave;
+  signed char   note; /* -1 if none */
+  signed char   volume; /* -1 if none */
+  bool          portamento; /* slide towards the note (if any) */
+  signed char   cut_tick; /* -1 if none */
+  unsigned char set_speed; /* 0 if none */
+} Cell;
+
+typedef bool PutCellFn(const Cell *cell, XMPattern *xm_pattern, FILE *f);
+
+/* Choices that depend only on the flags, made once per song instead of
+   for every cell */
+typedef struct {
+  PutCellFn  *put_cell;
+  OctaveRange octaves;
+  NoteRules   rules;
+  bool        check; /* Report non-standard octaves as problems */
+  bool        warn_octaves; /* Report or log non-standard octaves */
+} Transcoder;
+
 static int get_pt_period(const int octave, int note)
 {
   /* Period table for Tuning 0, normal. Octaves 0 and 4 are non-standard and
@@ -170,7 +258,7 @@ static bool fput_pt_command(const int pt_effect_com,
   uint8_t bytes[BYTES_PER_PT_COMMAND];
 
   /* Write higher 4 bits of note period and sample number */
-  bytes[0] = (pt_period >> 8 & 0xf) | (pt_sample_no >> 4 & 0xf);
+  bytes[0] = (pt_period >> 8 & 0xf) | (pt_sample_no & 0xf0);
 
   /* Write lower 8 bits of note period */
   bytes[1] = pt_period & UCHAR_MAX;
@@ -196,19 +284,41 @@ static bool fput_halfword(const unsigned short halfword, FILE * const f)
   return fwrite(bytes, sizeof(bytes), 1, f) == 1;
 }
 
-static bool command(const SFChannelData * const com)
+static void get_sample_name(char name[22],
+                            const PTSampleInfo * const ptsi,
+                            const SampleInfo * const sample)
+{
+  assert(name != NULL);
+  assert(ptsi != NULL);
+  assert(sample != NULL);
+
+  /* Name the variant of the sample, padded with null bytes */
+  memset(name, '\0', 22);
+  snprintf(name, 22, "%s-R%d-O%d", sample->file_name, ptsi->num_repeats,
+           ptsi->octaves_cheat);
+}
+
+static signed int get_finetune(const signed long pt_tuning)
 {
-  assert(com != NULL);
-  return com->note != 0 || com->oct_vol != 0 || com->voice_act != 0 ||
-         com->num_repeats != 0;
+  /* Convert the ProTracker tuning value to semitones (coarsen it). */
+  signed long finetune = pt_tuning / PT_TUNING_SEMITONE;
+
+  /* Find the fractional remainder that was discarded by the integer
+     division above, and use that as the 'finetune' value. */
+  assert(finetune <= LONG_MAX / PT_TUNING_SEMITONE);
+  assert(finetune >= LONG_MIN / PT_TUNING_SEMITONE);
+  finetune = pt_tuning - finetune * PT_TUNING_SEMITONE;
+
+  /* -8 means 1 semitone lower. 7 means 0.875 semitone higher. */
+  assert(finetune > -PT_TUNING_SEMITONE);
+  assert(finetune < PT_TUNING_SEMITONE);
+  return (signed int)finetune;
 }
 
-static bool write_sample_table(const unsigned int flags,
-                               const PTSampleArray * const pt_samples,
+static bool write_sample_table(const PTSampleArray * const pt_samples,
                                const SampleArray * const sf_samples,
                                FILE * const f)
 {
-  assert(!(flags & ~FLAGS_ALL));
   assert(pt_samples != NULL);
   assert(pt_samples->count >= 0);
   assert(pt_samples->count <= pt_samples->alloc);
@@ -236,13 +346,11 @@ static bool write_sample_table(const unsigned int flags,
 
     /* Write sample name, padded with null bytes */
     char sample_name[22];
-    memset(sample_name, '\0', sizeof(sample_name));
-    sprintf(sample_name, "%s-R%d-O%d", sample->file_name, ptsi->num_repeats,
-            ptsi->octaves_cheat);
+    get_sample_name(sample_name, ptsi, sample);
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf("Writing ProTracker sample table entry %d ('%s')\n",
-             pt_sample_no, sample_name);
+    LOGF(LogLevel_Debug, LogCategory_Transcode,
+         "Writing ProTracker sample table entry %d ('%s')",
+         pt_sample_no, sample_name);
 
     if (fwrite(sample_name, sizeof(sample_name), 1, f) != 1) {
       return false; /* failure */
@@ -252,24 +360,12 @@ static bool write_sample_table(const unsigned int flags,
     if (!fput_halfword(ptsi->half_len, f))
       return false; /* failure */
 
-    /* Convert the ProTracker tuning value to semitones (coarsen it). */
-    signed long finetune = ptsi->pt_tuning / PT_TUNING_SEMITONE;
-
-    /* Find the fractional remainder that was discarded by the integer
-       division above, and use that as the 'finetune' value. */
-    assert(finetune <= LONG_MAX / PT_TUNING_SEMITONE);
-    assert(finetune >= LONG_MIN / PT_TUNING_SEMITONE);
-    finetune = ptsi->pt_tuning - finetune * PT_TUNING_SEMITONE;
-
-    /* Write signed 8 bit 'finetune' value for sample
-       -8 means 1 semitone lower. 7 means 0.875 semitone higher. */
-    assert(finetune >= SCHAR_MIN);
-    assert(finetune <= SCHAR_MAX);
-    if (fputc((int)finetune, f) == EOF)
+    /* Write signed 8 bit 'finetune' value for sample */
+    if (fputc(get_finetune(ptsi->pt_tuning), f) == EOF)
       return false; /* failure */
 
     /* Write volume for sample */
-    if (fputc(PT_MAX_VOLUME, f) == EOF)
+    if (fputc(ptsi->volume, f) == EOF)
       return false; /* failure */
 
     /* Write repeat offset DIV 2 */
@@ -307,91 +403,106 @@ static bool write_sample(const unsigned int flags,
   assert(sample_handle != NULL);
   assert(!ferror(sample_handle));
 
-  /* Initialise the output counter to one less than the defined sample
-     len (because termination check is inclusive of zero). */
-  long int out_count = (long int)ptsi->half_len * 2 - 1;
+  /* Pre-tune the sample one chunk at a time, optionally using a band-limited
+     resampler instead of duplicating or skipping sample frames, so that
+     memory usage doesn't depend on the length of the sample. */
+  SampleStream stream;
+  if (!sample_stream_init(&stream, sample_handle, ptsi->octaves_cheat,
+                          (flags & FLAGS_RESAMPLE) != 0))
+    return false;
+
+  /* The repeat offset is scaled in the same way as the sample data. */
+  unsigned long repeat_offset = sample->repeat_offset;
+  for (int pow = ptsi->octaves_cheat; pow < 0; pow++)
+    repeat_offset *= 2;
+  for (int pow = ptsi->octaves_cheat; pow > 0; pow--)
+    repeat_offset /= 2;
 
   int num_repeats = ptsi->num_repeats;
   if (num_repeats == SF_MAX_REPEATS)
     num_repeats = 0; /* unlimited repeats will be handled automatically */
 
-  for (int repeat = 0; repeat <= num_repeats; repeat++) {
+  /* Must copy exactly the defined number of bytes, regardless of whether
+     or not we are manually looping the sample data. */
+  unsigned long out_count = (unsigned long)ptsi->half_len * 2;
+  int16_t prev = 0;
+  bool success = true;
+
+  for (int repeat = 0; repeat <= num_repeats && success; repeat++) {
     /* If we are looping the sample data then apply the repeat offset to
        prevent repeating the attack phase of the note. */
-    if (repeat != 0) {
-      if ((flags & FLAGS_VERBOSE) != 0)
-        printf("Seeking repeat offset %ld in sample data file\n",
-               (long int)sample->repeat_offset * 2);
-
-      if (fseek(sample_handle,
-                (long int)sample->repeat_offset * 2,
-                SEEK_SET)) {
-        fprintf(stderr,
-                "Failed to loop sample data file at %d: %s\n",
-                sample->repeat_offset * 2,
-                strerror(errno));
-        return false;
+    unsigned long pos = (repeat != 0 ? repeat_offset : 0);
+
+    LOGF(LogLevel_Debug, LogCategory_Samples,
+         "About to copy %lu bytes from sample data at offset %lu",
+         out_count, pos);
+
+    while (out_count > 0 && pos < stream.count && success) {
+      /* Convert the sample data to the output format in blocks, to amortise
+         the cost of calling fwrite. */
+      uint8_t bytes[BUFSIZ];
+      const size_t frame_size = (flags & FLAGS_XM) != 0 ? 2 : 1;
+      unsigned long n = out_count;
+      if (n > sizeof(bytes) / frame_size)
+        n = sizeof(bytes) / frame_size;
+
+      _Optional const int16_t * const frames =
+        sample_stream_read(&stream, pos, &n);
+      if (frames == NULL) {
+        success = false;
+        break;
       }
-    }
 
-    /* Must copy exactly the defined number of bytes, regardless of whether
-       or not we are manually looping the sample data. */
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf("About to copy %ld bytes from sample data file\n",
-             out_count + 1);
-
-    for (;out_count >= 0; out_count--) {
-      /* Read a 16 bit little-endian value but discard the least
-         significant 8 bits. */
-      static uint8_t sample_bytes[BYTES_PER_SF_SAMPLE];
-      if (fread(sample_bytes, sizeof(sample_bytes), 1, sample_handle) != 1)
-      {
-        if (!ferror(sample_handle))
-          break; /* End of sample file (not an error) */
+      if ((flags & FLAGS_XM) != 0) {
+        /* Keep all 16 bits, encoded as deltas. */
+        xm_encode_frames(&*frames, n, &prev, bytes);
+      } else if ((flags & FLAGS_NORMALISE) != 0) {
+        /* Amplify quiet samples to use the full range of 8 bit values. */
+        sample_data_scale_narrow(&*frames, n, bytes, ptsi->volume,
+                                 PT_MAX_VOLUME);
+      } else {
+        /* Discard the least significant 8 bits. */
+        sample_data_narrow(&*frames, n, bytes);
+      }
 
+      if (fwrite(bytes, n * frame_size, 1, f) != 1) {
         fprintf(stderr,
-                "Failed reading from sample data file: %s\n",
+                "Failed writing to output file: %s\n",
                 strerror(errno));
-        return false;
-      }
-
-      /* Create a lower pitched version of a sound by doubling or quadrupling
-         each sample. */
-      int dup = 1;
-      for (int pow = ptsi->octaves_cheat; pow < 0; pow ++)
-        dup *= 2;
-
-      /* Copy most significant byte of the sample to the ProTracker file. */
-      for (;dup > 0; dup --) {
-        if (fputc(sample_bytes[1], f) == EOF) {
-          fprintf(stderr,
-                  "Failed writing to output file: %s\n",
-                  strerror(errno));
-          return false;
-        }
-      }
-
-      if (ptsi->octaves_cheat > 0) {
-        /* Resampling interval is 2 to the power of the number of octaves by
-           which to transpose upwards. */
-        long int skip = 1;
-        for (int pow = ptsi->octaves_cheat; pow > 0; pow --)
-          skip *= BYTES_PER_SF_SAMPLE;
-
-        skip -= 1; /* the file pointer has already advanced by one sample */
-        if (fseek(sample_handle, skip * BYTES_PER_SF_SAMPLE, SEEK_CUR)) {
-          if (feof(sample_handle))
-            break; /* End of sample (not an error) */
-
-          fprintf(stderr,
-                  "Failed seeking within sample data file: %s\n",
-                  strerror(errno));
-          return false;
-        }
+        success = false;
       }
+      pos += n;
+      out_count -= n;
     }
   }
-  return true;
+
+  sample_stream_destroy(&stream);
+  return success;
+}
+
+static bool write_xm_instrument(const PTSampleInfo * const ptsi,
+                                const SampleInfo * const sample,
+                                FILE * const f)
+{
+  assert(ptsi != NULL);
+  assert(sample != NULL);
+  assert(f != NULL);
+
+  char name[22];
+  get_sample_name(name, ptsi, sample);
+
+  /* The coarse tuning of the sample is already applied to each note, as for
+     ProTracker, but an XM finetune value has finer resolution. */
+  const XMSample xm_sample = {
+    .len = (unsigned long)ptsi->half_len * 2,
+    .loop_start = (unsigned long)ptsi->half_repeat_offset * 2,
+    .loop_len = (unsigned long)ptsi->half_repeat_len * 2,
+    .volume = ptsi->volume,
+    .finetune = (signed char)(get_finetune(ptsi->pt_tuning) * XM_FINETUNE_SCALE),
+    .relative_note = 0,
+  };
+
+  return xm_write_instrument(f, name, &xm_sample);
 }
 
 static bool integrate_samples(const unsigned int flags,
@@ -426,13 +537,21 @@ static bool integrate_samples(const unsigned int flags,
        pt_sample_no++) {
 
     Fortify_CheckAllMemory();
+    const TraceTime sample_start = trace_now();
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf("About to write data for ProTracker sample %d\n", pt_sample_no);
+    LOGF(LogLevel_Info, LogCategory_Samples,
+         "About to write data for ProTracker sample %d", pt_sample_no);
 
     const PTSampleInfo * const ptsi = &ptsi_array[pt_sample_no];
     const SampleInfo * const sample = &sample_array[ptsi->sample_num];
 
+    /* Each XM instrument's header immediately precedes its sample data. */
+    if ((flags & FLAGS_XM) != 0 && !write_xm_instrument(ptsi, sample, f)) {
+      fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+      success = false;
+      break;
+    }
+
     /* Construct full path name of sample data file */
     StringBuffer sample_path;
     stringbuffer_init(&sample_path);
@@ -444,8 +563,8 @@ static bool integrate_samples(const unsigned int flags,
       success = false;
     } else {
       /* Open the sample data file */
-      if ((flags & FLAGS_VERBOSE) != 0)
-        printf("Opening sample data file '%s'\n", stringbuffer_get_pointer(&sample_path));
+      LOGF(LogLevel_Debug, LogCategory_Samples, "Opening sample data file '%s'",
+           stringbuffer_get_pointer(&sample_path));
 
       _Optional FILE * const sample_handle = fopen(stringbuffer_get_pointer(&sample_path), "rb");
       if (sample_handle == NULL) {
@@ -457,19 +576,58 @@ static bool integrate_samples(const unsigned int flags,
         success = write_sample(flags, ptsi, sample, f, &*sample_handle);
 
         /* Close the sample data file */
-        if ((flags & FLAGS_VERBOSE) != 0)
-          puts("Closing sample data file");
+        LOGF(LogLevel_Debug, LogCategory_Samples, "Closing sample data file");
 
         fclose(&*sample_handle);
       }
     }
     stringbuffer_destroy(&sample_path);
+
+    trace_span_number("sample", sample_start, "sample", pt_sample_no + 1);
   }
 
   return success;
 }
 
-static signed int note_to_pt(const SFChannelData * const com,
+static void report_stats(const unsigned int flags,
+                         const PTSampleArray * const pt_samples,
+                         const SampleArray * const sf_samples)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(pt_samples != NULL);
+  assert(sf_samples != NULL);
+
+  _Optional const PTSampleInfo * const ptsi_array = pt_samples->sample_info;
+  _Optional const SampleInfo * const si_array = sf_samples->sample_info;
+  if (!ptsi_array || !si_array)
+    return;
+
+  /* Statistics go to stderr because the module may be written to stdout.
+     Lengths are in units of 2 frames, and XM sample frames are 16 bits. */
+  const unsigned long unit = (flags & FLAGS_XM) != 0 ? 4 : 2;
+  unsigned long total_len = 0, total_trimmed = 0, total_truncated = 0;
+  for (int pt_sample_no = 0; pt_sample_no < pt_samples->count; pt_sample_no++) {
+    const PTSampleInfo * const ptsi = &ptsi_array[pt_sample_no];
+    const SampleInfo * const sample = &si_array[ptsi->sample_num];
+
+    fprintf(stderr, "Sample %d ('%s' x%d, pre-tuned by %d octaves): "
+                    "%lu bytes, %lu bytes of silence trimmed, "
+                    "%lu bytes truncated\n",
+            pt_sample_no + 1, sample->file_name, ptsi->num_repeats,
+            ptsi->octaves_cheat, (unsigned long)ptsi->half_len * unit,
+            ptsi->half_trimmed * unit, ptsi->half_truncated * unit);
+
+    total_len += (unsigned long)ptsi->half_len * unit;
+    total_trimmed += ptsi->half_trimmed * unit;
+    total_truncated += ptsi->half_truncated * unit;
+  }
+
+  fprintf(stderr, "Total: %lu bytes of sample data, %lu bytes of silence "
+                  "trimmed, %lu bytes truncated\n", total_len, total_trimmed,
+          total_truncated);
+}
+
+static signed int note_to_pt(const SFEvent * const event,
                              _Optional int * const note_out,
                              const signed long semitone_tuning)
 {
@@ -479,9 +637,9 @@ static signed int note_to_pt(const SFChannelData * const com,
   signed long note;
   signed int octave;
 
-  assert(com != NULL);
-  octave = (com->oct_vol & 0xf) - 1;
-  note = com->note & 0xfl;
+  assert(event != NULL);
+  octave = event->octave - 1;
+  note = event->note;
   note += semitone_tuning;
   while (note < 0) {
     octave --;
@@ -499,22 +657,28 @@ static signed int note_to_pt(const SFChannelData * const com,
   return octave;
 }
 
-static bool make_pt_sample(PTSampleInfo * const ptsi,
-                           const SampleInfo * const sample,
-                           const int num_repeats,
-                           const int sample_num,
-                           const signed int octaves_cheat,
-                           const signed long pt_tuning)
+static unsigned long calc_pt_sample_len(const SampleInfo * const sample,
+                                        const int num_repeats,
+                                        const signed int octaves_cheat,
+                                        unsigned long * const repeat_offset_out,
+                                        unsigned long * const repeat_len_out,
+                                        unsigned long * const trimmed_out)
 {
-  unsigned long repeat_len, sample_len, repeat_offset;
+  unsigned long repeat_len, sample_len, repeat_offset, sound_len, trimmed;
 
-  assert(ptsi != NULL);
   assert(sample != NULL);
+  assert(sample->sound_len <= sample->len);
+  assert(repeat_offset_out != NULL);
+  assert(repeat_len_out != NULL);
+  assert(trimmed_out != NULL);
 
   /* The resolution of the sample data will be reduced from 8 to 16 bits. */
   sample_len = sample->len / 2;
   DEBUGF("Sample len: %lu\n", sample_len);
 
+  sound_len = sample->sound_len / 2;
+  DEBUGF("Sound len: %lu\n", sound_len);
+
   repeat_offset = sample->repeat_offset; /* in sample frames not bytes */
   DEBUGF("Repeat offset: %lu\n", repeat_offset);
 
@@ -526,35 +690,80 @@ static bool make_pt_sample(PTSampleInfo * const ptsi,
 
     assert(sample_len <= ULONG_MAX / 2);
     sample_len *= 2;
+    sound_len *= 2;
   }
   for (int pow = octaves_cheat; pow > 0; pow--) {
     repeat_offset /= 2;
     sample_len /= 2;
+    sound_len = (sound_len + 1) / 2; /* don't lose the last loud frame */
   }
 
   /* ProTracker isn't capable of representing odd sample lengths or offsets
      within a sample (only multiples of 2). */
   repeat_offset /= 2;
   sample_len /= 2;
+  sound_len = (sound_len + 1) / 2;
+  if (sound_len > sample_len)
+    sound_len = sample_len;
 
   DEBUGF("Revised sample len: %lu\n", sample_len);
   DEBUGF("Revised offset: %lu\n", repeat_offset);
 
   if (num_repeats == SF_MAX_REPEATS) {
-    /* Calculate repeat length */
+    /* Calculate repeat length. Trailing silence is part of the loop so it
+       can't be omitted. */
     repeat_len = sample_len - repeat_offset;
+    trimmed = 0;
   } else {
+    /* Only the trailing silence of the last (or only) copy of the sample
+       data can be omitted. At least one sample frame must be kept. */
+    trimmed = sample_len - sound_len;
+    if (num_repeats != 0) {
+      if (trimmed > sample_len - repeat_offset)
+        trimmed = sample_len - repeat_offset;
+    } else if (trimmed >= sample_len && trimmed > 0) {
+      trimmed = sample_len - 1;
+    }
+
     if (num_repeats != 0) {
       /* There is no facility in ProTracker to loop a sample a specific
          number of times, so we must repeat the sample data! */
       DEBUGF("Loop size: %ld\n", sample_len - repeat_offset);
       sample_len += (sample_len - repeat_offset) * num_repeats;
     }
+    DEBUGF("Trailing silence: %lu\n", trimmed);
+    sample_len -= trimmed;
+
     /* No repeats for this variant of the sample */
     repeat_offset = 0;
     repeat_len = 0;
   }
 
+  *repeat_offset_out = repeat_offset;
+  *repeat_len_out = repeat_len;
+  *trimmed_out = trimmed;
+
+  return sample_len; /* in units of 2 bytes */
+}
+
+static bool make_pt_sample(PTSampleInfo * const ptsi,
+                           const SampleInfo * const sample,
+                           const int num_repeats,
+                           const int sample_num,
+                           const signed int octaves_cheat,
+                           const signed long pt_tuning,
+                           const int volume)
+{
+  unsigned long repeat_len, repeat_offset, trimmed;
+
+  assert(ptsi != NULL);
+  assert(sample != NULL);
+
+  const unsigned long sample_len = calc_pt_sample_len(sample, num_repeats,
+                                                      octaves_cheat,
+                                                      &repeat_offset,
+                                                      &repeat_len, &trimmed);
+
   /* Validate sample length */
   if (sample_len > USHRT_MAX) {
     fprintf(stderr, "Sample data file '%s' is too long with %d repeats "
@@ -569,6 +778,8 @@ static bool make_pt_sample(PTSampleInfo * const ptsi,
   assert(sample_len <= USHRT_MAX);
   assert(repeat_offset < sample_len);
   assert(repeat_offset <= USHRT_MAX);
+  assert(volume >= 1);
+  assert(volume <= PT_MAX_VOLUME);
 
   *ptsi = (PTSampleInfo){
     .num_repeats = num_repeats,
@@ -576,45 +787,72 @@ static bool make_pt_sample(PTSampleInfo * const ptsi,
     .half_len = (unsigned short)sample_len,
     .half_repeat_offset = (unsigned short)repeat_offset,
     .half_repeat_len = (unsigned short)repeat_len,
+    .half_trimmed = trimmed,
+    .half_truncated = 0,
     .pt_tuning = pt_tuning,
     .octaves_cheat = octaves_cheat,
+    .volume = volume,
   };
 
   return true; /* success */
 }
 
-static signed int calc_octaves_cheat(const unsigned int flags,
-                                     const SFChannelData * const com,
+static void get_octave_range(const unsigned int flags,
+                             signed int * const min_octave,
+                             signed int * const max_octave)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(min_octave != NULL);
+  assert(max_octave != NULL);
+
+  /* FastTracker 2 notes range from C-0 to B-7 (ProTracker octaves -2 to 5).
+     ProTracker octaves 0 and 4 are non-standard and may not be available. */
+  if ((flags & FLAGS_XM) != 0) {
+    *min_octave = -XM_OCTAVE_OFFSET;
+    *max_octave = XM_OCTAVE_RANGE - XM_OCTAVE_OFFSET - 1;
+  } else if ((flags & FLAGS_EXTRA_OCTAVES) == 0) {
+    *min_octave = 1;
+    *max_octave = PT_OCTAVE_RANGE - 2;
+  } else {
+    *min_octave = 0;
+    *max_octave = PT_OCTAVE_RANGE - 1;
+  }
+}
+
+static void get_octave_ranges(const unsigned int flags,
+                              OctaveRange * const octaves)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(octaves != NULL);
+
+  get_octave_range(flags, &octaves->min, &octaves->max);
+  get_octave_range(flags & ~FLAGS_EXTRA_OCTAVES, &octaves->std_min,
+                   &octaves->std_max);
+}
+
+static signed int calc_octaves_cheat(const OctaveRange * const octaves,
+                                     const SFEvent * const event,
                                      const signed long pt_tuning,
                                      _Optional int * const octave_out,
                                      _Optional int * const note_out)
 {
-  signed int octave, octaves_cheat, min_octave, max_octave;
+  signed int octave, octaves_cheat;
 
-  assert(!(flags & ~FLAGS_ALL));
-  assert(com != NULL);
+  assert(octaves != NULL);
+  assert(event != NULL);
 
   /* Convert the SF3000 octave and note numbers into their ProTracker
      equivalents. */
-  octave = note_to_pt(com, note_out, pt_tuning / PT_TUNING_SEMITONE);
-
-  /* ProTracker octaves 0 and 4 are non-standard and may not be available. */
-  if ((flags & FLAGS_EXTRA_OCTAVES) == 0) {
-    min_octave = 1;
-    max_octave = PT_OCTAVE_RANGE - 2;
-  } else {
-    min_octave = 0;
-    max_octave = PT_OCTAVE_RANGE - 1;
-  }
+  octave = note_to_pt(event, note_out, pt_tuning / PT_TUNING_SEMITONE);
 
-  if (octave < min_octave) {
+  if (octave < octaves->min) {
     DEBUGF("Invalid octave %d; must pre-tune sample down\n", octave);
-    octaves_cheat = octave - min_octave;
-    octave = min_octave;
-  } else if (octave > max_octave) {
+    octaves_cheat = octave - octaves->min;
+    octave = octaves->min;
+  } else if (octave > octaves->max) {
     DEBUGF("Invalid octave %d; must pre-tune sample up\n", octave);
-    octaves_cheat = octave - max_octave;
-    octave = max_octave;
+    octaves_cheat = octave - octaves->max;
+    octave = octaves->max;
   } else {
     octaves_cheat = 0;
   }
@@ -624,98 +862,117 @@ static signed int calc_octaves_cheat(const unsigned int flags,
   return octaves_cheat;
 }
 
-static int find_song_len(const SFTrack * const music_data)
+static size_t describe_position(char * const buf, const size_t size,
+                                const size_t len, const long int pattern,
+                                const char * const label)
 {
-  assert(music_data != NULL);
+  assert(buf != NULL);
+  assert(label != NULL);
 
-  /* There is no record of the song length in a SF3000 music file, so
-     iterate through the play order in search of the terminator. */
-  int song_len;
-  for (song_len = 0; song_len < MAX_SF_PATTERNS; song_len++) {
-    /* Is this the end of the play list? */
-    if (music_data->play_order[song_len] == 255)
-      break; /* found the terminator */
-  }
+  if (len >= size)
+    return len;
 
-  return song_len;
+  const int n = snprintf(buf + len, size - len, "%s%ld%s",
+                         len > 0 ? "," : "", pattern, label);
+  if (n < 0)
+    return len;
+
+  return (size_t)n < size - len ? len + (size_t)n : size;
 }
 
-static bool write_play_order(const unsigned int flags,
-                             const SFTrack * const music_data,
-                             const int song_len,
-                             const int pt_song_len,
-                             FILE * const f)
+static void add_song_positions(const unsigned int flags,
+                               const SFTrack * const music_data,
+                               const int song_len,
+                               const int first_pattern,
+                               PTPlayOrder * const order)
 {
   assert(!(flags & ~FLAGS_ALL));
   assert(music_data != NULL);
   assert(song_len >= 0);
   assert(song_len <= MAX_SF_PATTERNS);
-  assert(pt_song_len >= 1);
-  assert(pt_song_len > song_len);
-  assert(pt_song_len <= MAX_PT_SONG_LEN);
-  assert(f != NULL);
-  assert(!ferror(f));
-
-  /* Write the song length */
-  if ((flags & FLAGS_VERBOSE) != 0)
-    printf("Writing ProTracker song length %d\n", pt_song_len);
-
-  if (fputc(pt_song_len, f) == EOF)
-    return false;
-
-  /* Apparently this byte must be 127 so that old trackers search through all
-     patterns when loading. */
-  if (fputc(127, f) == EOF)
-    return false;
-
-  if ((flags & FLAGS_VERBOSE) != 0)
-    printf("Writing ProTracker song positions: 0 (tempo)");
-
-  /* An extra song position (pattern 0) will be required to set the tempo. */
-  if (fputc(0, f) == EOF)
-    return false;
+  assert(first_pattern >= 0);
+  assert(order != NULL);
+
+  /* Unless the first pattern to be played sets the tempo, an extra song
+     position (the song's first pattern) will be required to do so. */
+  const int offset = (flags & FLAGS_FOLD_TEMPO) != 0 ? 0 : 1;
+  const bool log_positions = LOG_ENABLED(LogLevel_Info, LogCategory_Transcode);
+
+  if (offset) {
+    if (log_positions)
+      order->desc_len = describe_position(order->desc, sizeof(order->desc),
+                                          order->desc_len, first_pattern,
+                                          " (tempo)");
+
+    assert(order->len < MAX_PT_SONG_LEN);
+    order->positions[order->len++] = (unsigned char)first_pattern;
+  }
 
-  /* Write the song positions that dictate the play order for patterns. */
-  int pos;
-  for (pos = 0; pos < song_len; pos++) {
-    /* Pattern numbers are offset by 1 because pattern 0 will set the tempo. */
-    int pattern = music_data->play_order[pos] + 1;
+  /* Add the song positions that dictate the play order for patterns. */
+  for (int sf_pos = 0; sf_pos < song_len; sf_pos++) {
+    /* Pattern numbers are offset by 1 if a pattern will set the tempo. */
+    int pattern = music_data->play_order[sf_pos] + first_pattern + offset;
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf(",%d", pattern);
+    if (log_positions)
+      order->desc_len = describe_position(order->desc, sizeof(order->desc),
+                                          order->desc_len, pattern, "");
 
-    if (fputc(pattern, f) == EOF)
-      return false;
+    assert(pattern <= UCHAR_MAX);
+    assert(order->len < MAX_PT_SONG_LEN);
+    order->positions[order->len++] = (unsigned char)pattern;
   }
 
   /* An extra song position may be required to allow late notes to finish. */
   if ((flags & FLAGS_BLANK_PATTERN) != 0) {
-    long int extra_pattern = music_data->last_pattern_no + 2;
+    long int extra_pattern = music_data->last_pattern_no + 1 + first_pattern +
+                             offset;
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf(",%ld (blank)", extra_pattern);
+    if (log_positions)
+      order->desc_len = describe_position(order->desc, sizeof(order->desc),
+                                          order->desc_len, extra_pattern,
+                                          " (blank)");
 
     assert(extra_pattern <= UCHAR_MAX);
-    if (fputc((int)extra_pattern, f) == EOF)
-      return false;
-    pos++;
+    assert(order->len < MAX_PT_SONG_LEN);
+    order->positions[order->len++] = (unsigned char)extra_pattern;
   }
+}
+
+static bool write_play_order(const PTPlayOrder * const order, FILE * const f)
+{
+  assert(order != NULL);
+  assert(order->len >= 1);
+  assert(order->len <= MAX_PT_SONG_LEN);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  /* Write the song length */
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing ProTracker song length %d", order->len);
+
+  if (fputc(order->len, f) == EOF)
+    return false;
+
+  /* Apparently this byte must be 127 so that old trackers search through all
+     patterns when loading. */
+  if (fputc(127, f) == EOF)
+    return false;
 
-  if ((flags & FLAGS_VERBOSE) != 0)
-    puts("");
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing ProTracker song positions: %.*s", (int)order->desc_len,
+       order->desc);
 
   /* The ProTracker file format allocates a fixed amount of space for the
-     song positions, so we must pad it to the required size. We have already
-     written one more position (pattern 0) than 'pos' reflects. */
-  for (;pos < MAX_PT_SONG_LEN - 1; pos++) {
-    if (fputc(0, f) == EOF)
+     song positions, so we must pad it to the required size. */
+  for (int pos = 0; pos < MAX_PT_SONG_LEN; pos++) {
+    if (fputc(pos < order->len ? order->positions[pos] : 0, f) == EOF)
       return false;
   }
 
   return true;
 }
 
-static bool write_tempo_pattern(const unsigned int flags, const int speed, FILE * const f)
+static bool write_tempo_pattern(const int speed, FILE * const f)
 {
   /* ProTracker's representation of tempo is based upon 1/24th of the no. of
      ticks per minute of a 50Hz timer. Star Fighter 3000's music player is
@@ -724,13 +981,12 @@ static bool write_tempo_pattern(const unsigned int flags, const int speed, FILE
   const int tempo = (SECONDS_PER_MINUTE * SF_CLOCK_FREQ) /
                      PT_BPM_DIVISOR;
 
-  assert(!(flags & ~FLAGS_ALL));
   assert(speed < PT_SPEED_THRESHOLD); /* higher values set tempo */
   assert(f != NULL);
 
-  if ((flags & FLAGS_VERBOSE) != 0)
-    printf("Writing ProTracker pattern to set tempo %d and speed %d\n",
-           tempo, speed);
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing ProTracker pattern to set tempo %d and speed %d",
+       tempo, speed);
 
   /* Write a command to set the tempo. */
   assert(tempo >= PT_SPEED_THRESHOLD); /* lower values set speed */
@@ -756,6 +1012,28 @@ static bool write_tempo_pattern(const unsigned int flags, const int speed, FILE
   return true; /* success */
 }
 
+static bool write_loop_pattern(const int first_pos, FILE * const f)
+{
+  assert(first_pos >= 0);
+  assert(first_pos < MAX_PT_SONG_LEN);
+  assert(f != NULL);
+
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing ProTracker pattern to jump to song position %d", first_pos);
+
+  /* Write a command to jump back to the start of the song. */
+  if (!fput_pt_command(PT_COM_POSITION_JUMP, first_pos, 0, 0, f))
+    return false; /* failure */
+
+  /* Pad the pattern to the required size. */
+  for (int n = MAX_PT_POSITIONS * NUM_PT_CHANNELS - 1; n > 0; n--) {
+    if (!fput_pt_command(PT_COM_NORMAL, 0, 0, 0, f))
+      return false; /* failure */
+  }
+
+  return true; /* success */
+}
+
 static int find_pt_sample(const PTSampleArray * const pt_samples,
                           const int num_repeats,
                           const int sample_num,
@@ -795,6 +1073,26 @@ static signed long sf_to_pt_tuning(const signed int sf_tuning)
   return ((long)sf_tuning * pt_octave + round) / SF_TUNING_OCTAVE;
 }
 
+static int calc_volume(const unsigned int flags,
+                       const SampleInfo * const sample)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(sample != NULL);
+
+  /* 16 bit XM sample data is never scaled. */
+  if ((flags & FLAGS_NORMALISE) == 0 || (flags & FLAGS_XM) != 0 ||
+      sample->peak == 0)
+    return PT_MAX_VOLUME;
+
+  /* Choose the lowest volume at which the peak amplitude of the sample data,
+     once scaled up by PT_MAX_VOLUME / volume, still fits in 8 bits. The
+     sample will sound as loud as it would have done without scaling. */
+  const unsigned long step = (1ul << 15) / PT_MAX_VOLUME;
+  const unsigned long volume = (sample->peak + step - 1) / step;
+  return volume < 1 ? 1 : (volume > PT_MAX_VOLUME ? PT_MAX_VOLUME :
+                                                     (int)volume);
+}
+
 static bool add_pt_sample(const unsigned int flags,
                           PTSampleArray * const pt_samples,
                           const SampleInfo * const sample,
@@ -811,7 +1109,16 @@ static bool add_pt_sample(const unsigned int flags,
   assert(num_repeats >= 0);
   assert(sample_num >= 0);
 
-  if (pt_samples->count >= MAX_PT_SAMPLES) {
+  /* When checking, the limit is enforced after all samples are counted. */
+  if ((flags & FLAGS_CHECK) != 0) {
+    /* No limit here */
+  } else if ((flags & FLAGS_XM) != 0) {
+    if (pt_samples->count >= XM_MAX_INSTRUMENTS) {
+      fprintf(stderr, "Song requires too many XM instruments "
+                      "(limit is %d)\n", XM_MAX_INSTRUMENTS);
+      return false;
+    }
+  } else if (pt_samples->count >= MAX_PT_SAMPLES) {
     fprintf(stderr, "Song requires too many ProTracker samples "
                     "(limit is %d)\n", MAX_PT_SAMPLES);
     return false;
@@ -845,186 +1152,1231 @@ static bool add_pt_sample(const unsigned int flags,
                       num_repeats,
                       sample_num,
                       octaves_cheat,
-                      pt_tuning))
+                      pt_tuning,
+                      calc_volume(flags, sample))) {
+    if ((flags & FLAGS_CHECK) != 0) {
+      /* Keep a placeholder so that the same problem isn't reported for
+         every note that would use this variant. */
+      *ptsi = (PTSampleInfo){
+        .num_repeats = num_repeats,
+        .sample_num = sample_num,
+        .octaves_cheat = octaves_cheat,
+      };
+      pt_samples->count++;
+    }
     return false;
+  }
 
-  if ((flags & FLAGS_VERBOSE) != 0) {
-    printf("ProTracker sample %d will be:\n", pt_samples->count);
+  if (LOG_ENABLED(LogLevel_Debug, LogCategory_Planning)) {
+    log_printf(LogLevel_Debug, LogCategory_Planning,
+               "ProTracker sample %d will be:", pt_samples->count);
 
-    printf("  %d repeats of sample %d ('%s'), "
-           "pre-tuned up by %d octaves\n", ptsi->num_repeats,
-           ptsi->sample_num, sample->file_name, ptsi->octaves_cheat);
+    log_printf(LogLevel_Debug, LogCategory_Planning,
+               "  %d repeats of sample %d ('%s'), "
+               "pre-tuned up by %d octaves", ptsi->num_repeats,
+               ptsi->sample_num, sample->file_name, ptsi->octaves_cheat);
 
-    printf("  Tuning:%ld Length: %d Repeat offset:%d "
-           "Repeat length:%d\n", ptsi->pt_tuning, ptsi->half_len * 2,
-           ptsi->half_repeat_offset * 2, ptsi->half_repeat_len * 2);
+    log_printf(LogLevel_Debug, LogCategory_Planning,
+               "  Tuning:%ld Length: %d Repeat offset:%d "
+               "Repeat length:%d Volume:%d", ptsi->pt_tuning,
+               ptsi->half_len * 2, ptsi->half_repeat_offset * 2,
+               ptsi->half_repeat_len * 2, ptsi->volume);
   }
 
   pt_samples->count++;
   return true;
 }
 
-static bool make_pt_sample_list(const unsigned int flags,
-                                const SFTrack * const music_data,
-                                const SampleArray * const sf_samples,
-                                PTSampleArray * const pt_samples)
+static int select_pt_sample(const NoteRules * const rules,
+                            const OctaveRange * const octaves,
+                            const PTSampleArray * const pt_samples,
+                            const SFEvent * const event,
+                            const int num_repeats,
+                            const signed long pt_tuning,
+                            int * const octave_out,
+                            int * const note_out)
 {
-  bool success = true;
-
-  assert(!(flags & ~FLAGS_ALL));
-  assert(music_data != NULL);
-  assert(sf_samples != NULL);
-  assert(sf_samples->count >= 0);
-  assert(sf_samples->count <= sf_samples->alloc);
-  assert((sf_samples->alloc == 0) == (sf_samples->sample_info == NULL));
+  assert(rules != NULL);
+  assert(octaves != NULL);
   assert(pt_samples != NULL);
+  assert(event != NULL);
+  assert(event->type == SFEventType_Note);
+  assert(num_repeats >= 0);
+  assert(num_repeats <= SF_MAX_REPEATS);
+  assert(octave_out != NULL);
+  assert(note_out != NULL);
+
+  if (!rules->plan_octaves) {
+    /* Search for the variation of the sample with the appropriate number
+       of repeats and pre-tuning. */
+    const signed int octaves_cheat = calc_octaves_cheat(octaves, event,
+                                                        pt_tuning, octave_out,
+                                                        note_out);
+
+    return find_pt_sample(pt_samples, num_repeats, event->sample_num,
+                          octaves_cheat);
+  }
 
-  if ((flags & FLAGS_VERBOSE) != 0) {
-    puts("SF3000 voice table:");
-    for (int v = 0; v < NUM_SF_VOICES; v++)
-      printf("  %d maps to sample %d\n", v, music_data->voice_table[v]);
+  /* Any planned variation of the sample that can play the note will do, but
+     prefer one that can play it in a standard octave and, failing that, the
+     one that has been pre-tuned least. */
+  const signed int octave = note_to_pt(event, note_out,
+                                       pt_tuning / PT_TUNING_SEMITONE);
+
+  _Optional const PTSampleInfo * const ptsi_array = pt_samples->sample_info;
+  if (!ptsi_array)
+    return 0;
 
-    printf("SF3000 music comprises %" PRId32 " patterns\n",
-           music_data->last_pattern_no + 1);
+  int best = 0, best_score = INT_MAX;
+  for (int pt_sample_no = 0; pt_sample_no < pt_samples->count; pt_sample_no++) {
+    const PTSampleInfo * const ptsi = &ptsi_array[pt_sample_no];
+    if (ptsi->num_repeats != num_repeats ||
+        ptsi->sample_num != event->sample_num)
+      continue;
+
+    const signed int pt_octave = octave - ptsi->octaves_cheat;
+    if (pt_octave < octaves->min || pt_octave > octaves->max)
+      continue;
+
+    int score = abs(ptsi->octaves_cheat);
+    if (pt_octave < octaves->std_min || pt_octave > octaves->std_max)
+      score += PT_OCTAVE_RANGE * 2;
+
+    if (score < best_score) {
+      best = pt_sample_no + 1; /* ProTracker sample numbers are based at 1 */
+      best_score = score;
+      *octave_out = pt_octave;
+    }
   }
 
-  _Optional const SFPattern * const patterns = music_data->patterns;
-  if (!patterns) {
-    success = false;
+  return best;
+}
+
+static bool add_plan_note(PlanArray * const plan,
+                          const int sample_num,
+                          const int num_repeats,
+                          const signed int octave)
+{
+  assert(plan != NULL);
+  assert(plan->count >= 0);
+  assert(plan->count <= plan->alloc);
+  assert(sample_num >= 0);
+  assert(sample_num <= UCHAR_MAX);
+  assert(num_repeats >= 0);
+  assert(num_repeats <= SF_MAX_REPEATS);
+
+  /* Find the group of notes played using the same sample with the same
+     number of repeats, or create a new group. */
+  PlanGroup *group = NULL;
+  _Optional PlanGroup * const groups = plan->groups;
+  for (int g = 0; g < plan->count && groups; g++) {
+    if (groups[g].sample_num == sample_num &&
+        groups[g].num_repeats == num_repeats) {
+      group = &groups[g];
+      break;
+    }
   }
 
-  for (long int pattern_no = 0;
-       (pattern_no <= music_data->last_pattern_no) && success;
-       pattern_no++)
-  {
-    const SFPattern * const pattern = &patterns[pattern_no];
+  if (group == NULL) {
+    if (plan->count >= plan->alloc || !plan->groups) {
+      const int new_alloc = plan->alloc == 0 ? INIT_SIZE : plan->alloc * 2;
+      const size_t new_size = new_alloc * sizeof(PlanGroup);
+      _Optional PlanGroup * const new_buf = realloc(plan->groups, new_size);
+      if (new_buf == NULL) {
+        fprintf(stderr, "Failed to allocate %zu bytes for octave plan\n",
+                new_size);
+        return false;
+      }
+      plan->groups = new_buf;
+      plan->alloc = new_alloc;
+    }
 
-    Fortify_CheckAllMemory();
+    group = &plan->groups[plan->count++];
+    *group = (PlanGroup){
+      .sample_num = sample_num,
+      .num_repeats = num_repeats,
+      .num_octaves = 0,
+    };
+  }
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf("About to pre-scan pattern %ld\n", pattern_no);
+  /* Insert the octave into the group's list, if not already present. */
+  int i = 0;
+  while (i < group->num_octaves && group->octaves[i] < octave)
+    i++;
 
-    for (int division_no = 0;
-         (division_no < NUM_SF_DIVISIONS) && success;
-         division_no++)
-    {
-      const SFDivision * const division = &pattern->divisions[division_no];
+  if (i < group->num_octaves && group->octaves[i] == octave)
+    return true; /* already present */
 
-      assert(NUM_PT_CHANNELS <= NUM_SF_CHANNELS);
-      for (int c = 0; (c < NUM_SF_CHANNELS) && success; c++) {
-        const SFChannelData * const com = &division->channels[c];
+  if (group->num_octaves >= MAX_PLAN_OCTAVES) {
+    fprintf(stderr, "Sample %d is played in too many octaves "
+                    "(limit is %d)\n", sample_num, MAX_PLAN_OCTAVES);
+    return false;
+  }
 
-        if (!command(com))
-          continue; /* No command here. */
+  memmove(&group->octaves[i + 1], &group->octaves[i],
+          (group->num_octaves - i) * sizeof(group->octaves[0]));
+  group->octaves[i] = octave;
+  group->num_octaves++;
+  return true;
+}
 
-        /* Only interested in note-playing actions, for now. */
-        if (com->voice_act >> 4 >= SF_GLISSANDO_THRESHOLD)
-          continue;
+static void cover_octaves(const unsigned int flags,
+                          PlanGroup * const group,
+                          const SampleInfo * const sample,
+                          const int want,
+                          _Optional signed int * const cheats)
+{
+  unsigned long best[MAX_PLAN_OCTAVES + 1][MAX_PT_SAMPLES + 1];
+  signed char from_octave[MAX_PLAN_OCTAVES + 1][MAX_PT_SAMPLES + 1];
+  signed int from_cheat[MAX_PLAN_OCTAVES + 1][MAX_PT_SAMPLES + 1];
+  signed int std_min, std_max, min_octave, max_octave;
 
-        /* Decode the voice number into a sample number */
-        const int sample_num = music_data->voice_table[com->voice_act & 0xf];
+  assert(!(flags & ~FLAGS_ALL));
+  assert(group != NULL);
+  assert(group->num_octaves > 0);
+  assert(group->num_octaves <= MAX_PLAN_OCTAVES);
+  assert(sample != NULL);
+  assert(want >= 0);
+  assert(want <= MAX_PT_SAMPLES);
+
+  get_octave_range(flags & ~FLAGS_EXTRA_OCTAVES, &std_min, &std_max);
+  get_octave_range(flags, &min_octave, &max_octave);
+
+  /* Only consider pre-tuning by as little as none, or by as much as would
+     be required to play the lowest and highest notes in standard octaves.
+     Pre-tuning upward by more than that would shrink the sample data but
+     needlessly lose quality. */
+  const int n = group->num_octaves;
+  signed int min_cheat = 0, max_cheat = 0;
+  for (int i = 0; i < n; i++) {
+    const signed int o = group->octaves[i];
+    const signed int cheat = o < std_min ? o - std_min :
+                             (o > std_max ? o - std_max : 0);
+    if (cheat < min_cheat)
+      min_cheat = cheat;
+    if (cheat > max_cheat)
+      max_cheat = cheat;
+  }
 
-        _Optional const SampleInfo * const sample =
-          sf_samples->sample_info && sample_num < sf_samples->count ?
-            &sf_samples->sample_info[sample_num] :
-            NULL;
-
-        if (!sample || (sample->type == SampleInfo_Type_Unused)) {
-          printf("%d %d %d\n", sf_samples->count, sample_num,
-                 sample ? sample->type : SampleInfo_Type_Unused);
-          fprintf(stderr, "Warning: Sample number %d is not defined!\n",
-                          sample_num);
+  for (int i = 0; i <= n; i++) {
+    for (int m = 0; m <= MAX_PT_SAMPLES; m++)
+      best[i][m] = ULONG_MAX;
+  }
+  best[0][0] = 0;
+
+  /* Each variant of the sample can play a contiguous range of octaves, so
+     cover the octaves in ascending order. best[i][m] is the least total
+     length of m variants that can play the i lowest octaves. */
+  for (int i = 0; i < n; i++) {
+    const signed int o = group->octaves[i];
+    const signed int lo = o - max_octave > min_cheat ? o - max_octave : min_cheat;
+    const signed int hi = o - min_octave < max_cheat ? o - min_octave : max_cheat;
+
+    for (signed int cheat = lo; cheat <= hi; cheat++) {
+      unsigned long repeat_offset, repeat_len, trimmed;
+      const unsigned long len = calc_pt_sample_len(sample, group->num_repeats,
+                                                   cheat, &repeat_offset,
+                                                   &repeat_len, &trimmed);
+      if (len > USHRT_MAX)
+        continue; /* too long */
+
+      int j = i + 1;
+      while (j < n && group->octaves[j] - cheat <= max_octave)
+        j++;
+
+      for (int m = 0; m < MAX_PT_SAMPLES; m++) {
+        if (best[i][m] == ULONG_MAX || best[i][m] + len >= best[j][m + 1])
           continue;
-        }
 
-        if (sample->type == SampleInfo_Type_Effect) {
-          if ((flags & FLAGS_VERBOSE) != 0) {
-            printf("Sound effect on channel %d is %s (division %d of pattern %ld)\n",
-                   c + 1,
-                   (flags & FLAGS_ALLOW_SFX) != 0 ? "allowed" : "forbidden",
-                   division_no,
-                   pattern_no);
-          }
-          if ((flags & FLAGS_ALLOW_SFX) == 0)
-            continue; /* Sound effects not allowed during music */
-        } else {
-          assert(sample->type == SampleInfo_Type_Music);
-        }
-
-        /* Decode the number of repeats */
-        const int num_repeats = com->num_repeats >> 4;
-
-        /* Calculate the equivalent tuning value in ProTracker units
-           (-8 means 1 semitone lower. 7 means 0.875 semitone higher) */
-        const signed long pt_tuning = sf_to_pt_tuning(sample->tuning);
-        const signed int octaves_cheat = calc_octaves_cheat(flags, com, pt_tuning, NULL, NULL);
-
-        /* If no usable variation of the sample required for this note
-           already exists then invent one. */
-        if (find_pt_sample(pt_samples,
-                           num_repeats,
-                           sample_num,
-                           octaves_cheat) == 0) {
-          success = add_pt_sample(flags, pt_samples, &*sample,
-                                  num_repeats, sample_num, octaves_cheat,
-                                  pt_tuning);
-        }
+        best[j][m + 1] = best[i][m] + len;
+        from_octave[j][m + 1] = (signed char)i;
+        from_cheat[j][m + 1] = cheat;
       }
     }
   }
 
-  if (success && (pt_samples->count == 0)) {
-    fprintf(stderr, "Cannot create output file containing no samples!\n");
-    success = false;
-  }
+  for (int m = 0; m <= MAX_PT_SAMPLES; m++)
+    group->cost[m] = best[n][m];
 
-  if (!success) {
-    free(pt_samples->sample_info);
-    pt_samples->sample_info = NULL;
+  if (cheats && want > 0) {
+    assert(best[n][want] != ULONG_MAX);
+    for (int i = n, m = want; m > 0; m--) {
+      cheats[m - 1] = from_cheat[i][m];
+      i = from_octave[i][m];
+    }
   }
-
-  return success;
 }
 
-static bool glissando_machine(ChannelState channels[NUM_PT_CHANNELS],
-                              const int c,
-                              FILE * const f)
+static bool plan_pt_samples(const unsigned int flags,
+                            PlanArray * const plan,
+                            const SampleArray * const sf_samples,
+                            PTSampleArray * const pt_samples)
 {
-  int effect_com, effect_val, sample_no, period;
+  assert(!(flags & ~FLAGS_ALL));
+  assert(plan != NULL);
+  assert(sf_samples != NULL);
+  assert(pt_samples != NULL);
 
-  assert(channels != NULL);
-  assert(c < NUM_SF_CHANNELS);
-  assert(f != NULL);
-  assert(!ferror(f));
+  _Optional PlanGroup * const groups = plan->groups;
+  _Optional const SampleInfo * const si_array = sf_samples->sample_info;
+  if (!groups || !si_array)
+    return true; /* nothing to do */
+
+  /* Find the greedy choice of variants for comparison. */
+  signed int min_octave, max_octave;
+  get_octave_range(flags, &min_octave, &max_octave);
+
+  unsigned long greedy_len = 0;
+  int greedy_count = 0;
+  bool greedy_ok = true;
+  for (int g = 0; g < plan->count; g++) {
+    const PlanGroup * const group = &groups[g];
+    signed int last_cheat = INT_MIN;
+
+    for (int i = 0; i < group->num_octaves; i++) {
+      const signed int o = group->octaves[i];
+      const signed int cheat = o < min_octave ? o - min_octave :
+                               (o > max_octave ? o - max_octave : 0);
+      if (cheat == last_cheat)
+        continue; /* octaves are in ascending order */
+
+      unsigned long repeat_offset, repeat_len, trimmed;
+      const unsigned long len = calc_pt_sample_len(&si_array[group->sample_num],
+                                                   group->num_repeats, cheat,
+                                                   &repeat_offset,
+                                                   &repeat_len, &trimmed);
+      if (len > USHRT_MAX)
+        greedy_ok = false;
+
+      greedy_len += len;
+      greedy_count++;
+      last_cheat = cheat;
+    }
+  }
 
-  switch (channels[c].glissando_state) {
-    case GlissandoState_None:
-      /* No glissando on this channel yet */
-      effect_com = PT_COM_NORMAL,
-      effect_val = 0;
-      sample_no = 0;
-      period = 0;
-      break;
+  /* Find the least total length of each group of variants for every
+     possible number of variants, then choose how many variants to allocate
+     to each group without exceeding the limit on the number of ProTracker
+     samples (a knapsack problem). */
+  const size_t table_size = ((size_t)plan->count + 1) * (MAX_PT_SAMPLES + 1);
+  _Optional unsigned long * const total = malloc(table_size * sizeof(*total));
+  _Optional unsigned char * const pick = malloc(table_size * sizeof(*pick));
+  _Optional unsigned char * const counts = malloc(plan->count * sizeof(*counts));
+  bool success = true;
+
+  if (!total || !pick || !counts) {
+    fprintf(stderr, "Failed to allocate memory for octave plan\n");
+    success = false;
+  } else {
+    for (int c = 0; c <= MAX_PT_SAMPLES; c++)
+      total[c] = c == 0 ? 0 : ULONG_MAX;
+
+    for (int g = 0; g < plan->count && success; g++) {
+      PlanGroup * const group = &groups[g];
+      const SampleInfo * const sample = &si_array[group->sample_num];
+      const unsigned long * const prev = &total[g * (MAX_PT_SAMPLES + 1)];
+      unsigned long * const next = &total[(g + 1) * (MAX_PT_SAMPLES + 1)];
+      unsigned char * const next_pick = &pick[(g + 1) * (MAX_PT_SAMPLES + 1)];
+
+      cover_octaves(flags, group, sample, 0, NULL);
+
+      int m;
+      for (m = 1; m <= MAX_PT_SAMPLES && group->cost[m] == ULONG_MAX; m++) {}
+      if (m > MAX_PT_SAMPLES) {
+        fprintf(stderr, "Sample data file '%s' is too long with %d repeats "
+                        "from offset %u\n", sample->file_name,
+                        group->num_repeats, sample->repeat_offset);
+        success = false;
+        break;
+      }
+
+      for (int c = 0; c <= MAX_PT_SAMPLES; c++)
+        next[c] = ULONG_MAX;
+
+      for (int c = 0; c < MAX_PT_SAMPLES; c++) {
+        if (prev[c] == ULONG_MAX)
+          continue;
+
+        for (int m = 1; c + m <= MAX_PT_SAMPLES; m++) {
+          if (group->cost[m] == ULONG_MAX ||
+              prev[c] + group->cost[m] >= next[c + m])
+            continue;
+
+          next[c + m] = prev[c] + group->cost[m];
+          next_pick[c + m] = (unsigned char)m;
+        }
+      }
+    }
+
+    /* Prefer fewer samples if the total length is the same. */
+    const unsigned long * const last = &total[plan->count * (MAX_PT_SAMPLES + 1)];
+    int best_count = 0;
+    if (success) {
+      for (int c = 1; c <= MAX_PT_SAMPLES; c++) {
+        if (last[c] < last[best_count])
+          best_count = c;
+      }
+
+      if (last[best_count] == ULONG_MAX) {
+        fprintf(stderr, "Song requires too many ProTracker samples "
+                        "(limit is %d)\n", MAX_PT_SAMPLES);
+        success = false;
+      }
+    }
+
+    if (success) {
+      if ((flags & FLAGS_STATS) != 0) {
+        fprintf(stderr, "Octave plan: %d samples, %lu bytes (greedy: %d "
+                        "samples, %lu bytes%s)\n", best_count,
+                last[best_count] * 2, greedy_count, greedy_len * 2,
+                !greedy_ok || greedy_count > MAX_PT_SAMPLES ?
+                  ", not possible" : "");
+      }
+
+      /* Work backwards to find how many variants were allocated to each
+         group, then create them in the original order. */
+      for (int g = plan->count, c = best_count; g > 0; g--) {
+        const int m = pick[g * (MAX_PT_SAMPLES + 1) + c];
+        counts[g - 1] = (unsigned char)m;
+        c -= m;
+      }
+
+      for (int g = 0; g < plan->count && success; g++) {
+        PlanGroup * const group = &groups[g];
+        const SampleInfo * const sample = &si_array[group->sample_num];
+        signed int cheats[MAX_PT_SAMPLES];
+        const int m = counts[g];
+
+        cover_octaves(flags, group, sample, m, cheats);
+
+        LOGF(LogLevel_Info, LogCategory_Planning,
+             "Planned %d variants of sample %d with %d repeats", m,
+             group->sample_num, group->num_repeats);
+
+        for (int v = 0; v < m && success; v++) {
+          success = add_pt_sample(flags, pt_samples, sample,
+                                  group->num_repeats, group->sample_num,
+                                  cheats[v], sf_to_pt_tuning(sample->tuning));
+        }
+      }
+    }
+  }
+
+  free(counts);
+  free(pick);
+  free(total);
+  return success;
+}
+
+static void get_note_rules(const unsigned int flags, NoteRules * const rules)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(rules != NULL);
+
+  *rules = (NoteRules){
+    .allow_sfx = (flags & FLAGS_ALLOW_SFX) != 0,
+    .loop_repeats = (flags & FLAGS_LOOP_REPEATS) != 0,
+    .glissando_single = (flags & FLAGS_GLISSANDO_SINGLE) != 0,
+    .plan_octaves = (flags & FLAGS_PLAN_OCTAVES) != 0,
+    .xm = (flags & FLAGS_XM) != 0,
+  };
+}
+
+static unsigned long calc_note_ticks(const bool xm,
+                                     const unsigned long frames,
+                                     signed int octave,
+                                     const int note,
+                                     const signed int finetune)
+{
+  /* Semitone and ProTracker finetune ratios in units of 1/65536 */
+  static const unsigned long semitone_ratio[SEMITONES_PER_OCTAVE] = {
+    65536, 69433, 73562, 77936, 82570, 87480, 92682, 98193, 104032, 110218,
+    116772, 123715
+  };
+  static const unsigned long finetune_ratio[PT_TUNING_SEMITONE * 2 - 1] = {
+    62306, 62757, 63212, 63670, 64132, 64596, 65065, 65536, 66011, 66489,
+    66971, 67456, 67945, 68438, 68933
+  };
+
+  assert(note >= 0);
+  assert(note < SEMITONES_PER_OCTAVE);
+  assert(finetune > -PT_TUNING_SEMITONE);
+  assert(finetune < PT_TUNING_SEMITONE);
+
+  /* Find the playback rate in sample frames per second (in units of 1/65536)
+     then the number of ticks for which the given number of frames play,
+     rounded to the nearest tick. */
+  unsigned long long rate = finetune_ratio[finetune + PT_TUNING_SEMITONE - 1];
+  if (xm) {
+    rate = rate * XM_BASE_RATE * semitone_ratio[note] >> 16;
+    octave -= 2;
+  } else {
+    /* Octaves beyond the period table are only reachable by pre-tuning. */
+    signed int pt_octave = octave < 0 ? 0 :
+                           (octave >= PT_OCTAVE_RANGE ? PT_OCTAVE_RANGE - 1 :
+                                                        octave);
+    rate = rate * PT_CLOCK_FREQ / get_pt_period(pt_octave, note);
+    octave -= pt_octave;
+  }
+
+  for (; octave > 0; octave--)
+    rate *= 2;
+  for (; octave < 0 && rate > 1; octave++)
+    rate /= 2;
+
+  const unsigned long long ticks =
+    ((unsigned long long)frames * SF_CLOCK_FREQ * 65536 + rate / 2) / rate;
+
+  return ticks > ULONG_MAX ? ULONG_MAX : (unsigned long)ticks;
+}
+
+static bool replaced_in_time(const NoteRules * const rules,
+                             const SFTrack * const music_data,
+                             const SampleArray * const sf_samples,
+                             const long int pattern_no,
+                             const int c,
+                             const unsigned long end_division)
+{
+  assert(rules != NULL);
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(end_division >= NUM_SF_DIVISIONS);
+
+  /* Returns true if a note that would end at the given division (counting
+     on from the start of the given pattern) is always replaced by another
+     note on the same channel first, wherever the pattern is played. */
+  if (!music_data->patterns)
+    return false;
+
+  const int song_len = sftrack_song_len(music_data);
+  for (int pos = 0; pos < song_len; pos++) {
+    if (music_data->play_order[pos] != pattern_no)
+      continue;
+
+    bool replaced = false;
+    unsigned long remaining = end_division - NUM_SF_DIVISIONS;
+    for (int next = pos + 1; next < song_len && !replaced; next++) {
+      const int next_no = music_data->play_order[next];
+      if (next_no > music_data->last_pattern_no)
+        continue;
+
+      SFEventCursor cursor;
+      sftrack_cursor_init(music_data, next_no, &cursor);
+
+      int d, c2;
+      for (_Optional const SFEvent *event = sftrack_cursor_next(&cursor, &d,
+                                                                 &c2);
+           event != NULL && (unsigned long)d <= remaining && !replaced;
+           event = sftrack_cursor_next(&cursor, &d, &c2)) {
+        replaced = c2 == c &&
+                   sftrack_note_sample(sf_samples, event,
+                                       rules->allow_sfx) != NULL;
+      }
+
+      if (remaining < NUM_SF_DIVISIONS)
+        break;
+
+      remaining -= NUM_SF_DIVISIONS;
+    }
+
+    /* The note would play indefinitely at the end of the song. */
+    if (!replaced)
+      return false;
+  }
+
+  return true;
+}
+
+static bool find_note_cut(const NoteRules * const rules,
+                          const SFTrack * const music_data,
+                          const SampleArray * const sf_samples,
+                          const SFEventGrid * const grid,
+                          const long int pattern_no,
+                          const int division_no,
+                          const int c,
+                          int * const cut_division,
+                          int * const cut_tick)
+{
+  int note;
+
+  assert(rules != NULL);
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(grid != NULL);
+  assert(division_no >= 0);
+  assert(division_no < NUM_SF_DIVISIONS);
+  assert(c >= 0);
+  assert(c < NUM_PT_CHANNELS);
+  assert(cut_division != NULL);
+  assert(cut_tick != NULL);
+
+  /* Returns true if a note played a finite number of times can instead use
+     the variant of its sample that loops indefinitely. */
+  if (!rules->loop_repeats)
+    return false;
+
+  _Optional const SFEvent * const event = grid->cells[division_no][c];
+  _Optional const SampleInfo * const sample =
+    sftrack_note_sample(sf_samples, event, rules->allow_sfx);
+  if (!sample || !event)
+    return false;
+
+  const int num_repeats = event->repeats;
+  if (num_repeats == 0 || num_repeats == SF_MAX_REPEATS)
+    return false;
+
+  /* Find when the repeated sample data would have run out (ignoring any
+     trailing silence), in ticks from the start of the note. */
+  unsigned long repeat_offset, repeat_len, trimmed;
+  const unsigned long frames = calc_pt_sample_len(&*sample, num_repeats, 0,
+                                                  &repeat_offset, &repeat_len,
+                                                  &trimmed) * 2;
+
+  const signed long pt_tuning = sf_to_pt_tuning(sample->tuning);
+  const signed int octave = note_to_pt(&*event, &note,
+                                       pt_tuning / PT_TUNING_SEMITONE);
+  unsigned long ticks = calc_note_ticks(rules->xm, frames, octave, note,
+                                        get_finetune(pt_tuning));
+
+  /* Speed 0 stops a ProTracker song but treat it like 1 to be safe. */
+  const int speed = music_data->speed > 0 ? music_data->speed : 1;
+  unsigned long end_division = division_no + ticks / speed;
+  bool glissando = false;
+
+  /* No cut is needed if another note replaces this one first. A glissando
+     changes the rate at which sample data is consumed, so conservatively
+     assume that its target pitch was reached immediately. */
+  for (int d = division_no + 1;
+       d < NUM_SF_DIVISIONS && (unsigned long)d <= end_division;
+       d++) {
+    for (int c2 = 0; c2 < NUM_PT_CHANNELS; c2++) {
+      _Optional const SFEvent * const event2 = grid->cells[d][c2];
+      if (!event2 || event2->type != SFEventType_Glissando)
+        continue;
+
+      if (c2 != c && rules->glissando_single)
+        continue;
+
+      if (event2->sample_num != event->sample_num)
+        continue;
+
+      const signed int target = note_to_pt(&*event2, &note,
+                                           pt_tuning / PT_TUNING_SEMITONE);
+      const unsigned long target_ticks = calc_note_ticks(rules->xm, frames,
+                                                         target, note,
+                                                         get_finetune(pt_tuning));
+      if (target_ticks < ticks) {
+        ticks = target_ticks;
+        end_division = division_no + ticks / speed;
+      }
+      glissando = true;
+    }
+
+    if (sftrack_note_sample(sf_samples, grid->cells[d][c],
+                            rules->allow_sfx)) {
+      *cut_division = -1;
+      return true;
+    }
+  }
+
+  /* The time at which to cut a note is uncertain during a glissando, and
+     the glissando would occupy the command needed to cut it. */
+  if (glissando)
+    return false;
+
+  /* Channel state is reset at the start of each pattern (which may be
+     followed by any other), so a cut can only be in the same pattern.
+     Otherwise, the note must be replaced before its end. */
+  if (end_division >= NUM_SF_DIVISIONS) {
+    *cut_division = -1;
+    return replaced_in_time(rules, music_data, sf_samples, pattern_no, c,
+                            end_division);
+  }
+
+  /* A ProTracker note's own command is needed to set its volume. */
+  if ((end_division == (unsigned long)division_no && !rules->xm) ||
+      ticks % speed > PT_MAX_CUT_TICK)
+    return false;
+
+  *cut_division = (int)end_division;
+  *cut_tick = (int)(ticks % speed);
+  return true;
+}
+
+static int note_repeats(const NoteRules * const rules,
+                        const SFTrack * const music_data,
+                        const SampleArray * const sf_samples,
+                        const SFEventGrid * const grid,
+                        const long int pattern_no,
+                        const int division_no,
+                        const int c,
+                        _Optional int * const cut_division,
+                        _Optional int * const cut_tick)
+{
+  int division = -1, tick = -1;
+
+  assert(grid != NULL);
+
+  /* Returns the number of repeats of the variant of the sample with which
+     to play a note. */
+  _Optional const SFEvent * const event = grid->cells[division_no][c];
+  assert(event != NULL);
+  int num_repeats = event ? event->repeats : 0;
+
+  if (find_note_cut(rules, music_data, sf_samples, grid, pattern_no,
+                    division_no, c, &division, &tick))
+    num_repeats = SF_MAX_REPEATS;
+
+  if (cut_division != NULL)
+    *cut_division = division;
+
+  if (cut_tick != NULL)
+    *cut_tick = tick;
+
+  return num_repeats;
+}
+
+static void log_voice_table(const SFTrack * const music_data)
+{
+  assert(music_data != NULL);
+
+  if (LOG_ENABLED(LogLevel_Info, LogCategory_Planning)) {
+    log_printf(LogLevel_Info, LogCategory_Planning, "SF3000 voice table:");
+    for (int v = 0; v < NUM_SF_VOICES; v++)
+      log_printf(LogLevel_Info, LogCategory_Planning,
+                 "  %d maps to sample %d", v, music_data->voice_table[v]);
+
+    log_printf(LogLevel_Info, LogCategory_Planning,
+               "SF3000 music comprises %" PRId32 " patterns",
+               music_data->last_pattern_no + 1);
+  }
+}
+
+static void begin_pt_sample_list(const unsigned int flags,
+                                 const SFTrack * const music_data,
+                                 SampleListBuilder * const builder)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(builder != NULL);
+
+  *builder = (SampleListBuilder){
+    .pt_samples = {0, 0, NULL},
+    .plan = {0, 0, NULL},
+    .success = true,
+    .bad_sample = false,
+  };
+  get_octave_ranges(flags, &builder->octaves);
+  get_note_rules(flags, &builder->rules);
+  log_voice_table(music_data);
+}
+
+static void add_pattern_samples(const unsigned int flags,
+                                const SFTrack * const music_data,
+                                const SampleArray * const sf_samples,
+                                const long int pattern_no,
+                                SampleListBuilder * const builder)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(pattern_no >= 0);
+  assert(pattern_no <= music_data->last_pattern_no);
+  assert(builder != NULL);
+
+  /* Only the given pattern and those before it need have been read, so
+     this mustn't be used with '-looprepeats' (which looks ahead). */
+  if (!builder->success)
+    return;
+
+  if (!music_data->patterns) {
+    builder->success = false;
+    return;
+  }
+
+  PTSampleArray * const pt_samples = &builder->pt_samples;
+
+  Fortify_CheckAllMemory();
+
+  LOGF(LogLevel_Debug, LogCategory_Planning,
+       "About to pre-scan pattern %ld", pattern_no);
+
+  /* Random access is only needed to find when notes are replaced. */
+  SFEventGrid grid;
+  sftrack_expand(music_data, pattern_no, &grid);
+
+  SFEventCursor cursor;
+  sftrack_cursor_init(music_data, pattern_no, &cursor);
+
+  assert(NUM_PT_CHANNELS <= (int)NUM_SF_CHANNELS);
+  int division_no, c;
+  for (_Optional const SFEvent *event = sftrack_cursor_next(&cursor,
+                                                             &division_no, &c);
+       event != NULL && builder->success;
+       event = sftrack_cursor_next(&cursor, &division_no, &c))
+  {
+    /* Only interested in note-playing actions, for now. */
+    if (event->type != SFEventType_Note)
+      continue;
+
+    const int sample_num = event->sample_num;
+
+    _Optional const SampleInfo * const sample =
+      sf_samples->sample_info && sample_num < sf_samples->count ?
+        &sf_samples->sample_info[sample_num] :
+        NULL;
+
+    if (!sample || (sample->type == SampleInfo_Type_Unused)) {
+      fprintf(stderr, "Warning: Sample number %d is not defined!\n",
+                      sample_num);
+      continue;
+    }
+
+    if (sample->type == SampleInfo_Type_Effect) {
+      LOGF(LogLevel_Debug, LogCategory_Planning,
+           "Sound effect on channel %d is %s (division %d of pattern %ld)",
+           c + 1,
+           builder->rules.allow_sfx ? "allowed" : "forbidden",
+           division_no,
+           pattern_no);
+      if (!builder->rules.allow_sfx)
+        continue; /* Sound effects not allowed during music */
+    } else {
+      assert(sample->type == SampleInfo_Type_Music);
+    }
+
+    /* Decode the number of repeats */
+    const int num_repeats = note_repeats(&builder->rules, music_data,
+                                         sf_samples, &grid, pattern_no,
+                                         division_no, c, NULL, NULL);
+
+    /* Calculate the equivalent tuning value in ProTracker units
+       (-8 means 1 semitone lower. 7 means 0.875 semitone higher) */
+    const signed long pt_tuning = sf_to_pt_tuning(sample->tuning);
+
+    if (builder->rules.plan_octaves) {
+      /* Defer the choice of variants until all notes have been seen. */
+      builder->success = add_plan_note(&builder->plan, sample_num,
+                                       num_repeats,
+                                       note_to_pt(&*event, NULL,
+                                                  pt_tuning / PT_TUNING_SEMITONE));
+      continue;
+    }
+
+    const signed int octaves_cheat = calc_octaves_cheat(&builder->octaves,
+                                                        &*event, pt_tuning,
+                                                        NULL, NULL);
+
+    /* If no usable variation of the sample required for this note
+       already exists then invent one. */
+    if (find_pt_sample(pt_samples,
+                       num_repeats,
+                       sample_num,
+                       octaves_cheat) == 0) {
+      const int old_count = pt_samples->count;
+      if (!add_pt_sample(flags, pt_samples, &*sample,
+                         num_repeats, sample_num, octaves_cheat,
+                         pt_tuning)) {
+        /* When checking, carry on looking for problems unless memory
+           ran out (in which case no placeholder was added). */
+        if ((flags & FLAGS_CHECK) != 0 && pt_samples->count > old_count)
+          builder->bad_sample = true;
+        else
+          builder->success = false;
+      }
+    }
+  }
+}
+
+static bool end_pt_sample_list(const unsigned int flags,
+                               const SampleArray * const sf_samples,
+                               SampleListBuilder * const builder,
+                               PTSampleArray * const pt_samples,
+                               const TraceTime start)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(sf_samples != NULL);
+  assert(builder != NULL);
+  assert(pt_samples != NULL);
+
+  /* Ownership of the list passes to the caller. */
+  bool success = builder->success;
+  *pt_samples = builder->pt_samples;
+  builder->pt_samples = (PTSampleArray){0, 0, NULL};
+
+  if (success && (flags & FLAGS_PLAN_OCTAVES) != 0)
+    success = plan_pt_samples(flags, &builder->plan, sf_samples, pt_samples);
+
+  if (success && (flags & FLAGS_CHECK) != 0) {
+    const int limit = (flags & FLAGS_XM) != 0 ? XM_MAX_INSTRUMENTS :
+                                                MAX_PT_SAMPLES;
+    if (pt_samples->count > limit) {
+      fprintf(stderr, "Song requires too many %s (%d, limit is %d)\n",
+              (flags & FLAGS_XM) != 0 ? "XM instruments" :
+                                        "ProTracker samples",
+              pt_samples->count, limit);
+      success = false;
+    }
+  }
+
+  if (builder->bad_sample)
+    success = false;
+
+  free(builder->plan.groups);
+  builder->plan.groups = NULL;
+
+  if (success && (pt_samples->count == 0)) {
+    fprintf(stderr, "Cannot create output file containing no samples!\n");
+    success = false;
+  }
+
+  if (!success) {
+    free(pt_samples->sample_info);
+    pt_samples->sample_info = NULL;
+  }
+
+  trace_span("make_pt_sample_list", start);
+  return success;
+}
+
+static void discard_pt_sample_list(SampleListBuilder * const builder)
+{
+  assert(builder != NULL);
+  free(builder->plan.groups);
+  builder->plan.groups = NULL;
+  free(builder->pt_samples.sample_info);
+  builder->pt_samples.sample_info = NULL;
+}
+
+static bool make_pt_sample_list(const unsigned int flags,
+                                const SFTrack * const music_data,
+                                const SampleArray * const sf_samples,
+                                PTSampleArray * const pt_samples)
+{
+  SampleListBuilder builder;
+  const TraceTime start = trace_now();
+
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(pt_samples != NULL);
+
+  begin_pt_sample_list(flags, music_data, &builder);
+
+  for (long int pattern_no = 0;
+       (pattern_no <= music_data->last_pattern_no) && builder.success;
+       pattern_no++)
+    add_pattern_samples(flags, music_data, sf_samples, pattern_no, &builder);
+
+  return end_pt_sample_list(flags, sf_samples, &builder, pt_samples, start);
+}
+
+static signed int glissando_octave(const OctaveRange * const octaves,
+                                   const PTSampleInfo * const ptsi,
+                                   const signed int octave,
+                                   bool * const in_range)
+{
+  assert(octaves != NULL);
+  assert(ptsi != NULL);
+  assert(in_range != NULL);
+
+  /* Make the target pitch specific to the variation of the sample
+     playing on this channel (which may have been pre-tuned to a
+     different octave). */
+  if (ptsi->octaves_cheat != 0) {
+    DEBUGF("Glissando of pre-tuned sample (by %d octaves)\n",
+              ptsi->octaves_cheat);
+  }
+  signed int chan_octave = octave - ptsi->octaves_cheat;
+  /* e.g. Use octave 1 to obtain octave 0 with a sample pre-tuned 'up'
+          by -1 octave. */
+
+  *in_range = true;
+  if (chan_octave < octaves->min) {
+    chan_octave = octaves->min;
+    *in_range = false;
+  } else if (chan_octave > octaves->max) {
+    chan_octave = octaves->max;
+    *in_range = false;
+  }
+
+  return chan_octave;
+}
+
+static unsigned long calc_play_rate(signed int octave, const int note)
+{
+  /* Octaves beyond the ProTracker period table (only playable in an XM file)
+     double or halve the rate for the nearest octave in the table. */
+  unsigned long num = (unsigned long)PT_CLOCK_FREQ * PT_FINETUNE_MARGIN,
+                den = (unsigned long)SF_CLOCK_FREQ * 16;
+
+  for (; octave < 0; octave++)
+    den *= 2;
+  for (; octave >= PT_OCTAVE_RANGE; octave--)
+    num *= 2;
+
+  den *= get_pt_period(octave, note);
+
+  /* Number of sample frames consumed per tick at the given pitch,
+     rounded up and with a margin for the sample's finetune value. */
+  return (num + den - 1) / den;
+}
+
+typedef struct {
+  unsigned char pt_sample_no; /* 0 if no note is playing */
+  unsigned char sample_num; /* UCHAR_MAX if unaffected by glissando */
+  unsigned long start; /* No. of the row at which the note started */
+  unsigned long max_rate; /* Highest play rate reached by the note */
+} NoteState;
+
+static void end_note(const NoteState * const note, const unsigned long row,
+                     const int speed, unsigned long max_len[MAX_VARIANTS])
+{
+  assert(note != NULL);
+  assert(row >= note->start);
+  assert(max_len != NULL);
+
+  if (note->pt_sample_no == 0)
+    return; /* No note playing */
+
+  assert(note->pt_sample_no <= MAX_VARIANTS);
+  assert(note->max_rate > 0);
+  const unsigned long ticks = (row - note->start) * (unsigned long)speed;
+  const unsigned long len = ticks > ULONG_MAX / note->max_rate ?
+                            ULONG_MAX : ticks * note->max_rate;
+
+  if (len > max_len[note->pt_sample_no - 1])
+    max_len[note->pt_sample_no - 1] = len;
+}
+
+static void find_max_play_lens(const unsigned int flags,
+                               const SFTrack * const music_data,
+                               const int song_len,
+                               const SampleArray * const sf_samples,
+                               const PTSampleArray * const pt_samples,
+                               unsigned long max_len[MAX_VARIANTS])
+{
+  NoteState notes[NUM_PT_CHANNELS];
+  unsigned long row = 0;
+  OctaveRange octaves;
+  NoteRules rules;
+
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(song_len >= 0);
+  assert(song_len <= MAX_SF_PATTERNS);
+  assert(sf_samples != NULL);
+  assert(pt_samples != NULL);
+  assert(pt_samples->count <= MAX_VARIANTS);
+  assert(max_len != NULL);
+
+  for (int pt_sample_no = 0; pt_sample_no < MAX_VARIANTS; pt_sample_no++)
+    max_len[pt_sample_no] = 0;
+
+  _Optional const PTSampleInfo * const ptsi_array = pt_samples->sample_info;
+  if (!music_data->patterns || !ptsi_array)
+    return;
+
+  /* Speed 0 stops a ProTracker song but treat it like 1 to be safe. */
+  const int speed = music_data->speed > 0 ? music_data->speed : 1;
+  get_octave_ranges(flags, &octaves);
+  get_note_rules(flags, &rules);
+
+  for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+    notes[c] = (NoteState){
+      .pt_sample_no = 0,
+      .sample_num = UCHAR_MAX,
+      .start = 0,
+      .max_rate = 0,
+    };
+  }
+
+  /* Simulate playing the patterns in order. Unlike the state of glissando
+     effects (which is reset at the start of each pattern by the transcoder),
+     a note can continue playing from one pattern into the next. */
+  for (int pos = 0; pos < song_len; pos++) {
+    const int pattern_no = music_data->play_order[pos];
+    if (pattern_no > music_data->last_pattern_no)
+      continue;
+
+    SFEventGrid grid;
+    sftrack_expand(music_data, pattern_no, &grid);
+
+    for (int c = 0; c < NUM_PT_CHANNELS; c++)
+      notes[c].sample_num = UCHAR_MAX;
+
+    for (int division_no = 0; division_no < NUM_SF_DIVISIONS;
+         division_no++, row++)
+    {
+      _Optional const SFEvent * const * const division = grid.cells[division_no];
+
+      /* A glissando can raise the pitch of a note (and therefore the rate at
+         which it consumes sample data) on any channel playing the same
+         sample. Conservatively assume that the target pitch is reached
+         immediately. */
+      for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+        _Optional const SFEvent * const event = division[c];
+        int note;
+
+        if (!event || event->type != SFEventType_Glissando)
+          continue;
+
+        const int sample_num = event->sample_num;
+        if ((sample_num >= sf_samples->count) || !sf_samples->sample_info ||
+            (sf_samples->sample_info[sample_num].type == SampleInfo_Type_Unused))
+          continue;
+
+        const signed long pt_tuning = sf_to_pt_tuning(
+                                sf_samples->sample_info[sample_num].tuning);
+        const signed int octave = note_to_pt(&*event, &note,
+                                             pt_tuning / PT_TUNING_SEMITONE);
+
+        for (int c2 = 0; c2 < NUM_PT_CHANNELS; c2++) {
+          if (notes[c2].sample_num != sample_num)
+            continue;
+
+          if (c2 != c && rules.glissando_single)
+            continue;
+
+          bool in_range;
+          const unsigned long rate = calc_play_rate(
+            glissando_octave(&octaves, &ptsi_array[notes[c2].pt_sample_no - 1],
+                             octave, &in_range), note);
+
+          if (rate > notes[c2].max_rate)
+            notes[c2].max_rate = rate;
+        }
+      }
+
+      for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+        _Optional const SFEvent * const event = division[c];
+        int octave, note;
+
+        _Optional const SampleInfo * const sample =
+          sftrack_note_sample(sf_samples, event, rules.allow_sfx);
+
+        if (!sample || !event)
+          continue; /* Doesn't retrigger the channel */
+
+        const int sample_num = event->sample_num;
+        const int pt_sample_no = select_pt_sample(&rules, &octaves, pt_samples,
+                                                  &*event,
+                                                  note_repeats(&rules, music_data,
+                                                               sf_samples,
+                                                               &grid,
+                                                               pattern_no,
+                                                               division_no, c,
+                                                               NULL, NULL),
+                                                  sf_to_pt_tuning(sample->tuning),
+                                                  &octave, &note);
+        if (pt_sample_no == 0)
+          continue;
+
+        end_note(&notes[c], row, speed, max_len);
+
+        notes[c] = (NoteState){
+          .pt_sample_no = pt_sample_no,
+          .sample_num = sample_num,
+          .start = row,
+          .max_rate = calc_play_rate(octave, note),
+        };
+      }
+    }
+  }
+
+  /* Notes still playing at the end of the song may continue indefinitely. */
+  for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+    if (notes[c].pt_sample_no != 0)
+      max_len[notes[c].pt_sample_no - 1] = ULONG_MAX;
+  }
+}
+
+static void truncate_to_play_lens(const unsigned long max_len[MAX_VARIANTS],
+                                  PTSampleArray * const pt_samples)
+{
+  assert(max_len != NULL);
+  assert(pt_samples != NULL);
+
+  _Optional PTSampleInfo * const ptsi_array = pt_samples->sample_info;
+  if (!ptsi_array)
+    return;
+
+  for (int pt_sample_no = 0; pt_sample_no < pt_samples->count; pt_sample_no++) {
+    PTSampleInfo * const ptsi = &ptsi_array[pt_sample_no];
+
+    /* A sample that loops indefinitely can't be truncated without changing
+       the loop, and is cut off by the next note anyway. */
+    if (ptsi->num_repeats == SF_MAX_REPEATS)
+      continue;
+
+    /* Sample lengths are in units of 2 frames. Keep at least one unit, as
+       for a sample that has been trimmed of silence. */
+    unsigned long half_max_len = max_len[pt_sample_no] / 2 +
+                                 max_len[pt_sample_no] % 2;
+    if (half_max_len < 1)
+      half_max_len = 1;
+
+    if (half_max_len >= ptsi->half_len)
+      continue;
+
+    LOGF(LogLevel_Info, LogCategory_Planning,
+         "Truncating ProTracker sample %d from %d to %lu bytes",
+         pt_sample_no + 1, ptsi->half_len * 2, half_max_len * 2);
+
+    ptsi->half_truncated = ptsi->half_len - half_max_len;
+    ptsi->half_len = (unsigned short)half_max_len;
+  }
+}
+
+static void truncate_pt_samples(const unsigned int flags,
+                                const SFTrack * const music_data,
+                                const int song_len,
+                                const SampleArray * const sf_samples,
+                                PTSampleArray * const pt_samples)
+{
+  unsigned long max_len[MAX_VARIANTS];
+
+  assert(!(flags & ~FLAGS_ALL));
+  assert(pt_samples != NULL);
+
+  find_max_play_lens(flags, music_data, song_len, sf_samples, pt_samples,
+                     max_len);
+
+  truncate_to_play_lens(max_len, pt_samples);
+}
+
+static bool glissando_machine(ChannelState channels[NUM_PT_CHANNELS],
+                              const int c,
+                              Cell * const cell)
+{
+  assert(channels != NULL);
+  assert(c < NUM_SF_CHANNELS);
+  assert(cell != NULL);
+
+  switch (channels[c].glissando_state) {
+    case GlissandoState_None:
+      /* No glissando on this channel yet */
+      *cell = (Cell){.pt_sample_no = 0, .note = -1, .volume = -1,
+                     .portamento = false, .cut_tick = -1};
+      break;
 
     case GlissandoState_Start:
       /* Tell the player the target pitch and sample number only at
          the start of the glissando. */
-      DEBUGF("Starting glissando of sample %d to pitch %d on "
+      DEBUGF("Starting glissando of sample %d to octave %d note %d on "
                 "channel %d\n", channels[c].pt_sample_no,
-                channels[c].target_pitch, c);
+                channels[c].target_octave, channels[c].target_note, c);
       channels[c].glissando_state = GlissandoState_Continue;
-      effect_com = PT_COM_TONE_PORTAMENTO,
-      effect_val = PT_GLISSANDO_SPEED;
-      sample_no = channels[c].pt_sample_no;
-      period = channels[c].target_pitch;
+      *cell = (Cell){.pt_sample_no = channels[c].pt_sample_no,
+                     .octave = channels[c].target_octave,
+                     .note = channels[c].target_note, .volume = -1,
+                     .portamento = true, .cut_tick = -1};
       break;
 
     case GlissandoState_Continue:
       DEBUGF("Continuing glissando on channel %d\n", c);
-      effect_com = PT_COM_TONE_PORTAMENTO,
-      effect_val = PT_GLISSANDO_SPEED;
-      sample_no = 0; /* Don't like but Martin says it's correct */
-      period = 0; /* Don't like but Martin says it's correct */
+      /* Don't like but Martin says it's correct */
+      *cell = (Cell){.pt_sample_no = 0, .note = -1, .volume = -1,
+                     .portamento = true, .cut_tick = -1};
       break;
 
     default:
@@ -1032,24 +2384,162 @@ static bool glissando_machine(ChannelState channels[NUM_PT_CHANNELS],
       return false; /* failure */
   }
 
-  return fput_pt_command(effect_com, effect_val, sample_no, period, f);
+  return true; /* success */
+}
+
+static bool put_xm_cell(const Cell * const cell,
+                        XMPattern * const xm_pattern,
+                        FILE * const f)
+{
+  assert(cell != NULL);
+  assert(xm_pattern != NULL);
+  (void)f;
+
+  /* XM patterns are packed, so buffer them until complete. */
+  const XMCell xm_cell = {
+    .note = cell->note < 0 ? 0 :
+              (cell->octave + XM_OCTAVE_OFFSET) * SEMITONES_PER_OCTAVE +
+              cell->note + 1,
+    .instrument = cell->pt_sample_no,
+    .volume = cell->volume < 0 ? 0 : XM_VOLUME_BASE + cell->volume,
+    .effect = cell->portamento ? XM_COM_TONE_PORTAMENTO :
+                (cell->cut_tick >= 0 ? XM_COM_EXTENDED : 0),
+    .param = cell->portamento ? PT_GLISSANDO_SPEED :
+               (cell->cut_tick >= 0 ? PT_EXT_NOTE_CUT | cell->cut_tick : 0),
+  };
+  xm_pattern_put(xm_pattern, &xm_cell);
+  return true; /* success */
+}
+
+static bool put_pt_cell(const Cell * const cell,
+                        XMPattern * const xm_pattern,
+                        FILE * const f)
+{
+  assert(cell != NULL);
+  (void)xm_pattern;
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  /* A ProTracker command can only have one effect, such as setting the
+     volume or sliding the pitch. */
+  int effect_com = PT_COM_NORMAL, effect_val = 0;
+  if (cell->portamento) {
+    effect_com = PT_COM_TONE_PORTAMENTO;
+    effect_val = PT_GLISSANDO_SPEED;
+  } else if (cell->volume >= 0) {
+    assert(cell->cut_tick < 0);
+    effect_com = PT_COM_SET_VOLUME;
+    effect_val = cell->volume;
+  } else if (cell->cut_tick >= 0) {
+    assert(cell->cut_tick <= PT_MAX_CUT_TICK);
+    effect_com = PT_COM_EXTENDED;
+    effect_val = PT_EXT_NOTE_CUT | cell->cut_tick;
+  } else if (cell->set_speed > 0) {
+    effect_com = PT_COM_SET_SPEED;
+    effect_val = cell->set_speed;
+  }
+
+  return fput_pt_command(effect_com, effect_val, cell->pt_sample_no,
+                         cell->note < 0 ? 0 :
+                           get_pt_period(cell->octave, cell->note), f);
 }
 
-static void warn_octave(const signed int    octave,
+static void init_transcoder(const unsigned int flags,
+                            Transcoder * const transcoder)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(transcoder != NULL);
+
+  *transcoder = (Transcoder){
+    .put_cell = (flags & FLAGS_XM) != 0 ? put_xm_cell : put_pt_cell,
+    .check = (flags & FLAGS_CHECK) != 0,
+    .warn_octaves = (flags & FLAGS_CHECK) != 0 ||
+                    LOG_ENABLED(LogLevel_Debug, LogCategory_Transcode),
+  };
+
+  get_octave_ranges(flags, &transcoder->octaves);
+  get_note_rules(flags, &transcoder->rules);
+}
+
+static void warn_octave(const Transcoder * const transcoder,
+                        const signed int    octave,
                         const int           channel,
                         const int           division_no,
                         const long int      pattern_no)
 {
-  if (octave < 1 || octave > PT_OCTAVE_RANGE - 2) {
-    printf("Utilising non-standard octave %d on channel %d (division %d of "
-           "pattern %ld)\n",
-           octave,
-           channel,
-           division_no,
-           pattern_no);
+  assert(transcoder != NULL);
+
+  /* When checking, this is reported as a problem rather than as progress. */
+  if (octave < transcoder->octaves.std_min ||
+      octave > transcoder->octaves.std_max) {
+    if (transcoder->check)
+      fprintf(stderr, "Warning: Utilising non-standard octave %d on channel "
+              "%d (division %d of pattern %ld)\n",
+              octave, channel, division_no, pattern_no);
+    else
+      LOGF(LogLevel_Debug, LogCategory_Transcode,
+           "Utilising non-standard octave %d on channel %d (division %d of "
+           "pattern %ld)", octave, channel, division_no, pattern_no);
   }
 }
 
+static bool plan_tempo_fold(const unsigned int flags,
+                            const SFTrack * const music_data,
+                            const SampleArray * const sf_samples,
+                            unsigned char set_speed[NUM_PT_CHANNELS])
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(set_speed != NULL);
+
+  for (int c = 0; c < NUM_PT_CHANNELS; c++)
+    set_speed[c] = 0;
+
+  /* Speed 0 would stop the song and couldn't be distinguished from no
+     command. The default speed needn't be set at all. */
+  const int tempo = (SECONDS_PER_MINUTE * SF_CLOCK_FREQ) / PT_BPM_DIVISOR;
+  assert(tempo >= PT_SPEED_THRESHOLD); /* lower values set speed */
+  assert(tempo <= UCHAR_MAX);
+
+  if (music_data->speed == 0)
+    return false;
+
+  int commands[2], num_commands = 0;
+  commands[num_commands++] = tempo;
+  if (music_data->speed != PT_DEFAULT_SPEED)
+    commands[num_commands++] = music_data->speed;
+
+  if (!music_data->patterns || sftrack_song_len(music_data) == 0)
+    return false;
+
+  const int pattern_no = music_data->play_order[0];
+  if (pattern_no > music_data->last_pattern_no)
+    return false;
+
+  /* The state of every channel is reset at the start of a pattern, so the
+     only effects in its first division are Set Volume for notes. That is
+     redundant for a note at full volume because selecting the sample sets
+     its default volume. */
+  SFEventGrid grid;
+  sftrack_expand(music_data, pattern_no, &grid);
+
+  NoteRules rules;
+  get_note_rules(flags, &rules);
+
+  int next = 0;
+  for (int c = 0; c < NUM_PT_CHANNELS && next < num_commands; c++) {
+    _Optional const SFEvent * const event = grid.cells[0][c];
+    if (sftrack_note_sample(sf_samples, event, rules.allow_sfx) && event &&
+        event->volume != SF_MAX_VOLUME)
+      continue;
+
+    set_speed[c] = (unsigned char)commands[next++];
+  }
+
+  return next == num_commands;
+}
+
 static bool transcode_patterns(const unsigned int  flags,
                                const SFTrack * const music_data,
                                const PTSampleArray *pt_samples,
@@ -1059,6 +2549,8 @@ static bool transcode_patterns(const unsigned int  flags,
 {
   long int last_pattern_no;
   ChannelState channels[NUM_PT_CHANNELS], final_channels[NUM_PT_CHANNELS];
+  XMPattern xm_pattern;
+  Transcoder transcoder;
 
   assert(music_data != NULL);
   assert(pt_samples != NULL);
@@ -1072,6 +2564,20 @@ static bool transcode_patterns(const unsigned int  flags,
   assert(f != NULL);
   assert(!ferror(f));
 
+  /* The tempo may be set by the first division of the first pattern to be
+     played instead of by an extra pattern. */
+  unsigned char set_speed[NUM_PT_CHANNELS];
+  long int tempo_pattern_no = -1;
+  if ((flags & (FLAGS_FOLD_TEMPO | FLAGS_XM)) == FLAGS_FOLD_TEMPO &&
+      plan_tempo_fold(flags, music_data, sf_samples, set_speed)) {
+    tempo_pattern_no = music_data->play_order[0];
+
+    LOGF(LogLevel_Info, LogCategory_Transcode,
+         "Setting tempo and speed %d in pattern %ld",
+         music_data->speed, tempo_pattern_no);
+  }
+
+  init_transcoder(flags, &transcoder);
   last_pattern_no = music_data->last_pattern_no;
 
   /* An extra pattern may be required to allow late notes to finish. */
@@ -1080,65 +2586,62 @@ static bool transcode_patterns(const unsigned int  flags,
 
   for (long int pattern_no = 0; pattern_no <= last_pattern_no; pattern_no++)
   {
-    _Optional const SFPattern *pattern;
+    SFEventGrid grid;
+    const TraceTime pattern_start = trace_now();
 
     Fortify_CheckAllMemory();
+    xm_pattern_init(&xm_pattern);
 
     if ((flags & FLAGS_BLANK_PATTERN) != 0 && pattern_no == last_pattern_no) {
-      if ((flags & FLAGS_VERBOSE) != 0)
-        puts("About to write a blank ProTracker pattern");
+      LOGF(LogLevel_Debug, LogCategory_Transcode,
+           "About to write a blank pattern");
 
       /* We are appending a blank pattern so restore the state of the channels
          at the end of the pattern played immediately beforehand, to allow
          continuation of any glissando effects. */
-      pattern = NULL;
       memcpy(&channels, &final_channels, sizeof(channels));
     } else {
       /* Clear the state of every channel at the start of each new pattern. This
          isn't strictly accurate, but it's the best that we can practically do
          given that patterns may be played in any order. */
-      if ((flags & FLAGS_VERBOSE) != 0)
-        printf("About to transcode pattern %ld\n", pattern_no);
+      LOGF(LogLevel_Debug, LogCategory_Transcode,
+           "About to transcode pattern %ld", pattern_no);
 
       for (int c = 0; c < NUM_PT_CHANNELS; c++) {
         channels[c] = (ChannelState){
           .pt_sample_no = 0,
           .sample_num = UCHAR_MAX,
-          .target_pitch = 0,
+          .target_octave = 0,
+          .target_note = 0,
           .glissando_state = GlissandoState_None,
+          .cut_division = -1,
+          .cut_tick = -1,
         };
         /* Fixed implicit truncation of UINT_MAX to unsigned char, 11/04/2010 */
       }
-      pattern = music_data->patterns + pattern_no;
     }
 
+    /* The blank pattern doesn't exist, so it has no events. */
+    sftrack_expand(music_data, pattern_no, &grid);
+
     for (int division_no = 0; division_no < NUM_SF_DIVISIONS; division_no++)
     {
-      const SFDivision *division;
-      static const SFDivision blank_division = {{{0,0,0,0},
-                                                 {0,0,0,0},
-                                                 {0,0,0,0},
-                                                 {0,0,0,0}}};
-
-      if (pattern == NULL)
-        division = &blank_division;
-      else
-        division = &pattern->divisions[division_no];
+      _Optional const SFEvent * const * const division = grid.cells[division_no];
 
       /* First examine the command for each channel to discover any glissando
          effects that should be applied to all channels. */
-      assert(NUM_PT_CHANNELS <= NUM_SF_CHANNELS);
+      assert(NUM_PT_CHANNELS <= (int)NUM_SF_CHANNELS);
       for (int c = 0; c < NUM_PT_CHANNELS; c++) {
-        const SFChannelData * const com = &division->channels[c];
+        _Optional const SFEvent * const event = division[c];
         int sample_num, note;
         signed long pt_tuning;
         signed int octave;
 
         /* Is this a glissando effect? */
-        if (com->voice_act >> 4 < SF_GLISSANDO_THRESHOLD)
+        if (!event || event->type != SFEventType_Glissando)
           continue; /* no */
 
-        sample_num = music_data->voice_table[com->voice_act & 0xf];
+        sample_num = event->sample_num;
         if ((sample_num >= sf_samples->count) ||
             ((sf_samples->sample_info + sample_num)->type == SampleInfo_Type_Unused))
           continue;
@@ -1146,25 +2649,26 @@ static bool transcode_patterns(const unsigned int  flags,
         /* Convert the SF3000 octave and note numbers into ProTracker
            equivalents. */
         pt_tuning = sf_to_pt_tuning((sf_samples->sample_info + sample_num)->tuning);
-        octave = note_to_pt(com, &note, pt_tuning / PT_TUNING_SEMITONE);
+        octave = note_to_pt(&*event, &note, pt_tuning / PT_TUNING_SEMITONE);
 
         /* A quirk is that a glissando affects all instances of the specified
            sample - regardless of which channel it is playing on. */
         for (int c2 = 0; c2 < NUM_SF_CHANNELS; c2++) {
           const PTSampleInfo *ptsi;
-          signed int min_octave, max_octave, chan_octave;
+          signed int chan_octave;
+          bool in_range;
 
           if (channels[c2].sample_num != sample_num)
             continue;
 
           if (c2 != c) {
-            if ((flags & FLAGS_VERBOSE) != 0)
-              printf("Glissando on channel %d->%d is %s (division %d of "
-                     "pattern %ld)\n", c, c2,
-                     (flags & FLAGS_GLISSANDO_SINGLE) == 0 ?
-                     "allowed" : "forbidden", division_no, pattern_no);
+            LOGF(LogLevel_Debug, LogCategory_Transcode,
+                 "Glissando on channel %d->%d is %s (division %d of "
+                 "pattern %ld)", c, c2,
+                 transcoder.rules.glissando_single ? "forbidden" : "allowed",
+                 division_no, pattern_no);
 
-            if ((flags & FLAGS_GLISSANDO_SINGLE) != 0)
+            if (transcoder.rules.glissando_single)
               continue;
           }
 
@@ -1173,135 +2677,142 @@ static bool transcode_patterns(const unsigned int  flags,
           assert(channels[c2].pt_sample_no <= pt_samples->count);
           ptsi = &pt_samples->sample_info[channels[c2].pt_sample_no - 1];
 
-          /* Make the target pitch specific to the variation of the sample
-             playing on this channel (which may have been pre-tuned to a
-             different octave). */
-          if (ptsi->octaves_cheat != 0) {
-            DEBUGF("Glissando of pre-tuned sample (by %d octaves)\n",
-                      ptsi->octaves_cheat);
-          }
-          chan_octave = octave - ptsi->octaves_cheat;
-          /* e.g. Use octave 1 to obtain octave 0 with a sample pre-tuned 'up'
-                  by -1 octave. */
-
-          /* ProTracker octaves 0 and 4 are non-standard and may not be
-             available. */
-          if ((flags & FLAGS_EXTRA_OCTAVES) == 0) {
-            min_octave = 1;
-            max_octave = PT_OCTAVE_RANGE - 2;
-          } else {
-            min_octave = 0;
-            max_octave = PT_OCTAVE_RANGE - 1;
-          }
-          if (chan_octave < min_octave || chan_octave > max_octave) {
-            if (chan_octave < min_octave)
-              chan_octave = min_octave;
-            else if (chan_octave > max_octave)
-              chan_octave = max_octave;
-
+          chan_octave = glissando_octave(&transcoder.octaves, ptsi, octave,
+                                         &in_range);
+          if (!in_range) {
             fprintf(stderr, "Warning: target for glissando out of range "
                     "on channel %d (division %d of pattern %ld)\n",
                     c2, division_no, pattern_no);
           }
 
-          if ((flags & FLAGS_VERBOSE) != 0)
-            warn_octave(chan_octave, c2, division_no, pattern_no);
+          if (transcoder.warn_octaves)
+            warn_octave(&transcoder, chan_octave, c2, division_no, pattern_no);
 
           if (channels[c2].glissando_state != GlissandoState_None) {
             DEBUGF("New glissando cancels existing glissando of "
-                      "sample %d to pitch %d on channel %d\n",
-                      channels[c2].pt_sample_no, channels[c2].target_pitch,
-                      c2);
+                      "sample %d to octave %d note %d on channel %d\n",
+                      channels[c2].pt_sample_no, channels[c2].target_octave,
+                      channels[c2].target_note, c2);
           }
           /* Schedule an immediate Tone Portamento command */
-          channels[c2].target_pitch = get_pt_period(chan_octave, note);
+          channels[c2].target_octave = (signed char)chan_octave;
+          channels[c2].target_note = (signed char)note;
           channels[c2].glissando_state = GlissandoState_Start;
 
-          DEBUGF("New glissando of sample %d to pitch %d on "
+          DEBUGF("New glissando of sample %d to octave %d note %d on "
                  "channel %d (division %d of pattern %ld)\n",
-                 channels[c2].pt_sample_no, channels[c2].target_pitch,
+                 channels[c2].pt_sample_no, chan_octave, note,
                  c2, division_no, pattern_no);
         }
       }
 
-      assert(NUM_PT_CHANNELS <= NUM_SF_CHANNELS);
+      assert(NUM_PT_CHANNELS <= (int)NUM_SF_CHANNELS);
       for (int c = 0; c < NUM_PT_CHANNELS; c++) {
-        const SFChannelData * const com = &division->channels[c];
-        bool blank = false;
-        const int sample_num = music_data->voice_table[com->voice_act & 0xf];
-        const SampleInfo * const sample = &sf_samples->sample_info[sample_num];
-
-        if (!command(com)) {
-          blank = true;
-        } else if (com->voice_act >> 4 >= SF_GLISSANDO_THRESHOLD) {
-          /* dealt with glissando starts on first pass */
-          blank = true;
-        } else if (sample_num >= sf_samples->count) {
-          blank = true; /* undefined sample */
-        } else {
-          switch (sample->type) {
-            case SampleInfo_Type_Unused:
-              blank = true; /* undefined sample */
-              break;
-
-            case SampleInfo_Type_Effect:
-              if ((flags & FLAGS_ALLOW_SFX) == 0)
-                blank = true; /* Sound effects not allowed during music */
-              break;
-
-            default:
-              assert(sample->type == SampleInfo_Type_Music);
-              break;
-          }
-        }
-        if (blank) {
+        _Optional const SFEvent * const event = division[c];
+        Cell cell;
+
+        /* Glissando starts were dealt with on the first pass */
+        _Optional const SampleInfo * const sample =
+          sftrack_note_sample(sf_samples, event,
+                              transcoder.rules.allow_sfx);
+
+        if (!sample || !event) {
           /* We may need to output a Tone Portamento command to continue a
              glissando. */
-          if (!glissando_machine(channels, c, f))
+          if (!glissando_machine(channels, c, &cell))
             return false;
+
+          /* A note played using a looping variant of its sample may need to
+             be cut when the repeats would have ended. */
+          if (channels[c].cut_division == division_no) {
+            assert(!cell.portamento);
+            cell.cut_tick = channels[c].cut_tick;
+            channels[c].cut_division = -1;
+          }
         } else {
           /* Convert the SF3000 octave and note numbers into ProTracker
              equivalents. */
-          int octave, note;
-          const signed int octaves_cheat = calc_octaves_cheat(flags,
-                                             com,
-                                             sf_to_pt_tuning(sample->tuning),
-                                             &octave,
-                                             &note);
-
-          if ((flags & FLAGS_VERBOSE) != 0)
-            warn_octave(octave, c, division_no, pattern_no);
-
           /* Search for the variation of the sample with the appropriate number
              of repeats. */
-          const int pt_sample_no = find_pt_sample(pt_samples, com->num_repeats >> 4,
-                                                  sample_num, octaves_cheat);
+          int octave, note, cut_division = -1, cut_tick = -1;
+          const int num_repeats = note_repeats(&transcoder.rules, music_data,
+                                               sf_samples, &grid, pattern_no,
+                                               division_no, c, &cut_division,
+                                               &cut_tick);
+
+          const int pt_sample_no = select_pt_sample(&transcoder.rules,
+                                                    &transcoder.octaves,
+                                                    pt_samples,
+                                                    &*event,
+                                                    num_repeats,
+                                                    sf_to_pt_tuning(sample->tuning),
+                                                    &octave,
+                                                    &note);
           assert(pt_sample_no != 0);
 
-          if (!fput_pt_command(PT_COM_SET_VOLUME,
-                               (com->oct_vol >> 4) *
-                                 PT_MAX_VOLUME / SF_MAX_VOLUME,
-                               pt_sample_no,
-                               get_pt_period(octave, note),
-                               f))
-            return false; /* failure */
+          if (transcoder.warn_octaves)
+            warn_octave(&transcoder, octave, c, division_no, pattern_no);
+
+          /* The volume of a note must be scaled down in proportion to the
+             volume of the sample, because the Set Volume command overrides
+             it. */
+          const PTSampleInfo * const ptsi =
+            &pt_samples->sample_info[pt_sample_no - 1];
+
+          cell = (Cell){
+            .pt_sample_no = pt_sample_no,
+            .octave = (signed char)octave,
+            .note = (signed char)note,
+            .volume = (signed char)(event->volume * ptsi->volume /
+                                    SF_MAX_VOLUME),
+            .portamento = false,
+            .cut_tick = -1,
+          };
+
+          /* An XM note can be cut by its own command because the volume
+             is set separately. */
+          if (cut_division == division_no) {
+            cell.cut_tick = (signed char)cut_tick;
+            cut_division = -1;
+          }
 
           if (channels[c].glissando_state != GlissandoState_None) {
-            DEBUGF("New note cancels glissando of sample %d to pitch %d "
-                      "on channel %d\n", channels[c].pt_sample_no,
-                      channels[c].target_pitch, c);
+            DEBUGF("New note cancels glissando of sample %d to octave %d "
+                      "note %d on channel %d\n", channels[c].pt_sample_no,
+                      channels[c].target_octave, channels[c].target_note, c);
           }
 
           channels[c] = (ChannelState){
-            .sample_num = sample_num,
+            .sample_num = event->sample_num,
             .pt_sample_no = pt_sample_no,
-            .target_pitch = 0,
+            .target_octave = 0,
+            .target_note = 0,
             .glissando_state = GlissandoState_None,
+            .cut_division = (signed char)cut_division,
+            .cut_tick = (signed char)cut_tick,
           };
         }
+
+        if (pattern_no == tempo_pattern_no && division_no == 0 &&
+            set_speed[c] > 0) {
+          assert(!cell.portamento);
+          assert(cell.cut_tick < 0);
+          assert(cell.volume < 0 ||
+                 (cell.pt_sample_no > 0 &&
+                  cell.volume ==
+                    pt_samples->sample_info[cell.pt_sample_no - 1].volume));
+          cell.volume = -1;
+          cell.set_speed = set_speed[c];
+        }
+
+        if (!transcoder.put_cell(&cell, &xm_pattern, f))
+          return false; /* failure */
       }
     }
 
+    if ((flags & FLAGS_XM) != 0 && !xm_write_pattern(f, &xm_pattern))
+      return false; /* failure */
+
     /* If we just transcoded the pattern to be played last then copy the state
        of the channels to allow continuation of any glissando effects on the
        additional 'blank' pattern (if one is to be appended). */
@@ -1311,6 +2822,8 @@ static bool transcode_patterns(const unsigned int  flags,
 
       memcpy(&final_channels, &channels, sizeof(final_channels));
     }
+
+    trace_span_number("pattern", pattern_start, "pattern", pattern_no);
   }
   return true; /* success */
 }
@@ -1324,116 +2837,74 @@ bool check_tuning(signed int sf_tuning)
   return ((int)abs(sf_tuning) <= (LONG_MAX - SF_TUNING_OCTAVE / 2) / pt_octave);
 }
 
-static bool read_track(const unsigned int flags, Reader * const r, SFTrack * const music_data)
+static void stream_pattern(const SFTrack * const music_data,
+                           const long int pattern_no, void * const arg)
 {
-  assert(!(flags & ~FLAGS_ALL));
-  assert(r != NULL);
-  assert(!reader_ferror(r));
-  assert(music_data != NULL);
+  PatternStream * const stream = arg;
+  assert(stream != NULL);
+  assert(stream->started);
 
-  /* First byte of Star Fighter 3000 music data gives the tempo as an interval
-     between divisions (in centiseconds). */
-
-  const int s = reader_fgetc(r);
-  if (s == EOF) {
-    fprintf(stderr, "Failed to read tempo\n");
-    return false;
-  }
-
-  if (s >= PT_SPEED_THRESHOLD) {
-    fprintf(stderr, "Tempo %d is too slow in input file (limit is %d)\n",
-                    s, PT_SPEED_THRESHOLD - 1);
-    return false;
-  }
-
-  if ((flags & FLAGS_VERBOSE) != 0)
-    printf("SF3000 music tempo is %d cs\n", s);
-
-  music_data->speed = s;
+  add_pattern_samples(stream->flags, music_data, stream->sf_samples,
+                      pattern_no, &stream->builder);
+}
 
-  if (reader_fseek(r, 16, SEEK_SET)) {
-    fprintf(stderr, "Failed to seek voice table\n");
-    return false;
-  }
+static bool read_track(const unsigned int flags, Reader * const r,
+                       SFTrack * const music_data,
+                       _Optional PatternStream * const stream)
+{
+  assert(!(flags & ~FLAGS_ALL));
 
-  if (reader_fread(music_data->voice_table, sizeof(music_data->voice_table), 1, r) != 1) {
-    fprintf(stderr, "Failed to read voice table\n");
-    return false;
-  }
+  /* The input is read strictly forwards, so it can be a pipe. */
+  const TraceTime start = trace_now();
+  bool success = sftrack_read_header(music_data, r);
 
-  if (!reader_fread_int32(&music_data->last_pattern_no, r)) {
-    fprintf(stderr, "Failed to read no. of patterns\n");
-    return false;
-  }
-
-  if (reader_fseek(r, 4, SEEK_CUR)) {
-    fprintf(stderr, "Failed to seek play order\n");
-    return false;
+  if (success && music_data->speed >= PT_SPEED_THRESHOLD) {
+    fprintf(stderr, "Tempo %d is too slow in input file (limit is %d)\n",
+                    music_data->speed, PT_SPEED_THRESHOLD - 1);
+    success = false;
   }
 
-  if (reader_fread(music_data->play_order, sizeof(music_data->play_order), 1, r) != 1) {
-    fprintf(stderr, "Failed to read play order\n");
-    return false;
-  }
+  /* The play order precedes the patterns, so those that are never played
+     can be left undecoded. */
+  if (success && (flags & FLAGS_PRUNE_PATTERNS) != 0)
+    sftrack_prune(music_data);
 
-  assert(music_data->last_pattern_no >= 0);
-  size_t const bytes = ((size_t)music_data->last_pattern_no + 1) * sizeof(SFPattern);
-  music_data->patterns = malloc(bytes);
-  if (music_data->patterns == NULL) {
-    fprintf(stderr, "Failed to allocate %zu bytes for SF3000 patterns data\n", bytes);
-    return false;
+  if (success) {
+    /* Plan the samples for each pattern while the next is being read,
+       unless the song can't be converted anyway. */
+    if (stream != NULL && sftrack_song_len(music_data) < MAX_SF_PATTERNS) {
+      begin_pt_sample_list(flags, music_data, &stream->builder);
+      stream->started = true;
+      success = sftrack_stream_patterns(music_data, r, stream_pattern,
+                                        &*stream);
+    } else {
+      success = sftrack_read_patterns(music_data, r);
+    }
   }
 
-  bool success = true;
-  for (long int pattern_no = 0;
-       pattern_no <= music_data->last_pattern_no && success;
-       pattern_no++)
-  {
-    SFPattern * const pattern = &music_data->patterns[pattern_no];
-
-    Fortify_CheckAllMemory();
+  trace_span("read_track", start);
+  return success;
+}
 
-    if ((flags & FLAGS_VERBOSE) != 0)
-      printf("Reading pattern %ld\n", pattern_no);
-
-    for (int division_no = 0;
-         division_no < NUM_SF_DIVISIONS && success;
-         division_no++) {
-      SFDivision * const division = &pattern->divisions[division_no];
-      assert(NUM_PT_CHANNELS <= NUM_SF_CHANNELS);
-      for (int c = 0; c < NUM_SF_CHANNELS && success; c++) {
-        SFChannelData * const com = &division->channels[c];
-        uint8_t raw[4];
-        if (reader_fread(raw, sizeof(raw), 1, r) != 1) {
-          fprintf(stderr,
-                  "Failed to read channel %d (division %d of pattern %ld)\n",
-                  c, division_no, pattern_no);
-          success = false;
-        } else {
-          *com = (SFChannelData){
-            .note = raw[0],
-            .oct_vol = raw[1],
-            .voice_act = raw[2],
-            .num_repeats = raw[3],
-          };
-        }
-      }
-    }
-  }
+static bool write_song_name(const char * const song_name, FILE * const f)
+{
+  assert(song_name != NULL);
+  assert(f != NULL);
+  assert(!ferror(f));
 
-  if (!success) {
-    free(music_data->patterns);
-    music_data->patterns = NULL;
-  }
+  char name[20];
+  memset(name, '\0', sizeof(name));
+  strncpy(name, song_name, sizeof(name)-1);
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing ProTracker song name '%s'", name);
 
-  return success;
+  return fwrite(name, sizeof(name), 1, f) == 1;
 }
 
 static bool write_track(const unsigned int flags,
                         const char * const song_name,
                         const SFTrack * const music_data,
                         const int song_len,
-                        const int pt_song_len,
                         const SampleArray * const sf_samples,
                         const PTSampleArray * const pt_samples,
                         FILE * const f)
@@ -1443,9 +2914,6 @@ static bool write_track(const unsigned int flags,
   assert(music_data != NULL);
   assert(song_len >= 0);
   assert(song_len <= MAX_SF_PATTERNS);
-  assert(pt_song_len >= 1);
-  assert(pt_song_len > song_len);
-  assert(pt_song_len <= MAX_PT_SONG_LEN);
   assert(sf_samples != NULL);
   assert(sf_samples->count >= 0);
   assert(sf_samples->count <= sf_samples->alloc);
@@ -1457,24 +2925,20 @@ static bool write_track(const unsigned int flags,
   assert(f != NULL);
   assert(!ferror(f));
 
-  char name[20];
-  memset(name, '\0', sizeof(name));
-  strncpy(name, song_name, sizeof(name)-1);
-  if ((flags & FLAGS_VERBOSE) != 0)
-    printf("Writing ProTracker song name '%s'\n", name);
-
-  if (fwrite(name, sizeof(name), 1, f) != 1) {
+  if (!write_song_name(song_name, f)) {
     return false;
   }
 
   /* Write sample info */
-  if (!write_sample_table(flags, pt_samples, sf_samples, f)) {
+  if (!write_sample_table(pt_samples, sf_samples, f)) {
     return false;
   }
 
-  /* Write the order in which to play patterns and get the number of the
-     pattern to be played last. */
-  if (!write_play_order(flags, music_data, song_len, pt_song_len, f)) {
+  /* Write the order in which to play patterns. */
+  PTPlayOrder order = {.len = 0, .desc_len = 0};
+  add_song_positions(flags, music_data, song_len, 0, &order);
+
+  if (!write_play_order(&order, f)) {
     return false;
   }
 
@@ -1484,8 +2948,10 @@ static bool write_track(const unsigned int flags,
     return false;
   }
 
-  /* Write data for pattern 0, which will set the tempo for the song... */
-  if (!write_tempo_pattern(flags, music_data->speed, f)) {
+  /* Write data for pattern 0, which will set the tempo for the song, unless
+     the first pattern to be played does so... */
+  if ((flags & FLAGS_FOLD_TEMPO) == 0 &&
+      !write_tempo_pattern(music_data->speed, f)) {
     return false;
   }
 
@@ -1503,6 +2969,354 @@ static bool write_track(const unsigned int flags,
   return true; /* success */
 }
 
+static bool write_xm_track(const unsigned int flags,
+                           const char * const song_name,
+                           const SFTrack * const music_data,
+                           const int song_len,
+                           const SampleArray * const sf_samples,
+                           const PTSampleArray * const pt_samples,
+                           FILE * const f)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(song_name != NULL);
+  assert(music_data != NULL);
+  assert(song_len >= 0);
+  assert(song_len <= MAX_SF_PATTERNS);
+  assert(pt_samples != NULL);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  /* There is no need for an extra pattern to set the tempo because an XM
+     file has a default tempo and BPM, and pattern numbers are unchanged. */
+  uint8_t order[MAX_SF_PATTERNS + 1];
+  int xm_song_len = 0;
+  for (int pos = 0; pos < song_len; pos++)
+    order[xm_song_len++] = music_data->play_order[pos];
+
+  long int num_patterns = music_data->last_pattern_no + 1;
+
+  /* An extra song position may be required to allow late notes to finish. */
+  if ((flags & FLAGS_BLANK_PATTERN) != 0)
+    order[xm_song_len++] = (uint8_t)num_patterns++;
+
+  /* An XM file must have at least one song position. */
+  if (xm_song_len == 0)
+    order[xm_song_len++] = 0;
+
+  if (num_patterns > XM_MAX_SONG_LEN) {
+    fprintf(stderr, "Too many patterns in input file\n");
+    return false;
+  }
+
+  /* The BPM has the same meaning as the ProTracker tempo. Speed 0 would
+     stop a ProTracker song but isn't valid in an XM file. */
+  const int bpm = (SECONDS_PER_MINUTE * SF_CLOCK_FREQ) / PT_BPM_DIVISOR;
+  const int speed = music_data->speed > 0 ? music_data->speed : 1;
+
+  LOGF(LogLevel_Info, LogCategory_Transcode,
+       "Writing XM header with %d song positions, %ld patterns, "
+       "%d instruments, BPM %d and speed %d", xm_song_len,
+       num_patterns, pt_samples->count, bpm, speed);
+
+  if (!xm_write_header(f, song_name, xm_song_len, order, (int)num_patterns,
+                       pt_samples->count, speed, bpm)) {
+    fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+    return false;
+  }
+
+  if (!transcode_patterns(flags,
+                          music_data,
+                          pt_samples,
+                          sf_samples,
+                          music_data->play_order[song_len - 1],
+                          f)) {
+    fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true; /* success */
+}
+
+static long int count_pt_patterns(const unsigned int flags,
+                                  const SFTrack * const music_data)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+
+  /* One extra pattern may set the tempo and another may be appended. */
+  long int num_patterns = music_data->last_pattern_no + 1;
+  if ((flags & FLAGS_FOLD_TEMPO) == 0)
+    num_patterns++;
+  if ((flags & FLAGS_BLANK_PATTERN) != 0)
+    num_patterns++;
+
+  return num_patterns;
+}
+
+static unsigned long pt_music_size(const long int num_patterns)
+{
+  assert(num_patterns >= 0);
+
+  /* The song name, sample table, song positions and "M.K." identifier are
+     followed by the patterns. */
+  return 20 + BYTES_PER_PT_SAMPLE * MAX_PT_SAMPLES + 2 + MAX_PT_SONG_LEN + 4 +
+         (unsigned long)num_patterns * MAX_PT_POSITIONS * NUM_PT_CHANNELS *
+         BYTES_PER_PT_COMMAND;
+}
+
+static unsigned long pt_module_size(const unsigned int flags,
+                                    const SFTrack * const music_data,
+                                    const unsigned long sample_bytes)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+
+  return pt_music_size(count_pt_patterns(flags, music_data)) +
+         sample_bytes;
+}
+
+static bool pt_samples_size(const unsigned int flags,
+                            const SFTrack * const music_data,
+                            const int song_len,
+                            const SampleArray * const sf_samples,
+                            unsigned long * const sample_bytes)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(sample_bytes != NULL);
+
+  /* Find which variants of samples a ProTracker module would need. This
+     isn't always possible. */
+  PTSampleArray pt_samples = {0, 0, NULL};
+  if (!make_pt_sample_list(flags, music_data, sf_samples, &pt_samples))
+    return false;
+
+  if ((flags & FLAGS_TRUNCATE) != 0)
+    truncate_pt_samples(flags, music_data, song_len, sf_samples,
+                        &pt_samples);
+
+  *sample_bytes = 0;
+  _Optional const PTSampleInfo * const ptsi_array = pt_samples.sample_info;
+  for (int pt_sample_no = 0;
+       pt_sample_no < pt_samples.count && ptsi_array;
+       pt_sample_no++)
+    *sample_bytes += (unsigned long)ptsi_array[pt_sample_no].half_len * 2;
+
+  free(pt_samples.sample_info);
+  return true;
+}
+
+static void report_module_size(const unsigned int flags,
+                               const long int size,
+                               const SFTrack * const music_data,
+                               const int song_len,
+                               const SampleArray * const sf_samples)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+
+  if (size < 0)
+    return; /* output stream isn't seekable */
+
+  if ((flags & FLAGS_XM) == 0) {
+    fprintf(stderr, "Module: %ld bytes\n", size);
+    return;
+  }
+
+  /* For comparison, find the size of the equivalent ProTracker module
+     without logging the progress of doing so. */
+  const unsigned int pt_flags = flags & ~(FLAGS_XM | FLAGS_STATS);
+  unsigned long sample_bytes;
+  const unsigned int saved_mask = log_set_mask(0);
+  const bool possible = pt_samples_size(pt_flags, music_data, song_len,
+                                        sf_samples, &sample_bytes);
+  log_set_mask(saved_mask);
+
+  if (!possible) {
+    fprintf(stderr, "Module: %ld bytes (ProTracker equivalent: not "
+                    "possible)\n", size);
+    return;
+  }
+
+  fprintf(stderr, "Module: %ld bytes (ProTracker equivalent: %lu bytes)\n",
+          size, pt_module_size(pt_flags, music_data, sample_bytes));
+}
+
+bool estimate_protracker_size(unsigned int flags,
+                              const SFTrack * const music_data,
+                              const SampleArray * const sf_samples,
+                              unsigned long * const size)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(sf_samples != NULL);
+  assert(size != NULL);
+
+  /* Without the pattern data, assume that the tempo can't be folded. */
+  unsigned char set_speed[NUM_PT_CHANNELS];
+  if ((flags & FLAGS_FOLD_TEMPO) != 0 &&
+      !plan_tempo_fold(flags, music_data, sf_samples, set_speed))
+    flags &= ~FLAGS_FOLD_TEMPO;
+
+  unsigned long sample_bytes = 0;
+
+  if (music_data->patterns) {
+    const int song_len = sftrack_song_len(music_data);
+    if (song_len >= MAX_SF_PATTERNS ||
+        !pt_samples_size(flags, music_data, song_len, sf_samples,
+                         &sample_bytes))
+      return false;
+  } else {
+    /* Without the pattern data, assume that each sample in the voice table
+       is played once, without pre-tuning or repeats. */
+    bool counted[NUM_SF_VOICES] = {false};
+
+    for (int v = 0; v < NUM_SF_VOICES; v++) {
+      const int sample_num = music_data->voice_table[v];
+      if (sample_num >= sf_samples->count || !sf_samples->sample_info)
+        continue;
+
+      const SampleInfo * const sample = &sf_samples->sample_info[sample_num];
+      if (sample->type == SampleInfo_Type_Unused ||
+          (sample->type == SampleInfo_Type_Effect &&
+           (flags & FLAGS_ALLOW_SFX) == 0))
+        continue;
+
+      /* Count each sample once, however many voices use it. */
+      bool duplicate = false;
+      for (int v2 = 0; v2 < v && !duplicate; v2++)
+        duplicate = counted[v2] && music_data->voice_table[v2] == sample_num;
+
+      if (!duplicate) {
+        unsigned long repeat_offset, repeat_len, trimmed;
+        counted[v] = true;
+        sample_bytes += calc_pt_sample_len(sample, 0, 0, &repeat_offset,
+                                           &repeat_len, &trimmed) * 2;
+      }
+    }
+  }
+
+  *size = pt_module_size(flags, music_data, sample_bytes);
+  return true;
+}
+
+static bool convert_track(unsigned int flags,
+                          const char * const song_name,
+                          const SFTrack * const music_data,
+                          const char * const samples_dir,
+                          const SampleArray * const sf_samples,
+                          _Optional SampleListBuilder * const builder,
+                          FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(music_data->speed < PT_SPEED_THRESHOLD);
+
+  /* Find the number of song positions in the SF3000 play order. */
+  bool success = true;
+  int pt_song_len;
+  const int song_len = sftrack_song_len(music_data);
+  if (song_len >= MAX_SF_PATTERNS) {
+    fprintf(stderr, "Unterminated pattern play order in input file\n");
+    success = false;
+  } else {
+    LOGF(LogLevel_Info, LogCategory_Decode,
+         "SF3000 pattern play order has length %d", song_len);
+
+    /* Setting the tempo in the first pattern to be played requires free
+       effects in its first division. */
+    unsigned char set_speed[NUM_PT_CHANNELS];
+    if ((flags & FLAGS_FOLD_TEMPO) != 0 &&
+        !plan_tempo_fold(flags, music_data, sf_samples, set_speed)) {
+      LOGF(LogLevel_Info, LogCategory_Transcode,
+           "Cannot set tempo in the first pattern to be played");
+
+      flags &= ~FLAGS_FOLD_TEMPO;
+    }
+
+    /* One extra song position may be required to set the tempo and optionally
+       another to allow late notes to decay. */
+    pt_song_len = song_len;
+    if ((flags & FLAGS_FOLD_TEMPO) == 0)
+      pt_song_len ++;
+    if ((flags & FLAGS_BLANK_PATTERN) != 0)
+      pt_song_len ++;
+
+    /* Compare the hardwired limits first to avoid checking the actual song
+       len unless unavoidable. Here, song_len may equal MAX_SF_PATTERNS. */
+    if ((int)MAX_SF_PATTERNS > MAX_PT_SONG_LEN) {
+      if (pt_song_len > MAX_PT_SONG_LEN) {
+        fprintf(stderr, "Too many patterns to be played in input file\n");
+        success = false;
+      }
+    }
+  }
+
+  /* When checking, plan the samples even if the song can't be written so
+     that more problems are reported. */
+  if (success || ((flags & FLAGS_CHECK) != 0 && song_len < MAX_SF_PATTERNS)) {
+    /* First pass is to determine which samples (and variants thereof) to
+       include in the ProTracker file. */
+    PTSampleArray pt_samples = {0, 0, NULL};
+    if (builder != NULL) {
+      /* Finish the list that was started while reading the patterns. */
+      if (!end_pt_sample_list(flags, sf_samples, &*builder, &pt_samples,
+                              trace_now()))
+        success = false;
+    } else if (!make_pt_sample_list(flags, music_data, sf_samples,
+                                    &pt_samples)) {
+      success = false;
+    }
+
+    if (success) {
+      if ((flags & FLAGS_TRUNCATE) != 0)
+        truncate_pt_samples(flags, music_data, song_len, sf_samples,
+                            &pt_samples);
+
+      const long int start = (flags & FLAGS_STATS) != 0 ? ftell(out) : -1;
+
+      if ((flags & FLAGS_XM) != 0) {
+        success = write_xm_track(flags, song_name, music_data, song_len,
+                                 sf_samples, &pt_samples, out);
+      } else {
+        success = write_track(flags, song_name, music_data, song_len,
+                              sf_samples, &pt_samples, out);
+        if (!success)
+          fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+      }
+
+      /* Store the sound samples right after the pattern data, unless only
+         checking the music (in which case the output is discarded). */
+      if (success && (flags & FLAGS_CHECK) == 0) {
+        success = integrate_samples(flags, &pt_samples, sf_samples, samples_dir, out);
+        if (success && (flags & FLAGS_STATS) != 0) {
+          report_stats(flags, &pt_samples, sf_samples);
+
+          const long int end = start < 0 || fflush(out) ? -1 : ftell(out);
+          report_module_size(flags, end < 0 ? -1 : end - start,
+                             music_data, song_len, sf_samples);
+        }
+      }
+    }
+    free(pt_samples.sample_info);
+  }
+
+  return success;
+}
+
+bool convert_sftrack(const unsigned int flags,
+                     const char * const song_name,
+                     const SFTrack * const music_data,
+                     const char * const samples_dir,
+                     const SampleArray * const sf_samples,
+                     FILE * const out)
+{
+  return convert_track(flags, song_name, music_data, samples_dir, sf_samples,
+                       NULL, out);
+}
+
 bool create_protracker(unsigned int flags,
                        const char * const song_name,
                        Reader * const in,
@@ -1514,61 +3328,323 @@ bool create_protracker(unsigned int flags,
   assert(in != NULL);
   assert(!reader_ferror(in));
 
-  SFTrack music_data = {
-    .speed = 0,
-    .voice_table = {0},
-    .last_pattern_no = 0,
-    .play_order = {0},
-    .patterns = NULL,
+  /* Patterns can't be planned as they arrive if the flags aren't known yet,
+     or if later patterns are needed to decide how to play a note. */
+  PatternStream stream = {
+    .flags = flags,
+    .sf_samples = sf_samples,
+    .started = false,
   };
-  bool success = read_track(flags, in, &music_data);
+  const bool can_stream = (flags & (FLAGS_AUTOTUNE | FLAGS_LOOP_REPEATS)) == 0;
+
+  SFTrack music_data;
+  bool success = read_track(flags, in, &music_data,
+                            can_stream ? &stream : NULL);
 
   if (success) {
-    /* Find the number of song positions in the SF3000 play order. */
-    int pt_song_len;
-    const int song_len = find_song_len(&music_data);
-    if (song_len >= MAX_SF_PATTERNS) {
-      fprintf(stderr, "Unterminated pattern play order in input file\n");
-      success = false;
-    } else {
-      if ((flags & FLAGS_VERBOSE) != 0)
-        printf("SF3000 pattern play order has length %d\n", song_len);
-
-      /* One extra song position will be required to set the tempo and optionally
-         another to allow late notes to decay. */
-      pt_song_len = song_len + 1;
-      if ((flags & FLAGS_BLANK_PATTERN) != 0)
-        pt_song_len ++;
-
-      /* Compare the hardwired limits first to avoid checking the actual song
-         len unless unavoidable. Here, song_len may equal MAX_SF_PATTERNS. */
-      if (MAX_SF_PATTERNS > MAX_PT_SONG_LEN) {
-        if (pt_song_len > MAX_PT_SONG_LEN) {
-          fprintf(stderr, "Too many patterns to be played in input file\n");
-          success = false;
-        }
+    if ((flags & FLAGS_AUTOTUNE) != 0)
+      success = autotune_flags(&flags, song_name, &music_data, samples_dir,
+                               sf_samples);
+
+    if (success)
+      success = convert_track(flags, song_name, &music_data, samples_dir,
+                              sf_samples,
+                              stream.started ? &stream.builder : NULL, out);
+
+    sftrack_destroy(&music_data);
+  }
+
+  if (stream.started)
+    discard_pt_sample_list(&stream.builder);
+
+  return success;
+}
+
+static bool write_packed_track(const unsigned int flags,
+                               const char * const song_name,
+                               const int num_songs,
+                               const PackedSong * const songs,
+                               const SampleArray * const sf_samples,
+                               const PTSampleArray * const pt_samples,
+                               FILE * const f)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert((flags & FLAGS_FOLD_TEMPO) == 0);
+  assert(song_name != NULL);
+  assert(num_songs > 0);
+  assert(songs != NULL);
+  assert(sf_samples != NULL);
+  assert(pt_samples != NULL);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  if (!write_song_name(song_name, f) ||
+      !write_sample_table(pt_samples, sf_samples, f)) {
+    return false;
+  }
+
+  /* Each song's positions follow those of the song before, and refer to
+     its own range of patterns. */
+  PTPlayOrder order = {.len = 0, .desc_len = 0};
+  for (int s = 0; s < num_songs; s++) {
+    assert(order.len == songs[s].first_pos);
+    add_song_positions(flags, &songs[s].music_data, songs[s].song_len,
+                       songs[s].first_pattern, &order);
+
+    /* Patterns can be played at more than one song position, so a song's
+       last pattern can't jump back to its start; an extra pattern does. */
+    const int loop_pattern = songs[s].loop_pattern;
+    if (LOG_ENABLED(LogLevel_Info, LogCategory_Transcode))
+      order.desc_len = describe_position(order.desc, sizeof(order.desc),
+                                         order.desc_len, loop_pattern,
+                                         " (loop)");
+
+    assert(loop_pattern <= UCHAR_MAX);
+    assert(order.len < MAX_PT_SONG_LEN);
+    order.positions[order.len++] = (unsigned char)loop_pattern;
+  }
+
+  if (!write_play_order(&order, f) || fputs("M.K.", f) == EOF) {
+    return false;
+  }
+
+  /* Every song starts with a pattern to set its tempo, followed by its own
+     patterns in their original order and then a pattern to loop it. */
+  for (int s = 0; s < num_songs; s++) {
+    const PackedSong * const song = &songs[s];
+
+    LOGF(LogLevel_Info, LogCategory_Transcode,
+         "Writing song %d from pattern %d", s + 1, song->first_pattern);
+
+    if (!write_tempo_pattern(song->music_data.speed, f) ||
+        !transcode_patterns(flags, &song->music_data, pt_samples, sf_samples,
+                            song->song_len > 0 ?
+                              song->music_data.play_order[song->song_len - 1] :
+                              -1,
+                            f) ||
+        !write_loop_pattern(song->first_pos, f)) {
+      return false;
+    }
+  }
+
+  return true; /* success */
+}
+
+static int count_packed_positions(const unsigned int flags,
+                                  const int song_len)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert((flags & FLAGS_FOLD_TEMPO) == 0);
+  assert(song_len >= 0);
+
+  /* A song's positions are preceded by one to set the tempo and followed by
+     one to loop it, and another may be appended to let late notes finish. */
+  return song_len + 2 + ((flags & FLAGS_BLANK_PATTERN) != 0 ? 1 : 0);
+}
+
+static void report_pack_size(const unsigned int flags,
+                             const int num_songs,
+                             const char * const names[],
+                             const PackedSong * const songs,
+                             const long int num_patterns,
+                             const PTSampleArray * const pt_samples,
+                             const SampleArray * const sf_samples)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(num_songs > 0);
+  assert(names != NULL);
+  assert(songs != NULL);
+  assert(pt_samples != NULL);
+  assert(sf_samples != NULL);
+
+  /* A game needs to know where to start playing each song. */
+  for (int s = 0; s < num_songs; s++) {
+    const int len = count_packed_positions(flags, songs[s].song_len);
+
+    fprintf(stderr, "Song %d ('%s'): song positions %d to %d\n",
+            s + 1, names[s], songs[s].first_pos, songs[s].first_pos + len - 1);
+  }
+
+  unsigned long packed_size = pt_music_size(num_patterns);
+  _Optional const PTSampleInfo * const ptsi_array = pt_samples->sample_info;
+  for (int pt_sample_no = 0;
+       pt_sample_no < pt_samples->count && ptsi_array;
+       pt_sample_no++)
+    packed_size += (unsigned long)ptsi_array[pt_sample_no].half_len * 2;
+
+  /* For comparison, find the total size of the equivalent separate modules
+     without logging the progress of doing so. */
+  unsigned long separate_size = 0;
+  bool possible = true;
+  const unsigned int saved_mask = log_set_mask(0);
+  for (int s = 0; s < num_songs && possible; s++) {
+    unsigned long sample_bytes;
+    possible = pt_samples_size(flags, &songs[s].music_data, songs[s].song_len,
+                               sf_samples, &sample_bytes);
+    if (possible)
+      separate_size += pt_module_size(flags, &songs[s].music_data,
+                                      sample_bytes);
+  }
+  log_set_mask(saved_mask);
+
+  if (!possible) {
+    fprintf(stderr, "Module: %lu bytes (separate modules: not possible)\n",
+            packed_size);
+  } else if (separate_size >= packed_size) {
+    fprintf(stderr, "Module: %lu bytes (separate modules: %lu bytes, "
+                    "%lu bytes saved)\n", packed_size, separate_size,
+            separate_size - packed_size);
+  } else {
+    fprintf(stderr, "Module: %lu bytes (separate modules: %lu bytes, "
+                    "%lu bytes extra)\n", packed_size, separate_size,
+            packed_size - separate_size);
+  }
+}
+
+bool pack_protracker(unsigned int flags,
+                     const char * const song_name,
+                     const int num_songs,
+                     Reader in[],
+                     const char * const names[],
+                     const char * const samples_dir,
+                     const SampleArray * const sf_samples,
+                     FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert((flags & (FLAGS_XM | FLAGS_CHECK | FLAGS_AUTOTUNE)) == 0);
+  assert(song_name != NULL);
+  assert(num_songs > 0);
+  assert(in != NULL);
+  assert(names != NULL);
+  assert(sf_samples != NULL);
+  assert(out != NULL);
+
+  /* A game may start playing any song after any other, so each must set
+     both its tempo and speed in an extra pattern. */
+  flags &= ~FLAGS_FOLD_TEMPO;
+
+  _Optional PackedSong * const songs = malloc(sizeof(*songs) *
+                                              (size_t)num_songs);
+  if (songs == NULL) {
+    fprintf(stderr, "Failed to allocate memory for %d songs\n", num_songs);
+    return false;
+  }
+
+  /* Read every song before planning the samples that they share. */
+  bool success = true;
+  int num_read = 0, pt_song_len = 0;
+  long int num_patterns = 0;
+  while (success && num_read < num_songs) {
+    const int s = num_read;
+    PackedSong * const song = &songs[s];
+
+    LOGF(LogLevel_Info, LogCategory_Decode, "Reading song %d ('%s')",
+         s + 1, names[s]);
+
+    success = read_track(flags, &in[s], &song->music_data, NULL);
+    if (success)
+      num_read++;
+
+    if (success) {
+      song->song_len = sftrack_song_len(&song->music_data);
+      if (song->song_len >= MAX_SF_PATTERNS) {
+        fprintf(stderr, "Unterminated pattern play order in input file\n");
+        success = false;
       }
     }
 
     if (success) {
-      /* First pass is to determine which samples (and variants thereof) to
-         include in the ProTracker file. */
-      PTSampleArray pt_samples = {0, 0, NULL};
-      success = make_pt_sample_list(flags, &music_data, sf_samples, &pt_samples);
-      if (success) {
-        success = write_track(flags, song_name, &music_data, song_len,
-                              pt_song_len, sf_samples, &pt_samples, out);
-        if (!success) {
-          fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
-        } else {
-          /* Store the sound samples right after the pattern data. */
-          success = integrate_samples(flags, &pt_samples, sf_samples, samples_dir, out);
-        }
-        free(pt_samples.sample_info);
+      song->first_pos = pt_song_len;
+      song->first_pattern = (int)num_patterns;
+      pt_song_len += count_packed_positions(flags, song->song_len);
+      num_patterns += count_pt_patterns(flags, &song->music_data);
+
+      /* The loop pattern is numbered after the song's own patterns. */
+      song->loop_pattern = (int)num_patterns++;
+    } else {
+      fprintf(stderr, "Cannot pack song '%s'\n", names[s]);
+    }
+  }
+
+  /* Check the limits before doing any expensive work. */
+  if (success && pt_song_len > MAX_PT_SONG_LEN) {
+    fprintf(stderr, "Too many song positions to pack (%d, limit is %d)\n",
+            pt_song_len, MAX_PT_SONG_LEN);
+    success = false;
+  }
+
+  if (success && num_patterns > MAX_PT_PATTERNS) {
+    fprintf(stderr, "Too many patterns to pack (%ld, limit is %d)\n",
+            num_patterns, MAX_PT_PATTERNS);
+    success = false;
+  }
+
+  /* One list of samples (and variants thereof) serves every song. */
+  PTSampleArray pt_samples = {0, 0, NULL};
+  if (success) {
+    SampleListBuilder builder;
+    const TraceTime start = trace_now();
+
+    begin_pt_sample_list(flags, &songs[0].music_data, &builder);
+
+    for (int s = 0; s < num_songs && builder.success; s++) {
+      const SFTrack * const music_data = &songs[s].music_data;
+      if (s > 0)
+        log_voice_table(music_data);
+
+      for (long int pattern_no = 0;
+           (pattern_no <= music_data->last_pattern_no) && builder.success;
+           pattern_no++)
+        add_pattern_samples(flags, music_data, sf_samples, pattern_no,
+                            &builder);
+    }
+
+    success = end_pt_sample_list(flags, sf_samples, &builder, &pt_samples,
+                                 start);
+  }
+
+  if (success && (flags & FLAGS_TRUNCATE) != 0) {
+    /* A variant of a sample can only be truncated to the longest time for
+       which any song plays it. */
+    unsigned long max_len[MAX_VARIANTS] = {0};
+    for (int s = 0; s < num_songs; s++) {
+      unsigned long song_max_len[MAX_VARIANTS];
+      find_max_play_lens(flags, &songs[s].music_data, songs[s].song_len,
+                         sf_samples, &pt_samples, song_max_len);
+
+      for (int pt_sample_no = 0; pt_sample_no < pt_samples.count;
+           pt_sample_no++) {
+        if (song_max_len[pt_sample_no] > max_len[pt_sample_no])
+          max_len[pt_sample_no] = song_max_len[pt_sample_no];
       }
     }
-    free(music_data.patterns);
+    truncate_to_play_lens(max_len, &pt_samples);
+  }
+
+  if (success) {
+    success = write_packed_track(flags, song_name, num_songs, &*songs,
+                                 sf_samples, &pt_samples, out);
+    if (!success)
+      fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+  }
+
+  if (success)
+    success = integrate_samples(flags, &pt_samples, sf_samples, samples_dir,
+                                out);
+
+  if (success) {
+    if ((flags & FLAGS_STATS) != 0)
+      report_stats(flags, &pt_samples, sf_samples);
+
+    report_pack_size(flags, num_songs, names, &*songs, num_patterns,
+                     &pt_samples, sf_samples);
   }
 
+  free(pt_samples.sample_info);
+
+  for (int s = 0; s < num_read; s++)
+    sftrack_destroy(&songs[s].music_data);
+
+  free(songs);
   return success;
 }
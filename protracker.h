@@ -16,6 +16,7 @@
 
 /* Local headers */
 #include "samp.h"
+#include "sftrack.h"
 
 /* Flags controlling generation of ProTracker music */
 enum {
@@ -24,7 +25,25 @@ enum {
   FLAGS_VERBOSE          = 1<<2, /* emit information about processing */
   FLAGS_ALLOW_SFX        = 1<<3, /* allow sound effects during music */
   FLAGS_EXTRA_OCTAVES    = 1<<4, /* use non-standard octaves 0 and 4 */
-  FLAGS_ALL              = (1<<5)-1
+  FLAGS_RESAMPLE         = 1<<5, /* use a band-limited resampler */
+  FLAGS_NORMALISE        = 1<<6, /* scale samples to use the full range */
+  FLAGS_STATS            = 1<<7, /* report the size of sample data */
+  FLAGS_TRUNCATE         = 1<<8, /* omit sample data that is never played */
+  FLAGS_PLAN_OCTAVES     = 1<<9, /* choose pre-tuning to minimise size */
+  FLAGS_XM               = 1<<10, /* write an XM file instead of ProTracker */
+  FLAGS_LOOP_REPEATS     = 1<<11, /* loop samples and cut notes instead of
+                                     repeating sample data */
+  FLAGS_WAV              = 1<<12, /* render a WAV file instead of a module */
+  FLAGS_RENDER           = 1<<13, /* render the module to a WAV file */
+  FLAGS_AUTOTUNE         = 1<<14, /* choose conversion flags by comparing
+                                     renders of the module and track */
+  FLAGS_INFO             = 1<<15, /* report track metadata as JSON */
+  FLAGS_SCAN             = 1<<16, /* scan patterns for more accurate info */
+  FLAGS_CHECK            = 1<<17, /* report problems and discard output */
+  FLAGS_PRUNE_PATTERNS   = 1<<18, /* omit patterns that are never played */
+  FLAGS_FOLD_TEMPO       = 1<<19, /* set the tempo in the first pattern */
+  FLAGS_COMPRESS         = 1<<20, /* compress the output file */
+  FLAGS_ALL              = (1<<21)-1
 };
 
 extern bool create_protracker(unsigned int       flags,
@@ -34,6 +53,27 @@ extern bool create_protracker(unsigned int       flags,
                               const SampleArray *sf_samples,
                               FILE              *out);
 
+extern bool convert_sftrack(unsigned int       flags,
+                            const char        *song_name,
+                            const SFTrack     *music_data,
+                            const char        *samples_dir,
+                            const SampleArray *sf_samples,
+                            FILE              *out);
+
+extern bool pack_protracker(unsigned int       flags,
+                            const char        *song_name,
+                            int                num_songs,
+                            Reader             in[],
+                            const char        *const names[],
+                            const char        *samples_dir,
+                            const SampleArray *sf_samples,
+                            FILE              *out);
+
+extern bool estimate_protracker_size(unsigned int       flags,
+                                     const SFTrack     *music_data,
+                                     const SampleArray *sf_samples,
+                                     unsigned long     *size);
+
 extern bool check_tuning(signed int sf_tuning);
 
 #endif /* PROTRACKER_H */
@@ -0,0 +1,542 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Playback of ProTracker modules
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "protracker.h"
+#include "wav.h"
+#include "mix.h"
+#include "ptplay.h"
+
+enum {
+  MIX_RATE             = 44100, /* Hz */
+  MIX_HEADROOM         = 2, /* Four channels at full volume may clip */
+
+/* The following values are dictated by the ProTracker file format */
+  MAX_PT_SAMPLES       = 31,
+  MAX_PT_SONG_LEN      = 128,
+  NUM_PT_ROWS          = 64,
+  NUM_PT_CHANNELS      = 4,
+  BYTES_PER_PT_COMMAND = 4,
+  BYTES_PER_PT_PATTERN = NUM_PT_ROWS * NUM_PT_CHANNELS * BYTES_PER_PT_COMMAND,
+  PT_NAME_LEN          = 20,
+  PT_SAMPLE_NAME_LEN   = 22,
+  PT_MAX_VOLUME        = 64,
+  PT_DEFAULT_SPEED     = 6,
+  PT_DEFAULT_TEMPO     = 125,
+  PT_SPEED_THRESHOLD   = 32,
+  PT_TICKS_PER_BEAT    = 24, /* ProTracker tempo is in beats per minute,
+                                where a beat is 24 ticks */
+  PT_FINETUNE_RANGE    = 16,
+  PT_CLOCK_FREQ        = 3546895, /* Hz (PAL Amiga) divided by period to get
+                                     the playback rate */
+  PT_COM_TONE_PORTAMENTO = 0x3,
+  PT_COM_SET_VOLUME    = 0xc,
+  PT_COM_PATTERN_BREAK = 0xd,
+  PT_COM_EXTENDED      = 0xe,
+  PT_COM_SET_SPEED     = 0xf,
+  PT_EXT_NOTE_CUT      = 0xc,
+  SECONDS_PER_MINUTE   = 60
+};
+
+typedef struct {
+  unsigned long len; /* in bytes */
+  unsigned long repeat_offset;
+  unsigned long repeat_len; /* 0 if the sample doesn't loop */
+  signed int    finetune;
+  int           volume;
+  _Optional const int16_t *data; /* Widened from 8 bits for mixing */
+} PTSample;
+
+typedef struct {
+  unsigned char song_len;
+  unsigned char order[MAX_PT_SONG_LEN];
+  int           num_patterns;
+  _Optional uint8_t *patterns;
+  PTSample      samples[MAX_PT_SAMPLES];
+  _Optional int16_t *sample_data;
+} PTModule;
+
+typedef struct {
+  _Optional const PTSample *sample; /* Last sample selected (if any) */
+  _Optional const PTSample *playing; /* NULL if nothing is playing */
+  MixCursor     cursor; /* Position in the sample */
+  unsigned long end; /* End of the sample or its loop */
+  int           period;
+  int           target_period;
+  int           portamento_speed;
+  signed int    finetune;
+  int           volume;
+  int           cut_tick; /* -1 if none */
+} PTChannel;
+
+typedef struct {
+  PTChannel    channels[NUM_PT_CHANNELS];
+  int          speed;
+  int          tempo;
+  unsigned int tick_frac; /* Remainder of output frames per tick */
+} PTPlayer;
+
+static unsigned int get_halfword(const uint8_t * const bytes)
+{
+  assert(bytes != NULL);
+
+  /* All half-word values in a ProTracker file are big-endian */
+  return ((unsigned int)bytes[0] << 8) | bytes[1];
+}
+
+static bool read_module(FILE * const in, PTModule * const module)
+{
+  uint8_t header[PT_NAME_LEN];
+  uint8_t sample_info[MAX_PT_SAMPLES][PT_SAMPLE_NAME_LEN + 8];
+  uint8_t order_info[2 + MAX_PT_SONG_LEN];
+  char id[4];
+
+  assert(in != NULL);
+  assert(module != NULL);
+
+  *module = (PTModule){.song_len = 0, .num_patterns = 0, .patterns = NULL,
+                       .sample_data = NULL};
+
+  if (fread(header, sizeof(header), 1, in) != 1 ||
+      fread(sample_info, sizeof(sample_info), 1, in) != 1 ||
+      fread(order_info, sizeof(order_info), 1, in) != 1 ||
+      fread(id, sizeof(id), 1, in) != 1) {
+    fprintf(stderr, "Failed to read module header\n");
+    return false;
+  }
+
+  if (memcmp(id, "M.K.", sizeof(id)) != 0) {
+    fprintf(stderr, "Module is not in ProTracker format\n");
+    return false;
+  }
+
+  module->song_len = order_info[0];
+  if (module->song_len > MAX_PT_SONG_LEN) {
+    fprintf(stderr, "Bad song length %d in module\n", module->song_len);
+    return false;
+  }
+
+  /* The number of patterns isn't recorded, so it is inferred from the
+     highest pattern number in the whole order table. */
+  memcpy(module->order, order_info + 2, sizeof(module->order));
+  for (int pos = 0; pos < MAX_PT_SONG_LEN; pos++) {
+    if (module->order[pos] >= module->num_patterns)
+      module->num_patterns = module->order[pos] + 1;
+  }
+
+  unsigned long total_len = 0;
+  for (int s = 0; s < MAX_PT_SAMPLES; s++) {
+    const uint8_t * const info = sample_info[s] + PT_SAMPLE_NAME_LEN;
+    PTSample * const sample = &module->samples[s];
+    const unsigned long repeat_len = get_halfword(info + 6) * 2ul;
+
+    /* A repeat length of 2 bytes (or 0) means the sample doesn't loop. */
+    *sample = (PTSample){
+      .len = get_halfword(info) * 2ul,
+      .finetune = (info[2] & 0x8 ? (info[2] & 0xf) - PT_FINETUNE_RANGE :
+                                   info[2] & 0xf),
+      .volume = info[3] > PT_MAX_VOLUME ? PT_MAX_VOLUME : info[3],
+      .repeat_offset = get_halfword(info + 4) * 2ul,
+      .repeat_len = repeat_len > 2 ? repeat_len : 0,
+      .data = NULL,
+    };
+    total_len += sample->len;
+  }
+
+  const size_t patterns_size = (size_t)module->num_patterns *
+                               BYTES_PER_PT_PATTERN;
+  module->patterns = malloc(patterns_size);
+  module->sample_data = malloc(sizeof(int16_t) * (total_len ? total_len : 1));
+  if (module->patterns == NULL || module->sample_data == NULL) {
+    fprintf(stderr, "Failed to allocate memory for module\n");
+    return false;
+  }
+
+  if (fread(&*module->patterns, patterns_size, 1, in) != 1) {
+    fprintf(stderr, "Failed to read pattern data from module\n");
+    return false;
+  }
+
+  /* Any sample data missing from the end of the module is played as
+     silence. */
+  int16_t * const frames = &*module->sample_data;
+  uint8_t * const bytes = (uint8_t *)frames;
+  const size_t n = fread(bytes, 1, total_len, in);
+  if (ferror(in)) {
+    fprintf(stderr, "Failed to read sample data from module: %s\n",
+            strerror(errno));
+    return false;
+  }
+
+  /* Widen the sample data in place, starting from the end so that each
+     frame is overwritten only after it has been read, and scale it to the
+     same range as SF3000 sample data. */
+  for (size_t i = total_len; i > n; i--)
+    frames[i - 1] = 0;
+
+  for (size_t i = n; i > 0; i--) {
+    const int value = bytes[i - 1] > INT8_MAX ? bytes[i - 1] - 256 :
+                                                bytes[i - 1];
+    frames[i - 1] = (int16_t)(value * 256);
+  }
+
+  unsigned long offset = 0;
+  for (int s = 0; s < MAX_PT_SAMPLES; s++) {
+    PTSample * const sample = &module->samples[s];
+    sample->data = &module->sample_data[offset];
+    offset += sample->len;
+
+    if (sample->repeat_len > 0 &&
+        sample->repeat_offset + sample->repeat_len > sample->len) {
+      LOGF(LogLevel_Debug, LogCategory_Render,
+           "Ignoring bad loop of sample %d", s + 1);
+      sample->repeat_len = 0;
+    }
+  }
+
+  return true;
+}
+
+static void destroy_module(PTModule * const module)
+{
+  assert(module != NULL);
+  free(module->patterns);
+  free(module->sample_data);
+}
+
+static unsigned long period_to_step(const int period,
+                                    const signed int finetune)
+{
+  /* Frequency ratios of finetune values -8 to 7 (16.16 fixed point) */
+  static const unsigned long finetune_ratio[PT_FINETUNE_RANGE] = {
+    61858, 62306, 62757, 63212, 63670, 64132, 64596, 65065, 65536, 66011,
+    66489, 66971, 67456, 67945, 68438, 68933
+  };
+
+  assert(finetune >= -PT_FINETUNE_RANGE / 2);
+  assert(finetune < PT_FINETUNE_RANGE / 2);
+
+  if (period <= 0)
+    return 0;
+
+  /* Each finetune step is 1/8th of a semitone. */
+  const unsigned long long step =
+    (unsigned long long)PT_CLOCK_FREQ *
+    finetune_ratio[finetune + PT_FINETUNE_RANGE / 2] /
+    ((unsigned long long)period * MIX_RATE);
+
+  return step > ULONG_MAX ? ULONG_MAX : (unsigned long)step;
+}
+
+static void play_row(PTPlayer * const player, const PTModule * const module,
+                     const uint8_t * const row, int * const break_row,
+                     bool * const stop)
+{
+  assert(player != NULL);
+  assert(module != NULL);
+  assert(row != NULL);
+  assert(break_row != NULL);
+  assert(stop != NULL);
+
+  for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+    const uint8_t * const bytes = row + c * BYTES_PER_PT_COMMAND;
+    PTChannel * const chan = &player->channels[c];
+
+    const int sample_no = (bytes[0] & 0xf0) | (bytes[2] >> 4);
+    const int period = ((bytes[0] & 0xf) << 8) | bytes[1];
+    const int effect = bytes[2] & 0xf;
+    const int param = bytes[3];
+
+    chan->cut_tick = -1;
+
+    /* Selecting a sample sets the default volume, even without a note. */
+    if (sample_no > 0 && sample_no <= MAX_PT_SAMPLES) {
+      const PTSample * const sample = &module->samples[sample_no - 1];
+      chan->sample = sample;
+      chan->volume = sample->volume;
+      chan->finetune = sample->finetune;
+    }
+
+    if (period > 0) {
+      if (effect == PT_COM_TONE_PORTAMENTO) {
+        /* Slide towards the note instead of playing it. */
+        chan->target_period = period;
+      } else if (chan->sample) {
+        const PTSample * const sample = &*chan->sample;
+        chan->playing = sample;
+        chan->cursor.pos = 0;
+        chan->cursor.frac = 0;
+        chan->end = sample->repeat_len > 0 ?
+                    sample->repeat_offset + sample->repeat_len : sample->len;
+        chan->period = period;
+        chan->target_period = period;
+      }
+    }
+
+    switch (effect) {
+      case PT_COM_TONE_PORTAMENTO:
+        if (param != 0)
+          chan->portamento_speed = param;
+        break;
+
+      case PT_COM_SET_VOLUME:
+        chan->volume = param > PT_MAX_VOLUME ? PT_MAX_VOLUME : param;
+        break;
+
+      case PT_COM_PATTERN_BREAK:
+        /* The row to start at is encoded as two decimal digits. */
+        *break_row = (param >> 4) * 10 + (param & 0xf);
+        if (*break_row >= NUM_PT_ROWS)
+          *break_row = 0;
+        break;
+
+      case PT_COM_EXTENDED:
+        if (param >> 4 == PT_EXT_NOTE_CUT)
+          chan->cut_tick = param & 0xf;
+        else
+          LOGF(LogLevel_Debug, LogCategory_Render,
+               "Ignoring extended command %X%02X", effect, param);
+        break;
+
+      case PT_COM_SET_SPEED:
+        if (param == 0)
+          *stop = true;
+        else if (param < PT_SPEED_THRESHOLD)
+          player->speed = param;
+        else
+          player->tempo = param;
+        break;
+
+      default:
+        if (effect != 0 || param != 0)
+          LOGF(LogLevel_Debug, LogCategory_Render,
+               "Ignoring command %X%02X", effect, param);
+        break;
+    }
+
+    chan->cursor.step = period_to_step(chan->period, chan->finetune);
+  }
+}
+
+static void update_channels(PTPlayer * const player, const int tick)
+{
+  assert(player != NULL);
+
+  for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+    PTChannel * const chan = &player->channels[c];
+
+    if (tick == chan->cut_tick)
+      chan->volume = 0;
+
+    /* Tone portamento takes effect on every tick except the first. */
+    if (tick == 0 || chan->period == chan->target_period)
+      continue;
+
+    if (chan->period < chan->target_period) {
+      chan->period += chan->portamento_speed;
+      if (chan->period > chan->target_period)
+        chan->period = chan->target_period;
+    } else {
+      chan->period -= chan->portamento_speed;
+      if (chan->period < chan->target_period)
+        chan->period = chan->target_period;
+    }
+    chan->cursor.step = period_to_step(chan->period, chan->finetune);
+  }
+}
+
+static void mix_channel(PTChannel * const chan, int32_t * const mix,
+                        const int count)
+{
+  assert(chan != NULL);
+  assert(mix != NULL);
+  assert(count >= 0);
+
+  int done = 0;
+  while (chan->playing && done < count) {
+    const PTSample * const sample = &*chan->playing;
+
+    if (chan->cursor.pos >= chan->end) {
+      /* Loop or stop playing. */
+      if (sample->repeat_len == 0) {
+        chan->playing = NULL;
+        break;
+      }
+      chan->cursor.pos = sample->repeat_offset +
+                         (chan->cursor.pos - chan->end) % sample->repeat_len;
+      continue;
+    }
+
+    done += mix_frames(&*sample->data, chan->end, &chan->cursor,
+                       chan->volume, count - done, mix + done);
+  }
+}
+
+static bool render_frames(PTPlayer * const player, const int count,
+                          FILE * const out)
+{
+  enum { MAX_CHUNK = 1024 };
+  int32_t mix[MAX_CHUNK];
+  int16_t frames[MAX_CHUNK];
+  uint8_t bytes[MAX_CHUNK * 2];
+
+  assert(player != NULL);
+  assert(out != NULL);
+
+  for (int done = 0; done < count; ) {
+    const int chunk = count - done > MAX_CHUNK ? MAX_CHUNK : count - done;
+
+    memset(mix, 0, sizeof(mix[0]) * chunk);
+    for (int c = 0; c < NUM_PT_CHANNELS; c++)
+      mix_channel(&player->channels[c], mix, chunk);
+
+    /* Scale samples at volume 64 to 16 bits, with the same headroom as for
+       rendering SF3000 music. */
+    for (int i = 0; i < chunk; i++) {
+      int32_t value = mix[i] / (PT_MAX_VOLUME * MIX_HEADROOM);
+      value = value > INT16_MAX ? INT16_MAX : value;
+      value = value < INT16_MIN ? INT16_MIN : value;
+      frames[i] = (int16_t)value;
+    }
+
+    wav_encode_frames(frames, chunk, bytes);
+    if (fwrite(bytes, chunk * 2, 1, out) != 1)
+      return false;
+
+    done += chunk;
+  }
+  return true;
+}
+
+static bool play_module(const PTModule * const module,
+                        _Optional FILE * const out,
+                        unsigned long * const num_frames)
+{
+  assert(module != NULL);
+  assert(num_frames != NULL);
+
+  /* Plays the module once, without writing any output if 'out' is NULL
+     (to find the duration in advance). */
+  PTPlayer player = {
+    .speed = PT_DEFAULT_SPEED,
+    .tempo = PT_DEFAULT_TEMPO,
+    .tick_frac = 0,
+  };
+  for (int c = 0; c < NUM_PT_CHANNELS; c++) {
+    player.channels[c] = (PTChannel){.sample = NULL, .playing = NULL,
+                                     .cut_tick = -1};
+  }
+
+  *num_frames = 0;
+  bool stop = false;
+  int start_row = 0;
+
+  for (int pos = 0; pos < module->song_len && !stop; pos++) {
+    const int pattern_no = module->order[pos];
+    assert(pattern_no < module->num_patterns);
+    const uint8_t * const pattern = &module->patterns[(size_t)pattern_no *
+                                                      BYTES_PER_PT_PATTERN];
+
+    if (out)
+      LOGF(LogLevel_Debug, LogCategory_Render,
+           "Rendering pattern %d at song position %d", pattern_no, pos);
+
+    int break_row = -1;
+    for (int row = start_row; row < NUM_PT_ROWS && break_row < 0 && !stop;
+         row++) {
+      play_row(&player, module,
+               pattern + row * NUM_PT_CHANNELS * BYTES_PER_PT_COMMAND,
+               &break_row, &stop);
+      if (stop)
+        break;
+
+      for (int tick = 0; tick < player.speed; tick++) {
+        update_channels(&player, tick);
+
+        /* A tick lasts 1/24th of a beat. Carry the remainder over to the
+           next tick. */
+        const unsigned int divisor = (unsigned int)player.tempo *
+                                     PT_TICKS_PER_BEAT;
+        player.tick_frac += MIX_RATE * SECONDS_PER_MINUTE;
+        const int count = (int)(player.tick_frac / divisor);
+        player.tick_frac %= divisor;
+
+        *num_frames += count;
+        if (out && !render_frames(&player, count, &*out)) {
+          fprintf(stderr, "Failed writing to output file: %s\n",
+                  strerror(errno));
+          return false;
+        }
+      }
+    }
+    start_row = break_row < 0 ? 0 : break_row;
+  }
+
+  return true;
+}
+
+bool render_protracker(const unsigned int flags, FILE * const in,
+                       FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(in != NULL);
+  assert(out != NULL);
+
+  PTModule module;
+  bool success = read_module(in, &module);
+  if (success) {
+    /* The duration must be known before writing the WAV header, so play
+       the module silently first. */
+    unsigned long num_frames;
+    success = play_module(&module, NULL, &num_frames);
+
+    if (success) {
+      if (!wav_write_header(out, MIX_RATE, num_frames)) {
+        fprintf(stderr, "Failed writing to output file: %s\n",
+                strerror(errno));
+        success = false;
+      } else {
+        unsigned long check;
+        success = play_module(&module, out, &check);
+        assert(!success || check == num_frames);
+      }
+    }
+
+    if (success && (flags & FLAGS_STATS) != 0) {
+      const unsigned long centisecs = num_frames / (MIX_RATE / 100);
+      fprintf(stderr, "Rendered %lu frames at %d Hz (%lu.%02lu seconds)\n",
+              num_frames, MIX_RATE, centisecs / 100, centisecs % 100);
+    }
+  }
+  destroy_module(&module);
+
+  return success;
+}
@@ -0,0 +1,16 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Playback of ProTracker modules
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef PTPLAY_H
+#define PTPLAY_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+
+extern bool render_protracker(unsigned int flags, FILE *in, FILE *out);
+
+#endif /* PTPLAY_H */
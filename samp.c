@@ -32,7 +32,9 @@
 
 /* Local header files */
 #include "misc.h"
+#include "log.h"
 #include "samp.h"
+#include "sampdata.h"
 #include "protracker.h"
 
 enum {
@@ -47,13 +49,21 @@ static void report_error(const char   *error,
           error, line_no + 1, index_file);
 }
 
-static long int get_sample_len(const bool verbose,
+static long int measure_sample(const bool analyse,
+                               const int silence_level,
                                const char * const samples_dir,
-                               const char * const file_name)
+                               const char * const file_name,
+                               unsigned int * const peak,
+                               unsigned long * const sound_len)
 {
   long int len = -1;
   assert(samples_dir != NULL);
   assert(file_name != NULL);
+  assert(peak != NULL);
+  assert(sound_len != NULL);
+
+  *peak = 0;
+  *sound_len = 0;
 
   /* Construct full path name of sample data file */
   StringBuffer sample_path;
@@ -65,9 +75,8 @@ static long int get_sample_len(const bool verbose,
     fprintf(stderr, "Failed to allocate memory for sample data file path\n");
   } else {
     /* Get the length of the sample data file */
-    if (verbose)
-      printf("Opening sample data file '%s'\n",
-             stringbuffer_get_pointer(&sample_path));
+    LOGF(LogLevel_Debug, LogCategory_Index, "Opening sample data file '%s'",
+         stringbuffer_get_pointer(&sample_path));
 
     _Optional FILE * const sample_handle = fopen(
          stringbuffer_get_pointer(&sample_path), "rb");
@@ -89,8 +98,37 @@ static long int get_sample_len(const bool verbose,
          format might only be included in a form where it has been pre-tuned
          upward by one or more octaves (thus shortening it). */
 
-      if (verbose)
-        puts("Closing sample data file");
+      /* Find the peak amplitude of the sample data, if required. Doing this
+         once per index rather than once per song keeps the cost down when
+         converting a batch of files. */
+      if (len >= 0 && analyse) {
+        if (fseek(&*sample_handle, 0, SEEK_SET) ||
+            !sample_data_find_peak(&*sample_handle, peak)) {
+          fprintf(stderr, "Failed to analyse sample data file\n");
+          len = -1;
+        }
+      }
+
+      /* Find the length of the sample data without any trailing silence,
+         if required (a negative level means don't trim). */
+      if (len >= 0) {
+        *sound_len = (unsigned long)len;
+
+        if (silence_level >= 0) {
+          unsigned long sound_count;
+          if (!sample_data_find_end(&*sample_handle,
+                                    (unsigned long)len / 2,
+                                    (unsigned int)silence_level,
+                                    &sound_count)) {
+            fprintf(stderr, "Failed to analyse sample data file\n");
+            len = -1;
+          } else {
+            *sound_len = sound_count * 2;
+          }
+        }
+      }
+
+      LOGF(LogLevel_Debug, LogCategory_Index, "Closing sample data file");
 
       fclose(&*sample_handle);
     }
@@ -125,9 +163,11 @@ static SampleInfo_Type char_to_type(int c)
   return type;
 }
 
-static bool add_sf_sample(const bool verbose, SampleArray * const sf_samples,
+static bool add_sf_sample(SampleArray * const sf_samples,
                           const int sample_id, const char * const file_name,
                           const int repeat_offset, long int len,
+                          const unsigned long sound_len,
+                          const unsigned int peak,
                           const SampleInfo_Type type,
                           const int tuning)
 {
@@ -140,6 +180,7 @@ static bool add_sf_sample(const bool verbose, SampleArray * const sf_samples,
   assert(file_name != NULL);
   assert(repeat_offset >= 0);
   assert(len >= 0);
+  assert(sound_len <= (unsigned long)len);
   assert((repeat_offset / 2) < (len / 4));
   assert((type == SampleInfo_Type_Music) || (type == SampleInfo_Type_Effect));
 
@@ -183,24 +224,35 @@ static bool add_sf_sample(const bool verbose, SampleArray * const sf_samples,
     .repeat_offset = repeat_offset,
     .tuning = tuning,
     .len = len,
+    .sound_len = sound_len,
+    .peak = peak,
     .type = type,
   };
 
   strncpy(write_ptr->file_name, file_name, sizeof(write_ptr->file_name) - 1);
 
-  if (verbose) {
-    printf("Sample %d ('%s') has length %lu, tuning %d and repeats from %d\n",
-           sample_id,
-           write_ptr->file_name,
-           write_ptr->len,
-           write_ptr->tuning,
-           write_ptr->repeat_offset);
-  }
+  LOGF(LogLevel_Debug, LogCategory_Index,
+       "Sample %d ('%s') has length %lu, tuning %d and repeats from %d",
+       sample_id,
+       write_ptr->file_name,
+       write_ptr->len,
+       write_ptr->tuning,
+       write_ptr->repeat_offset);
+
+  if (write_ptr->peak != 0)
+    LOGF(LogLevel_Debug, LogCategory_Index,
+         "Sample %d has peak amplitude %u", sample_id, write_ptr->peak);
+
+  if (write_ptr->sound_len != write_ptr->len)
+    LOGF(LogLevel_Debug, LogCategory_Index,
+         "Sample %d has %lu bytes of trailing silence", sample_id,
+         write_ptr->len - write_ptr->sound_len);
 
   return true;
 }
 
-static bool parse_index(const bool verbose, FILE * const f,
+static bool parse_index(const bool analyse,
+                        const int silence_level, FILE * const f,
                         const char * const samples_dir,
                         const char * const index_file,
                         SampleArray * const sf_samples)
@@ -267,7 +319,11 @@ static bool parse_index(const bool verbose, FILE * const f,
       }
     }
 
-    const long int len = get_sample_len(verbose, samples_dir, file_name);
+    unsigned int peak;
+    unsigned long sound_len;
+    const long int len = measure_sample(analyse, silence_level,
+                                        samples_dir, file_name, &peak,
+                                        &sound_len);
     if (len < 0) {
       success = false;
     } else {
@@ -293,8 +349,9 @@ static bool parse_index(const bool verbose, FILE * const f,
     }
 
     if (success) {
-      success = add_sf_sample(verbose, sf_samples, sample_id, file_name,
-                              repeat_offset, len, type, tuning);
+      success = add_sf_sample(sf_samples, sample_id, file_name,
+                              repeat_offset, len, sound_len, peak, type,
+                              tuning);
     }
   }
 
@@ -315,7 +372,50 @@ static bool parse_index(const bool verbose, FILE * const f,
   return success;
 }
 
-bool load_sample_index(const bool verbose, const char * const index_file,
+bool remeasure_sample(const bool analyse,
+                      const int silence_level,
+                      const char * const samples_dir,
+                      SampleArray * const sf_samples,
+                      const int sample_id)
+{
+  assert(samples_dir != NULL);
+  assert(sf_samples != NULL);
+  assert(sample_id >= 0);
+  assert(sample_id < sf_samples->count);
+  assert(sf_samples->sample_info != NULL);
+
+  /* The sample data file may have changed since the index was loaded, but
+     the index entry itself hasn't. */
+  SampleInfo * const info = &sf_samples->sample_info[sample_id];
+  assert(info->type != SampleInfo_Type_Unused);
+
+  unsigned int peak;
+  unsigned long sound_len;
+  const long int len = measure_sample(analyse, silence_level, samples_dir,
+                                      info->file_name, &peak, &sound_len);
+  if (len < 0)
+    return false;
+
+  if (info->repeat_offset / 2l >= len / 4) {
+    fprintf(stderr, "Bad repeat offset for sample %d ('%s')\n", sample_id,
+            info->file_name);
+    return false;
+  }
+
+  info->len = (unsigned long)len;
+  info->sound_len = sound_len;
+  info->peak = peak;
+
+  LOGF(LogLevel_Debug, LogCategory_Index,
+       "Sample %d ('%s') now has length %lu", sample_id, info->file_name,
+       info->len);
+
+  return true;
+}
+
+bool load_sample_index(const bool analyse,
+                       const int silence_level,
+                       const char * const index_file,
                        const char * const samples_dir,
                        SampleArray * const sf_samples)
 {
@@ -325,8 +425,8 @@ bool load_sample_index(const bool verbose, const char * const index_file,
   assert(sf_samples != NULL);
 
   /* Open samples index file */
-  if (verbose)
-    printf("Opening sound samples index file '%s'\n", index_file);
+  LOGF(LogLevel_Info, LogCategory_Index,
+       "Opening sound samples index file '%s'", index_file);
 
   _Optional FILE * const f = fopen(index_file, "r"); /* open text for reading */
   if (f == NULL) {
@@ -334,10 +434,10 @@ bool load_sample_index(const bool verbose, const char * const index_file,
             "Failed to open samples index file: %s\n",
             strerror(errno));
   } else {
-    success = parse_index(verbose, &*f, samples_dir, index_file, sf_samples);
+    success = parse_index(analyse, silence_level, &*f, samples_dir,
+                          index_file, sf_samples);
 
-    if (verbose)
-      puts("Closing sound samples index file");
+    LOGF(LogLevel_Info, LogCategory_Index, "Closing sound samples index file");
 
     fclose(&*f);
   }
@@ -25,6 +25,10 @@ typedef struct {
   unsigned int    repeat_offset;
   signed   int    tuning;
   unsigned long   len;
+  unsigned long   sound_len; /* Length excluding any trailing silence
+                                (same as len if not analysed) */
+  unsigned int    peak; /* Largest magnitude of any sample value
+                           (0 if the sample data was not analysed) */
   SampleInfo_Type type;
 } SampleInfo;
 
@@ -34,9 +38,16 @@ typedef struct {
   _Optional SampleInfo *sample_info;
 } SampleArray;
 
-extern bool load_sample_index(bool          verbose,
+extern bool load_sample_index(bool          analyse,
+                              int           silence_level,
                               const char   *index_file,
                               const char   *samples_dir,
                               SampleArray  *sf_samples);
 
+extern bool remeasure_sample(bool          analyse,
+                             int           silence_level,
+                             const char   *samples_dir,
+                             SampleArray  *sf_samples,
+                             int           sample_id);
+
 #endif /* SAMP_H */
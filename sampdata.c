@@ -0,0 +1,767 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Sound sample data processing
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/* Local header files */
+#include "misc.h"
+#include "sampdata.h"
+
+enum {
+  BYTES_PER_SF_SAMPLE = 2,
+  READ_BUFFER_SIZE    = 4096, /* No. of sample frames */
+  HALFBAND_TAPS       = 8, /* No. of non-zero coefficients either side of the
+                              centre of the half-band filter */
+  HALFBAND_REACH      = HALFBAND_TAPS * 2 - 1, /* Furthest input frame used
+                                                  (relative to the centre) */
+  HALFBAND_SHIFT      = 14, /* Coefficients are fixed point with 14 bits of
+                               fractional precision */
+  DEFAULT_STREAM_LIMIT = 64 * 1024, /* Bytes of sample data to buffer */
+  MAX_SCALE_VOLUME    = 64 /* Largest volume for which scaled sample values
+                              can be computed in 32 bits (ProTracker's
+                              maximum) */
+};
+
+static size_t stream_limit = DEFAULT_STREAM_LIMIT;
+
+/* Odd-numbered coefficients of a 31 tap half-band low-pass filter (Kaiser
+   window, beta 7), scaled for a gain of 2 so that they can be used directly
+   as the interpolating phase of a 1:2 polyphase interpolator. The centre tap
+   is 0.5 and all other even-numbered coefficients are zero. */
+static const int_least32_t halfband[HALFBAND_TAPS] = {
+  10280, -3050, 1441, -707, 321, -124, 35, -4
+};
+
+static int16_t clamp_frame(const int_least32_t value)
+{
+  if (value > INT16_MAX)
+    return INT16_MAX;
+
+  if (value < INT16_MIN)
+    return INT16_MIN;
+
+  return (int16_t)value;
+}
+
+static void decode_frames(const uint8_t * const bytes,
+                          const unsigned long count,
+                          int16_t * const frames)
+{
+  /* Convert from 16 bit little-endian to the host's representation */
+  for (unsigned long i = 0; i < count; i++) {
+    const unsigned int u = bytes[i * 2] | ((unsigned int)bytes[i * 2 + 1] << 8);
+    frames[i] = (int16_t)(u > INT16_MAX ? (long)u - 65536 : (long)u);
+  }
+}
+
+bool sample_data_load(SampleData * const data, FILE * const f)
+{
+  assert(data != NULL);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  *data = (SampleData){
+    .count = 0,
+    .frames = NULL,
+  };
+
+  /* Get the length of the sample data file */
+  long int len = -1;
+  if (!fseek(f, 0, SEEK_END))
+    len = ftell(f);
+
+  if (len < 0 || fseek(f, 0, SEEK_SET)) {
+    fprintf(stderr,
+            "Couldn't determine length of sample data file: %s\n",
+            strerror(errno));
+    return false;
+  }
+
+  const unsigned long count = (unsigned long)len / BYTES_PER_SF_SAMPLE;
+  const size_t size = (count ? count : 1) * sizeof(int16_t);
+  _Optional int16_t * const frames = malloc(size);
+  if (frames == NULL) {
+    fprintf(stderr, "Failed to allocate %zu bytes for sample data\n", size);
+    return false;
+  }
+
+  for (unsigned long n = 0; n < count; ) {
+    uint8_t bytes[READ_BUFFER_SIZE * BYTES_PER_SF_SAMPLE];
+    unsigned long chunk = count - n;
+    if (chunk > READ_BUFFER_SIZE)
+      chunk = READ_BUFFER_SIZE;
+
+    if (fread(bytes, BYTES_PER_SF_SAMPLE, chunk, f) != chunk) {
+      fprintf(stderr,
+              "Failed reading from sample data file: %s\n",
+              strerror(errno));
+      free(frames);
+      return false;
+    }
+
+    decode_frames(bytes, chunk, &frames[n]);
+    n += chunk;
+  }
+
+  *data = (SampleData){
+    .count = count,
+    .frames = frames,
+  };
+
+  return true;
+}
+
+bool sample_data_find_peak(FILE * const f, unsigned int * const peak)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(peak != NULL);
+
+  int_least32_t min = 0, max = 0;
+
+  for (;;) {
+    uint8_t bytes[READ_BUFFER_SIZE * BYTES_PER_SF_SAMPLE];
+    int16_t frames[READ_BUFFER_SIZE];
+    const size_t chunk = fread(bytes, BYTES_PER_SF_SAMPLE, READ_BUFFER_SIZE, f);
+
+    if (chunk == 0) {
+      if (!ferror(f))
+        break; /* End of sample file (not an error) */
+
+      fprintf(stderr,
+              "Failed reading from sample data file: %s\n",
+              strerror(errno));
+      return false;
+    }
+
+    decode_frames(bytes, chunk, frames);
+
+    /* Separate minimum and maximum reductions without any data-dependent
+       branches can be vectorised. */
+    int_least32_t chunk_min = 0, chunk_max = 0;
+    for (size_t i = 0; i < chunk; i++) {
+      chunk_min = frames[i] < chunk_min ? frames[i] : chunk_min;
+      chunk_max = frames[i] > chunk_max ? frames[i] : chunk_max;
+    }
+
+    if (chunk_min < min)
+      min = chunk_min;
+    if (chunk_max > max)
+      max = chunk_max;
+  }
+
+  *peak = (unsigned int)(-min > max ? -min : max);
+  return true;
+}
+
+bool sample_data_find_end(FILE * const f, const unsigned long count,
+                          const unsigned int level,
+                          unsigned long * const sound_count)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(sound_count != NULL);
+
+  /* Scan backwards from the end of the sample data, one block at a time,
+     because any trailing silence is usually much shorter than the sound
+     that precedes it. */
+  unsigned long end = count;
+
+  while (end > 0) {
+    uint8_t bytes[READ_BUFFER_SIZE * BYTES_PER_SF_SAMPLE];
+    int16_t frames[READ_BUFFER_SIZE];
+    const size_t chunk = end > READ_BUFFER_SIZE ? READ_BUFFER_SIZE : end;
+    const unsigned long start = end - chunk;
+
+    if (fseek(f, (long)(start * BYTES_PER_SF_SAMPLE), SEEK_SET) ||
+        fread(bytes, BYTES_PER_SF_SAMPLE, chunk, f) != chunk) {
+      fprintf(stderr,
+              "Failed reading from sample data file: %s\n",
+              strerror(errno));
+      return false;
+    }
+
+    decode_frames(bytes, chunk, frames);
+
+    /* Find the largest magnitude in the block first, because a reduction
+       without any data-dependent branches can be vectorised, whereas
+       searching for the last loud frame cannot. */
+    int_least32_t chunk_max = 0;
+    for (size_t i = 0; i < chunk; i++) {
+      const int_least32_t mag = frames[i] < 0 ? -(int_least32_t)frames[i] :
+                                                frames[i];
+      chunk_max = mag > chunk_max ? mag : chunk_max;
+    }
+
+    if ((unsigned long)chunk_max > level) {
+      size_t i = chunk;
+      while (frames[i - 1] >= -(long)level && frames[i - 1] <= (long)level)
+        --i;
+
+      *sound_count = start + i;
+      return true;
+    }
+
+    end = start;
+  }
+
+  *sound_count = 0; /* the whole sample is silent */
+  return true;
+}
+
+static unsigned long stage_count(const SampleStageType type,
+                                 const unsigned int stride,
+                                 const unsigned long in_count)
+{
+  /* Returns the no. of frames output by a stage (or ULONG_MAX if too
+     many to count). */
+  switch (type) {
+    case SampleStageType_Halve:
+      return (in_count + 1) / 2;
+
+    case SampleStageType_Double:
+      return in_count > ULONG_MAX / 2 ? ULONG_MAX : in_count * 2;
+
+    case SampleStageType_Skip:
+      return in_count == 0 ? 0 : ((in_count - 1) >> stride) + 1;
+
+    default:
+      assert(type == SampleStageType_Duplicate);
+      return in_count > (ULONG_MAX >> stride) ? ULONG_MAX : in_count << stride;
+  }
+}
+
+static void stage_window(const SampleStageType type,
+                         const unsigned int stride,
+                         const long int start, const unsigned long len,
+                         long int * const in_start,
+                         unsigned long * const in_len)
+{
+  assert(start >= 0);
+  assert(len > 0);
+  assert(in_start != NULL);
+  assert(in_len != NULL);
+
+  /* Find the input frames required to compute the given output frames. */
+  const long int end = start + (long int)len - 1;
+  long int lo, hi;
+
+  switch (type) {
+    case SampleStageType_Halve:
+      lo = start * 2 - HALFBAND_REACH;
+      hi = end * 2 + HALFBAND_REACH;
+      break;
+
+    case SampleStageType_Double:
+      lo = start / 2 - (HALFBAND_TAPS - 1);
+      hi = end / 2 + HALFBAND_TAPS;
+      break;
+
+    case SampleStageType_Skip:
+      lo = start << stride;
+      hi = end << stride;
+      break;
+
+    default:
+      assert(type == SampleStageType_Duplicate);
+      lo = start >> stride;
+      hi = end >> stride;
+      break;
+  }
+
+  *in_start = lo;
+  *in_len = (unsigned long)(hi - lo + 1);
+}
+
+static size_t stage_window_size(const SampleStageType type,
+                                const unsigned int stride, const size_t len)
+{
+  assert(len > 0);
+
+  /* Largest window required for any output frames of the given length,
+     wherever they start (or SIZE_MAX if too large to count). */
+  switch (type) {
+    case SampleStageType_Halve:
+      return len > (SIZE_MAX - HALFBAND_REACH * 2) / 2 ? SIZE_MAX :
+             (len - 1) * 2 + HALFBAND_REACH * 2 + 1;
+
+    case SampleStageType_Double:
+      return (len + 1) / 2 + HALFBAND_TAPS * 2;
+
+    case SampleStageType_Skip:
+      return len - 1 > (SIZE_MAX - 1) >> stride ? SIZE_MAX :
+             ((len - 1) << stride) + 1;
+
+    default:
+      assert(type == SampleStageType_Duplicate);
+      return ((len - 1) >> stride) + 2;
+  }
+}
+
+static void skip_frames(const int16_t * const in, const unsigned int stride,
+                        const unsigned long len, int16_t * const out)
+{
+  assert(in != NULL);
+  assert(out != NULL);
+
+  /* A constant step lets the compiler vectorise the loop (a variable one
+     would need a gather), so the usual strides have their own loops. */
+  switch (stride) {
+    case 1:
+      for (unsigned long n = 0; n < len; n++)
+        out[n] = in[n * 2];
+      break;
+
+    case 2:
+      for (unsigned long n = 0; n < len; n++)
+        out[n] = in[n * 4];
+      break;
+
+    default:
+      for (unsigned long n = 0; n < len; n++)
+        out[n] = in[n << stride];
+      break;
+  }
+}
+
+static void duplicate_frames(const int16_t * const in,
+                             const unsigned int stride,
+                             const unsigned long count,
+                             int16_t * const out)
+{
+  assert(in != NULL);
+  assert(out != NULL);
+
+  /* Writes 2^stride copies of each of the given number of input frames. */
+  if (stride == 1) {
+    for (unsigned long m = 0; m < count; m++) {
+      out[m * 2] = in[m];
+      out[m * 2 + 1] = in[m];
+    }
+  } else {
+    const unsigned long reps = 1ul << stride;
+    for (unsigned long m = 0; m < count; m++) {
+      for (unsigned long r = 0; r < reps; r++)
+        out[m * reps + r] = in[m];
+    }
+  }
+}
+
+static void run_stage(const SampleStageType type, const unsigned int stride,
+                      const int16_t * const in, const long int in_start,
+                      const long int start, const unsigned long len,
+                      int16_t * const out)
+{
+  assert(in != NULL);
+  assert(start >= 0);
+  assert(out != NULL);
+
+  /* The input window is padded with silence beyond either end of the
+     sample data, so no bounds checks are needed. Apart from those for
+     uncommon strides, the loops that compute frames have no branches and
+     a constant step so that the compiler can vectorise them. */
+  switch (type) {
+    case SampleStageType_Halve:
+    {
+      /* Polyphase decimator: only every other output of the low-pass filter
+         is computed. The round-to-nearest constant is folded into the
+         accumulator. */
+      const int shift = HALFBAND_SHIFT + 1;
+      const int_least32_t round = 1l << (shift - 1);
+
+      for (unsigned long n = 0; n < len; n++) {
+        const int16_t * const centre = in + ((start + (long)n) * 2 - in_start);
+        int_least32_t acc = *centre * (1l << HALFBAND_SHIFT) + round;
+
+        for (int k = 0; k < HALFBAND_TAPS; k++) {
+          acc += halfband[k] * ((int_least32_t)centre[-(2 * k + 1)] +
+                                (int_least32_t)centre[2 * k + 1]);
+        }
+        out[n] = clamp_frame(acc >> shift);
+      }
+      break;
+    }
+    case SampleStageType_Double:
+    {
+      /* Polyphase interpolator: even-numbered outputs are the input frames
+         themselves (the half-band filter's centre tap) and odd-numbered
+         outputs are computed using the odd-numbered coefficients. The two
+         phases are computed in separate passes. */
+      const unsigned long first_even = (unsigned long)(start % 2);
+      const unsigned long first_odd = 1 - first_even;
+      const unsigned long num_even = (len + 1 - first_even) / 2;
+      const unsigned long num_odd = len > first_odd ?
+                                    (len - first_odd + 1) / 2 : 0;
+
+      const int16_t * const even_in =
+        in + ((start + (long)first_even) / 2 - in_start);
+      int16_t * const even_out = out + first_even;
+
+      for (unsigned long m = 0; m < num_even; m++) {
+        even_out[m * 2] = even_in[m];
+      }
+
+      const int_least32_t round = 1l << (HALFBAND_SHIFT - 1);
+      const int16_t * const odd_in =
+        in + ((start + (long)first_odd) / 2 - in_start);
+      int16_t * const odd_out = out + first_odd;
+
+      for (unsigned long m = 0; m < num_odd; m++) {
+        const int16_t * const left = odd_in + m;
+        int_least32_t acc = round;
+        for (int k = 0; k < HALFBAND_TAPS; k++) {
+          acc += halfband[k] * ((int_least32_t)left[-k] +
+                                (int_least32_t)left[1 + k]);
+        }
+        odd_out[m * 2] = clamp_frame(acc >> HALFBAND_SHIFT);
+      }
+      break;
+    }
+    case SampleStageType_Skip:
+      /* Crudely raise the pitch by keeping only one of every 2^stride
+         frames */
+      skip_frames(in + ((start << stride) - in_start), stride, len, out);
+      break;
+
+    default:
+    {
+      /* Crudely lower the pitch by repeating every frame 2^stride times.
+         The output may begin or end part of the way through the copies
+         of a frame. */
+      assert(type == SampleStageType_Duplicate);
+      const unsigned long reps = 1ul << stride;
+      const unsigned long phase = (unsigned long)start & (reps - 1);
+      const int16_t *src = in + ((start >> stride) - in_start);
+      unsigned long n = 0;
+
+      if (phase != 0) {
+        for (; n < reps - phase && n < len; n++)
+          out[n] = *src;
+        src++;
+      }
+
+      const unsigned long count = (len - n) >> stride;
+      duplicate_frames(src, stride, count, out + n);
+      n += count << stride;
+      src += count;
+
+      for (; n < len; n++)
+        out[n] = *src;
+      break;
+    }
+  }
+}
+
+static bool read_frames(SampleStream * const stream, const long int start,
+                        const unsigned long len, int16_t * const out)
+{
+  assert(stream != NULL);
+  assert(out != NULL);
+
+  /* Unlike other stages, reading from the file never needs more than one
+     window of frames at once. */
+  const long int end = start + (long int)len;
+  const long int first = start < 0 ? 0 : start;
+  const long int last = end > (long int)stream->levels[0].count ?
+                        (long int)stream->levels[0].count : end;
+
+  if (first < last) {
+    const size_t count = (size_t)(last - first);
+    uint8_t * const bytes = (uint8_t *)(out + (first - start));
+
+    if (fseek(stream->f, first * BYTES_PER_SF_SAMPLE, SEEK_SET) ||
+        fread(bytes, BYTES_PER_SF_SAMPLE, count, stream->f) != count) {
+      fprintf(stderr,
+              "Failed reading from sample data file: %s\n",
+              strerror(errno));
+      return false;
+    }
+
+    /* Each frame is decoded in the same place as its encoding, and before
+       the next frame, so nothing is overwritten before it is read. */
+    decode_frames(bytes, count, out + (first - start));
+  }
+
+  for (long int pos = start; pos < first && pos < end; pos++)
+    out[pos - start] = 0;
+
+  for (long int pos = last > start ? last : start; pos < end; pos++)
+    out[pos - start] = 0;
+
+  return true;
+}
+
+static bool fill_level(SampleStream * const stream, const int level,
+                       const long int start, const unsigned long len)
+{
+  assert(stream != NULL);
+  assert(level >= 0);
+  assert(level <= stream->num_stages);
+
+  SampleLevel * const out = &stream->levels[level];
+  assert(len <= out->size);
+
+  _Optional int16_t * const frames = out->frames;
+  if (frames == NULL)
+    return false;
+
+  if (level == 0)
+    return read_frames(stream, start, len, &*frames);
+
+  /* Only frames within the signal output by this stage are computed; the
+     rest are silent. */
+  const long int end = start + (long int)len;
+  const long int first = start < 0 ? 0 : start;
+  const long int last = end > (long int)out->count ? (long int)out->count : end;
+
+  for (long int pos = start; pos < first && pos < end; pos++)
+    frames[pos - start] = 0;
+
+  for (long int pos = last > start ? last : start; pos < end; pos++)
+    frames[pos - start] = 0;
+
+  if (first >= last)
+    return true;
+
+  const SampleStageType type = stream->stage_type;
+  const unsigned int stride = stream->stride;
+  long int in_start;
+  unsigned long in_len;
+  stage_window(type, stride, first, (unsigned long)(last - first), &in_start,
+               &in_len);
+
+  if (!fill_level(stream, level - 1, in_start, in_len))
+    return false;
+
+  _Optional const int16_t * const in = stream->levels[level - 1].frames;
+  if (in == NULL)
+    return false;
+
+  run_stage(type, stride, &*in, in_start, first,
+            (unsigned long)(last - first), &frames[first - start]);
+  return true;
+}
+
+void sample_stream_set_limit(const size_t limit)
+{
+  assert(limit > 0);
+  stream_limit = limit;
+}
+
+bool sample_stream_init(SampleStream * const stream, FILE * const f,
+                        const signed int octaves, const bool band_limited)
+{
+  assert(stream != NULL);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  *stream = (SampleStream){
+    .f = f,
+    .num_stages = 0,
+    .stage_type = SampleStageType_Skip,
+    .stride = 0,
+    .count = 0,
+    .chunk = 0,
+    .buffer = NULL,
+  };
+
+  /* Get the length of the sample data file */
+  long int len = -1;
+  if (!fseek(f, 0, SEEK_END))
+    len = ftell(f);
+
+  if (len < 0) {
+    fprintf(stderr,
+            "Couldn't determine length of sample data file: %s\n",
+            strerror(errno));
+    return false;
+  }
+
+  /* The crude method changes the pitch by any number of octaves in one
+     stage. A band-limited filter only changes it by one octave per stage. */
+  if (octaves != 0) {
+    const unsigned int magnitude = (unsigned)abs(octaves);
+    if (band_limited) {
+      stream->stage_type = octaves > 0 ? SampleStageType_Halve :
+                                         SampleStageType_Double;
+      stream->num_stages = (int)magnitude;
+    } else {
+      stream->stage_type = octaves > 0 ? SampleStageType_Skip :
+                                         SampleStageType_Duplicate;
+      stream->stride = magnitude;
+      stream->num_stages = 1;
+    }
+  }
+
+  if (stream->num_stages > MAX_SAMPLE_STAGES ||
+      stream->stride >= sizeof(long int) * CHAR_BIT - 1) {
+    fprintf(stderr, "Cannot pre-tune sample data by %d octaves\n", octaves);
+    return false;
+  }
+
+  /* Each stage counts its output frames from the start of the sample. */
+  stream->levels[0].count = (unsigned long)len / BYTES_PER_SF_SAMPLE;
+  for (int level = 1; level <= stream->num_stages; level++) {
+    stream->levels[level].count = stage_count(stream->stage_type,
+                                              stream->stride,
+                                              stream->levels[level - 1].count);
+  }
+
+  stream->count = stream->levels[stream->num_stages].count;
+  if (stream->count > LONG_MAX / 2) {
+    fprintf(stderr, "Sample data is too long to pre-tune\n");
+    return false;
+  }
+
+  if (stream->count == 0)
+    return true; /* nothing to read */
+
+  /* Find the largest no. of output frames per read for which the windows
+     of every stage fit within the memory limit. Memory usage therefore
+     doesn't depend on the length of the sample. */
+  const size_t limit = stream_limit / sizeof(int16_t);
+  size_t chunk = stream->count < limit ? (size_t)stream->count : limit;
+  size_t total = 0;
+
+  for (; chunk > 0; chunk /= 2) {
+    size_t size = chunk;
+    total = 0;
+    for (int level = stream->num_stages; level >= 0 && total <= limit;
+         level--) {
+      stream->levels[level].size = size;
+      total = size > limit ? SIZE_MAX : total + size;
+      if (level > 0)
+        size = stage_window_size(stream->stage_type, stream->stride, size);
+    }
+
+    if (total <= limit)
+      break;
+  }
+
+  if (chunk == 0) {
+    fprintf(stderr, "Sample buffer of %zu bytes is too small to pre-tune "
+                    "sample data by %d octaves\n", stream_limit, octaves);
+    return false;
+  }
+
+  _Optional int16_t * const buffer = malloc(total * sizeof(int16_t));
+  if (buffer == NULL) {
+    fprintf(stderr, "Failed to allocate %zu bytes for sample data\n",
+            total * sizeof(int16_t));
+    return false;
+  }
+
+  int16_t *next = &*buffer;
+  for (int level = 0; level <= stream->num_stages; level++) {
+    stream->levels[level].frames = next;
+    next += stream->levels[level].size;
+  }
+
+  stream->buffer = buffer;
+  stream->chunk = chunk;
+  return true;
+}
+
+_Optional const int16_t *sample_stream_read(SampleStream * const stream,
+                                            const unsigned long pos,
+                                            unsigned long * const count)
+{
+  assert(stream != NULL);
+  assert(pos < stream->count);
+  assert(count != NULL);
+  assert(*count > 0);
+
+  /* Read no more than one chunk, and not beyond the end of the data. */
+  unsigned long n = stream->count - pos;
+  if (n > *count)
+    n = *count;
+  if (n > stream->chunk)
+    n = stream->chunk;
+
+  if (!fill_level(stream, stream->num_stages, (long int)pos, n))
+    return NULL;
+
+  *count = n;
+  return stream->levels[stream->num_stages].frames;
+}
+
+void sample_stream_destroy(SampleStream * const stream)
+{
+  assert(stream != NULL);
+  free(stream->buffer);
+  stream->buffer = NULL;
+}
+
+void sample_data_narrow(const int16_t * const in, const unsigned long count,
+                        uint8_t * const out)
+{
+  assert(in != NULL || count == 0);
+  assert(out != NULL || count == 0);
+
+  /* Keep the most significant byte of each value */
+  for (unsigned long n = 0; n < count; n++) {
+    out[n] = (uint8_t)((in[n] >> 8) & UCHAR_MAX);
+  }
+}
+
+void sample_data_scale_narrow(const int16_t * const in,
+                              const unsigned long count,
+                              uint8_t * const out,
+                              const unsigned int volume,
+                              const unsigned int max_volume)
+{
+  assert(in != NULL || count == 0);
+  assert(out != NULL || count == 0);
+  assert(volume >= 1);
+  assert(volume <= max_volume);
+  assert(max_volume <= MAX_SCALE_VOLUME);
+
+  /* Multiply each value by max_volume / (volume * 256), rounding to nearest.
+     The gain has 16 bits of fractional precision and is at most 2^14, so the
+     product of a 16 bit value and the gain, plus the rounding constant and
+     a bias of 2^30, cannot overflow 31 bits. The bias keeps the intermediate
+     result positive so that the right shift is well-defined. */
+  const int_least32_t gain = (int_least32_t)((256ul * max_volume + volume / 2) /
+                                             volume);
+  const int_least32_t bias = 1l << 30;
+  const int_least32_t round = 1l << 15;
+
+  for (unsigned long n = 0; n < count; n++) {
+    int_least32_t v = ((in[n] * gain + round + bias) >> 16) - (bias >> 16);
+    v = v > SCHAR_MAX ? SCHAR_MAX : v;
+    v = v < SCHAR_MIN ? SCHAR_MIN : v;
+    out[n] = (uint8_t)(v & UCHAR_MAX);
+  }
+}
+
+void sample_data_destroy(SampleData * const data)
+{
+  assert(data != NULL);
+  free(data->frames);
+  data->frames = NULL;
+  data->count = 0;
+}
@@ -0,0 +1,81 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Sound sample data processing
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef SAMPDATA_H
+#define SAMPDATA_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if !defined(USE_OPTIONAL) && !defined(_Optional)
+#define _Optional
+#endif
+
+enum {
+  MAX_SAMPLE_STAGES = 16 /* Max. no. of octaves for band-limited pre-tuning */
+};
+
+typedef struct {
+  unsigned long      count; /* No. of sample frames */
+  _Optional int16_t *frames;
+} SampleData;
+
+typedef enum {
+  SampleStageType_Halve,
+  SampleStageType_Double,
+  SampleStageType_Skip,
+  SampleStageType_Duplicate
+} SampleStageType;
+
+typedef struct {
+  unsigned long      count; /* No. of frames output by the stage */
+  size_t             size; /* Capacity of the window buffer, in frames */
+  _Optional int16_t *frames; /* Window buffer */
+} SampleLevel;
+
+typedef struct {
+  FILE              *f;
+  int                num_stages;
+  SampleStageType    stage_type; /* All stages are of the same type */
+  unsigned int       stride; /* Octaves per stage of crude pre-tuning */
+  unsigned long      count; /* No. of frames after pre-tuning */
+  size_t             chunk; /* Max. no. of frames per read */
+  _Optional int16_t *buffer; /* Storage for all window buffers */
+  SampleLevel        levels[MAX_SAMPLE_STAGES + 1]; /* Level 0 is the
+                                                      sample data file */
+} SampleStream;
+
+extern bool sample_data_load(SampleData *data, FILE *f);
+
+extern bool sample_data_find_peak(FILE *f, unsigned int *peak);
+
+extern bool sample_data_find_end(FILE *f, unsigned long count,
+                                 unsigned int level,
+                                 unsigned long *sound_count);
+
+extern void sample_stream_set_limit(size_t limit);
+
+extern bool sample_stream_init(SampleStream *stream, FILE *f,
+                               signed int octaves, bool band_limited);
+
+extern _Optional const int16_t *sample_stream_read(SampleStream *stream,
+                                                   unsigned long pos,
+                                                   unsigned long *count);
+
+extern void sample_stream_destroy(SampleStream *stream);
+
+extern void sample_data_narrow(const int16_t *in, unsigned long count,
+                               uint8_t *out);
+
+extern void sample_data_scale_narrow(const int16_t *in, unsigned long count,
+                                     uint8_t *out, unsigned int volume,
+                                     unsigned int max_volume);
+
+extern void sample_data_destroy(SampleData *data);
+
+#endif /* SAMPDATA_H */
@@ -0,0 +1,521 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Generator of synthetic music and sound samples for testing
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+
+/* StreamLib headers */
+#include "Writer.h"
+#include "WriterGKey.h"
+#include "WriterRaw.h"
+
+/* CBUtilLib headers */
+#include "ArgUtils.h"
+#include "StrExtra.h"
+#include "StringBuff.h"
+
+/* Local header files */
+#include "misc.h"
+#include "sftrack.h"
+
+enum {
+  HistoryLog2 = 9, /* Base 2 logarithm of the history size used by
+                      the compression algorithm */
+  SF_HEADER_SIZE = 104, /* Bytes before the first pattern */
+  SF_VOICE_TABLE_OFFSET = 16,
+  SF_MAX_OCTAVE = 3, /* Highest octave of generated notes */
+  MAX_GEN_PATTERNS = SF_END_OF_ORDER, /* Highest number is the terminator */
+  MAX_GEN_SONG_LEN = MAX_SF_PATTERNS - 1, /* Leaves room for the terminator */
+  MAX_GEN_SAMPLES = 100, /* Limited by the length of file names */
+  MAX_GEN_TUNING = SF_TUNING_OCTAVE / 2,
+  MIN_GEN_TUNING = -SF_TUNING_OCTAVE / 2,
+  GEN_AMPLITUDE = 30000
+};
+
+typedef struct {
+  unsigned long seed;
+  int num_patterns;
+  int song_len;
+  int speed;
+  int num_voices;
+  int num_samples;
+  long int sample_len; /* No. of sample frames */
+  int note_density; /* Percentage of channels in each division */
+  int glissando_freq; /* Percentage of channels in each division */
+  int repeat_freq; /* Percentage of notes */
+  bool raw;
+} GenParams;
+
+static unsigned long next_random(unsigned long * const state)
+{
+  assert(state != NULL);
+
+  /* A linear congruential generator gives the same sequence on every
+     platform, unlike rand(). Only the upper bits are any good. */
+  *state = (*state * 1664525ul + 1013904223ul) & 0xfffffffful;
+  return *state >> 16;
+}
+
+static int random_below(unsigned long * const state, const int limit)
+{
+  assert(limit > 0);
+  assert(limit <= 0x10000);
+  return (int)(next_random(state) % (unsigned long)limit);
+}
+
+static bool write_sample(const GenParams * const params, const int sample_id,
+                         FILE * const f)
+{
+  assert(params != NULL);
+  assert(sample_id >= 0);
+  assert(f != NULL);
+
+  /* Each sample is a sawtooth wave of a different period, fading out
+     linearly over the first three quarters of its length and followed by
+     silence (to exercise -trimsilence). Quieter samples exercise
+     normalisation. */
+  const long int period = 16 + (sample_id * 7) % 48;
+  const long int fade_len = params->sample_len - params->sample_len / 4;
+  const long int amplitude = GEN_AMPLITUDE / (1 + sample_id % 3);
+
+  for (long int n = 0; n < params->sample_len; n++) {
+    long int value = 0;
+    if (n < fade_len) {
+      const long int saw = (n % period) * 2 * amplitude / period - amplitude;
+      value = saw * (fade_len - n) / fade_len;
+    }
+
+    const unsigned int u = (unsigned int)(value < 0 ? value + 65536 : value);
+    if (fputc(u & 0xff, f) == EOF || fputc(u >> 8, f) == EOF)
+      return false;
+  }
+
+  return true;
+}
+
+static bool make_file_path(StringBuffer * const path,
+                           const char * const dir,
+                           const char * const leaf)
+{
+  assert(path != NULL);
+  assert(dir != NULL);
+  assert(leaf != NULL);
+
+  stringbuffer_truncate(path, 0);
+  if (!stringbuffer_append(path, dir, SIZE_MAX) ||
+      !stringbuffer_append_separated(path, PATH_SEPARATOR, leaf)) {
+    fprintf(stderr, "Failed to allocate memory for file path\n");
+    return false;
+  }
+  return true;
+}
+
+static bool write_samples(const GenParams * const params,
+                          const char * const samples_dir)
+{
+  assert(params != NULL);
+  assert(samples_dir != NULL);
+
+  StringBuffer path;
+  stringbuffer_init(&path);
+
+  bool success = make_file_path(&path, samples_dir, "index");
+  _Optional FILE *index = NULL;
+  if (success) {
+    index = fopen(stringbuffer_get_pointer(&path), "w");
+    if (index == NULL) {
+      fprintf(stderr, "Failed to create samples index file: %s\n",
+              strerror(errno));
+      success = false;
+    }
+  }
+
+  if (success) {
+    fputs("# Synthetic sound samples generated by SF3KGen\n\n"
+          "# ID File name   Repeat Type Tuning\n"
+          "# -- ---------   ------ ---- ------\n", &*index);
+  }
+
+  /* Tunings are random, but repeatable because they come from a separate
+     sequence to the music. */
+  unsigned long state = params->seed ^ 0x5a5a5a5aul;
+
+  for (int sample_id = 0; sample_id < params->num_samples && success;
+       sample_id++) {
+    char file_name[16];
+    snprintf(file_name, sizeof(file_name), "Synth%d", sample_id);
+
+    const int tuning = MIN_GEN_TUNING +
+                       random_below(&state, MAX_GEN_TUNING - MIN_GEN_TUNING + 1);
+
+    /* Every other sample repeats from the even frame nearest its midpoint */
+    const long int repeat_offset = sample_id % 2 != 0 ?
+      (params->sample_len / 2) & ~1l : 0;
+
+    fprintf(&*index, "  %-2d %-11s %-6ld M    %d\n", sample_id, file_name,
+            repeat_offset, tuning);
+
+    if (!make_file_path(&path, samples_dir, file_name)) {
+      success = false;
+      break;
+    }
+
+    _Optional FILE * const f = fopen(stringbuffer_get_pointer(&path), "wb");
+    if (f == NULL) {
+      fprintf(stderr, "Failed to create sample data file: %s\n",
+              strerror(errno));
+      success = false;
+      break;
+    }
+
+    if (!write_sample(params, sample_id, &*f)) {
+      fprintf(stderr, "Failed writing to sample data file: %s\n",
+              strerror(errno));
+      success = false;
+    }
+
+    if (fclose(&*f)) {
+      fprintf(stderr, "Failed to close sample data file: %s\n",
+              strerror(errno));
+      success = false;
+    }
+  }
+
+  if (index != NULL) {
+    if (ferror(&*index) && success) {
+      fprintf(stderr, "Failed writing to samples index file: %s\n",
+              strerror(errno));
+      success = false;
+    }
+    if (fclose(&*index)) {
+      fprintf(stderr, "Failed to close samples index file: %s\n",
+              strerror(errno));
+      success = false;
+    }
+  }
+
+  stringbuffer_destroy(&path);
+  return success;
+}
+
+static bool write_header(const GenParams * const params,
+                         unsigned long * const state, Writer * const w)
+{
+  assert(params != NULL);
+  assert(state != NULL);
+  assert(w != NULL);
+
+  uint8_t header[SF_HEADER_SIZE] = {0};
+  header[0] = (uint8_t)params->speed;
+
+  /* Voices beyond the number of samples share samples with other voices. */
+  for (int v = 0; v < NUM_SF_VOICES; v++) {
+    header[SF_VOICE_TABLE_OFFSET + v] = (uint8_t)(v % params->num_samples);
+  }
+
+  /* Every pattern is played once (if it fits in the play order) before any
+     is played again. */
+  uint8_t play_order[MAX_SF_PATTERNS];
+  memset(play_order, SF_END_OF_ORDER, sizeof(play_order));
+  for (int pos = 0; pos < params->song_len; pos++) {
+    play_order[pos] = (uint8_t)(pos < params->num_patterns ? pos :
+                                random_below(state, params->num_patterns));
+  }
+
+  return writer_fwrite(header, SF_VOICE_TABLE_OFFSET + NUM_SF_VOICES, 1,
+                       w) == 1 &&
+         writer_fwrite_int32(params->num_patterns - 1, w) &&
+         writer_fwrite_int32(0, w) &&
+         writer_fwrite(play_order, sizeof(play_order), 1, w) == 1;
+}
+
+static bool write_patterns(const GenParams * const params,
+                           unsigned long * const state, Writer * const w)
+{
+  assert(params != NULL);
+  assert(state != NULL);
+  assert(w != NULL);
+
+  for (int pattern_no = 0; pattern_no < params->num_patterns; pattern_no++) {
+    for (int division_no = 0; division_no < NUM_SF_DIVISIONS; division_no++) {
+      for (int c = 0; c < NUM_SF_CHANNELS; c++) {
+        uint8_t com[4] = {0}; /* note, oct_vol, voice_act, num_repeats */
+        const int r = random_below(state, 100);
+
+        if (r < params->note_density + params->glissando_freq) {
+          const int voice = random_below(state, params->num_voices);
+          const int octave = 1 + random_below(state, SF_MAX_OCTAVE);
+          com[0] = (uint8_t)random_below(state, 12);
+
+          if (r < params->note_density) {
+            const int volume = 1 + random_below(state, SF_MAX_VOLUME);
+            com[1] = (uint8_t)(octave | (volume << 4));
+            com[2] = (uint8_t)voice;
+
+            /* Each distinct no. of repeats needs another ProTracker
+               sample, so only use one finite number. */
+            if (random_below(state, 100) < params->repeat_freq) {
+              com[3] = (uint8_t)((random_below(state, 2) != 0 ?
+                                  SF_MAX_REPEATS : 1) << 4);
+            }
+          } else {
+            /* The target of a glissando is given by the note and octave. */
+            com[1] = (uint8_t)octave;
+            com[2] = (uint8_t)(voice | (SF_GLISSANDO_THRESHOLD << 4));
+          }
+        }
+
+        if (writer_fwrite(com, sizeof(com), 1, w) != 1)
+          return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+static bool write_track(const GenParams * const params,
+                        const char * const file_name)
+{
+  assert(params != NULL);
+  assert(file_name != NULL);
+
+  _Optional FILE * const f = fopen(file_name, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to create music file: %s\n", strerror(errno));
+    return false;
+  }
+
+  const long int size = SF_HEADER_SIZE +
+                        (long int)params->num_patterns *
+                        NUM_SF_DIVISIONS * NUM_SF_CHANNELS * SF_COMMAND_SIZE;
+  Writer w;
+  bool success = true;
+  if (params->raw) {
+    writer_raw_init(&w, &*f);
+  } else if (!writer_gkey_init(&w, HistoryLog2, size, &*f)) {
+    fprintf(stderr, "Failed to initialize compressor\n");
+    success = false;
+  }
+
+  if (success) {
+    /* Each file gets different music, but the same seed always produces
+       the same file. */
+    unsigned long state = params->seed;
+    success = write_header(params, &state, &w) &&
+              write_patterns(params, &state, &w) &&
+              !writer_ferror(&w);
+
+    if (writer_destroy(&w) < 0)
+      success = false;
+
+    if (!success)
+      fprintf(stderr, "Failed writing to music file: %s\n", strerror(errno));
+  }
+
+  if (fclose(&*f)) {
+    fprintf(stderr, "Failed to close music file: %s\n", strerror(errno));
+    success = false;
+  }
+
+  if (!success)
+    remove(file_name);
+
+  return success;
+}
+
+static int syntax_msg(FILE * const f, const char * const path)
+{
+  assert(f != NULL);
+  assert(path != NULL);
+
+  const char * const leaf = strtail(path, PATH_SEPARATOR, 1);
+  fprintf(f,
+          "usage: %s [switches] <samples-dir> [<file1> [<file2> .. <fileN>]]\n"
+          "Writes synthetic sound samples and an index file to the samples\n"
+          "directory (which must exist) and a synthetic SF3000 music file for\n"
+          "each file name. Each music file is generated from the next seed.\n",
+          leaf);
+
+  fputs("Switches (names may be abbreviated):\n"
+        "  -density <n>        Percentage of channels that play a note (default 30)\n"
+        "  -glissando <n>      Percentage of channels with a glissando (default 5)\n"
+        "  -help               Display this text\n"
+        "  -order <n>          Length of the play order (1-63, default is the no.\n"
+        "                      of patterns or 63)\n"
+        "  -patterns <n>       No. of patterns in each music file (1-255, default 8)\n"
+        "  -raw                Write uncompressed music files\n"
+        "  -repeats <n>        Percentage of notes with repeats (default 10)\n"
+        "  -samplelen <n>      No. of frames in each sample (default 8000)\n"
+        "  -samples <n>        No. of sound samples (1-100, default 4)\n"
+        "  -seed <n>           Seed for the first music file (default 1)\n"
+        "  -speed <n>          Interval between divisions in cs (1-31, default 6)\n"
+        "  -voices <n>         No. of voices used by notes (1-16, default 4)\n", f);
+
+  return EXIT_FAILURE;
+}
+
+static bool parse_number(const char * const arg, const long int min,
+                         const long int max, long int * const value)
+{
+  assert(arg != NULL);
+  assert(value != NULL);
+
+  char *end;
+  const long int num = strtol(arg, &end, 10);
+  if (end == arg || *end != '\0' || num < min || num > max) {
+    fprintf(stderr, "Bad number '%s' (must be %ld-%ld)\n", arg, min, max);
+    return false;
+  }
+  *value = num;
+  return true;
+}
+
+int main(int argc, const char *argv[])
+{
+  GenParams params = {
+    .seed = 1,
+    .num_patterns = 8,
+    .song_len = -1, /* depends on the no. of patterns */
+    .speed = 6,
+    .num_voices = 4,
+    .num_samples = 4,
+    .sample_len = 8000,
+    .note_density = 30,
+    .glissando_freq = 5,
+    .repeat_freq = 10,
+    .raw = false,
+  };
+
+  assert(argc > 0);
+  assert(argv != NULL);
+
+  DEBUG_SET_OUTPUT(DebugOutput_Reporter, "");
+
+  /* Parse any options specified on the command line */
+  int n;
+  for (n = 1; n < argc && argv[n][0] == '-'; n++) {
+    const char *opt = argv[n] + 1;
+    _Optional int *int_param = NULL;
+    long int min = 0, max = 0;
+
+    if (is_switch(opt, "density", 1)) {
+      int_param = &params.note_density;
+      max = 100;
+    } else if (is_switch(opt, "glissando", 1)) {
+      int_param = &params.glissando_freq;
+      max = 100;
+    } else if (is_switch(opt, "help", 1)) {
+      (void)syntax_msg(stdout, argv[0]);
+      return EXIT_SUCCESS;
+    } else if (is_switch(opt, "order", 1)) {
+      int_param = &params.song_len;
+      min = 1;
+      max = MAX_GEN_SONG_LEN;
+    } else if (is_switch(opt, "patterns", 1)) {
+      int_param = &params.num_patterns;
+      min = 1;
+      max = MAX_GEN_PATTERNS;
+    } else if (is_switch(opt, "raw", 2)) {
+      params.raw = true;
+    } else if (is_switch(opt, "repeats", 2)) {
+      int_param = &params.repeat_freq;
+      max = 100;
+    } else if (is_switch(opt, "samplelen", 8)) {
+      long int value;
+      if (++n >= argc || !parse_number(argv[n], 1, LONG_MAX / 4, &value)) {
+        fprintf(stderr, "Missing or bad sample length\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      params.sample_len = value;
+    } else if (is_switch(opt, "samples", 7)) {
+      int_param = &params.num_samples;
+      min = 1;
+      max = MAX_GEN_SAMPLES;
+    } else if (is_switch(opt, "seed", 2)) {
+      long int value;
+      if (++n >= argc || !parse_number(argv[n], 0, LONG_MAX, &value)) {
+        fprintf(stderr, "Missing or bad seed\n");
+        return syntax_msg(stderr, argv[0]);
+      }
+      params.seed = (unsigned long)value;
+    } else if (is_switch(opt, "speed", 2)) {
+      int_param = &params.speed;
+      min = 1;
+      max = 31;
+    } else if (is_switch(opt, "voices", 1)) {
+      int_param = &params.num_voices;
+      min = 1;
+      max = NUM_SF_VOICES;
+    } else {
+      fprintf(stderr, "Unrecognised switch '%s'\n", opt);
+      return syntax_msg(stderr, argv[0]);
+    }
+
+    if (int_param != NULL) {
+      long int value;
+      if (++n >= argc) {
+        fprintf(stderr, "Missing value for -%s\n", opt);
+        return syntax_msg(stderr, argv[0]);
+      }
+      if (!parse_number(argv[n], min, max, &value))
+        return syntax_msg(stderr, argv[0]);
+
+      *int_param = (int)value;
+    }
+  }
+
+  if (params.note_density + params.glissando_freq > 100) {
+    fputs("Note density and glissando frequency exceed 100%\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  if (params.song_len < 0) {
+    params.song_len = params.num_patterns < MAX_GEN_SONG_LEN ?
+                      params.num_patterns : MAX_GEN_SONG_LEN;
+  }
+
+  /* The first argument is the directory in which to write samples */
+  if (n >= argc) {
+    fputs("Must specify a samples directory\n", stderr);
+    return syntax_msg(stderr, argv[0]);
+  }
+
+  const char * const samples_dir = argv[n++];
+  if (!write_samples(&params, samples_dir))
+    return EXIT_FAILURE;
+
+  /* Every remaining argument is the name of a music file to write */
+  int rtn = EXIT_SUCCESS;
+  for (; n < argc && rtn == EXIT_SUCCESS; n++) {
+    if (!write_track(&params, argv[n]))
+      rtn = EXIT_FAILURE;
+
+    params.seed++;
+  }
+
+  return rtn;
+}
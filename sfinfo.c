@@ -0,0 +1,184 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Reporting of Star Fighter 3000 music metadata
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "samp.h"
+#include "sftrack.h"
+#include "protracker.h"
+#include "json.h"
+#include "sfinfo.h"
+
+static const char *type_name(const SampleInfo_Type type)
+{
+  switch (type) {
+    case SampleInfo_Type_Effect:
+      return "effect";
+
+    case SampleInfo_Type_Music:
+      return "music";
+
+    default:
+      assert(type == SampleInfo_Type_Unused);
+      return "unused";
+  }
+}
+
+static int scan_patterns(const unsigned int flags,
+                         const SFTrack * const music_data,
+                         const int song_len,
+                         const SampleArray * const sf_samples,
+                         bool used[UINT8_MAX + 1])
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(song_len >= 0);
+  assert(song_len < MAX_SF_PATTERNS);
+  assert(sf_samples != NULL);
+  assert(used != NULL);
+
+  /* Find which samples are actually played, in the order in which the
+     patterns are played. */
+  int num_notes = 0;
+  for (int position = 0; position < song_len; position++) {
+    SFEventCursor cursor;
+    sftrack_cursor_init(music_data, music_data->play_order[position],
+                        &cursor);
+
+    int division_no, c;
+    for (_Optional const SFEvent *event = sftrack_cursor_next(&cursor,
+                                                               &division_no,
+                                                               &c);
+         event != NULL;
+         event = sftrack_cursor_next(&cursor, &division_no, &c)) {
+      if (sftrack_note_sample(sf_samples, event,
+                              (flags & FLAGS_ALLOW_SFX) != 0)) {
+        used[event->sample_num] = true;
+        num_notes++;
+      }
+    }
+  }
+
+  return num_notes;
+}
+
+bool report_sftrack_info(unsigned int flags,
+                         const char * const song_name,
+                         Reader * const in,
+                         const SampleArray * const sf_samples,
+                         FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(song_name != NULL);
+  assert(in != NULL);
+  assert(!reader_ferror(in));
+  assert(sf_samples != NULL);
+  assert(out != NULL);
+
+  /* Decoding stops after the play order unless a scan was requested. */
+  SFTrack music_data;
+  if (!sftrack_read_header(&music_data, in))
+    return false;
+
+  const int song_len = sftrack_song_len(&music_data);
+  if (song_len >= MAX_SF_PATTERNS) {
+    fprintf(stderr, "Unterminated pattern play order in input file\n");
+    return false;
+  }
+
+  /* Report the number of patterns stored, but estimate the size of the
+     output as it would be converted. */
+  const long num_patterns = (long)music_data.last_stored_no + 1;
+  if ((flags & FLAGS_PRUNE_PATTERNS) != 0)
+    sftrack_prune(&music_data);
+
+  bool used[UINT8_MAX + 1] = {false};
+  int num_notes = 0;
+
+  if ((flags & FLAGS_SCAN) != 0) {
+    if (!sftrack_read_patterns(&music_data, in))
+      return false;
+
+    num_notes = scan_patterns(flags, &music_data, song_len, sf_samples,
+                              used);
+  } else {
+    /* Every sample in the voice table might be played. */
+    for (int v = 0; v < NUM_SF_VOICES; v++)
+      used[music_data.voice_table[v]] = true;
+  }
+
+  fputs("{\"name\":", out);
+  json_put_string(song_name, out);
+  fprintf(out, ",\"tempo\":%d,\"song_length\":%d,\"patterns\":%ld",
+          music_data.speed, song_len, num_patterns);
+
+  if ((flags & FLAGS_SCAN) != 0)
+    fprintf(out, ",\"notes\":%d", num_notes);
+
+  fputs(",\"samples\":[", out);
+  bool first = true;
+  for (int s = 0;
+       s < sf_samples->count && s <= UINT8_MAX && sf_samples->sample_info;
+       s++) {
+    const SampleInfo * const sample = &sf_samples->sample_info[s];
+    if (!used[s] || sample->type == SampleInfo_Type_Unused)
+      continue;
+
+    fprintf(out, "%s{\"number\":%d,\"file\":", first ? "" : ",", s);
+    json_put_string(sample->file_name, out);
+    fprintf(out, ",\"type\":\"%s\"}", type_name(sample->type));
+    first = false;
+  }
+  fputs("]", out);
+
+  /* The estimate is a lower bound unless the patterns were scanned, because
+     pre-tuned variants of samples and repeated sample data are unknown.
+     Progress isn't logged because no module is actually created. */
+  unsigned long size;
+  const unsigned int saved_mask = log_set_mask(0);
+  const bool estimated = estimate_protracker_size(flags, &music_data,
+                                                  sf_samples, &size);
+  log_set_mask(saved_mask);
+
+  if (estimated)
+    fprintf(out, ",\"estimated_size\":%lu}\n", size);
+  else
+    fputs(",\"estimated_size\":null}\n", out);
+
+  sftrack_destroy(&music_data);
+
+  if (ferror(out)) {
+    fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+    return false;
+  }
+
+  return true;
+}
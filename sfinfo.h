@@ -0,0 +1,26 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Reporting of Star Fighter 3000 music metadata
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef SFINFO_H
+#define SFINFO_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* Local headers */
+#include "samp.h"
+
+extern bool report_sftrack_info(unsigned int       flags,
+                                const char        *song_name,
+                                Reader            *in,
+                                const SampleArray *sf_samples,
+                                FILE              *out);
+
+#endif /* SFINFO_H */
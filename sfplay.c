@@ -0,0 +1,487 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Playback of Star Fighter 3000 music
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* CBUtilLib headers */
+#include "StringBuff.h"
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "samp.h"
+#include "sampdata.h"
+#include "sftrack.h"
+#include "protracker.h"
+#include "wav.h"
+#include "mix.h"
+#include "sfplay.h"
+
+enum {
+  MIX_RATE             = 44100, /* Hz */
+  SF_TICK_FREQ         = 100, /* Hz (the tempo is in centiseconds) */
+  FRAMES_PER_TICK      = MIX_RATE / SF_TICK_FREQ,
+  SEMITONES_PER_OCTAVE = 12,
+  PITCH_SEMITONE       = 4096, /* Pitch units per semitone */
+  PITCH_OCTAVE         = PITCH_SEMITONE * SEMITONES_PER_OCTAVE,
+  PITCH_PER_TUNING     = PITCH_OCTAVE / SF_TUNING_OCTAVE,
+  REF_OCTAVE           = 3, /* SF3000 octave played at the reference rate */
+  REF_PERIOD           = 428, /* ProTracker period of C-2, the equivalent
+                                 of the reference note (as in a module) */
+  PAL_CLOCK            = 3546895, /* Hz, divided by period to get the rate */
+  GLISSANDO_STEP       = 80, /* Pitch units per tick: about 2 semitones per
+                                second, which is an approximation because the
+                                speed varied with the size of 'SFX_Handler's
+                                DMA buffer */
+  MIN_STEP_OCTAVE      = -24, /* Lower notes are treated as silent */
+  MAX_STEP_OCTAVE      = 16,
+  MIX_HEADROOM         = 2 /* Four channels at full volume may clip */
+};
+
+typedef struct {
+  _Optional const SampleData *data; /* NULL if nothing is playing */
+  int           sample_num;
+  unsigned long repeat_offset; /* in sample frames */
+  int           repeats; /* No. of repeats left (SF_MAX_REPEATS forever) */
+  MixCursor     cursor; /* Position in the sample */
+  signed long   pitch;
+  signed long   target_pitch;
+  bool          gliding;
+  int           volume;
+} Channel;
+
+static signed long calc_pitch(const SFEvent * const event,
+                              const SampleInfo * const sample)
+{
+  assert(event != NULL);
+  assert(sample != NULL);
+
+  /* Pitch is linear in octaves, fine enough to represent the tuning
+     of a sample exactly. */
+  const signed long octave = event->octave;
+  const signed long note = event->note;
+  return (octave * SEMITONES_PER_OCTAVE + note) * PITCH_SEMITONE +
+         (signed long)sample->tuning * PITCH_PER_TUNING;
+}
+
+static unsigned long pitch_to_step(const signed long pitch)
+{
+  /* Frequency ratios of the semitones in an octave (16.16 fixed point) */
+  static const unsigned long semitone_ratio[SEMITONES_PER_OCTAVE + 1] = {
+    65536, 69433, 73562, 77936, 82570, 87480, 92682, 98193, 104032, 110218,
+    116772, 123715, 131072
+  };
+
+  signed long rel = pitch - (signed long)REF_OCTAVE * PITCH_OCTAVE;
+  signed long octave = rel / PITCH_OCTAVE;
+  rel -= octave * PITCH_OCTAVE;
+  if (rel < 0) {
+    rel += PITCH_OCTAVE;
+    octave--;
+  }
+
+  if (octave < MIN_STEP_OCTAVE)
+    return 0;
+
+  if (octave > MAX_STEP_OCTAVE)
+    octave = MAX_STEP_OCTAVE;
+
+  /* Interpolate linearly between semitones, which is accurate to about
+     a cent. */
+  const int semitone = (int)(rel / PITCH_SEMITONE);
+  const unsigned long fine = (unsigned long)(rel % PITCH_SEMITONE);
+  const unsigned long ratio = semitone_ratio[semitone] +
+    (semitone_ratio[semitone + 1] - semitone_ratio[semitone]) * fine /
+    PITCH_SEMITONE;
+
+  /* The playback rate is PAL_CLOCK * ratio / REF_PERIOD (in 16.16 fixed
+     point), which is divided by the output rate. */
+  unsigned long long num = (unsigned long long)PAL_CLOCK * ratio;
+  unsigned long long den = (unsigned long long)REF_PERIOD * MIX_RATE;
+  if (octave >= 0)
+    num <<= octave;
+  else
+    den <<= -octave;
+
+  const unsigned long long step = num / den;
+  return step > ULONG_MAX ? ULONG_MAX : (unsigned long)step;
+}
+
+static bool load_sample(const SampleInfo * const sample,
+                        const char * const samples_dir,
+                        SampleData * const data)
+{
+  bool success = true;
+
+  assert(sample != NULL);
+  assert(samples_dir != NULL);
+  assert(data != NULL);
+
+  /* Construct full path name of sample data file */
+  StringBuffer sample_path;
+  stringbuffer_init(&sample_path);
+
+  if (!stringbuffer_append(&sample_path, samples_dir, SIZE_MAX) ||
+      !stringbuffer_append_separated(&sample_path, PATH_SEPARATOR,
+                                     sample->file_name)) {
+    fprintf(stderr,"Failed to allocate memory for sample data file path\n");
+    success = false;
+  } else {
+    LOGF(LogLevel_Debug, LogCategory_Render, "Loading sample data file '%s'",
+         stringbuffer_get_pointer(&sample_path));
+
+    _Optional FILE * const sample_handle =
+      fopen(stringbuffer_get_pointer(&sample_path), "rb");
+    if (sample_handle == NULL) {
+      fprintf(stderr,
+              "Failed to open sample data file: %s\n",
+              strerror(errno));
+      success = false;
+    } else {
+      success = sample_data_load(data, &*sample_handle);
+      fclose(&*sample_handle);
+    }
+  }
+  stringbuffer_destroy(&sample_path);
+
+  return success;
+}
+
+static void start_glissandos(const unsigned int flags,
+                             const SampleArray * const sf_samples,
+                             _Optional const SFEvent * const division[NUM_SF_CHANNELS],
+                             Channel channels[NUM_SF_CHANNELS])
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(sf_samples != NULL);
+  assert(division != NULL);
+  assert(channels != NULL);
+
+  for (int c = 0; c < NUM_SF_CHANNELS; c++) {
+    _Optional const SFEvent * const event = division[c];
+    if (!event || event->type != SFEventType_Glissando)
+      continue;
+
+    const int sample_num = event->sample_num;
+    if (sample_num >= sf_samples->count || !sf_samples->sample_info)
+      continue;
+
+    const SampleInfo * const sample = &sf_samples->sample_info[sample_num];
+    if (sample->type == SampleInfo_Type_Unused)
+      continue;
+
+    /* A glissando affects all instances of the specified sample, regardless
+       of which channel it is playing on. */
+    const signed long target_pitch = calc_pitch(&*event, sample);
+    for (int c2 = 0; c2 < NUM_SF_CHANNELS; c2++) {
+      if (!channels[c2].data || channels[c2].sample_num != sample_num)
+        continue;
+
+      if (c2 != c && (flags & FLAGS_GLISSANDO_SINGLE) != 0)
+        continue;
+
+      channels[c2].target_pitch = target_pitch;
+      channels[c2].gliding = true;
+    }
+  }
+}
+
+static bool play_notes(const unsigned int flags,
+                       const SampleArray * const sf_samples,
+                       const char * const samples_dir,
+                       SampleData * const cache,
+                       _Optional const SFEvent * const division[NUM_SF_CHANNELS],
+                       Channel channels[NUM_SF_CHANNELS])
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(sf_samples != NULL);
+  assert(cache != NULL);
+  assert(division != NULL);
+  assert(channels != NULL);
+
+  for (int c = 0; c < NUM_SF_CHANNELS; c++) {
+    _Optional const SFEvent * const event = division[c];
+    _Optional const SampleInfo * const sample =
+      sftrack_note_sample(sf_samples, event, (flags & FLAGS_ALLOW_SFX) != 0);
+    if (!sample || !event)
+      continue;
+
+    const int sample_num = event->sample_num;
+
+    /* Each sample's data is loaded when it is first played. */
+    SampleData * const data = &cache[sample_num];
+    if (!data->frames &&
+        !load_sample(&*sample, samples_dir, data))
+      return false;
+
+    const signed long pitch = calc_pitch(&*event, &*sample);
+    channels[c] = (Channel){
+      .data = data,
+      .sample_num = sample_num,
+      .repeat_offset = sample->repeat_offset,
+      .repeats = event->repeats,
+      .cursor = {.pos = 0, .frac = 0, .step = pitch_to_step(pitch)},
+      .pitch = pitch,
+      .target_pitch = pitch,
+      .gliding = false,
+      .volume = event->volume,
+    };
+  }
+  return true;
+}
+
+static void mix_channel(Channel * const chan, int32_t * const mix)
+{
+  assert(chan != NULL);
+  assert(mix != NULL);
+
+  int done = 0;
+  while (chan->data && done < FRAMES_PER_TICK) {
+    const SampleData * const data = &*chan->data;
+    const unsigned long count = data->count;
+
+    if (chan->cursor.pos >= count) {
+      /* Repeat from the repeat offset or stop playing. */
+      if (chan->repeats == 0 || chan->repeat_offset >= count) {
+        chan->data = NULL;
+        break;
+      }
+      if (chan->repeats != SF_MAX_REPEATS)
+        chan->repeats--;
+
+      chan->cursor.pos = chan->repeat_offset + (chan->cursor.pos - count);
+      continue;
+    }
+
+    done += mix_frames(&*data->frames, count, &chan->cursor, chan->volume,
+                       FRAMES_PER_TICK - done, mix + done);
+  }
+}
+
+static void update_glissandos(Channel channels[NUM_SF_CHANNELS])
+{
+  assert(channels != NULL);
+
+  for (int c = 0; c < NUM_SF_CHANNELS; c++) {
+    Channel * const chan = &channels[c];
+    if (!chan->gliding)
+      continue;
+
+    if (chan->pitch < chan->target_pitch) {
+      chan->pitch += GLISSANDO_STEP;
+      if (chan->pitch > chan->target_pitch)
+        chan->pitch = chan->target_pitch;
+    } else {
+      chan->pitch -= GLISSANDO_STEP;
+      if (chan->pitch < chan->target_pitch)
+        chan->pitch = chan->target_pitch;
+    }
+
+    /* The slide stops when the target pitch is reached. */
+    chan->gliding = (chan->pitch != chan->target_pitch);
+    chan->cursor.step = pitch_to_step(chan->pitch);
+  }
+}
+
+static bool render_tick(Channel channels[NUM_SF_CHANNELS], FILE * const out)
+{
+  int32_t mix[FRAMES_PER_TICK];
+  int16_t frames[FRAMES_PER_TICK];
+  uint8_t bytes[FRAMES_PER_TICK * 2];
+
+  assert(channels != NULL);
+  assert(out != NULL);
+
+  memset(mix, 0, sizeof(mix));
+  for (int c = 0; c < NUM_SF_CHANNELS; c++)
+    mix_channel(&channels[c], mix);
+
+  for (int i = 0; i < FRAMES_PER_TICK; i++) {
+    int32_t value = mix[i] / (SF_MAX_VOLUME * MIX_HEADROOM);
+    value = value > INT16_MAX ? INT16_MAX : value;
+    value = value < INT16_MIN ? INT16_MIN : value;
+    frames[i] = (int16_t)value;
+  }
+
+  wav_encode_frames(frames, FRAMES_PER_TICK, bytes);
+  return fwrite(bytes, sizeof(bytes), 1, out) == 1;
+}
+
+static bool render_patterns(const unsigned int flags,
+                            const SFTrack * const music_data,
+                            const int song_len,
+                            const int speed,
+                            const SampleArray * const sf_samples,
+                            const char * const samples_dir,
+                            SampleData * const cache,
+                            FILE * const out)
+{
+  Channel channels[NUM_SF_CHANNELS];
+
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(song_len >= 0);
+  assert(song_len < MAX_SF_PATTERNS);
+  assert(speed > 0);
+  assert(cache != NULL);
+  assert(out != NULL);
+
+  for (int c = 0; c < NUM_SF_CHANNELS; c++)
+    channels[c] = (Channel){.data = NULL};
+
+  /* Unlike a tracker module, the state of each channel (including any
+     glissando) carries over from one pattern to the next. An extra blank
+     pattern allows late notes to finish playing. */
+  const int num_positions = song_len +
+                            ((flags & FLAGS_BLANK_PATTERN) != 0 ? 1 : 0);
+
+  for (int position = 0; position < num_positions; position++) {
+    /* A pattern that doesn't exist (such as the extra one) is blank. */
+    SFEventGrid grid;
+    int pattern_no = -1;
+    if (position < song_len) {
+      pattern_no = music_data->play_order[position];
+
+      LOGF(LogLevel_Debug, LogCategory_Render,
+           "Rendering pattern %d at song position %d", pattern_no, position);
+    }
+    sftrack_expand(music_data, pattern_no, &grid);
+
+    for (int division_no = 0; division_no < NUM_SF_DIVISIONS; division_no++) {
+      _Optional const SFEvent * const * const division = grid.cells[division_no];
+
+      /* Glissandos apply to notes that were already playing, not to new
+         notes in the same division. */
+      start_glissandos(flags, sf_samples, division, channels);
+      if (!play_notes(flags, sf_samples, samples_dir, cache,
+                      division, channels))
+        return false;
+
+      for (int tick = 0; tick < speed; tick++) {
+        if (!render_tick(channels, out)) {
+          fprintf(stderr, "Failed writing to output file: %s\n",
+                  strerror(errno));
+          return false;
+        }
+        update_glissandos(channels);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool play_sftrack(unsigned int flags,
+                  const SFTrack * const music_data,
+                  const char * const samples_dir,
+                  const SampleArray * const sf_samples,
+                  FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(music_data != NULL);
+  assert(samples_dir != NULL);
+  assert(sf_samples != NULL);
+  assert(sf_samples->count >= 0);
+  assert(out != NULL);
+
+  bool success = true;
+  const int song_len = sftrack_song_len(music_data);
+  if (song_len >= MAX_SF_PATTERNS) {
+    fprintf(stderr, "Unterminated pattern play order in input file\n");
+    success = false;
+  }
+
+  /* A tempo of 0 is treated like 1 to be safe. */
+  const int speed = music_data->speed > 0 ? music_data->speed : 1;
+
+  _Optional SampleData *cache = NULL;
+  if (success) {
+    const size_t n = sf_samples->count > 0 ? (size_t)sf_samples->count : 1;
+    cache = calloc(n, sizeof(*cache));
+    if (cache == NULL) {
+      fprintf(stderr, "Failed to allocate memory for sample data cache\n");
+      success = false;
+    }
+  }
+
+  if (success) {
+    const int num_positions = song_len +
+                              ((flags & FLAGS_BLANK_PATTERN) != 0 ? 1 : 0);
+    const unsigned long num_frames = (unsigned long)num_positions *
+                                     NUM_SF_DIVISIONS * speed *
+                                     FRAMES_PER_TICK;
+
+    LOGF(LogLevel_Info, LogCategory_Render,
+         "Rendering %d song positions at tempo %d cs (%lu frames)",
+         num_positions, speed, num_frames);
+
+    if (!wav_write_header(out, MIX_RATE, num_frames)) {
+      fprintf(stderr, "Failed writing to output file: %s\n", strerror(errno));
+      success = false;
+    } else {
+      success = render_patterns(flags, music_data, song_len, speed,
+                                sf_samples, samples_dir, &*cache, out);
+    }
+
+    if (success && (flags & FLAGS_STATS) != 0) {
+      const unsigned long centisecs = num_frames / (MIX_RATE / 100);
+      fprintf(stderr, "Rendered %lu frames at %d Hz (%lu.%02lu seconds)\n",
+              num_frames, MIX_RATE, centisecs / 100, centisecs % 100);
+    }
+
+    for (int s = 0; s < sf_samples->count; s++)
+      sample_data_destroy(&cache[s]);
+  }
+
+  free(cache);
+
+  return success;
+}
+
+bool render_sftrack(unsigned int flags,
+                    Reader * const in,
+                    const char * const samples_dir,
+                    const SampleArray * const sf_samples,
+                    FILE * const out)
+{
+  assert(!(flags & ~FLAGS_ALL));
+  assert(in != NULL);
+  assert(!reader_ferror(in));
+
+  SFTrack music_data;
+  if (!sftrack_read(&music_data, in))
+    return false;
+
+  const bool success = play_sftrack(flags, &music_data, samples_dir,
+                                    sf_samples, out);
+  sftrack_destroy(&music_data);
+
+  return success;
+}
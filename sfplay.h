@@ -0,0 +1,33 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Playback of Star Fighter 3000 music
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef SFPLAY_H
+#define SFPLAY_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* Local headers */
+#include "samp.h"
+#include "sftrack.h"
+
+extern bool play_sftrack(unsigned int       flags,
+                         const SFTrack     *music_data,
+                         const char        *samples_dir,
+                         const SampleArray *sf_samples,
+                         FILE              *out);
+
+extern bool render_sftrack(unsigned int       flags,
+                           Reader            *in,
+                           const char        *samples_dir,
+                           const SampleArray *sf_samples,
+                           FILE              *out);
+
+#endif /* SFPLAY_H */
@@ -0,0 +1,528 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Star Fighter 3000 music track
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "samp.h"
+#include "sftrack.h"
+
+enum {
+  SF_VOICE_TABLE_OFFSET = 16,
+  SKIP_BUFFER_SIZE      = 16
+};
+
+static bool skip_bytes(Reader * const r, size_t n)
+{
+  assert(r != NULL);
+
+  /* Read and discard data instead of seeking, so that the input needn't
+     be seekable (e.g. a pipe from another program). */
+  while (n > 0) {
+    uint8_t buf[SKIP_BUFFER_SIZE];
+    const size_t len = n < sizeof(buf) ? n : sizeof(buf);
+    if (reader_fread(buf, len, 1, r) != 1)
+      return false;
+
+    n -= len;
+  }
+  return true;
+}
+
+bool sftrack_read_header(SFTrack * const music_data, Reader * const r)
+{
+  assert(r != NULL);
+  assert(!reader_ferror(r));
+  assert(music_data != NULL);
+
+  *music_data = (SFTrack){
+    .speed = 0,
+    .voice_table = {0},
+    .last_pattern_no = 0,
+    .last_stored_no = 0,
+    .pruned = false,
+    .kept_no = {0},
+    .play_order = {0},
+    .patterns = NULL,
+    .events = NULL,
+    .num_events = 0,
+    .events_alloc = 0,
+  };
+
+  /* First byte of Star Fighter 3000 music data gives the tempo as an interval
+     between divisions (in centiseconds). */
+
+  const int s = reader_fgetc(r);
+  if (s == EOF) {
+    fprintf(stderr, "Failed to read tempo\n");
+    return false;
+  }
+
+  LOGF(LogLevel_Info, LogCategory_Decode, "SF3000 music tempo is %d cs", s);
+
+  music_data->speed = s;
+
+  /* The tempo was the first byte. */
+  if (!skip_bytes(r, SF_VOICE_TABLE_OFFSET - 1)) {
+    fprintf(stderr, "Failed to skip to voice table\n");
+    return false;
+  }
+
+  if (reader_fread(music_data->voice_table, sizeof(music_data->voice_table), 1, r) != 1) {
+    fprintf(stderr, "Failed to read voice table\n");
+    return false;
+  }
+
+  if (!reader_fread_int32(&music_data->last_pattern_no, r)) {
+    fprintf(stderr, "Failed to read no. of patterns\n");
+    return false;
+  }
+
+  if (music_data->last_pattern_no < 0) {
+    fprintf(stderr, "Bad no. of patterns\n");
+    return false;
+  }
+
+  music_data->last_stored_no = music_data->last_pattern_no;
+
+  if (!skip_bytes(r, 4)) {
+    fprintf(stderr, "Failed to skip to play order\n");
+    return false;
+  }
+
+  if (reader_fread(music_data->play_order, sizeof(music_data->play_order), 1, r) != 1) {
+    fprintf(stderr, "Failed to read play order\n");
+    return false;
+  }
+
+  return true;
+}
+
+static bool reserve_events(SFTrack * const music_data, const size_t n)
+{
+  assert(music_data != NULL);
+
+  if (music_data->events_alloc - music_data->num_events >= n)
+    return true;
+
+  size_t new_alloc = music_data->events_alloc ?
+                     music_data->events_alloc * 2 : n;
+  if (new_alloc < music_data->num_events + n)
+    new_alloc = music_data->num_events + n;
+
+  _Optional SFEvent * const events =
+    realloc(music_data->events, new_alloc * sizeof(*events));
+  if (events == NULL) {
+    fprintf(stderr, "Failed to allocate %zu bytes for SF3000 patterns data\n",
+            new_alloc * sizeof(*events));
+    return false;
+  }
+
+  music_data->events = events;
+  music_data->events_alloc = new_alloc;
+  return true;
+}
+
+static void decode_command(const SFTrack * const music_data,
+                           const uint8_t raw[SF_COMMAND_SIZE],
+                           SFEvent * const event)
+{
+  assert(music_data != NULL);
+  assert(raw != NULL);
+  assert(event != NULL);
+
+  /* Byte 0 is the note, byte 1 the octave (low nibble) and volume (high
+     nibble), byte 2 the voice (low nibble) and action (high nibble) and
+     byte 3 the number of repeats (high nibble). */
+  *event = (SFEvent){
+    .type = raw[2] >> 4 >= SF_GLISSANDO_THRESHOLD ? SFEventType_Glissando :
+                                                    SFEventType_Note,
+    .sample_num = music_data->voice_table[raw[2] & 0xf],
+    .octave = raw[1] & 0xf,
+    .note = raw[0] & 0xf,
+    .volume = raw[1] >> 4,
+    .repeats = raw[3] >> 4,
+    .run = 1,
+  };
+}
+
+static bool decode_pattern(SFTrack * const music_data, Reader * const r,
+                           const long int stored_no,
+                           const long int pattern_no)
+{
+  assert(music_data != NULL);
+  assert(music_data->patterns != NULL);
+  assert(r != NULL);
+  assert(stored_no >= 0);
+  assert(stored_no <= music_data->last_stored_no);
+  assert(pattern_no >= 0);
+  assert(pattern_no <= music_data->last_pattern_no);
+
+  /* A pattern can't comprise more events than cells, because consecutive
+     empty cells are coalesced. */
+  if (!reserve_events(music_data, NUM_SF_DIVISIONS * NUM_SF_CHANNELS))
+    return false;
+
+  SFEvent * const events = &*music_data->events;
+  const size_t first = music_data->num_events;
+  size_t n = first;
+  bool empty_run = false;
+
+  for (int division_no = 0; division_no < NUM_SF_DIVISIONS; division_no++) {
+    for (int c = 0; c < NUM_SF_CHANNELS; c++) {
+      uint8_t raw[SF_COMMAND_SIZE];
+      if (reader_fread(raw, sizeof(raw), 1, r) != 1) {
+        fprintf(stderr,
+                "Failed to read channel %d (division %d of pattern %ld)\n",
+                c, division_no, stored_no);
+        return false;
+      }
+
+      if (raw[0] == 0 && raw[1] == 0 && raw[2] == 0 && raw[3] == 0) {
+        /* No command here. */
+        if (empty_run) {
+          events[n - 1].run++;
+        } else {
+          events[n++] = (SFEvent){.type = SFEventType_Empty, .run = 1};
+          empty_run = true;
+        }
+      } else {
+        decode_command(music_data, raw, &events[n++]);
+        empty_run = false;
+      }
+    }
+  }
+
+  /* Trailing empty cells needn't be stored. */
+  if (empty_run)
+    n--;
+
+  music_data->patterns[pattern_no] = (SFPatternEvents){
+    .first = first,
+    .count = n - first,
+  };
+  music_data->num_events = n;
+  return true;
+}
+
+static void pass_patterns(const SFTrack * const music_data,
+                          const bool ready[SF_END_OF_ORDER],
+                          long int * const next_no,
+                          _Optional SFTrackPatternFn * const fn,
+                          void * const arg)
+{
+  assert(music_data != NULL);
+  assert(music_data->pruned);
+  assert(ready != NULL);
+  assert(next_no != NULL);
+
+  /* Kept patterns are numbered in order of their first appearance in the
+     play order, not the order in which they are stored, so each is passed
+     to the caller only when all of those before it have been read. */
+  for (; *next_no <= music_data->last_pattern_no && ready[*next_no];
+       ++*next_no) {
+    if (fn != NULL)
+      fn(music_data, *next_no, arg);
+  }
+}
+
+bool sftrack_stream_patterns(SFTrack * const music_data, Reader * const r,
+                             _Optional SFTrackPatternFn * const fn,
+                             void * const arg)
+{
+  assert(r != NULL);
+  assert(!reader_ferror(r));
+  assert(music_data != NULL);
+  assert(music_data->patterns == NULL);
+  assert(music_data->events == NULL);
+
+  /* The pattern data follows the play order. Each cell is decoded once,
+     as it is read, so that no consumer need interpret the raw bit fields. */
+  assert(music_data->last_pattern_no >= 0);
+  size_t const bytes = ((size_t)music_data->last_pattern_no + 1) *
+                       sizeof(SFPatternEvents);
+  music_data->patterns = malloc(bytes);
+  if (music_data->patterns == NULL) {
+    fprintf(stderr, "Failed to allocate %zu bytes for SF3000 patterns data\n", bytes);
+    return false;
+  }
+
+  /* A pattern that is played but isn't stored is treated as blank. */
+  bool ready[SF_END_OF_ORDER] = {false};
+  long int next_no = 0;
+  if (music_data->pruned) {
+    for (long int p = music_data->last_stored_no + 1; p < SF_END_OF_ORDER;
+         p++) {
+      const int kept_no = music_data->kept_no[p];
+      if (kept_no != SF_END_OF_ORDER) {
+        music_data->patterns[kept_no] = (SFPatternEvents){.first = 0,
+                                                          .count = 0};
+        ready[kept_no] = true;
+      }
+    }
+  }
+
+  bool success = true;
+  for (long int stored_no = 0;
+       stored_no <= music_data->last_stored_no && success;
+       stored_no++)
+  {
+    Fortify_CheckAllMemory();
+
+    long int pattern_no = stored_no;
+    if (music_data->pruned) {
+      pattern_no = stored_no < SF_END_OF_ORDER ?
+                   music_data->kept_no[stored_no] : SF_END_OF_ORDER;
+
+      /* Patterns that are never played needn't be decoded. */
+      if (pattern_no == SF_END_OF_ORDER) {
+        LOGF(LogLevel_Debug, LogCategory_Decode, "Skipping pattern %ld",
+             stored_no);
+
+        success = skip_bytes(r, (size_t)NUM_SF_DIVISIONS * NUM_SF_CHANNELS *
+                                SF_COMMAND_SIZE);
+        if (!success)
+          fprintf(stderr, "Failed to skip pattern %ld\n", stored_no);
+
+        continue;
+      }
+    }
+
+    LOGF(LogLevel_Debug, LogCategory_Decode, "Reading pattern %ld",
+         stored_no);
+
+    success = decode_pattern(music_data, r, stored_no, pattern_no);
+
+    /* Let the caller start work on each pattern as soon as it arrives. */
+    if (success) {
+      if (!music_data->pruned) {
+        if (fn != NULL)
+          fn(music_data, pattern_no, arg);
+      } else {
+        ready[pattern_no] = true;
+        pass_patterns(music_data, ready, &next_no, fn, arg);
+      }
+    }
+  }
+
+  if (success && music_data->pruned) {
+    /* Any blank patterns that were never preceded by a stored pattern. */
+    pass_patterns(music_data, ready, &next_no, fn, arg);
+    assert(next_no == music_data->last_pattern_no + 1);
+  }
+
+  if (success) {
+    LOGF(LogLevel_Info, LogCategory_Decode, "Decoded %zu events from %ld "
+         "patterns", music_data->num_events,
+         (long)music_data->last_pattern_no + 1);
+  } else {
+    sftrack_destroy(music_data);
+  }
+
+  return success;
+}
+
+bool sftrack_read_patterns(SFTrack * const music_data, Reader * const r)
+{
+  return sftrack_stream_patterns(music_data, r, NULL, NULL);
+}
+
+bool sftrack_read(SFTrack * const music_data, Reader * const r)
+{
+  return sftrack_read_header(music_data, r) &&
+         sftrack_read_patterns(music_data, r);
+}
+
+void sftrack_prune(SFTrack * const music_data)
+{
+  assert(music_data != NULL);
+  assert(music_data->last_pattern_no >= 0);
+  assert(music_data->patterns == NULL);
+  assert(!music_data->pruned);
+
+  /* Number the patterns in order of their first appearance in the play
+     order. This is known before any patterns have been read, so those that
+     aren't played are skipped instead of being decoded. */
+  int new_no[SF_END_OF_ORDER];
+  for (int p = 0; p < SF_END_OF_ORDER; p++)
+    new_no[p] = -1;
+
+  const int song_len = sftrack_song_len(music_data);
+  int count = 0;
+  for (int pos = 0; pos < song_len; pos++) {
+    const int pattern_no = music_data->play_order[pos];
+    if (new_no[pattern_no] < 0)
+      new_no[pattern_no] = count++;
+  }
+
+  if (count == 0)
+    return; /* Nothing is played, so keep everything. */
+
+  LOGF(LogLevel_Info, LogCategory_Decode, "Keeping %d of %ld patterns",
+       count, (long)music_data->last_stored_no + 1);
+
+  for (int p = 0; p < SF_END_OF_ORDER; p++)
+    music_data->kept_no[p] = new_no[p] < 0 ? SF_END_OF_ORDER :
+                                             (uint8_t)new_no[p];
+
+  for (int pos = 0; pos < song_len; pos++)
+    music_data->play_order[pos] = (uint8_t)new_no[music_data->play_order[pos]];
+
+  music_data->last_pattern_no = count - 1;
+  music_data->pruned = true;
+}
+
+void sftrack_destroy(SFTrack * const music_data)
+{
+  assert(music_data != NULL);
+  free(music_data->patterns);
+  music_data->patterns = NULL;
+  free(music_data->events);
+  music_data->events = NULL;
+  music_data->num_events = music_data->events_alloc = 0;
+}
+
+int sftrack_song_len(const SFTrack * const music_data)
+{
+  assert(music_data != NULL);
+
+  /* There is no record of the song length in a SF3000 music file, so
+     iterate through the play order in search of the terminator. */
+  int song_len;
+  for (song_len = 0; song_len < MAX_SF_PATTERNS; song_len++) {
+    /* Is this the end of the play list? */
+    if (music_data->play_order[song_len] == SF_END_OF_ORDER)
+      break; /* found the terminator */
+  }
+
+  return song_len;
+}
+
+void sftrack_cursor_init(const SFTrack * const music_data,
+                         const long int pattern_no,
+                         SFEventCursor * const cursor)
+{
+  assert(music_data != NULL);
+  assert(cursor != NULL);
+
+  /* A pattern that doesn't exist is treated as blank. */
+  static const SFEvent none;
+  *cursor = (SFEventCursor){.next = &none, .end = &none, .cell = 0};
+
+  if (pattern_no < 0 || pattern_no > music_data->last_pattern_no ||
+      !music_data->patterns || !music_data->events)
+    return;
+
+  const SFPatternEvents * const pattern = &music_data->patterns[pattern_no];
+  cursor->next = &music_data->events[pattern->first];
+  cursor->end = cursor->next + pattern->count;
+}
+
+_Optional const SFEvent *sftrack_cursor_next(SFEventCursor * const cursor,
+                                             int * const division_no,
+                                             int * const channel)
+{
+  assert(cursor != NULL);
+  assert(division_no != NULL);
+  assert(channel != NULL);
+
+  /* Returns the next command (skipping empty cells), or NULL at the end
+     of the pattern. */
+  while (cursor->next < cursor->end) {
+    const SFEvent * const event = cursor->next++;
+    const int cell = cursor->cell;
+    cursor->cell += event->run;
+    assert(cursor->cell <= NUM_SF_DIVISIONS * NUM_SF_CHANNELS);
+
+    if (event->type != SFEventType_Empty) {
+      *division_no = cell / NUM_SF_CHANNELS;
+      *channel = cell % NUM_SF_CHANNELS;
+      return event;
+    }
+  }
+  return NULL;
+}
+
+void sftrack_expand(const SFTrack * const music_data,
+                    const long int pattern_no,
+                    SFEventGrid * const grid)
+{
+  assert(music_data != NULL);
+  assert(grid != NULL);
+
+  for (int d = 0; d < NUM_SF_DIVISIONS; d++) {
+    for (int c = 0; c < NUM_SF_CHANNELS; c++)
+      grid->cells[d][c] = NULL;
+  }
+
+  SFEventCursor cursor;
+  sftrack_cursor_init(music_data, pattern_no, &cursor);
+
+  int d, c;
+  for (_Optional const SFEvent *event = sftrack_cursor_next(&cursor, &d, &c);
+       event != NULL;
+       event = sftrack_cursor_next(&cursor, &d, &c))
+    grid->cells[d][c] = event;
+}
+
+_Optional const SampleInfo *sftrack_note_sample(
+                                     const SampleArray * const sf_samples,
+                                     _Optional const SFEvent * const event,
+                                     const bool allow_sfx)
+{
+  assert(sf_samples != NULL);
+
+  /* Returns the sample to be played if the given event plays a note,
+     otherwise NULL. */
+  if (!event || event->type != SFEventType_Note)
+    return NULL; /* No note here (e.g. a glissando effect). */
+
+  const int sample_num = event->sample_num;
+  if (sample_num >= sf_samples->count || !sf_samples->sample_info)
+    return NULL; /* undefined sample */
+
+  _Optional const SampleInfo * const sample =
+    &sf_samples->sample_info[sample_num];
+
+  switch (sample->type) {
+    case SampleInfo_Type_Unused:
+      return NULL; /* undefined sample */
+
+    case SampleInfo_Type_Effect:
+      if (!allow_sfx)
+        return NULL; /* Sound effects not allowed during music */
+      break;
+
+    default:
+      assert(sample->type == SampleInfo_Type_Music);
+      break;
+  }
+
+  return sample;
+}
@@ -0,0 +1,124 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Star Fighter 3000 music track
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef SFTRACK_H
+#define SFTRACK_H
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* StreamLib headers */
+#include "Reader.h"
+
+/* Local headers */
+#include "samp.h"
+
+#if !defined(USE_OPTIONAL) && !defined(_Optional)
+#define _Optional
+#endif
+
+/* The following values are dictated by the SF3000 music file format */
+enum {
+  MAX_SF_PATTERNS        = 64,
+  SF_MAX_VOLUME          = 15,
+  SF_MAX_REPEATS         = 15,
+  SF_GLISSANDO_THRESHOLD = 2, /* Values below this mean 'play note' */
+  SF_TUNING_OCTAVE       = 4096, /* Tuning units per octave */
+  SF_END_OF_ORDER        = 255, /* Terminates the play order */
+  SF_COMMAND_SIZE        = 4, /* Bytes per channel per division */
+  NUM_SF_CHANNELS        = 4,
+  NUM_SF_VOICES          = 16,
+  NUM_SF_DIVISIONS       = 64
+};
+
+/* Decoded commands are stored as a stream of events, in order of division
+   then channel, instead of as the raw bit fields of every cell. */
+typedef enum {
+  SFEventType_Empty,    /* No command for a run of cells */
+  SFEventType_Note,     /* Play a note */
+  SFEventType_Glissando /* Slide notes playing the same sample to a pitch */
+} SFEventType;
+
+typedef struct {
+  uint8_t  type;       /* SFEventType */
+  uint8_t  sample_num; /* Looked up in the voice table */
+  uint8_t  octave;
+  uint8_t  note;       /* Semitone within the octave */
+  uint8_t  volume;     /* 0..SF_MAX_VOLUME */
+  uint8_t  repeats;    /* 0..SF_MAX_REPEATS (which means forever) */
+  uint16_t run;        /* No. of cells covered (1 unless empty) */
+} SFEvent;
+
+typedef struct {
+  size_t first; /* Index of the first event of a pattern */
+  size_t count; /* Cells after the last event are empty */
+} SFPatternEvents;
+
+typedef struct {
+  uint8_t speed;
+  uint8_t voice_table[NUM_SF_VOICES];
+  int32_t last_pattern_no;
+  int32_t last_stored_no; /* Differs from last_pattern_no if pruned */
+  bool pruned;
+  uint8_t kept_no[SF_END_OF_ORDER]; /* New no. of each stored pattern if
+                                       pruned, or SF_END_OF_ORDER if unused */
+  uint8_t play_order[MAX_SF_PATTERNS];
+  _Optional SFPatternEvents *patterns;
+  _Optional SFEvent *events;
+  size_t num_events;
+  size_t events_alloc;
+} SFTrack;
+
+/* Sequential access to the commands of one pattern */
+typedef struct {
+  const SFEvent *next, *end;
+  int cell; /* Index of the first cell covered by the next event */
+} SFEventCursor;
+
+/* Random access to the commands of one pattern (NULL if empty) */
+typedef struct {
+  _Optional const SFEvent *cells[NUM_SF_DIVISIONS][NUM_SF_CHANNELS];
+} SFEventGrid;
+
+/* Called after each pattern has been read, in ascending order (of the
+   pattern numbers after pruning) */
+typedef void SFTrackPatternFn(const SFTrack *music_data, long int pattern_no,
+                              void *arg);
+
+extern bool sftrack_read_header(SFTrack *music_data, Reader *r);
+
+extern bool sftrack_stream_patterns(SFTrack *music_data, Reader *r,
+                                    _Optional SFTrackPatternFn *fn,
+                                    void *arg);
+
+extern bool sftrack_read_patterns(SFTrack *music_data, Reader *r);
+
+extern bool sftrack_read(SFTrack *music_data, Reader *r);
+
+extern void sftrack_prune(SFTrack *music_data);
+
+extern void sftrack_destroy(SFTrack *music_data);
+
+extern int sftrack_song_len(const SFTrack *music_data);
+
+extern void sftrack_cursor_init(const SFTrack *music_data, long int pattern_no,
+                                SFEventCursor *cursor);
+
+extern _Optional const SFEvent *sftrack_cursor_next(SFEventCursor *cursor,
+                                                    int *division_no,
+                                                    int *channel);
+
+extern void sftrack_expand(const SFTrack *music_data, long int pattern_no,
+                           SFEventGrid *grid);
+
+extern _Optional const SampleInfo *sftrack_note_sample(
+                                     const SampleArray *sf_samples,
+                                     _Optional const SFEvent *event,
+                                     bool allow_sfx);
+
+#endif /* SFTRACK_H */
@@ -0,0 +1,335 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Sequential reading and writing of tar archives
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+/* Local header files */
+#include "misc.h"
+#include "tar.h"
+
+/* The following values are dictated by the POSIX ustar format */
+enum {
+  TAR_BLOCK_SIZE      = 512,
+  TAR_NAME_OFFSET     = 0,
+  TAR_NAME_SIZE       = 100,
+  TAR_MODE_OFFSET     = 100,
+  TAR_UID_OFFSET      = 108,
+  TAR_GID_OFFSET      = 116,
+  TAR_ID_SIZE         = 8, /* Also the size of the mode */
+  TAR_SIZE_OFFSET     = 124,
+  TAR_MTIME_OFFSET    = 136,
+  TAR_NUMBER_SIZE     = 12, /* Size and modification time */
+  TAR_CHKSUM_OFFSET   = 148,
+  TAR_CHKSUM_SIZE     = 8,
+  TAR_TYPE_OFFSET     = 156,
+  TAR_MAGIC_OFFSET    = 257,
+  TAR_VERSION_OFFSET  = 263,
+  TAR_PREFIX_OFFSET   = 345,
+  TAR_PREFIX_SIZE     = 155,
+  TAR_END_BLOCKS      = 2 /* No. of zero-filled blocks at the end */
+};
+
+static const char ustar_magic[] = "ustar";
+
+static unsigned long padding(const unsigned long size)
+{
+  return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+static size_t field_len(const char * const field, const size_t size)
+{
+  assert(field != NULL);
+
+  size_t len = 0;
+  while (len < size && field[len] != '\0')
+    len++;
+  return len;
+}
+
+static bool parse_number(const unsigned char * const field, const size_t len,
+                         unsigned long * const value)
+{
+  assert(field != NULL);
+  assert(value != NULL);
+
+  /* Octal digits, optionally preceded by spaces and followed by spaces or
+     string terminators. Base 256 encoding of large values isn't needed
+     for music files. */
+  size_t i = 0;
+  while (i < len && field[i] == ' ')
+    i++;
+
+  unsigned long n = 0;
+  bool digits = false;
+  for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+    if (n > ULONG_MAX >> 3)
+      return false;
+
+    n = (n << 3) | (unsigned long)(field[i] - '0');
+    digits = true;
+  }
+
+  for (; i < len; i++) {
+    if (field[i] != ' ' && field[i] != '\0')
+      return false;
+  }
+
+  *value = n;
+  return digits;
+}
+
+static unsigned long checksum(const unsigned char block[TAR_BLOCK_SIZE])
+{
+  assert(block != NULL);
+
+  /* The checksum field itself is counted as if it were all spaces. */
+  unsigned long sum = 0;
+  for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+    sum += i >= TAR_CHKSUM_OFFSET && i < TAR_CHKSUM_OFFSET + TAR_CHKSUM_SIZE ?
+           (unsigned long)' ' : block[i];
+  }
+  return sum;
+}
+
+static void drain(FILE * const in)
+{
+  assert(in != NULL);
+
+  /* Consume anything after the end of the archive (e.g. padding to the
+     record size used by 'tar') so that a program writing to a pipe isn't
+     stopped by it being closed early. */
+  char buf[BUFSIZ];
+  while (fread(buf, 1, sizeof(buf), in) == sizeof(buf)) {}
+}
+
+static bool skip_bytes(FILE * const in, unsigned long n)
+{
+  assert(in != NULL);
+
+  /* Read and discard data instead of seeking, because the archive is
+     typically piped from another program. */
+  while (n > 0) {
+    unsigned char buf[TAR_BLOCK_SIZE];
+    const size_t len = n < sizeof(buf) ? (size_t)n : sizeof(buf);
+    if (fread(buf, len, 1, in) != 1) {
+      fprintf(stderr, "Failed to read tar entry data\n");
+      return false;
+    }
+    n -= len;
+  }
+  return true;
+}
+
+bool tar_read_data(FILE * const in, void * const buf,
+                   const unsigned long size)
+{
+  assert(in != NULL);
+  assert(buf != NULL || size == 0);
+
+  if (size > 0 && fread(buf, size, 1, in) != 1) {
+    fprintf(stderr, "Failed to read tar entry data\n");
+    return false;
+  }
+
+  return skip_bytes(in, padding(size));
+}
+
+bool tar_skip_data(FILE * const in, const unsigned long size)
+{
+  return skip_bytes(in, size + padding(size));
+}
+
+bool tar_read_header(FILE * const in, TarEntry * const entry,
+                     bool * const end)
+{
+  assert(in != NULL);
+  assert(entry != NULL);
+  assert(end != NULL);
+
+  *end = false;
+  bool long_name = false;
+
+  for (;;) {
+    unsigned char block[TAR_BLOCK_SIZE];
+    const size_t n = fread(block, 1, sizeof(block), in);
+    if (n == 0 && feof(in)) {
+      /* Tolerate a missing end-of-archive marker. */
+      *end = true;
+      return true;
+    }
+
+    if (n != sizeof(block)) {
+      fprintf(stderr, "Failed to read tar header\n");
+      return false;
+    }
+
+    bool zero = true;
+    for (size_t i = 0; i < sizeof(block) && zero; i++)
+      zero = block[i] == 0;
+
+    if (zero) {
+      drain(in);
+      *end = true;
+      return true;
+    }
+
+    unsigned long sum;
+    if (!parse_number(block + TAR_CHKSUM_OFFSET, TAR_CHKSUM_SIZE, &sum) ||
+        sum != checksum(block)) {
+      fprintf(stderr, "Bad checksum in tar header\n");
+      return false;
+    }
+
+    if (!parse_number(block + TAR_SIZE_OFFSET, TAR_NUMBER_SIZE,
+                      &entry->size)) {
+      fprintf(stderr, "Bad size in tar header\n");
+      return false;
+    }
+
+    if (!parse_number(block + TAR_MTIME_OFFSET, TAR_NUMBER_SIZE,
+                      &entry->mtime))
+      entry->mtime = 0;
+
+    const char type = (char)block[TAR_TYPE_OFFSET];
+    if (type == 'L') {
+      /* GNU tar stores a long name as the data of a pseudo-entry that
+         precedes the entry to which it belongs. */
+      if (entry->size >= sizeof(entry->name)) {
+        fprintf(stderr, "Name of tar entry is too long\n");
+        return false;
+      }
+
+      if (!tar_read_data(in, entry->name, entry->size))
+        return false;
+
+      entry->name[entry->size] = '\0';
+      long_name = true;
+      continue;
+    }
+
+    if (!long_name) {
+      /* A ustar name can be split, without its separator, between the
+         prefix and name fields. Neither need be terminated if full. */
+      const char * const prefix = (const char *)block + TAR_PREFIX_OFFSET;
+      const char * const name = (const char *)block + TAR_NAME_OFFSET;
+      const int prefix_len =
+        memcmp(block + TAR_MAGIC_OFFSET, ustar_magic, sizeof(ustar_magic) - 1) == 0 ?
+        (int)field_len(prefix, TAR_PREFIX_SIZE) : 0;
+
+      sprintf(entry->name, "%.*s%s%.*s", prefix_len, prefix,
+              prefix_len > 0 ? "/" : "",
+              (int)field_len(name, TAR_NAME_SIZE), name);
+    }
+
+    entry->regular = type == '0' || type == '\0' || type == '7';
+    return true;
+  }
+}
+
+static void put_number(unsigned char * const field, const size_t len,
+                       const unsigned long value)
+{
+  assert(field != NULL);
+  assert(len > 1);
+
+  /* Zero-padded octal digits followed by a string terminator */
+  unsigned long n = value;
+  field[len - 1] = '\0';
+  for (size_t i = len - 1; i > 0; i--) {
+    field[i - 1] = (unsigned char)('0' + (n & 7));
+    n >>= 3;
+  }
+}
+
+bool tar_write_entry(FILE * const out, const TarEntry * const entry,
+                     const void * const data)
+{
+  assert(out != NULL);
+  assert(entry != NULL);
+  assert(data != NULL || entry->size == 0);
+
+  unsigned char block[TAR_BLOCK_SIZE] = {0};
+
+  /* Split a long name at a directory separator, if possible. */
+  const size_t len = strlen(entry->name);
+  size_t split = 0;
+  if (len > TAR_NAME_SIZE) {
+    const char *sep = entry->name + len - TAR_NAME_SIZE - 1;
+    while (*sep != '\0' && *sep != '/')
+      sep++;
+
+    split = (size_t)(sep - entry->name);
+    if (*sep == '\0' || split == 0 || split > TAR_PREFIX_SIZE) {
+      fprintf(stderr, "Name of tar entry '%s' is too long\n", entry->name);
+      return false;
+    }
+    memcpy(block + TAR_PREFIX_OFFSET, entry->name, split);
+    split++;
+  }
+  memcpy(block + TAR_NAME_OFFSET, entry->name + split, len - split);
+
+  if (entry->size > 077777777777ul) {
+    fprintf(stderr, "Tar entry '%s' is too big\n", entry->name);
+    return false;
+  }
+
+  put_number(block + TAR_MODE_OFFSET, TAR_ID_SIZE, 0644);
+  put_number(block + TAR_UID_OFFSET, TAR_ID_SIZE, 0);
+  put_number(block + TAR_GID_OFFSET, TAR_ID_SIZE, 0);
+  put_number(block + TAR_SIZE_OFFSET, TAR_NUMBER_SIZE, entry->size);
+  put_number(block + TAR_MTIME_OFFSET, TAR_NUMBER_SIZE,
+             entry->mtime & 077777777777ul);
+  block[TAR_TYPE_OFFSET] = '0';
+  memcpy(block + TAR_MAGIC_OFFSET, ustar_magic, sizeof(ustar_magic));
+  memcpy(block + TAR_VERSION_OFFSET, "00", 2);
+
+  /* Six digits, a string terminator and a space (for historical reasons) */
+  put_number(block + TAR_CHKSUM_OFFSET, TAR_CHKSUM_SIZE - 1, checksum(block));
+  block[TAR_CHKSUM_OFFSET + TAR_CHKSUM_SIZE - 1] = ' ';
+
+  static const unsigned char zeros[TAR_BLOCK_SIZE];
+  const size_t pad = (size_t)padding(entry->size);
+
+  if (fwrite(block, sizeof(block), 1, out) != 1 ||
+      (entry->size > 0 && fwrite(data, entry->size, 1, out) != 1) ||
+      (pad > 0 && fwrite(zeros, pad, 1, out) != 1)) {
+    fprintf(stderr, "Failed to write tar entry '%s'\n", entry->name);
+    return false;
+  }
+
+  return true;
+}
+
+bool tar_write_end(FILE * const out)
+{
+  assert(out != NULL);
+
+  static const unsigned char zeros[TAR_BLOCK_SIZE * TAR_END_BLOCKS];
+  if (fwrite(zeros, sizeof(zeros), 1, out) != 1) {
+    fprintf(stderr, "Failed to write end of tar archive\n");
+    return false;
+  }
+
+  return true;
+}
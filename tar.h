@@ -0,0 +1,37 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Sequential reading and writing of tar archives
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+enum {
+  TAR_MAX_NAME = 257 /* Prefix, separator, name and string terminator */
+};
+
+typedef struct {
+  char          name[TAR_MAX_NAME];
+  unsigned long size;
+  unsigned long mtime;
+  bool          regular; /* false for directories, links, etc. */
+} TarEntry;
+
+extern bool tar_read_header(FILE *in, TarEntry *entry, bool *end);
+
+extern bool tar_read_data(FILE *in, void *buf, unsigned long size);
+
+extern bool tar_skip_data(FILE *in, unsigned long size);
+
+extern bool tar_write_entry(FILE *out, const TarEntry *entry,
+                            const void *data);
+
+extern bool tar_write_end(FILE *out);
+
+#endif /* TAR_H */
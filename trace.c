@@ -0,0 +1,185 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Timeline of processing in Chrome trace event format
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* Declare clock_gettime even when compiling for strict ISO C. This must
+   precede the first header file to have any effect. */
+#define _POSIX_C_SOURCE 200809L
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <unistd.h> /* Required for getpid */
+#define HAVE_GETPID
+#define HAVE_CLOCK_GETTIME
+#endif
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+/* Local header files */
+#include "misc.h"
+#include "json.h"
+#include "trace.h"
+
+static _Optional FILE *trace_file;
+static unsigned long long origin;
+static long int trace_pid;
+
+static unsigned long long clock_us(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts))
+    return 0;
+
+  return (unsigned long long)ts.tv_sec * 1000000u +
+         (unsigned long long)ts.tv_nsec / 1000u;
+#else
+  /* Processor time is the best that standard C offers, but on RISC OS it is
+     the same as elapsed time. */
+  return (unsigned long long)clock() * 1000000u / CLOCKS_PER_SEC;
+#endif
+}
+
+static long int thread_id(void)
+{
+  /* Each job started by '-jobs' is a separate process, so its process ID
+     identifies the thread of execution. */
+#ifdef HAVE_GETPID
+  return (long int)getpid();
+#else
+  return 1;
+#endif
+}
+
+bool trace_open(const char * const file_name)
+{
+  assert(file_name != NULL);
+  assert(trace_file == NULL);
+
+  /* Create the file, then reopen it for appending so that events written
+     by concurrent jobs don't overwrite each other. */
+  _Optional FILE *f = fopen(file_name, "w");
+  if (f != NULL) {
+    if (fputs("[\n", &*f) == EOF) {
+      fclose(&*f);
+      f = NULL;
+    } else if (fclose(&*f)) {
+      f = NULL;
+    } else {
+      f = fopen(file_name, "a");
+    }
+  }
+
+  if (f == NULL) {
+    fprintf(stderr, "Failed to create trace file: %s\n", strerror(errno));
+    return false;
+  }
+
+  trace_file = f;
+  trace_pid = thread_id();
+  origin = clock_us();
+  return true;
+}
+
+bool trace_close(void)
+{
+  if (trace_file == NULL)
+    return true;
+
+  /* Chrome accepts an unterminated array (e.g. if the program crashed), but
+     end it with an event naming the process so that it is valid JSON. */
+  fprintf(&*trace_file, "{\"name\":\"process_name\",\"ph\":\"M\","
+          "\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"SF3KtoProT\"}}\n]\n",
+          trace_pid, trace_pid);
+
+  bool success = !ferror(&*trace_file);
+  if (fclose(&*trace_file))
+    success = false;
+
+  trace_file = NULL;
+
+  if (!success)
+    fprintf(stderr, "Failed writing to trace file: %s\n", strerror(errno));
+
+  return success;
+}
+
+TraceTime trace_now(void)
+{
+  if (trace_file == NULL)
+    return 0;
+
+  return clock_us() - origin;
+}
+
+static void put_event(const char * const name, const TraceTime start,
+                      _Optional const char * const arg_name,
+                      _Optional const char * const string_value,
+                      const long int number_value)
+{
+  assert(name != NULL);
+  assert(trace_file != NULL);
+
+  /* Complete events ("X") give the start and duration of a span in one
+     line, so a span can't be left open by an early return. */
+  FILE * const f = &*trace_file;
+  const TraceTime end = trace_now();
+  fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+          "\"pid\":%ld,\"tid\":%ld", name, start,
+          end > start ? end - start : 0, trace_pid, thread_id());
+
+  if (arg_name != NULL) {
+    fprintf(f, ",\"args\":{\"%s\":", &*arg_name);
+    if (string_value != NULL)
+      json_put_string(&*string_value, f);
+    else
+      fprintf(f, "%ld", number_value);
+    fputc('}', f);
+  }
+
+  /* Write each event in one go, so that events from concurrent jobs are
+     never interleaved. */
+  fputs("},\n", f);
+  fflush(f);
+}
+
+void trace_span(const char * const name, const TraceTime start)
+{
+  if (trace_file != NULL)
+    put_event(name, start, NULL, NULL, 0);
+}
+
+void trace_span_string(const char * const name, const TraceTime start,
+                       const char * const arg_name, const char * const value)
+{
+  if (trace_file != NULL)
+    put_event(name, start, arg_name, value, 0);
+}
+
+void trace_span_number(const char * const name, const TraceTime start,
+                       const char * const arg_name, const long int value)
+{
+  if (trace_file != NULL)
+    put_event(name, start, arg_name, NULL, value);
+}
@@ -0,0 +1,30 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Timeline of processing in Chrome trace event format
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/* ISO library header files */
+#include <stdbool.h>
+
+/* Microseconds since the trace was opened, or 0 if not tracing */
+typedef unsigned long long TraceTime;
+
+extern bool trace_open(const char *file_name);
+
+extern bool trace_close(void);
+
+extern TraceTime trace_now(void);
+
+extern void trace_span(const char *name, TraceTime start);
+
+extern void trace_span_string(const char *name, TraceTime start,
+                              const char *arg_name, const char *value);
+
+extern void trace_span_number(const char *name, TraceTime start,
+                              const char *arg_name, long int value);
+
+#endif /* TRACE_H */
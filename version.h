@@ -7,6 +7,6 @@
 #ifndef VERSION_H
 #define VERSION_H
 
-#define VERSION_STRING "0.12 [23 May 2025]"
+#define VERSION_STRING "0.13 [18 Oct 2026]"
 
 #endif /* VERSION_H */
@@ -0,0 +1,211 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Notification of changes to files
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h> /* Required for read and close */
+#define HAVE_INOTIFY
+#endif
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Local header files */
+#include "misc.h"
+#include "log.h"
+#include "watch.h"
+
+enum {
+  SETTLE_TIME = 100, /* Milliseconds without changes before a burst of
+                        changes is deemed to be over */
+  MAX_DIR_PATH = 1024
+};
+
+#ifdef HAVE_INOTIFY
+static int watch_fd = -1;
+static _Optional int *dirs; /* Watch descriptor of each directory */
+static int num_dirs, alloc_dirs;
+#endif
+
+bool watch_open(void)
+{
+#ifdef HAVE_INOTIFY
+  assert(watch_fd < 0);
+
+  watch_fd = inotify_init();
+  if (watch_fd < 0) {
+    fprintf(stderr, "Failed to start watching files: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+#else
+  fputs("Watching files is not supported on this platform\n", stderr);
+  return false;
+#endif
+}
+
+int watch_add_dir(const char * const dir_path)
+{
+  assert(dir_path != NULL);
+
+#ifdef HAVE_INOTIFY
+  assert(watch_fd >= 0);
+
+  LOGF(LogLevel_Info, LogCategory_Decode, "Watching directory '%s'",
+       dir_path);
+
+  const int wd = inotify_add_watch(watch_fd, dir_path,
+                                   IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    fprintf(stderr, "Failed to watch directory '%s': %s\n", dir_path,
+            strerror(errno));
+    return -1;
+  }
+
+  /* Adding the same directory again gives the same watch descriptor. */
+  for (int d = 0; d < num_dirs && dirs; d++) {
+    if (dirs[d] == wd)
+      return d;
+  }
+
+  if (num_dirs >= alloc_dirs) {
+    const int new_alloc = alloc_dirs > 0 ? alloc_dirs * 2 : 4;
+    _Optional int * const new_dirs = realloc(dirs, sizeof(*dirs) *
+                                                   (size_t)new_alloc);
+    if (new_dirs == NULL) {
+      fprintf(stderr, "Failed to allocate memory for watched directories\n");
+      return -1;
+    }
+    dirs = new_dirs;
+    alloc_dirs = new_alloc;
+  }
+
+  assert(dirs != NULL);
+  dirs[num_dirs] = wd;
+  return num_dirs++;
+#else
+  (void)dir_path;
+  return -1;
+#endif
+}
+
+int watch_add_parent(const char * const file_path, const char ** const leaf)
+{
+  assert(file_path != NULL);
+  assert(leaf != NULL);
+
+  /* Watch the directory rather than the file, because many editors save a
+     file by writing a new one and renaming it over the original. */
+  const char * const sep = strrchr(file_path, PATH_SEPARATOR);
+  char dir_path[MAX_DIR_PATH];
+  if (sep == NULL) {
+    *leaf = file_path;
+    strcpy(dir_path, ".");
+  } else if ((size_t)(sep - file_path) >= sizeof(dir_path)) {
+    fprintf(stderr, "Path of file '%s' is too long\n", file_path);
+    return -1;
+  } else {
+    *leaf = sep + 1;
+    /* The root directory is the only one whose path ends with a
+       separator. */
+    const size_t len = sep > file_path ? (size_t)(sep - file_path) : 1;
+    memcpy(dir_path, file_path, len);
+    dir_path[len] = '\0';
+  }
+
+  return watch_add_dir(dir_path);
+}
+
+bool watch_wait(WatchFn * const fn, void * const arg)
+{
+  assert(fn != NULL);
+
+#ifdef HAVE_INOTIFY
+  assert(watch_fd >= 0);
+
+  /* Block until something changes, then wait for the burst of changes that
+     typically follows (e.g. when a file is copied in several writes or
+     many files are saved at once) to settle. */
+  for (int timeout = -1; ; timeout = SETTLE_TIME) {
+    struct pollfd pfd = {.fd = watch_fd, .events = POLLIN, .revents = 0};
+    const int ready = poll(&pfd, 1, timeout);
+    if (ready == 0)
+      return true;
+
+    union {
+      struct inotify_event event; /* for alignment */
+      char bytes[4096];
+    } buf;
+
+    const ssize_t len = ready < 0 ? -1 :
+                        read(watch_fd, buf.bytes, sizeof(buf.bytes));
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+
+      fprintf(stderr, "Failed to watch files: %s\n", strerror(errno));
+      return false;
+    }
+
+    /* Each event is followed by the padded name of the file, if any. */
+    for (ssize_t pos = 0; pos < len; ) {
+      const struct inotify_event * const event =
+        (const struct inotify_event *)(buf.bytes + pos);
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOGF(LogLevel_Info, LogCategory_Decode, "Changes to files were lost");
+        fn(-1, "", arg);
+      } else if (event->len > 0) {
+        for (int d = 0; d < num_dirs && dirs; d++) {
+          if (dirs[d] == event->wd) {
+            LOGF(LogLevel_Debug, LogCategory_Decode, "File '%s' changed",
+                 event->name);
+            fn(d, event->name, arg);
+          }
+        }
+      }
+
+      pos += (ssize_t)(sizeof(*event) + event->len);
+    }
+  }
+#else
+  (void)arg;
+  return false;
+#endif
+}
+
+void watch_close(void)
+{
+#ifdef HAVE_INOTIFY
+  if (watch_fd >= 0) {
+    close(watch_fd); /* also removes every watch */
+    watch_fd = -1;
+  }
+
+  free(dirs);
+  dirs = NULL;
+  num_dirs = alloc_dirs = 0;
+#endif
+}
@@ -0,0 +1,27 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  Notification of changes to files
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+/* ISO library header files */
+#include <stdbool.h>
+
+/* Called for each file that changed in a watched directory, or with
+   dir -1 if changes were lost (e.g. because too many happened at once). */
+typedef void WatchFn(int dir, const char *name, void *arg);
+
+extern bool watch_open(void);
+
+extern int watch_add_dir(const char *dir_path);
+
+extern int watch_add_parent(const char *file_path, const char **leaf);
+
+extern bool watch_wait(WatchFn *fn, void *arg);
+
+extern void watch_close(void);
+
+#endif /* WATCH_H */
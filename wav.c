@@ -0,0 +1,157 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  RIFF WAVE audio file encoding
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+/* Local header files */
+#include "misc.h"
+#include "wav.h"
+
+enum {
+  WAV_FORMAT_PCM      = 1,
+  WAV_NUM_CHANNELS    = 1,
+  WAV_BITS_PER_SAMPLE = 16,
+  WAV_BYTES_PER_FRAME = WAV_NUM_CHANNELS * WAV_BITS_PER_SAMPLE / 8,
+  WAV_FMT_SIZE        = 16,
+  WAV_HEADER_SIZE     = 44 /* Bytes before the sample data */
+};
+
+static bool fput_word(const unsigned int word, FILE * const f)
+{
+  assert(word <= 0xffff);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  /* All multi-byte values in a WAV file are little-endian */
+  uint8_t bytes[2];
+  bytes[0] = word & UCHAR_MAX; /* least-significant byte first */
+  bytes[1] = (word >> 8) & UCHAR_MAX;
+  return fwrite(bytes, sizeof(bytes), 1, f) == 1;
+}
+
+static bool fput_dword(const unsigned long dword, FILE * const f)
+{
+  assert(dword <= 0xffffffff);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  uint8_t bytes[4];
+  for (size_t i = 0; i < sizeof(bytes); i++)
+    bytes[i] = (dword >> (8 * i)) & UCHAR_MAX;
+
+  return fwrite(bytes, sizeof(bytes), 1, f) == 1;
+}
+
+bool wav_write_header(FILE * const f, const unsigned long rate,
+                      const unsigned long num_frames)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(rate > 0);
+  assert(num_frames <= (0xffffffff - WAV_HEADER_SIZE) / WAV_BYTES_PER_FRAME);
+
+  /* The length of the sample data must be known in advance because the
+     output stream may not be capable of being repositioned. */
+  const unsigned long data_size = num_frames * WAV_BYTES_PER_FRAME;
+
+  return fputs("RIFF", f) != EOF &&
+         fput_dword(WAV_HEADER_SIZE - 8 + data_size, f) &&
+         fputs("WAVEfmt ", f) != EOF &&
+         fput_dword(WAV_FMT_SIZE, f) &&
+         fput_word(WAV_FORMAT_PCM, f) &&
+         fput_word(WAV_NUM_CHANNELS, f) &&
+         fput_dword(rate, f) &&
+         fput_dword(rate * WAV_BYTES_PER_FRAME, f) &&
+         fput_word(WAV_BYTES_PER_FRAME, f) &&
+         fput_word(WAV_BITS_PER_SAMPLE, f) &&
+         fputs("data", f) != EOF &&
+         fput_dword(data_size, f);
+}
+
+static unsigned long get_le(const uint8_t * const bytes, const size_t n)
+{
+  assert(bytes != NULL);
+  assert(n <= 4);
+
+  unsigned long value = 0;
+  for (size_t i = 0; i < n; i++)
+    value |= (unsigned long)bytes[i] << (8 * i);
+
+  return value;
+}
+
+bool wav_read_header(FILE * const f, unsigned long * const rate,
+                     unsigned long * const num_frames)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(rate != NULL);
+  assert(num_frames != NULL);
+
+  /* Only the format written by wav_write_header is understood: a canonical
+     header with no optional chunks. */
+  uint8_t header[WAV_HEADER_SIZE];
+  if (fread(header, sizeof(header), 1, f) != 1)
+    return false;
+
+  if (memcmp(header, "RIFF", 4) != 0 ||
+      memcmp(header + 8, "WAVEfmt ", 8) != 0 ||
+      get_le(header + 16, 4) != WAV_FMT_SIZE ||
+      get_le(header + 20, 2) != WAV_FORMAT_PCM ||
+      get_le(header + 22, 2) != WAV_NUM_CHANNELS ||
+      get_le(header + 34, 2) != WAV_BITS_PER_SAMPLE ||
+      memcmp(header + 36, "data", 4) != 0)
+    return false;
+
+  *rate = get_le(header + 24, 4);
+  *num_frames = get_le(header + 40, 4) / WAV_BYTES_PER_FRAME;
+  return true;
+}
+
+void wav_encode_frames(const int16_t * const in, const unsigned long count,
+                       uint8_t * const out)
+{
+  assert(in != NULL);
+  assert(out != NULL);
+
+  for (unsigned long i = 0; i < count; i++) {
+    const uint16_t frame = (uint16_t)in[i];
+    out[i * 2] = frame & UCHAR_MAX;
+    out[i * 2 + 1] = frame >> 8;
+  }
+}
+
+void wav_decode_frames(const uint8_t * const in, const unsigned long count,
+                       int16_t * const out)
+{
+  assert(in != NULL);
+  assert(out != NULL);
+
+  for (unsigned long i = 0; i < count; i++) {
+    const unsigned int frame = in[i * 2] | ((unsigned int)in[i * 2 + 1] << 8);
+    out[i] = frame > INT16_MAX ? (int16_t)((long)frame - 0x10000) :
+                                 (int16_t)frame;
+  }
+}
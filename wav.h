@@ -0,0 +1,27 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  RIFF WAVE audio file encoding
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef WAV_H
+#define WAV_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+extern bool wav_write_header(FILE *f, unsigned long rate,
+                             unsigned long num_frames);
+
+extern bool wav_read_header(FILE *f, unsigned long *rate,
+                            unsigned long *num_frames);
+
+extern void wav_encode_frames(const int16_t *in, unsigned long count,
+                              uint8_t *out);
+
+extern void wav_decode_frames(const uint8_t *in, unsigned long count,
+                              int16_t *out);
+
+#endif /* WAV_H */
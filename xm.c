@@ -0,0 +1,247 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  FastTracker 2 extended module encoding
+ *  Copyright (C) 2026 Christopher Bazley
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public Licence as published by
+ *  the Free Software Foundation; either version 2 of the Licence, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public Licence for more details.
+ *
+ *  You should have received a copy of the GNU General Public Licence
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* ISO library header files */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+/* Local header files */
+#include "misc.h"
+#include "xm.h"
+
+enum {
+  XM_VERSION            = 0x0104,
+  XM_HEADER_SIZE        = 276, /* Counted from the header size field */
+  XM_PATTERN_HEADER_SIZE = 9,
+  XM_INSTRUMENT_SIZE    = 263, /* Instrument header with samples */
+  XM_INSTRUMENT_PREFIX  = 33, /* Bytes of the instrument header up to and
+                                 including the sample header size */
+  XM_SAMPLE_HEADER_SIZE = 40,
+  XM_FLAGS_LINEAR       = 1<<0, /* Linear frequency table */
+  XM_NAME_LEN           = 20,
+  XM_SAMPLE_NAME_LEN    = 22,
+  XM_SAMPLE_LOOP        = 1<<0, /* Forward loop */
+  XM_SAMPLE_16BIT       = 1<<4,
+  XM_PANNING_CENTRE     = 0x80,
+  XM_PACKED             = 0x80 /* Marks a packed cell */
+};
+
+static bool fput_word(const unsigned int word, FILE * const f)
+{
+  assert(word <= 0xffff);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  /* All multi-byte values in an XM file are little-endian */
+  uint8_t bytes[2];
+  bytes[0] = word & UCHAR_MAX; /* least-significant byte first */
+  bytes[1] = (word >> 8) & UCHAR_MAX;
+  return fwrite(bytes, sizeof(bytes), 1, f) == 1;
+}
+
+static bool fput_dword(const unsigned long dword, FILE * const f)
+{
+  assert(dword <= 0xffffffff);
+  assert(f != NULL);
+  assert(!ferror(f));
+
+  uint8_t bytes[4];
+  for (size_t i = 0; i < sizeof(bytes); i++)
+    bytes[i] = (dword >> (8 * i)) & UCHAR_MAX;
+
+  return fwrite(bytes, sizeof(bytes), 1, f) == 1;
+}
+
+static bool fput_padded(const char * const s, const size_t len, FILE * const f)
+{
+  assert(s != NULL);
+  assert(f != NULL);
+
+  /* Write a fixed-length string, truncated or padded with null bytes */
+  char buf[XM_SAMPLE_NAME_LEN];
+  assert(len <= sizeof(buf));
+  memset(buf, '\0', sizeof(buf));
+  const size_t n = strlen(s);
+  memcpy(buf, s, n < len ? n : len);
+  return fwrite(buf, len, 1, f) == 1;
+}
+
+static bool fput_zeros(size_t len, FILE * const f)
+{
+  assert(f != NULL);
+
+  for (; len > 0; len--) {
+    if (fputc(0, f) == EOF)
+      return false;
+  }
+  return true;
+}
+
+bool xm_write_header(FILE * const f,
+                     const char * const song_name,
+                     const int song_len,
+                     const uint8_t * const order,
+                     const int num_patterns,
+                     const int num_instruments,
+                     const int speed,
+                     const int bpm)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(song_name != NULL);
+  assert(song_len >= 1);
+  assert(song_len <= XM_MAX_SONG_LEN);
+  assert(order != NULL);
+  assert(num_patterns >= 1);
+  assert(num_patterns <= XM_MAX_SONG_LEN);
+  assert(num_instruments >= 0);
+  assert(num_instruments <= XM_MAX_INSTRUMENTS);
+  assert(speed >= 1);
+  assert(bpm >= 1);
+
+  if (fputs("Extended Module: ", f) == EOF ||
+      !fput_padded(song_name, XM_NAME_LEN, f) ||
+      fputc(0x1a, f) == EOF ||
+      !fput_padded("SF3KtoProT", XM_NAME_LEN, f) ||
+      !fput_word(XM_VERSION, f) ||
+      !fput_dword(XM_HEADER_SIZE, f) ||
+      !fput_word(song_len, f) ||
+      !fput_word(0, f) || /* restart position */
+      !fput_word(XM_NUM_CHANNELS, f) ||
+      !fput_word(num_patterns, f) ||
+      !fput_word(num_instruments, f) ||
+      !fput_word(XM_FLAGS_LINEAR, f) ||
+      !fput_word(speed, f) ||
+      !fput_word(bpm, f))
+    return false;
+
+  /* The pattern order table has a fixed size, so pad it with zeros. */
+  if (fwrite(order, song_len, 1, f) != 1)
+    return false;
+
+  return fput_zeros(XM_MAX_SONG_LEN - song_len, f);
+}
+
+void xm_pattern_init(XMPattern * const pattern)
+{
+  assert(pattern != NULL);
+  pattern->size = 0;
+}
+
+void xm_pattern_put(XMPattern * const pattern, const XMCell * const cell)
+{
+  assert(pattern != NULL);
+  assert(cell != NULL);
+  assert(cell->note <= XM_MAX_NOTE);
+  assert(pattern->size <= sizeof(pattern->data) - XM_BYTES_PER_CELL);
+
+  const uint8_t fields[XM_BYTES_PER_CELL] = {
+    cell->note, cell->instrument, cell->volume, cell->effect, cell->param
+  };
+  uint8_t mask = 0;
+  for (int i = 0; i < XM_BYTES_PER_CELL; i++) {
+    if (fields[i] != 0)
+      mask |= 1u << i;
+  }
+
+  /* A cell with every field present is smaller unpacked. Otherwise, the
+     first byte has its top bit set and indicates which fields follow. */
+  uint8_t * const out = pattern->data;
+  if (mask != (1u << XM_BYTES_PER_CELL) - 1)
+    out[pattern->size++] = XM_PACKED | mask;
+
+  for (int i = 0; i < XM_BYTES_PER_CELL; i++) {
+    if (fields[i] != 0 || mask == (1u << XM_BYTES_PER_CELL) - 1)
+      out[pattern->size++] = fields[i];
+  }
+}
+
+bool xm_write_pattern(FILE * const f, const XMPattern * const pattern)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(pattern != NULL);
+  assert(pattern->size <= sizeof(pattern->data));
+
+  if (!fput_dword(XM_PATTERN_HEADER_SIZE, f) ||
+      fputc(0, f) == EOF || /* packing type */
+      !fput_word(XM_NUM_ROWS, f) ||
+      !fput_word(pattern->size, f))
+    return false;
+
+  return pattern->size == 0 ||
+         fwrite(pattern->data, pattern->size, 1, f) == 1;
+}
+
+bool xm_write_instrument(FILE * const f, const char * const name,
+                         const XMSample * const sample)
+{
+  assert(f != NULL);
+  assert(!ferror(f));
+  assert(name != NULL);
+  assert(sample != NULL);
+  assert(sample->loop_start + sample->loop_len <= sample->len);
+
+  /* Each instrument has exactly one sample, which is used for every note,
+     and no envelopes or auto-vibrato. */
+  if (!fput_dword(XM_INSTRUMENT_SIZE, f) ||
+      !fput_padded(name, XM_SAMPLE_NAME_LEN, f) ||
+      fputc(0, f) == EOF || /* type */
+      !fput_word(1, f) || /* no. of samples */
+      !fput_dword(XM_SAMPLE_HEADER_SIZE, f) ||
+      !fput_zeros(XM_INSTRUMENT_SIZE - XM_INSTRUMENT_PREFIX, f))
+    return false;
+
+  /* Sample lengths and offsets are in bytes, not frames. */
+  return fput_dword(sample->len * 2, f) &&
+         fput_dword(sample->loop_start * 2, f) &&
+         fput_dword(sample->loop_len * 2, f) &&
+         fputc(sample->volume, f) != EOF &&
+         fputc((uint8_t)sample->finetune, f) != EOF &&
+         fputc(XM_SAMPLE_16BIT |
+               (sample->loop_len != 0 ? XM_SAMPLE_LOOP : 0), f) != EOF &&
+         fputc(XM_PANNING_CENTRE, f) != EOF &&
+         fputc((uint8_t)sample->relative_note, f) != EOF &&
+         fputc(0, f) != EOF && /* reserved */
+         fput_padded(name, XM_SAMPLE_NAME_LEN, f);
+}
+
+void xm_encode_frames(const int16_t * const in, const unsigned long count,
+                      int16_t * const prev, uint8_t * const out)
+{
+  assert(in != NULL);
+  assert(prev != NULL);
+  assert(out != NULL);
+
+  /* Sample data is stored as little-endian differences between successive
+     frames, which wrap around on overflow. */
+  uint16_t last = (uint16_t)*prev;
+  for (unsigned long i = 0; i < count; i++) {
+    const uint16_t delta = (uint16_t)((uint16_t)in[i] - last);
+    out[i * 2] = delta & UCHAR_MAX;
+    out[i * 2 + 1] = delta >> 8;
+    last = (uint16_t)in[i];
+  }
+  if (count > 0)
+    *prev = in[count - 1];
+}
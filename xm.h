@@ -0,0 +1,65 @@
+/*
+ *  SF3KtoProT - Converts Star Fighter 3000 music to Amiga ProTracker format
+ *  FastTracker 2 extended module encoding
+ *  Copyright (C) 2026 Christopher Bazley
+ */
+
+#ifndef XM_H
+#define XM_H
+
+/* ISO library header files */
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+  XM_MAX_INSTRUMENTS = 128,
+  XM_MAX_SONG_LEN    = 256,
+  XM_NUM_ROWS        = 64, /* Rows per pattern written by this program */
+  XM_NUM_CHANNELS    = 4,
+  XM_BYTES_PER_CELL  = 5,
+  XM_MAX_NOTE        = 96, /* B-7 (notes are based at 1 for C-0) */
+  XM_VOLUME_BASE     = 0x10, /* Volume column value for volume 0 */
+  XM_COM_TONE_PORTAMENTO = 0x3,
+  XM_COM_EXTENDED    = 0xe
+};
+
+typedef struct {
+  uint8_t note; /* 0 if none */
+  uint8_t instrument; /* 0 if none */
+  uint8_t volume; /* 0 if none */
+  uint8_t effect;
+  uint8_t param;
+} XMCell;
+
+typedef struct {
+  unsigned int size; /* No. of bytes of packed data */
+  uint8_t data[XM_NUM_ROWS * XM_NUM_CHANNELS * XM_BYTES_PER_CELL];
+} XMPattern;
+
+typedef struct {
+  unsigned long len; /* No. of 16 bit sample frames */
+  unsigned long loop_start;
+  unsigned long loop_len; /* 0 if the sample doesn't loop */
+  unsigned char volume;
+  signed char   finetune; /* in 1/128ths of a semitone */
+  signed char   relative_note; /* in semitones */
+} XMSample;
+
+extern bool xm_write_header(FILE *f, const char *song_name, int song_len,
+                            const uint8_t *order, int num_patterns,
+                            int num_instruments, int speed, int bpm);
+
+extern void xm_pattern_init(XMPattern *pattern);
+
+extern void xm_pattern_put(XMPattern *pattern, const XMCell *cell);
+
+extern bool xm_write_pattern(FILE *f, const XMPattern *pattern);
+
+extern bool xm_write_instrument(FILE *f, const char *name,
+                                const XMSample *sample);
+
+extern void xm_encode_frames(const int16_t *in, unsigned long count,
+                             int16_t *prev, uint8_t *out);
+
+#endif /* XM_H */